@@ -29,6 +29,10 @@
  *  SUCH DAMAGE.
  */
 
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 
 #include <stdio.h>
@@ -36,6 +40,11 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <err.h>
 #include <assert.h>
 
@@ -53,14 +62,99 @@
  * c_argv: template argument list
  * files: list of files being watched
  * replace: index of argument in c_argv to replace with the filename
+ * ws: the watch set, which names the entry modified within a tree
  */
 struct runinfo {
   int c_argc;
   /*@NULL@*/ /*@dependent@*/ char **c_argv;
   /*@NULL@*/ /*@dependent@*/ char **files;
   int replace;
+  /*@NULL@*/ /*@dependent@*/ struct watchset *ws;
 };
 
+/* struct runstats
+ *
+ * This structure counts the invocations of the utility made by one
+ * thread, which is the only one to write it, so that counting takes
+ * no lock. The structures of all threads are kept on a list, which
+ * the thread dumping them sums.
+ *
+ * spawned: children forked
+ * failed: forks which failed
+ * succeeded: children which exited with zero
+ * exited: children which exited with another code
+ * killed: children killed by a signal
+ * next: the structure of the thread which counted before this one
+ */
+struct runstats {
+  unsigned long spawned;
+  unsigned long failed;
+  unsigned long succeeded;
+  unsigned long exited;
+  unsigned long killed;
+  /*@NULL@*/ /*@dependent@*/ struct runstats *next;
+};
+
+/* relaxed, as each counter has one writer, see watchpaths_stats() */
+#define COUNT(c) __atomic_store_n(&(c), (c) + 1, __ATOMIC_RELAXED)
+#define COUNTED(c) __atomic_load_n(&(c), __ATOMIC_RELAXED)
+
+/* a dump is asked for with this signal, see stats_work() */
+#define STATS_SIGNAL SIGUSR1
+
+/* the records kept by -t, about 2.5MB of them */
+#define TRACE_RECORDS 65536
+
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+static pthread_key_t statskey;
+static pthread_mutex_t statslock = PTHREAD_MUTEX_INITIALIZER;
+/*@NULL@*/ /*@owned@*/ static struct runstats *allstats = NULL;
+/* the counts of a thread whose structure could not be allocated */
+static struct runstats lost;
+/* STATS_SIGNAL writes 'd' here, and main() writes 'q' to stop */
+static int statspipe[2] = {-1, -1};
+
+/*
+ * Returns the counters of the calling thread, allocating them on its
+ * first call.
+ */
+/*@dependent@*/
+static struct runstats *
+runstats_get(void)
+{
+  struct runstats *stats = pthread_getspecific(statskey);
+
+  if(stats != NULL){
+    return stats;
+  }
+  stats = calloc(1, sizeof(struct runstats));
+  if(stats == NULL || pthread_setspecific(statskey, stats) != 0){
+    free(stats);
+    return &lost;
+  }
+  (void) pthread_mutex_lock(&statslock);
+  stats->next = allstats;
+  allstats = stats;
+  (void) pthread_mutex_unlock(&statslock);
+  return stats;
+}
+
+/*
+ * Adds a record of kind `kind' to the trace made with -t, if any.
+ */
+static void
+trace_note(struct runinfo *info, int kind, int idx, int value)
+{
+  if(info->ws != NULL){
+    watchpaths_trace_note(info->ws, kind, idx, value);
+  }
+}
+
 /*
  * Callback function invoked by watchpaths()
  * See documentation in watchpaths.h for more information.
@@ -71,6 +165,10 @@ runscript(/*@unused@*/ u_int flags, int idx, void *data, int *cont)
   pid_t pid, waitok;
   int status = 0, exitcode = 0;
   struct runinfo *info = data;
+  const char *entry = NULL;
+  char *path = NULL;
+  size_t len;
+  struct runstats *stats = runstats_get();
 
 #ifdef FW_DEBUG
   char **dumper;
@@ -82,7 +180,31 @@ runscript(/*@unused@*/ u_int flags, int idx, void *data, int *cont)
   assert(info->files != NULL);
   assert(info->c_argv != NULL);
 
+  /*
+   * Name the entry modified within a tree, rather than its root. The
+   * path is built before forking, as with -j other threads may hold
+   * the allocator's locks at the moment of the fork.
+   */
+  entry = info->ws != NULL ? watchpaths_entry(info->ws) : NULL;
+  if(info->replace >= 0 && entry != NULL){
+    len = strlen(info->files[idx]) + strlen(entry) + 2;
+    path = malloc(len);
+    if(path == NULL){
+      warn("Unable to allocate space for the entry path");
+      return;
+    }
+    (void) snprintf(path, len, "%s/%s", info->files[idx], entry);
+  }
+
+  trace_note(info, WP_TRACE_FORK, idx, 0);
   pid = fork();
+  if(pid == -1){
+    /* waitpid(-1) would reap the utility run for another file */
+    warn("Unable to fork");
+    COUNT(stats->failed);
+    free(path);
+    return;
+  }
   if(pid == 0){
     if(info->replace >= 0){
       /*
@@ -90,7 +212,7 @@ runscript(/*@unused@*/ u_int flags, int idx, void *data, int *cont)
        * pathname of the file whose modification triggered the
        * callback
        */
-      info->c_argv[info->replace] = info->files[idx];
+      info->c_argv[info->replace] = path != NULL ? path : info->files[idx];
     }
 
 #ifdef FW_DEBUG
@@ -101,10 +223,13 @@ runscript(/*@unused@*/ u_int flags, int idx, void *data, int *cont)
     printf("\n");
 #endif
 
+    trace_note(info, WP_TRACE_EXEC, idx, (int) getpid());
     (void) execvp(info->c_argv[0], info->c_argv);
 
     err(2, "failed to exec '%s'", info->c_argv[0]); /* should not reach */
   } else {
+    COUNT(stats->spawned);
+    free(path);
     while((waitok = waitpid(pid, &status, 0)) == -1 && errno == EINTR);
     if(waitok == -1){
       /* an error other than EINTR occurred */
@@ -112,7 +237,15 @@ runscript(/*@unused@*/ u_int flags, int idx, void *data, int *cont)
       warn("Unable to wait for pid %d", pid);
 #endif
     } else {
+      trace_note(info, WP_TRACE_EXIT, idx, status);
       exitcode = WEXITSTATUS(status);
+      if(WIFSIGNALED(status)){
+        COUNT(stats->killed);
+      } else if(exitcode == 0){
+        COUNT(stats->succeeded);
+      } else {
+        COUNT(stats->exited);
+      }
 
 #ifdef FW_DEBUG
       printf("Exit Code: %d\n", exitcode);
@@ -129,11 +262,223 @@ runscript(/*@unused@*/ u_int flags, int idx, void *data, int *cont)
   }
 }
 
+/*
+ * Adds the counters of `r' to those of `sum'.
+ */
+static void
+runstats_add(struct runstats *sum, struct runstats *r)
+{
+  sum->spawned += COUNTED(r->spawned);
+  sum->failed += COUNTED(r->failed);
+  sum->succeeded += COUNTED(r->succeeded);
+  sum->exited += COUNTED(r->exited);
+  sum->killed += COUNTED(r->killed);
+}
+
+/*
+ * Writes the counters of the watch set `ws' and of the invocations of
+ * the utility, one "name value" line each, into `buf', which is `size'
+ * bytes long. Returns the length written.
+ */
+static size_t
+stats_format(struct watchset *ws, char *buf, size_t size)
+{
+  static const char *stages[WP_STAGES] = {"dispatch", "queue", "callback"};
+  struct watchpaths_stats ws_stats;
+  struct watchpaths_latency lat;
+  struct runstats sum;
+  struct runstats *r = NULL;
+  size_t used;
+  int len, i;
+
+  watchpaths_stats(ws, &ws_stats);
+  memset(&sum, 0, sizeof(sum));
+  (void) pthread_mutex_lock(&statslock);
+  for(r = allstats; r != NULL; r = r->next){
+    runstats_add(&sum, r);
+  }
+  (void) pthread_mutex_unlock(&statslock);
+  runstats_add(&sum, &lost);
+
+  len = snprintf(buf, size,
+                 "wakeups %lu\nevents %lu\nbatchmax %lu\n"
+                 "deletes %lu\nwrites %lu\nattribs %lu\nrenames %lu\n"
+                 "rechecks %lu\nrearms %lu\ncallbacks %lu\n"
+                 "suppressed %lu\npolls %lu\npaths %lu\nwatches %lu\n"
+                 "descriptors %lu\nspawned %lu\nfailed %lu\n"
+                 "succeeded %lu\nexited %lu\nkilled %lu\n",
+                 ws_stats.wakeups, ws_stats.events, ws_stats.batchmax,
+                 ws_stats.deletes, ws_stats.writes, ws_stats.attribs,
+                 ws_stats.renames, ws_stats.rechecks, ws_stats.rearms,
+                 ws_stats.callbacks, ws_stats.suppressed, ws_stats.polls,
+                 ws_stats.paths, ws_stats.watches, ws_stats.descriptors,
+                 sum.spawned, sum.failed, sum.succeeded, sum.exited,
+                 sum.killed);
+  if(len < 0){
+    return 0;
+  }
+  used = (size_t) len >= size ? size - 1 : (size_t) len;
+
+  /* the latencies of each stage, in ns */
+  for(i = 0; i < WP_STAGES && watchpaths_latency(ws, i, &lat) == 0; i++){
+    len = snprintf(buf + used, size - used,
+                   "%s_count %lu\n%s_p50 %lld\n%s_p90 %lld\n"
+                   "%s_p99 %lld\n%s_p999 %lld\n%s_max %lld\n",
+                   stages[i], lat.count, stages[i], lat.p50, stages[i],
+                   lat.p90, stages[i], lat.p99, stages[i], lat.p999,
+                   stages[i], lat.max);
+    if(len < 0){
+      break;
+    }
+    used += (size_t) len >= size - used ? size - used - 1 : (size_t) len;
+  }
+  return used;
+}
+
+/*
+ * Asks the stats thread for a dump to stderr. Only async-signal-safe
+ * calls may be made here.
+ */
+static void
+stats_signal(/*@unused@*/ int sig)
+{
+  int saved_errno = errno;
+
+  /* a full pipe already holds a request */
+  while(-1 == write(statspipe[1], "d", 1) && errno == EINTR);
+  errno = saved_errno;
+}
+
+/*
+ * Listens for connections at the unix socket `path', removing a socket
+ * left there by an fwatch which is no longer running. Returns the
+ * listening socket, or -1 with errno set, to EADDRINUSE if another
+ * process listens there.
+ */
+static int
+stats_listen(const char *path)
+{
+  struct sockaddr_un addr;
+  struct stat finfo;
+  int fd = -1, saved_errno;
+
+  if(strlen(path) >= sizeof(addr.sun_path)){
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  (void) strcpy(addr.sun_path, path);
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(fd == -1){
+    return -1;
+  }
+  if(lstat(path, &finfo) == 0 && S_ISSOCK(finfo.st_mode)){
+    if(connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0){
+      (void) close(fd);
+      errno = EADDRINUSE;
+      return -1;
+    }
+    /* nothing answers, so the socket is stale */
+    (void) unlink(path);
+    (void) close(fd);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd == -1){
+      return -1;
+    }
+  }
+  (void) fcntl(fd, F_SETFD, FD_CLOEXEC);
+  (void) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+#ifdef SO_NOSIGPIPE
+  {
+    int on = 1;
+
+    (void) setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+  }
+#endif
+  if(-1 == bind(fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+     -1 == listen(fd, 8)){
+    saved_errno = errno;
+    (void) close(fd);
+    errno = saved_errno;
+    return -1;
+  }
+  return fd;
+}
+
+/* struct statsinfo
+ *
+ * This structure is passed to stats_work().
+ *
+ * ws: the watch set whose counters are dumped
+ * listenfd: the socket listening for requests for a dump, or -1
+ */
+struct statsinfo {
+  /*@dependent@*/ struct watchset *ws;
+  int listenfd;
+};
+
+/*
+ * Dumps the counters to stderr whenever STATS_SIGNAL is received, and
+ * to each connection made to the stats socket, until told to stop.
+ */
+/*@null@*/
+static void *
+stats_work(void *arg)
+{
+  struct statsinfo *si = arg;
+  struct pollfd pfd[2];
+  char buf[2048];
+  char drain[16];
+  size_t len;
+  ssize_t got, i;
+  int fd;
+
+  pfd[0].fd = statspipe[0];
+  pfd[0].events = POLLIN;
+  /* a negative descriptor is ignored by poll(2) */
+  pfd[1].fd = si->listenfd;
+  pfd[1].events = POLLIN;
+  for(;;){
+    if(-1 == poll(pfd, 2, -1)){
+      if(errno == EINTR){
+        continue;
+      }
+      warn("Unable to wait for requests for stats");
+      return NULL;
+    }
+    if(pfd[0].revents & POLLIN){
+      while((got = read(statspipe[0], drain, sizeof(drain))) == -1 &&
+            errno == EINTR);
+      for(i = 0; i < got; i++){
+        if(drain[i] == 'q'){
+          return NULL;
+        }
+      }
+      len = stats_format(si->ws, buf, sizeof(buf));
+      while(-1 == write(STDERR_FILENO, buf, len) && errno == EINTR);
+    }
+    if(pfd[1].revents & POLLIN &&
+       (fd = accept(si->listenfd, NULL, NULL)) != -1){
+      len = stats_format(si->ws, buf, sizeof(buf));
+      while(-1 == send(fd, buf, len, SEND_FLAGS) && errno == EINTR);
+      (void) close(fd);
+    }
+  }
+}
+
 static void
 usage()
 {
-  printf("Usage: fwatch utility [argument ...] ';' file [file2 ...]\n"
-         "       fwatch utility [argument ...] '{}' [argument ...] ';'"
+  printf("Usage: fwatch [-q ms] [-m ms] [-j n] [-u] [-p ms | -P ms]\n"
+         "              [-s statefile] [-S socket] [-t tracefile]\n"
+         "              [-r [-i pattern] [-x pattern]]\n"
+         "              utility [argument ...] ';' file [file2 ...]\n"
+         "       fwatch [-q ms] [-m ms] [-j n] [-u] [-p ms | -P ms]\n"
+         "              [-s statefile] [-S socket] [-t tracefile]\n"
+         "              [-r [-i pattern] [-x pattern]]\n"
+         "              utility [argument ...] '{}' [argument ...] ';'"
          " file [file2 ...]\n\n"
          "Watches files for modification.\n"
          "Invokes utility with configured arguments each time one of the"
@@ -149,6 +494,55 @@ usage()
          " This replacement happens at most once.\n"
          " The semicolon between the argument list and the file list is"
          " mandatory.\n\n"
+         "OPTIONS\n"
+         " -q ms  Wait until a file has been left alone for ms milliseconds"
+         " before invoking\n"
+         "        utility, so that a burst of writes invokes it once.\n"
+         " -m ms  With -q, invoke utility no later than ms milliseconds"
+         " after the first\n"
+         "        write of a burst, even if the writes continue.\n"
+         " -j n   Invoke utility for up to n files at once. Invocations"
+         " for one file still\n"
+         "        run one at a time, in order.\n"
+         " -u     Do not invoke utility when a file is rewritten with the"
+         " same content, or\n"
+         "        only its attributes change.\n"
+         " -p ms  Check the files on file systems which do not report"
+         " changes, such as\n"
+         "        NFS, SMB and FUSE mounts, every ms milliseconds.\n"
+         " -P ms  Check every file every ms milliseconds.\n"
+         " -s statefile\n"
+         "        Record the files in statefile, and at startup invoke"
+         " utility for each\n"
+         "        file modified since the last run with the same"
+         " statefile.\n"
+         " -S socket\n"
+         "        Write the counters described under STATS to each"
+         " connection made to\n"
+         "        the unix socket socket.\n"
+         " -t tracefile\n"
+         "        Record when each event is read, when utility is forked,"
+         " executed and\n"
+         "        exits, and more, in tracefile, which fwtrace reads while"
+         " fwatch runs.\n"
+         " -r     Watch each directory as a tree, invoking utility when an"
+         " entry anywhere\n"
+         "        within it is created, modified or removed. '{}' is"
+         " replaced with the name\n"
+         "        of the entry.\n"
+         " -i pattern\n"
+         "        With -r, only invoke utility for entries matching pattern,"
+         " such as\n"
+         "        '*.conf'. May be given more than once.\n"
+         " -x pattern\n"
+         "        With -r, ignore entries matching pattern, such as '.git'"
+         " or '*.swp'.\n"
+         "        May be given more than once. A pattern without a slash"
+         " matches the name\n"
+         "        of an entry in any directory, '**' matches any number of"
+         " directories,\n"
+         "        and a pattern matching a directory matches everything"
+         " within it.\n\n"
          "FILES\n"
          " Handles file deletion and deletion of any parent directories by"
          " monitoring for them to\n"
@@ -157,21 +551,116 @@ usage()
          " Will continue to monitor the target paths so long as a single"
          " directory in the path\n"
          " exists on the same device.\n\n"
+         "STATS\n"
+         " On SIGUSR1, writes counters of the events seen, the watches"
+         " held and the\n"
+         " invocations of utility to stderr, one 'name value' line"
+         " each, followed\n"
+         " by the percentiles of how long events took to fall due, to"
+         " reach a worker\n"
+         " and to be handled, in ns.\n\n"
          "EXAMPLES\n"
          " fwatch hexdump -C {} ';' /some/file/that/changes\n"
          " fwatch pfctl -t me -T replace self \\;"
          " /var/db/dhclient.leases.*\n");
 }
 
+/*
+ * Returns the number, such as a count of milliseconds, given by `arg',
+ * or -1 if it is not a non-negative number which fits in an int.
+ */
+static int
+parse_num(const char *arg)
+{
+  char *end = NULL;
+  long ms;
+
+  errno = 0;
+  ms = strtol(arg, &end, 10);
+  if(errno != 0 || end == arg || *end != '\0' || ms < 0 || ms > INT_MAX){
+    return -1;
+  }
+  return (int) ms;
+}
+
 int
 main(int argc, char **argv)
 {
-  int i;
-  struct runinfo info = {0, NULL, NULL, -1};
-  int fcount;
+  int i, first;
+  struct runinfo info = {0, NULL, NULL, -1, NULL};
+  struct watchset *ws = NULL;
+  int fcount, ret;
+  int quiet = 0, maxdelay = 0, jobs = 0;
+  int tree = 0, numpatterns = 0, unchanged = 0;
+  int pollms = 0, pollall = 0;
+  int *patterns = NULL;
+  char *statefile = NULL;
+  char *statsock = NULL;
+  char *tracefile = NULL;
   char *arg;
+  struct statsinfo si = {NULL, -1};
+  struct sigaction sa;
+  pthread_t statsthread;
 
-  if(argc < 2){
+  /* the argv index of each -i and -x, whose pattern follows it */
+  patterns = reallocarray(NULL, (size_t) argc, sizeof(int));
+  if(patterns == NULL){
+    err(2, "Unable to allocate pattern array");
+  }
+
+  /* Options precede the utility. "--" ends them. */
+  for(first = 1; first < argc && argv[first][0] == '-'; first++){
+    if(strcmp(argv[first], "--") == 0){
+      first++;
+      break;
+    } else if(strcmp(argv[first], "-r") == 0){
+      tree = 1;
+      continue;
+    } else if(strcmp(argv[first], "-u") == 0){
+      unchanged = 1;
+      continue;
+    } else if(strcmp(argv[first], "-q") == 0 && first + 1 < argc &&
+              (quiet = parse_num(argv[first + 1])) != -1){
+      first++;
+      continue;
+    } else if(strcmp(argv[first], "-m") == 0 && first + 1 < argc &&
+              (maxdelay = parse_num(argv[first + 1])) != -1){
+      first++;
+      continue;
+    } else if((strcmp(argv[first], "-p") == 0 ||
+               strcmp(argv[first], "-P") == 0) && first + 1 < argc &&
+              (pollms = parse_num(argv[first + 1])) > 0){
+      pollall = argv[first][1] == 'P';
+      first++;
+      continue;
+    } else if(strcmp(argv[first], "-s") == 0 && first + 1 < argc){
+      statefile = argv[++first];
+      continue;
+    } else if(strcmp(argv[first], "-S") == 0 && first + 1 < argc){
+      statsock = argv[++first];
+      continue;
+    } else if(strcmp(argv[first], "-t") == 0 && first + 1 < argc){
+      tracefile = argv[++first];
+      continue;
+    } else if(strcmp(argv[first], "-j") == 0 && first + 1 < argc &&
+              (jobs = parse_num(argv[first + 1])) > 0){
+      first++;
+      continue;
+    } else if((strcmp(argv[first], "-i") == 0 ||
+               strcmp(argv[first], "-x") == 0) && first + 1 < argc){
+      patterns[numpatterns++] = first++;
+      continue;
+    }
+    usage();
+    return 1;
+  }
+
+  if(numpatterns > 0 && !tree){
+    usage();
+    return 1;
+  }
+
+  if(argc - first < 1){
     usage();
     return 1;
   }
@@ -187,7 +676,8 @@ main(int argc, char **argv)
    * vulnerabilities. Using an array for the arguments allows the use
    * of execvp instead of system.
    */
-  for(i = 1; i < argc && !(argv[i][0] == ';' && argv[i][1] == '\0'); i++){
+  for(i = first; i < argc && !(argv[i][0] == ';' && argv[i][1] == '\0');
+      i++){
     if(argv[i][0] == '{' && argv[i][1] == '}' && argv[i][2] == '\0'){
       info.replace = info.c_argc;
     }
@@ -205,8 +695,8 @@ main(int argc, char **argv)
   }
 
   /* All arguments after the semicolon are paths to watch */
-  info.files = &argv[info.c_argc + 2];
-  fcount = argc - info.c_argc - 2;
+  info.files = &argv[first + info.c_argc + 1];
+  fcount = argc - first - info.c_argc - 1;
 
   info.c_argv = reallocarray(NULL, info.c_argc + 1, sizeof(char *));
   if(info.c_argv == NULL){
@@ -218,7 +708,7 @@ main(int argc, char **argv)
       /* this is the placeholder element */
       arg = NULL;
     } else {
-      arg = strdup(argv[i + 1]);
+      arg = strdup(argv[first + i]);
       if(arg == NULL){
         err(2, "Unable to allocate space for argument element");
       }
@@ -235,6 +725,81 @@ main(int argc, char **argv)
   printf("\n");
 #endif
 
+  if(pthread_key_create(&statskey, NULL) != 0 || -1 == pipe(statspipe)){
+    err(2, "Unable to set up stats");
+  }
+  for(i = 0; i < 2; i++){
+    (void) fcntl(statspipe[i], F_SETFD, FD_CLOEXEC);
+    (void) fcntl(statspipe[i], F_SETFL,
+                 fcntl(statspipe[i], F_GETFL) | O_NONBLOCK);
+  }
+
   /* invoke runscript() whenever a path in info.files is modified */
-  return watchpaths(info.files, fcount, runscript, &info);
+  ws = watchpaths_create(tree ? NULL : info.files, tree ? 0 : fcount,
+                         runscript, &info);
+  if(ws == NULL){
+    return -1;
+  }
+  info.ws = ws;
+  for(i = 0; i < numpatterns; i++){
+    if(watchpaths_filter(ws, argv[patterns[i] + 1],
+                         argv[patterns[i]][1] == 'x') == -1){
+      err(2, "Unable to use pattern '%s'", argv[patterns[i] + 1]);
+    }
+  }
+  free(patterns);
+  /* the trees take the indexes of their places in info.files */
+  for(i = 0; tree && i < fcount; i++){
+    if(watchpaths_tree(ws, info.files[i]) != i){
+      err(2, "Unable to watch '%s'", info.files[i]);
+    }
+  }
+  if(quiet > 0 && watchpaths_debounce(ws, quiet, maxdelay) == -1){
+    err(2, "Unable to set the quiet window");
+  }
+  if(unchanged && watchpaths_fingerprint(ws, 1) == -1){
+    err(2, "Unable to fingerprint the files");
+  }
+  if(pollms > 0 && watchpaths_poll(ws, pollms, pollall) == -1){
+    err(2, "Unable to poll the files");
+  }
+  /* after -u, so that the records hold the content hashes */
+  if(statefile != NULL && watchpaths_state(ws, statefile) == -1){
+    err(2, "Unable to use state file '%s'", statefile);
+  }
+  /* before -j, as the workers add records too */
+  if(tracefile != NULL &&
+     watchpaths_trace(ws, tracefile, TRACE_RECORDS) == -1){
+    err(2, "Unable to use trace file '%s'", tracefile);
+  }
+  if(jobs > 1 && watchpaths_workers(ws, jobs) == -1){
+    err(2, "Unable to start %d workers", jobs);
+  }
+
+  if(statsock != NULL && (si.listenfd = stats_listen(statsock)) == -1){
+    err(2, "Unable to listen at '%s'", statsock);
+  }
+  si.ws = ws;
+  if(pthread_create(&statsthread, NULL, stats_work, &si) != 0){
+    err(2, "Unable to start the stats thread");
+  }
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = stats_signal;
+  sa.sa_flags = SA_RESTART;
+  (void) sigemptyset(&sa.sa_mask);
+  if(-1 == sigaction(STATS_SIGNAL, &sa, NULL)){
+    err(2, "Unable to handle SIGUSR1");
+  }
+
+  ret = watchpaths_run(ws);
+
+  /* the stats thread reads the watch set, so it stops first */
+  while(-1 == write(statspipe[1], "q", 1) && errno == EINTR);
+  (void) pthread_join(statsthread, NULL);
+  if(si.listenfd != -1){
+    (void) close(si.listenfd);
+    (void) unlink(statsock);
+  }
+  watchpaths_destroy(ws);
+  return ret;
 }
@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2015, Expanded Possibilities, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided
+ * with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *  CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+ *  BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ *  ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ *  THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "watchpaths.h"
+#include "splint_defs.h"
+
+/* how long to sleep between looks at a followed trace, in ms */
+#define FOLLOW_MS 100
+
+static const char *kinds[] = {"?", "read", "due", "start", "finish", "fork",
+                              "exec", "exit"};
+
+/*
+ * Copies the record at position `pos' of the trace `head' into `out'.
+ * Returns 0, 1 if the record is yet to be written, or -1 if it has
+ * been overwritten, see struct watchpaths_trace.
+ */
+static int
+take(struct watchpaths_tracehead *head, uint64_t pos,
+     struct watchpaths_trace *out)
+{
+  struct watchpaths_trace *r =
+    (struct watchpaths_trace *) (head + 1) + (pos & (head->capacity - 1));
+  uint64_t seq;
+
+  seq = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+  if(seq != pos + 1){
+    return seq < pos + 1 ? 1 : -1;
+  }
+  memcpy(out, r, sizeof(*out));
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&r->seq, __ATOMIC_RELAXED) == seq ? 0 : -1;
+}
+
+static void
+show(const struct watchpaths_trace *r)
+{
+  const char *kind = r->kind > 0 &&
+    r->kind < (int32_t) (sizeof(kinds) / sizeof(kinds[0])) ?
+    kinds[r->kind] : kinds[0];
+
+  printf("%lld %s %d 0x%x %d", (long long) r->time, kind, (int) r->index,
+         (unsigned int) r->fflags, (int) r->value);
+  if(r->origin != 0){
+    printf(" %lld\n", (long long) (r->time - r->origin));
+  } else {
+    printf(" -\n");
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  struct watchpaths_tracehead *head = NULL;
+  struct watchpaths_trace rec;
+  struct timespec pause = {0, FOLLOW_MS * 1000000L};
+  struct stat finfo;
+  uint64_t pos, end;
+  int follow = 0;
+  int fd, got;
+
+  if(argc == 3 && strcmp(argv[1], "-f") == 0){
+    follow = 1;
+  }
+  if(argc != 2 + follow || argv[1 + follow][0] == '-'){
+    printf("USAGE: fwtrace [-f] TRACEFILE\n"
+           "Writes the records of a trace made by fwatch -t, or by\n"
+           "watchpaths_trace(), to standard output, oldest first, while\n"
+           "the process making it runs on undisturbed. Each line holds\n"
+           "the time of the record in ns on the monotonic clock, its kind,\n"
+           "the index of the path, the fflags, a value depending on the\n"
+           "kind, and the ns since the event behind it was read from the\n"
+           "kernel, or '-'. With -f, waits for more records once the\n"
+           "last is written, as tail -f does.\n");
+    return 2;
+  }
+
+  fd = open(argv[1 + follow], O_RDONLY | O_CLOEXEC);
+  if(fd == -1 || -1 == fstat(fd, &finfo)){
+    err(1, "Unable to open %s", argv[1 + follow]);
+  }
+  if((size_t) finfo.st_size < sizeof(*head)){
+    errx(1, "%s is not a trace", argv[1 + follow]);
+  }
+  head = mmap(NULL, (size_t) finfo.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if(head == MAP_FAILED){
+    err(1, "Unable to map %s", argv[1 + follow]);
+  }
+  (void) close(fd);
+  if(memcmp(head->magic, WP_TRACE_MAGIC, sizeof(head->magic)) != 0 ||
+     head->order != WP_TRACE_ORDER || head->version != WP_TRACE_VERSION ||
+     head->recsize != sizeof(struct watchpaths_trace) ||
+     head->capacity == 0 || (head->capacity & (head->capacity - 1)) != 0 ||
+     (size_t) finfo.st_size < sizeof(*head) +
+     head->capacity * sizeof(struct watchpaths_trace)){
+    errx(1, "%s is not a trace", argv[1 + follow]);
+  }
+
+  end = __atomic_load_n(&head->head, __ATOMIC_ACQUIRE);
+  pos = end > head->capacity ? end - head->capacity : 0;
+  for(;;){
+    while(pos < end){
+      got = take(head, pos, &rec);
+      if(got == 0){
+        show(&rec);
+      } else if(got == 1 && follow){
+        /* claimed by a writer, which is yet to fill it in */
+        break;
+      }
+      pos++;
+    }
+    if(!follow){
+      return 0;
+    }
+    (void) fflush(stdout);
+    (void) nanosleep(&pause, NULL);
+    end = __atomic_load_n(&head->head, __ATOMIC_ACQUIRE);
+    if(end - pos > head->capacity){
+      printf("# lost %llu\n",
+             (unsigned long long) (end - pos - head->capacity));
+      pos = end - head->capacity;
+    }
+  }
+}
@@ -30,15 +30,13 @@
  */
 
 #include "../watchpaths.c"
-#include <err.h>
 #include <assert.h>
 
 int
 main(int argc, char **argv)
 {
-  char **slashes;
+  u_short slashes[PATH_MAX + 1];
   char *path;
-  /*@dependent@*/ char *it;
   size_t count, i, plen;
   if(argc < 2){
     printf("USAGE: t_findslashes PATH\n");
@@ -46,25 +44,23 @@ main(int argc, char **argv)
   }
   path = argv[1];
   plen = strnlen(argv[1], PATH_MAX);
+  assert(plen < PATH_MAX);
 
-  slashes = find_slashes(path, 0, &count);
-  if(slashes == NULL){
-    err(2, "find_slashes returned NULL");
-  }
+  count = find_slashes(path, 0, slashes);
+  assert(count >= 1);
   for(i = 0; i < count; i++){
     /* iterate over slash list and print out the offsets */
     fprintf(stderr, "%zu ", i);
-    it = slashes[i];
     if(i == 0){
-      assert(it == NULL);
+      assert(slashes[i] == plen);
       fprintf(stderr, "---\n");
     } else {
-      assert(it != NULL);
-      assert(it >= path);
-      assert(it <= path + plen);
-      fprintf(stderr, "%3ld %.180s\n", it - path, it);
+      assert(slashes[i] < plen);
+      assert(path[slashes[i]] == '/');
+      /* recorded from the right */
+      assert(slashes[i] < slashes[i - 1]);
+      fprintf(stderr, "%3d %.180s\n", (int) slashes[i], path + slashes[i]);
     }
   }
-  free(slashes);
   return 0;
 }
@@ -0,0 +1,343 @@
+/*
+ * Copyright (c) 2015, Expanded Possibilities, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided
+ * with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *  CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+ *  BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ *  ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ *  THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+/*
+ * t_watchpaths_dispatch DIR
+ *
+ * Services two watch sets from one poll(2) loop, as an event loop
+ * embedding watchpaths would. Checks that a dispatch with nothing
+ * ready returns at once, that each write reaches the callback of its
+ * own watch set only, that `max_events' is honoured, that paths can
+ * be added and removed while watching, that a burst of writes is
+ * reported once when debouncing, that the events of a dispatch
+ * reach a batch callback together, and that inactivity deadlines and
+ * the tick fire on time.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <err.h>
+#include <assert.h>
+
+#include "../watchpaths.h"
+#include "../splint_defs.h"
+
+/* how long to wait for an event before giving up, in ms */
+#define EVENT_TIMEOUT 5000
+
+static int seen[2];
+static int last[2];
+static int batches;
+static int batched[2];
+static int stale[2];
+static int ticks;
+
+static void
+callback(u_int flags, int idx, void *data, /*@unused@*/ int *cont)
+{
+  if(flags & WP_TICK){
+    ticks++;
+    return;
+  }
+  if(flags & WP_STALE){
+    stale[idx]++;
+    return;
+  }
+  seen[*(int *) data]++;
+  last[*(int *) data] = idx;
+}
+
+static void
+batch(const struct watchpaths_event *events, int count,
+      /*@unused@*/ void *data, /*@unused@*/ int *cont)
+{
+  int i;
+
+  batches++;
+  for(i = 0; i < count; i++){
+    if(events[i].index < 0 || events[i].index > 1 ||
+       events[i].time.tv_sec == 0){
+      errx(3, "Bad batch record for index %d", events[i].index);
+    }
+    batched[events[i].index]++;
+  }
+}
+
+static void
+touch(const char *path)
+{
+  int fd;
+
+  fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if(fd == -1 || 1 != write(fd, "x", 1)){
+    err(2, "Unable to write %s", path);
+  }
+  (void) close(fd);
+}
+
+/* dispatches both sets until `want' callbacks of `set' have been seen */
+static void
+await(struct watchset **ws, int set, int want)
+{
+  struct pollfd pfd[2];
+  int i;
+
+  pfd[0].fd = watchpaths_fd(ws[0]);
+  pfd[1].fd = watchpaths_fd(ws[1]);
+  pfd[0].events = pfd[1].events = POLLIN;
+  while(seen[set] < want){
+    if(poll(pfd, 2, EVENT_TIMEOUT) <= 0){
+      errx(2, "No callback from watch set %d", set);
+    }
+    for(i = 0; i < 2; i++){
+      if(pfd[i].revents & POLLIN && watchpaths_dispatch(ws[i], 0) == -1){
+        err(2, "Unable to dispatch watch set %d", i);
+      }
+    }
+  }
+}
+
+/* dispatches `ws' until nothing is pending or arrives for a while */
+static void
+settle(struct watchset *ws)
+{
+  struct pollfd pfd;
+  int timeout;
+
+  pfd.fd = watchpaths_fd(ws);
+  pfd.events = POLLIN;
+  while((timeout = watchpaths_timeout(ws)) != -1 || poll(&pfd, 1, 300) > 0){
+    if(timeout != -1){
+      (void) poll(&pfd, 1, timeout);
+    }
+    if(watchpaths_dispatch(ws, 0) == -1){
+      err(2, "Unable to dispatch");
+    }
+  }
+}
+
+static long long
+now_ms(void)
+{
+  struct timespec ts;
+
+  (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* dispatches `ws' for `ms' milliseconds */
+static void
+pump(struct watchset *ws, int ms)
+{
+  struct pollfd pfd;
+  long long end = now_ms() + ms;
+  long long left;
+  int timeout;
+
+  pfd.fd = watchpaths_fd(ws);
+  pfd.events = POLLIN;
+  while((left = end - now_ms()) > 0){
+    timeout = watchpaths_timeout(ws);
+    if(timeout == -1 || timeout > left){
+      timeout = (int) left;
+    }
+    (void) poll(&pfd, 1, timeout);
+    if(watchpaths_dispatch(ws, 0) == -1){
+      err(2, "Unable to dispatch");
+    }
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  struct watchset *ws[2];
+  char paths[2][2][PATH_MAX];
+  char dir[PATH_MAX];
+  char extra[PATH_MAX];
+  char *p[2][2];
+  int ids[2] = {0, 1};
+  int i, j, n;
+
+  if(argc != 2){
+    errx(1, "USAGE: t_watchpaths_dispatch DIR\n");
+  }
+
+  for(i = 0; i < 2; i++){
+    for(j = 0; j < 2; j++){
+      (void) snprintf(paths[i][j], PATH_MAX, "%s/set%d.%d", argv[1], i, j);
+      touch(paths[i][j]);
+      p[i][j] = paths[i][j];
+    }
+  }
+  for(i = 0; i < 2; i++){
+    ws[i] = watchpaths_create(p[i], 2, callback, &ids[i]);
+    if(ws[i] == NULL){
+      err(2, "Unable to create watch set %d", i);
+    }
+  }
+
+  /* nothing has happened yet, so this must not block or call back */
+  for(i = 0; i < 2; i++){
+    if(watchpaths_dispatch(ws[i], 0) != 0 || seen[i] != 0){
+      errx(3, "Unexpected event in watch set %d", i);
+    }
+  }
+
+  touch(paths[1][0]);
+  await(ws, 1, 1);
+  touch(paths[0][1]);
+  await(ws, 0, 1);
+  if(seen[0] != 1 || seen[1] != 1){
+    errx(3, "Events crossed between watch sets: %d %d", seen[0], seen[1]);
+  }
+
+  /*
+   * writes to two paths leave at least two events, of which one is
+   * taken. Each write may also leave events which cause no callback.
+   */
+  touch(paths[0][0]);
+  touch(paths[0][1]);
+  n = watchpaths_dispatch(ws[0], 1);
+  if(n != 1 || seen[0] != 2){
+    errx(3, "Dispatched %d events rather than 1", n);
+  }
+  /* the other may already be read, so is not announced by the descriptor */
+  n = watchpaths_dispatch(ws[0], 0);
+  if(n < 1 || seen[0] != 3){
+    errx(3, "Dispatched %d events, %d callbacks for the rest", n, seen[0]);
+  }
+
+  /* a path added below a missing directory is found once it appears */
+  (void) snprintf(dir, PATH_MAX, "%s/new", argv[1]);
+  if(snprintf(extra, PATH_MAX, "%s/extra", dir) >= PATH_MAX){
+    errx(2, "Path too long below %s", dir);
+  }
+  n = watchpaths_add(ws[1], extra);
+  if(n != 2){
+    errx(3, "Added path has index %d rather than 2", n);
+  }
+  if(watchpaths_add(ws[1], extra) != -1 || errno != EEXIST){
+    errx(3, "Path added twice");
+  }
+  if(-1 == mkdir(dir, 0755)){
+    err(2, "Unable to create %s", dir);
+  }
+  touch(extra);
+  await(ws, 1, 2);
+  if(last[1] != 2){
+    errx(3, "Callback for index %d rather than the added path", last[1]);
+  }
+
+  /* a removed path is silent, and its index is given out again */
+  if(watchpaths_remove(ws[1], paths[1][0]) != 0){
+    err(3, "Unable to remove %s", paths[1][0]);
+  }
+  if(watchpaths_remove(ws[1], paths[1][0]) != -1 || errno != ENOENT){
+    errx(3, "Path removed twice");
+  }
+  touch(paths[1][0]);
+  touch(paths[1][1]);
+  await(ws, 1, 3);
+  if(watchpaths_dispatch(ws[1], 0) == -1 || seen[1] != 3 || last[1] != 1){
+    errx(3, "Callback for a removed path");
+  }
+  n = watchpaths_add(ws[1], paths[1][0]);
+  if(n != 0){
+    errx(3, "Added path has index %d rather than 0", n);
+  }
+
+  /* a burst of writes within the quiet window is one callback */
+  if(watchpaths_debounce(ws[0], 100, 0) != 0){
+    err(3, "Unable to debounce");
+  }
+  n = seen[0];
+  for(i = 0; i < 5; i++){
+    touch(paths[0][0]);
+  }
+  settle(ws[0]);
+  if(seen[0] != n + 1){
+    errx(3, "%d callbacks for a burst of writes", seen[0] - n);
+  }
+
+  /* writes made before a dispatch arrive in one batch */
+  watchpaths_batch(ws[1], batch);
+  n = seen[1];
+  touch(paths[1][0]);
+  touch(paths[1][1]);
+  settle(ws[1]);
+  if(batches != 1 || batched[0] == 0 || batched[1] == 0 || seen[1] != n){
+    errx(3, "%d batches with %d and %d events", batches, batched[0],
+         batched[1]);
+  }
+
+  /* an event puts the deadline off, and it expires once */
+  if(watchpaths_deadline(ws[0], 1, 300) != 0 ||
+     watchpaths_tick(ws[0], 50) != 0){
+    err(3, "Unable to set timers");
+  }
+  if(watchpaths_deadline(ws[0], 9, 300) != -1 || errno != EINVAL){
+    errx(3, "Deadline set for a path not watched");
+  }
+  pump(ws[0], 150);
+  touch(paths[0][1]);
+  pump(ws[0], 200);
+  if(stale[1] != 0){
+    errx(3, "Deadline expired despite an event");
+  }
+  pump(ws[0], 400);
+  if(stale[0] != 0 || stale[1] != 1){
+    errx(3, "Deadlines expired %d and %d times", stale[0], stale[1]);
+  }
+  if(ticks < 5){
+    errx(3, "%d ticks in 750ms", ticks);
+  }
+
+  for(i = 0; i < 2; i++){
+    watchpaths_destroy(ws[i]);
+    for(j = 0; j < 2; j++){
+      (void) unlink(paths[i][j]);
+    }
+  }
+  (void) unlink(extra);
+  (void) rmdir(dir);
+  return 0;
+}
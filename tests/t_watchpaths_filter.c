@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2015, Expanded Possibilities, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided
+ * with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *  CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+ *  BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ *  ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ *  THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+/*
+ * t_watchpaths_filter DIR
+ *
+ * Watches a directory tree under DIR through a set of include and
+ * exclude patterns. Writes a file for each case of the table below,
+ * and checks that exactly the entries expected to pass are reported.
+ * Also checks that malformed patterns are refused, and that removing
+ * the patterns reports everything again.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "../watchpaths.h"
+#include "../splint_defs.h"
+
+/* how long to wait for an event before giving up, in ms */
+#define EVENT_TIMEOUT 5000
+
+/* the entry written last, whose report shows that the others are in */
+#define SENTINEL "zz.conf"
+
+static const char *includes[] = {
+  "*.conf", "**/keep/*", "/top[0-9]", "lit\\*"
+};
+static const char *excludes[] = {
+  ".git", "*.tmp.conf", "skip/", "[!a-z]*.conf"
+};
+
+static const char *dirs[] = {
+  "sub", "sub/keep", "keep", ".git", "skip", "deep", "deep/er"
+};
+
+static const struct {
+  const char *entry;
+  int passes;
+} cases[] = {
+  { "a.conf",          1 },
+  { "b.txt",           0 },
+  { "sub/c.conf",      1 },
+  { "deep/er/d.conf",  1 },
+  { ".git/e.conf",     0 },
+  { "x.tmp.conf",      0 },
+  { "skip/f.conf",     0 },
+  { "9.conf",          0 },
+  { "top1",            1 },
+  { "top",             0 },
+  { "sub/top1",        0 },
+  { "keep/g",          1 },
+  { "sub/keep/h",      1 },
+  { "lit*",            1 },
+  { "litx",            0 },
+};
+
+#define NUMCASES ((int) (sizeof(cases) / sizeof(cases[0])))
+
+static struct watchset *ws;
+static int reported[NUMCASES];
+static int sentinel;
+static int others;
+
+static void
+callback(/*@unused@*/ u_int flags, /*@unused@*/ int idx,
+         /*@unused@*/ void *data, /*@unused@*/ int *cont)
+{
+  const char *entry = watchpaths_entry(ws);
+  int i;
+
+  if(entry == NULL){
+    return;
+  }
+  if(strcmp(entry, SENTINEL) == 0){
+    sentinel = 1;
+    return;
+  }
+  for(i = 0; i < NUMCASES; i++){
+    if(strcmp(entry, cases[i].entry) == 0){
+      reported[i] = 1;
+      return;
+    }
+  }
+  others++;
+}
+
+static void
+touch(const char *dir, const char *name)
+{
+  char path[PATH_MAX];
+  int fd;
+
+  (void) snprintf(path, sizeof(path), "%s/%s", dir, name);
+  fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if(fd == -1 || 1 != write(fd, "x", 1)){
+    err(2, "Unable to write %s", path);
+  }
+  (void) close(fd);
+}
+
+static long long
+now_ms(void)
+{
+  struct timespec ts;
+
+  (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* dispatches until the sentinel is reported, then briefly after */
+static void
+pump(void)
+{
+  struct pollfd pfd;
+  long long end = now_ms() + EVENT_TIMEOUT;
+  long long left;
+
+  sentinel = 0;
+  pfd.fd = watchpaths_fd(ws);
+  pfd.events = POLLIN;
+  while(!sentinel && (left = end - now_ms()) > 0){
+    (void) poll(&pfd, 1, (int) left);
+    if(watchpaths_dispatch(ws, 0) == -1){
+      err(2, "Unable to dispatch");
+    }
+  }
+  if(!sentinel){
+    errx(2, "No callback for entry %s", SENTINEL);
+  }
+  (void) poll(&pfd, 1, 200);
+  if(watchpaths_dispatch(ws, 0) == -1){
+    err(2, "Unable to dispatch");
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  char root[PATH_MAX];
+  char path[PATH_MAX];
+  int i, failed = 0;
+
+  if(argc != 2){
+    errx(1, "USAGE: t_watchpaths_filter DIR\n");
+  }
+
+  (void) snprintf(root, sizeof(root), "%s/t", argv[1]);
+  if(-1 == mkdir(root, 0755)){
+    err(2, "Unable to create %s", root);
+  }
+  for(i = 0; i < (int) (sizeof(dirs) / sizeof(dirs[0])); i++){
+    if(snprintf(path, sizeof(path), "%s/%s", root, dirs[i]) >=
+       (int) sizeof(path)){
+      errx(2, "Path too long below %s", root);
+    }
+    if(-1 == mkdir(path, 0755)){
+      err(2, "Unable to create %s", path);
+    }
+  }
+
+  ws = watchpaths_create(NULL, 0, callback, NULL);
+  if(ws == NULL){
+    err(2, "Unable to create watch set");
+  }
+  if(watchpaths_tree(ws, root) == -1){
+    err(2, "Unable to watch tree %s", root);
+  }
+  if(watchpaths_filter(ws, "[abc", 0) != -1 || errno != EINVAL ||
+     watchpaths_filter(ws, "/", 1) != -1 || errno != EINVAL){
+    errx(2, "Malformed pattern accepted");
+  }
+  for(i = 0; i < (int) (sizeof(includes) / sizeof(includes[0])); i++){
+    if(watchpaths_filter(ws, includes[i], 0) == -1){
+      err(2, "Unable to include %s", includes[i]);
+    }
+  }
+  for(i = 0; i < (int) (sizeof(excludes) / sizeof(excludes[0])); i++){
+    if(watchpaths_filter(ws, excludes[i], 1) == -1){
+      err(2, "Unable to exclude %s", excludes[i]);
+    }
+  }
+
+  for(i = 0; i < NUMCASES; i++){
+    touch(root, cases[i].entry);
+  }
+  touch(root, SENTINEL);
+  pump();
+  for(i = 0; i < NUMCASES; i++){
+    if(reported[i] != cases[i].passes){
+      warnx("Entry %s was %sreported", cases[i].entry,
+            reported[i] ? "" : "not ");
+      failed = 1;
+    }
+  }
+  if(others != 0){
+    warnx("%d unexpected entries reported", others);
+    failed = 1;
+  }
+
+  /* without patterns, every entry is reported */
+  (void) watchpaths_filter(ws, NULL, 0);
+  memset(reported, 0, sizeof(reported));
+  for(i = 0; i < NUMCASES; i++){
+    touch(root, cases[i].entry);
+  }
+  touch(root, SENTINEL);
+  pump();
+  for(i = 0; i < NUMCASES; i++){
+    if(!reported[i]){
+      warnx("Entry %s was not reported without patterns", cases[i].entry);
+      failed = 1;
+    }
+  }
+
+  watchpaths_destroy(ws);
+  return failed ? 2 : 0;
+}
@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2015, Expanded Possibilities, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided
+ * with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *  CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+ *  BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ *  ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ *  THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+/*
+ * t_watchpaths_hash_times DIR REPS SIZE [SIZE ...]
+ *
+ * For each SIZE, in megabytes, watches a file of that size created
+ * under DIR and reports how fast its content is hashed, from the time
+ * taken by REPS calls to watchpaths_fingerprint(), each of which hashes
+ * the file in full. The file is read once beforehand, so the figures
+ * are for a file in the page cache rather than for the disk.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <err.h>
+#include <assert.h>
+
+#include "../watchpaths.h"
+#include "../splint_defs.h"
+
+#define MB (1024 * 1024)
+
+static void
+callback(/*@unused@*/ u_int flags, /*@unused@*/ int idx,
+         /*@unused@*/ void *data, /*@unused@*/ int *cont)
+{
+}
+
+static double
+usecs(void)
+{
+  struct timespec ts;
+
+  if(-1 == clock_gettime(CLOCK_MONOTONIC, &ts)){
+    err(2, "Unable to read clock");
+  }
+  return (double) ts.tv_sec * 1e6 + (double) ts.tv_nsec / 1e3;
+}
+
+static void
+fill(const char *path, int size)
+{
+  char *block;
+  int fd, i, j;
+
+  block = malloc(MB);
+  assert(block != NULL);
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd == -1){
+    err(2, "Unable to create %s", path);
+  }
+  for(i = 0; i < size; i++){
+    for(j = 0; j < MB; j++){
+      block[j] = (char) (i + j * 31 + j / 4096);
+    }
+    if(MB != write(fd, block, MB)){
+      err(2, "Unable to write %s", path);
+    }
+  }
+  (void) close(fd);
+  free(block);
+}
+
+static double
+measure(const char *dir, int reps, int size)
+{
+  struct watchset *ws = NULL;
+  char path[PATH_MAX];
+  char *paths[1];
+  double start;
+  int i;
+
+  (void) snprintf(path, sizeof(path), "%s/f%d", dir, size);
+  fill(path, size);
+  paths[0] = path;
+  ws = watchpaths_create(paths, 1, callback, NULL);
+  if(ws == NULL){
+    err(2, "Unable to create watch set");
+  }
+
+  /* bring the file into the page cache */
+  if(watchpaths_fingerprint(ws, 1) == -1){
+    err(2, "Unable to fingerprint %s", path);
+  }
+  start = usecs();
+  for(i = 0; i < reps; i++){
+    /* turning fingerprinting off drops the fingerprint to retake */
+    (void) watchpaths_fingerprint(ws, 0);
+    if(watchpaths_fingerprint(ws, 1) == -1){
+      err(2, "Unable to fingerprint %s", path);
+    }
+  }
+  start = usecs() - start;
+
+  watchpaths_destroy(ws);
+  (void) unlink(path);
+  return start / reps;
+}
+
+int
+main(int argc, char **argv)
+{
+  double usec;
+  int i, reps, size;
+
+  if(argc < 4){
+    errx(1, "USAGE: t_watchpaths_hash_times DIR REPS SIZE [SIZE ...]\n");
+  }
+
+  reps = atoi(argv[2]);
+  assert(reps > 0);
+
+  for(i = 3; i < argc; i++){
+    size = atoi(argv[i]);
+    assert(size > 0);
+    usec = measure(argv[1], reps, size);
+    fprintf(stderr, "MB: %6d usec/hash: %12.1f MB/s: %8.1f\n",
+            size, usec, size / (usec / 1e6));
+  }
+  return 0;
+}
@@ -0,0 +1,530 @@
+/*
+ * Copyright (c) 2015, Expanded Possibilities, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided
+ * with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *  CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+ *  BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ *  ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ *  THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+
+/*
+ * t_watchpaths_load_times DIR PATHS DIRS DEPTH MISSING ROUNDS [WORKLOAD ...]
+ *
+ * Builds a tree below DIR of DIRS directories, each DEPTH levels
+ * deep, spreads PATHS files over their bottom levels, leaves MISSING
+ * percent of them uncreated, and watches them all from a second
+ * thread. Then drives ROUNDS rounds of each WORKLOAD against the
+ * files, by default all of them:
+ *
+ * appends:  eight separate appends to each of a burst of files
+ * saves:    a burst of files each written aside and renamed over
+ * recreate: the levels of one directory removed with everything in
+ *           them, then made again and its files written again
+ * rotate:   a burst of files each renamed aside and written anew
+ *
+ * After each round it waits for a callback for every file touched,
+ * then a little longer for any late ones. A file with no callback is
+ * missed, callbacks for a file beyond the operations made on it are
+ * duplicates, and callbacks for files not touched are spurious. The
+ * latency is from the first operation on a file to its first
+ * callback. Each workload is reported on one line of `name: value'
+ * pairs on stdout, so that runs of different versions can be compared:
+ * the files touched, the operations made, the callbacks per second
+ * while they were awaited, the missed, duplicate and spurious
+ * callbacks, the latency percentiles in microseconds, and the most
+ * memory, descriptors and kernel watches held so far. Exits 2 if any
+ * callback was missed or spurious.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+#include <err.h>
+#include <assert.h>
+
+#include "../watchpaths.h"
+#include "../splint_defs.h"
+
+/* how long to wait for the callbacks of a round, in ms */
+#define EVENT_TIMEOUT 10000
+
+/* how long to wait for late callbacks once all have come, in ms */
+#define SETTLE 50
+
+/* the files touched at once by the burst workloads */
+#define BURST 64
+
+/* the appends made to each file in an append storm */
+#define STORM 8
+
+static struct watchset *ws;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+static char **paths;
+static char **dirs;
+static int size, ndirs, depth;
+static int *roundof;            /* the round which touched each file */
+static int *calls;              /* its callbacks in that round */
+static int *ops;                /* the operations made on it */
+static long long *opat;         /* when the first was made, in ns */
+static long long *firstat;      /* when its first callback came */
+static int round_;
+static int pending;
+static int spurious;
+static int stop[2];
+
+static long long
+now_ns(void)
+{
+  struct timespec ts;
+
+  if(-1 == clock_gettime(CLOCK_MONOTONIC, &ts)){
+    err(2, "Unable to read clock");
+  }
+  return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* as in t_watchpaths_times, kqueue needs a descriptor per path */
+static void
+raise_nofile(rlim_t want)
+{
+  struct rlimit rl;
+
+  if(0 == getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < want){
+    rl.rlim_cur = (rl.rlim_max != RLIM_INFINITY && rl.rlim_max < want) ?
+      rl.rlim_max : want;
+    (void) setrlimit(RLIMIT_NOFILE, &rl);
+  }
+}
+
+static void
+callback(/*@unused@*/ u_int flags, int idx, /*@unused@*/ void *data,
+         /*@unused@*/ int *cont)
+{
+  long long now = now_ns();
+
+  if(idx < 0 || idx >= size){
+    errx(3, "Callback for unknown index %d", idx);
+  }
+  (void) pthread_mutex_lock(&lock);
+  if(roundof[idx] != round_){
+    spurious++;
+  }else if(calls[idx]++ == 0){
+    firstat[idx] = now;
+    if(--pending == 0){
+      (void) pthread_cond_signal(&done);
+    }
+  }
+  (void) pthread_mutex_unlock(&lock);
+}
+
+/* dispatches until told to stop */
+static void *
+watcher(/*@unused@*/ void *arg)
+{
+  struct pollfd pfd[2];
+
+  pfd[0].fd = watchpaths_fd(ws);
+  pfd[0].events = POLLIN;
+  pfd[1].fd = stop[0];
+  pfd[1].events = POLLIN;
+  for(;;){
+    (void) poll(pfd, 2, watchpaths_timeout(ws));
+    if(pfd[1].revents != 0){
+      return NULL;
+    }
+    if(watchpaths_dispatch(ws, 0) == -1){
+      err(2, "Unable to dispatch");
+    }
+  }
+}
+
+static void
+write_file(const char *path, int flags, const char *text)
+{
+  int fd;
+  size_t len = strlen(text);
+
+  fd = open(path, O_WRONLY | O_CREAT | flags, 0644);
+  if(fd == -1 || (ssize_t) len != write(fd, text, len)){
+    err(2, "Unable to write %s", path);
+  }
+  (void) close(fd);
+}
+
+static void
+move(const char *from, const char *to)
+{
+  if(-1 == rename(from, to)){
+    err(2, "Unable to rename %s to %s", from, to);
+  }
+}
+
+/* mkdir -p of the levels of directory `d' */
+static void
+make_levels(int d)
+{
+  char path[PATH_MAX];
+  int i, len;
+
+  len = snprintf(path, sizeof(path), "t/s%d", d);
+  for(i = 0; ; i++){
+    if(-1 == mkdir(path, 0755) && errno != EEXIST){
+      err(2, "Unable to create %s", path);
+    }
+    if(i == depth){
+      break;
+    }
+    len += snprintf(path + len, sizeof(path) - (size_t) len, "/l%d", i);
+  }
+}
+
+/* rm -r */
+static void
+remove_tree(const char *path)
+{
+  char sub[PATH_MAX];
+  struct dirent *de;
+  DIR *dir;
+
+  if(0 == unlink(path)){
+    return;
+  }
+  dir = opendir(path);
+  if(dir == NULL){
+    err(2, "Unable to open %s", path);
+  }
+  while((de = readdir(dir)) != NULL){
+    if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0){
+      continue;
+    }
+    (void) snprintf(sub, sizeof(sub), "%s/%s", path, de->d_name);
+    remove_tree(sub);
+  }
+  (void) closedir(dir);
+  if(-1 == rmdir(path)){
+    err(2, "Unable to remove %s", path);
+  }
+}
+
+static int
+present(int idx, int missing)
+{
+  return idx % 100 >= missing;
+}
+
+/* marks file `idx' as touched by this round, `n' operations from now */
+static void
+touch_start(int idx, int n)
+{
+  roundof[idx] = round_;
+  calls[idx] = 0;
+  ops[idx] = n;
+  opat[idx] = now_ns();
+}
+
+static void
+do_appends(int idx)
+{
+  int fd, i;
+
+  touch_start(idx, STORM);
+  fd = open(paths[idx], O_WRONLY | O_APPEND);
+  if(fd == -1){
+    err(2, "Unable to open %s", paths[idx]);
+  }
+  for(i = 0; i < STORM; i++){
+    if(6 != write(fd, "entry\n", 6)){
+      err(2, "Unable to append to %s", paths[idx]);
+    }
+  }
+  (void) close(fd);
+}
+
+static void
+do_saves(int idx)
+{
+  char aside[PATH_MAX];
+
+  touch_start(idx, 1);
+  (void) snprintf(aside, sizeof(aside), "%s.tmp", paths[idx]);
+  write_file(aside, O_TRUNC, "saved\n");
+  move(aside, paths[idx]);
+}
+
+static void
+do_rotate(int idx)
+{
+  char aside[PATH_MAX];
+
+  touch_start(idx, 2);
+  (void) snprintf(aside, sizeof(aside), "%s.1", paths[idx]);
+  move(paths[idx], aside);
+  write_file(paths[idx], O_EXCL, "rotated\n");
+}
+
+/* waits for the round, returns how long it took in ns */
+static long long
+await_round(long long start)
+{
+  struct timespec ts;
+  long long last = start;
+  int i;
+
+  (void) clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += EVENT_TIMEOUT / 1000;
+  while(pending > 0){
+    if(ETIMEDOUT == pthread_cond_timedwait(&done, &lock, &ts)){
+      break;
+    }
+  }
+  (void) pthread_mutex_unlock(&lock);
+  (void) usleep(SETTLE * 1000);
+  (void) pthread_mutex_lock(&lock);
+  for(i = 0; i < size; i++){
+    if(roundof[i] == round_ && calls[i] > 0 && firstat[i] > last){
+      last = firstat[i];
+    }
+  }
+  return last - start;
+}
+
+static int
+cmp_ll(const void *a, const void *b)
+{
+  long long x = *(const long long *) a;
+  long long y = *(const long long *) b;
+
+  return (x > y) - (x < y);
+}
+
+static double
+pct(long long *lat, int n, int permille)
+{
+  if(n == 0){
+    return 0;
+  }
+  return (double) lat[(long long) (n - 1) * permille / 1000] / 1e3;
+}
+
+static int
+run(const char *name, int rounds, int missing)
+{
+  struct watchpaths_stats stats;
+  struct rusage ru;
+  long long *lat;
+  long long busy = 0, start;
+  int r, i, k, d, n, nlat = 0, nops = 0, ncalls = 0;
+  int touched = 0, missed = 0, dups = 0, cursor = 0;
+
+  lat = malloc(sizeof(long long) * (size_t) size * (size_t) rounds);
+  assert(lat != NULL);
+  (void) pthread_mutex_lock(&lock);
+  spurious = 0;
+  for(r = 0; r < rounds; r++){
+    round_++;
+    pending = 0;
+    start = now_ns();
+    if(strcmp(name, "recreate") == 0){
+      char top[PATH_MAX];
+
+      d = r % ndirs;
+      (void) snprintf(top, sizeof(top), "t/s%d/l0", d);
+      for(i = d; i < size; i += ndirs){
+        if(present(i, missing)){
+          touch_start(i, 2);
+          pending++;
+        }
+      }
+      if(depth > 0){
+        remove_tree(top);
+      }else{
+        for(i = d; i < size; i += ndirs){
+          (void) unlink(paths[i]);
+        }
+      }
+      make_levels(d);
+      for(i = d; i < size; i += ndirs){
+        if(present(i, missing)){
+          write_file(paths[i], O_EXCL, "recreated\n");
+        }
+      }
+    }else{
+      for(k = 0, n = 0; n < BURST && k < size; k++){
+        i = cursor;
+        cursor = (cursor + 1) % size;
+        if(!present(i, missing)){
+          continue;
+        }
+        pending++;
+        n++;
+        if(strcmp(name, "appends") == 0){
+          do_appends(i);
+        }else if(strcmp(name, "saves") == 0){
+          do_saves(i);
+        }else if(strcmp(name, "rotate") == 0){
+          do_rotate(i);
+        }else{
+          errx(1, "Unknown workload %s", name);
+        }
+      }
+    }
+    busy += await_round(start);
+    for(i = 0; i < size; i++){
+      if(roundof[i] != round_){
+        continue;
+      }
+      touched++;
+      nops += ops[i];
+      ncalls += calls[i];
+      if(calls[i] == 0){
+        missed++;
+      }else{
+        lat[nlat++] = firstat[i] - opat[i];
+        if(calls[i] > ops[i]){
+          dups += calls[i] - ops[i];
+        }
+      }
+    }
+  }
+  (void) pthread_mutex_unlock(&lock);
+
+  qsort(lat, (size_t) nlat, sizeof(long long), cmp_ll);
+  watchpaths_stats(ws, &stats);
+  (void) getrusage(RUSAGE_SELF, &ru);
+  (void) printf("workload: %s paths: %d touched: %d ops: %d "
+                "events_per_sec: %.0f missed: %d duplicates: %d "
+                "spurious: %d p50_usec: %.1f p90_usec: %.1f "
+                "p99_usec: %.1f max_usec: %.1f maxrss_kb: %ld "
+                "descriptors: %lu watches: %lu\n",
+                name, size, touched, nops,
+                busy > 0 ? ncalls / (busy / 1e9) : 0.0,
+                missed, dups, spurious,
+                pct(lat, nlat, 500), pct(lat, nlat, 900),
+                pct(lat, nlat, 990), pct(lat, nlat, 1000),
+                (long) ru.ru_maxrss,
+                (unsigned long) stats.descriptors,
+                (unsigned long) stats.watches);
+  (void) fflush(stdout);
+  free(lat);
+  return missed == 0 && spurious == 0;
+}
+
+int
+main(int argc, char **argv)
+{
+  static const char *all[] = { "appends", "saves", "recreate", "rotate" };
+  const char **workloads = all;
+  pthread_t thread;
+  char path[PATH_MAX];
+  int i, d, len, nworkloads = 4, rounds, missing, ok = 1;
+
+  if(argc < 7){
+    errx(1, "USAGE: t_watchpaths_load_times DIR PATHS DIRS DEPTH "
+         "MISSING ROUNDS [WORKLOAD ...]\n");
+  }
+  if(-1 == chdir(argv[1])){
+    err(2, "Unable to enter %s", argv[1]);
+  }
+  size = atoi(argv[2]);
+  ndirs = atoi(argv[3]);
+  depth = atoi(argv[4]);
+  missing = atoi(argv[5]);
+  rounds = atoi(argv[6]);
+  assert(size > 0 && ndirs > 0 && depth >= 0 && missing >= 0 &&
+         missing < 100 && rounds > 0);
+  if(argc > 7){
+    workloads = (const char **) argv + 7;
+    nworkloads = argc - 7;
+  }
+  raise_nofile((rlim_t) size + (rlim_t) ndirs * (rlim_t) depth + 64);
+
+  paths = calloc((size_t) size, sizeof(char *));
+  dirs = calloc((size_t) ndirs, sizeof(char *));
+  roundof = calloc((size_t) size, sizeof(int));
+  calls = calloc((size_t) size, sizeof(int));
+  ops = calloc((size_t) size, sizeof(int));
+  opat = calloc((size_t) size, sizeof(long long));
+  firstat = calloc((size_t) size, sizeof(long long));
+  assert(paths != NULL && dirs != NULL && roundof != NULL &&
+         calls != NULL && ops != NULL && opat != NULL && firstat != NULL);
+
+  if(-1 == mkdir("t", 0755)){
+    err(2, "Unable to create %s/t", argv[1]);
+  }
+  for(d = 0; d < ndirs; d++){
+    make_levels(d);
+    len = snprintf(path, sizeof(path), "t/s%d", d);
+    for(i = 0; i < depth; i++){
+      len += snprintf(path + len, sizeof(path) - (size_t) len, "/l%d", i);
+    }
+    dirs[d] = strdup(path);
+    assert(dirs[d] != NULL);
+  }
+  for(i = 0; i < size; i++){
+    (void) snprintf(path, sizeof(path), "%s/f%d", dirs[i % ndirs], i);
+    paths[i] = strdup(path);
+    assert(paths[i] != NULL);
+    if(present(i, missing)){
+      write_file(paths[i], O_EXCL, "created\n");
+    }
+  }
+
+  ws = watchpaths_create(paths, size, callback, NULL);
+  if(ws == NULL){
+    err(2, "Unable to watch %d paths", size);
+  }
+  if(-1 == pipe(stop)){
+    err(2, "Unable to make pipe");
+  }
+  if(0 != pthread_create(&thread, NULL, watcher, NULL)){
+    errx(2, "Unable to start the watching thread");
+  }
+
+  for(i = 0; i < nworkloads; i++){
+    ok &= run(workloads[i], rounds, missing);
+  }
+
+  if(1 != write(stop[1], "q", 1)){
+    err(2, "Unable to stop the watching thread");
+  }
+  (void) pthread_join(thread, NULL);
+  watchpaths_destroy(ws);
+  return ok ? 0 : 2;
+}
@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2015, Expanded Possibilities, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided
+ * with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *  CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+ *  BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ *  ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ *  THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+
+/*
+ * t_watchpaths_open DIR
+ *
+ * Watches a file below DIR with an open callback. Checks that the
+ * descriptor and mapping passed hold what was written, that both are
+ * kept while the file is only rewritten in place, that the mapping is
+ * replaced once the file grows, that a file saved over the path is
+ * passed in place of the old one, that a missing file is passed as -1,
+ * and that flags which would create or truncate the file are refused.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "../watchpaths.h"
+#include "../splint_defs.h"
+
+/* how long to wait for an event before giving up, in ms */
+#define EVENT_TIMEOUT 5000
+
+static struct watchset *ws;
+static int hit;
+static int lastfd;
+static const void *lastview;
+static char content[64];
+
+static void
+callback(/*@unused@*/ u_int flags, /*@unused@*/ int idx,
+         /*@unused@*/ void *data, /*@unused@*/ int *cont)
+{
+  errx(3, "Plain callback invoked while an open callback is set");
+}
+
+static void
+opened(/*@unused@*/ u_int flags, int idx, const struct watchpaths_file *file,
+       /*@unused@*/ void *data, /*@unused@*/ int *cont)
+{
+  char buf[sizeof(content)];
+  ssize_t got;
+
+  if(idx != 0){
+    errx(3, "Callback for unknown index %d", idx);
+  }
+  hit = 1;
+  lastfd = file->fd;
+  lastview = file->view;
+  content[0] = '\0';
+  if(file->fd == -1){
+    return;
+  }
+  got = pread(file->fd, buf, sizeof(buf) - 1, 0);
+  if(got < 0 || (size_t) got != file->size){
+    errx(3, "Read %ld bytes rather than the %lu of the file", (long) got,
+         (unsigned long) file->size);
+  }
+  buf[got] = '\0';
+  if(file->view == NULL || memcmp(file->view, buf, (size_t) got) != 0){
+    errx(3, "The mapping does not hold what the descriptor does");
+  }
+  (void) strcpy(content, buf);
+}
+
+static void
+put(const char *path, int flags, const char *text)
+{
+  int fd;
+
+  fd = open(path, O_WRONLY | O_CREAT | flags, 0644);
+  if(fd == -1 || (ssize_t) strlen(text) != write(fd, text, strlen(text))){
+    err(2, "Unable to write %s", path);
+  }
+  (void) close(fd);
+}
+
+static long long
+now_ms(void)
+{
+  struct timespec ts;
+
+  (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* dispatches for up to `ms' milliseconds, until a callback is made */
+static void
+pump(int ms)
+{
+  struct pollfd pfd;
+  long long end = now_ms() + ms;
+  long long left;
+
+  hit = 0;
+  pfd.fd = watchpaths_fd(ws);
+  pfd.events = POLLIN;
+  while(!hit && (left = end - now_ms()) > 0){
+    (void) poll(&pfd, 1, (int) left);
+    if(watchpaths_dispatch(ws, 0) == -1){
+      err(2, "Unable to dispatch");
+    }
+  }
+  if(!hit){
+    errx(2, "No callback for \"%s\"", content);
+  }
+  /* the rest of the burst, if any */
+  (void) poll(&pfd, 1, 100);
+  (void) watchpaths_dispatch(ws, 0);
+}
+
+int
+main(int argc, char **argv)
+{
+  char path[PATH_MAX], aside[PATH_MAX];
+  char *paths[1];
+  const void *view;
+  int fd;
+
+  if(argc != 2){
+    errx(1, "USAGE: t_watchpaths_open DIR\n");
+  }
+  (void) snprintf(path, sizeof(path), "%s/f", argv[1]);
+  (void) snprintf(aside, sizeof(aside), "%s/f.tmp", argv[1]);
+  paths[0] = path;
+  put(path, O_TRUNC, "alpha");
+
+  ws = watchpaths_create(paths, 1, callback, NULL);
+  if(ws == NULL){
+    err(2, "Unable to create watch set");
+  }
+  if(watchpaths_open(ws, opened, O_RDONLY | O_CREAT, 0) != -1 ||
+     errno != EINVAL){
+    errx(2, "Open callback accepted O_CREAT");
+  }
+  if(watchpaths_open(ws, opened, O_WRONLY, 1) != -1 || errno != EINVAL){
+    errx(2, "Open callback accepted a mapping of a file open for writing");
+  }
+  if(watchpaths_open(ws, opened, O_RDONLY, 1) == -1){
+    err(2, "Unable to set open callback");
+  }
+
+  put(path, 0, "bravo");
+  pump(EVENT_TIMEOUT);
+  if(strcmp(content, "bravo") != 0){
+    errx(2, "Passed \"%s\" rather than \"bravo\"", content);
+  }
+  fd = lastfd;
+  view = lastview;
+
+  /* the same file at the same size keeps both */
+  put(path, 0, "delta");
+  pump(EVENT_TIMEOUT);
+  if(strcmp(content, "delta") != 0 || lastfd != fd || lastview != view){
+    errx(2, "The file rewritten in place was not passed as it was");
+  }
+
+  put(path, O_APPEND, " echo");
+  pump(EVENT_TIMEOUT);
+  if(strcmp(content, "delta echo") != 0 || lastfd != fd){
+    errx(2, "The file which grew was not passed through its descriptor");
+  }
+
+  put(aside, O_TRUNC, "foxtrot");
+  if(-1 == rename(aside, path)){
+    err(2, "Unable to rename %s to %s", aside, path);
+  }
+  pump(EVENT_TIMEOUT);
+  if(strcmp(content, "foxtrot") != 0){
+    errx(2, "Passed \"%s\" rather than the file saved over it", content);
+  }
+
+  /* the removal itself may pass unreported, but the deadline is not */
+  if(-1 == unlink(path)){
+    err(2, "Unable to remove %s", path);
+  }
+  if(watchpaths_deadline(ws, 0, 100) == -1){
+    err(2, "Unable to set deadline");
+  }
+  pump(EVENT_TIMEOUT);
+  if(lastfd != -1){
+    errx(2, "A descriptor was passed for a missing file");
+  }
+
+  if(watchpaths_open(ws, NULL, O_RDONLY, 0) == -1){
+    err(2, "Unable to clear open callback");
+  }
+  watchpaths_destroy(ws);
+  return 0;
+}
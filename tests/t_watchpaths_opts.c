@@ -0,0 +1,255 @@
+/*
+ * Copyright (c) 2015, Expanded Possibilities, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided
+ * with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *  CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+ *  BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ *  ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ *  THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+
+/*
+ * t_watchpaths_opts DIR
+ *
+ * Watches files below DIR with options of their own. Checks that each
+ * path is passed its own data, or the blob if it has none, by the
+ * callback, the batch callback and the open callback, that writes to a
+ * path which does not want them are not read from the kernel at all,
+ * that the open callback opens each path with its own flags, and that
+ * flags which would create or truncate the file are refused.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "../watchpaths.h"
+#include "../splint_defs.h"
+
+/* how long to wait for an event before giving up, in ms */
+#define EVENT_TIMEOUT 5000
+
+/* how long to wait for an event which should not come, in ms */
+#define QUIET_TIMEOUT 300
+
+static struct watchset *ws;
+static int blob, wdata, ddata, odata;
+static int hit;
+static int lastidx;
+static u_int lastflags;
+static void *lastdata;
+static int lastmode;
+
+static void
+record(u_int flags, int idx, void *data)
+{
+  hit++;
+  lastidx = idx;
+  lastflags = flags;
+  lastdata = data;
+}
+
+static void
+callback(u_int flags, int idx, void *data, /*@unused@*/ int *cont)
+{
+  record(flags, idx, data);
+}
+
+static void
+batch(const struct watchpaths_event *events, int count,
+      /*@unused@*/ void *data, /*@unused@*/ int *cont)
+{
+  int i;
+
+  for(i = 0; i < count; i++){
+    record(events[i].fflags, events[i].index, events[i].data);
+  }
+}
+
+static void
+opened(u_int flags, int idx, const struct watchpaths_file *file,
+       void *data, /*@unused@*/ int *cont)
+{
+  record(flags, idx, data);
+  lastmode = file->fd == -1 ? -1 : fcntl(file->fd, F_GETFL) & O_ACCMODE;
+}
+
+static void
+touch(const char *path)
+{
+  int fd;
+
+  fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if(fd == -1 || 1 != write(fd, "x", 1)){
+    err(2, "Unable to write %s", path);
+  }
+  (void) close(fd);
+}
+
+static long long
+now_ms(void)
+{
+  struct timespec ts;
+
+  (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* dispatches for up to `ms' milliseconds, until a callback is made */
+static void
+pump(int ms)
+{
+  struct pollfd pfd;
+  long long end = now_ms() + ms;
+  long long left;
+
+  hit = 0;
+  pfd.fd = watchpaths_fd(ws);
+  pfd.events = POLLIN;
+  while(!hit && (left = end - now_ms()) > 0){
+    (void) poll(&pfd, 1, (int) left);
+    if(watchpaths_dispatch(ws, 0) == -1){
+      err(2, "Unable to dispatch");
+    }
+  }
+}
+
+static void
+expect(const char *path, int idx, void *data)
+{
+  touch(path);
+  pump(EVENT_TIMEOUT);
+  if(!hit){
+    errx(2, "No callback for %s", path);
+  }
+  if(lastidx != idx || (lastflags & NOTE_WRITE) == 0){
+    errx(2, "Callback for index %d with fflags %x rather than for %d",
+         lastidx, lastflags, idx);
+  }
+  if(lastdata != data){
+    errx(2, "The wrong data was passed for %s", path);
+  }
+  /* the rest of the burst, if any */
+  pump(100);
+}
+
+int
+main(int argc, char **argv)
+{
+  char wpath[PATH_MAX], dpath[PATH_MAX], ppath[PATH_MAX], opath[PATH_MAX];
+  struct watchpaths_opts paths[3], opts;
+  struct watchpaths_stats before, after;
+
+  if(argc != 2){
+    errx(1, "USAGE: t_watchpaths_opts DIR\n");
+  }
+  (void) snprintf(wpath, sizeof(wpath), "%s/w", argv[1]);
+  (void) snprintf(dpath, sizeof(dpath), "%s/d", argv[1]);
+  (void) snprintf(ppath, sizeof(ppath), "%s/p", argv[1]);
+  (void) snprintf(opath, sizeof(opath), "%s/o", argv[1]);
+  touch(wpath);
+  touch(dpath);
+  touch(ppath);
+  touch(opath);
+
+  memset(paths, 0, sizeof(paths));
+  paths[0].path = wpath;
+  paths[0].mask = NOTE_WRITE;
+  paths[0].data = &wdata;
+  paths[0].openflags = -1;
+  paths[1].path = dpath;
+  paths[1].mask = NOTE_DELETE | NOTE_RENAME;
+  paths[1].data = &ddata;
+  paths[1].openflags = -1;
+  paths[2].path = ppath;
+  paths[2].openflags = O_RDONLY | O_TRUNC;
+
+  if(watchpaths_create_opts(paths, 3, callback, &blob, 1) != NULL ||
+     errno != EINVAL){
+    errx(2, "A path opened with O_TRUNC was accepted");
+  }
+  paths[2].openflags = -1;
+  ws = watchpaths_create_opts(paths, 3, callback, &blob, 1);
+  if(ws == NULL){
+    err(2, "Unable to create watch set");
+  }
+
+  expect(wpath, 0, &wdata);
+  expect(ppath, 2, &blob);
+
+  /* dropped by the kernel, so not even read */
+  watchpaths_stats(ws, &before);
+  touch(dpath);
+  pump(QUIET_TIMEOUT);
+  watchpaths_stats(ws, &after);
+  if(hit){
+    errx(2, "Callback for a write which was not wanted");
+  }
+  if(after.events != before.events){
+    errx(2, "%lu events read for a write which was not wanted",
+         after.events - before.events);
+  }
+
+  watchpaths_batch(ws, batch);
+  expect(wpath, 0, &wdata);
+  expect(ppath, 2, &blob);
+  watchpaths_batch(ws, NULL);
+
+  memset(&opts, 0, sizeof(opts));
+  opts.path = opath;
+  opts.data = &odata;
+  opts.openflags = O_RDWR | O_CREAT;
+  if(watchpaths_add_opts(ws, &opts) != -1 || errno != EINVAL){
+    errx(2, "A path opened with O_CREAT was accepted");
+  }
+  opts.openflags = O_RDWR;
+  if(watchpaths_add_opts(ws, &opts) != 3){
+    err(2, "Unable to add %s", opath);
+  }
+  if(watchpaths_open(ws, opened, O_RDONLY, 0) == -1){
+    err(2, "Unable to set open callback");
+  }
+  expect(opath, 3, &odata);
+  if(lastmode != O_RDWR){
+    errx(2, "The path was not opened with its own flags");
+  }
+  expect(ppath, 2, &blob);
+  if(lastmode != O_RDONLY){
+    errx(2, "The path was not opened with the flags of the callback");
+  }
+
+  watchpaths_destroy(ws);
+  return 0;
+}
@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) 2015, Expanded Possibilities, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided
+ * with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *  CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+ *  BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ *  ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ *  THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+/*
+ * t_watchpaths_poll DIR
+ *
+ * Watches files under DIR with every path polled. A write through a
+ * shared mapping raises no inotify event, as the writes of another NFS
+ * client raise none, but does move the modification time, so checks
+ * that such writes are reported, including after another path has been
+ * removed from among those polled, and that a change of mode alone is
+ * reported as NOTE_ATTRIB to a path which asks for it and to no other.
+ * There are enough paths for each slice of the sweep to be looked up
+ * in a batch where the kernel allows it. Also checks that the timeout
+ * covers the poll and that polling can be turned off.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "../watchpaths.h"
+#include "../splint_defs.h"
+
+/* enough for a slice of the sweep to make a batch, see RING_MIN */
+#define NUMFILES 128
+
+/* the poll interval, in ms */
+#define INTERVAL 100
+
+/* how long to wait for an event before giving up, in ms */
+#define EVENT_TIMEOUT 5000
+
+static struct watchset *ws;
+/* one more for a path added with options of its own */
+static int seen[NUMFILES + 1];
+static u_int lastflags[NUMFILES + 1];
+
+static void
+callback(u_int flags, int idx, /*@unused@*/ void *data,
+         /*@unused@*/ int *cont)
+{
+  if(idx >= 0 && idx <= NUMFILES){
+    seen[idx]++;
+    lastflags[idx] = flags;
+  }
+}
+
+static void
+put(const char *path, const char *buf)
+{
+  int fd;
+
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd == -1 || (ssize_t) strlen(buf) != write(fd, buf, strlen(buf))){
+    err(2, "Unable to write %s", path);
+  }
+  (void) close(fd);
+}
+
+/* writes `c' at the start of `path' through a shared mapping */
+static void
+poke(const char *path, char c)
+{
+  char *map;
+  int fd;
+
+  fd = open(path, O_RDWR);
+  if(fd == -1){
+    err(2, "Unable to open %s", path);
+  }
+  map = mmap(NULL, 1, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(map == MAP_FAILED){
+    err(2, "Unable to map %s", path);
+  }
+  map[0] = c;
+  (void) munmap(map, 1);
+  (void) close(fd);
+}
+
+static long long
+now_ms(void)
+{
+  struct timespec ts;
+
+  (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* dispatches for up to `ms' milliseconds, or until `idx' is reported */
+static void
+pump(int idx, int ms)
+{
+  struct pollfd pfd;
+  long long end = now_ms() + ms;
+  long long left;
+  int wait;
+
+  pfd.fd = watchpaths_fd(ws);
+  pfd.events = POLLIN;
+  while((idx < 0 || seen[idx] == 0) && (left = end - now_ms()) > 0){
+    wait = watchpaths_timeout(ws);
+    (void) poll(&pfd, 1, wait == -1 || wait > left ? (int) left : wait);
+    if(watchpaths_dispatch(ws, 0) == -1){
+      err(2, "Unable to dispatch");
+    }
+  }
+}
+
+static void
+expect(int idx, const char *what)
+{
+  memset(seen, 0, sizeof(seen));
+  pump(idx, EVENT_TIMEOUT);
+  if(seen[idx] == 0){
+    errx(2, "No callback after %s", what);
+  }
+  pump(-1, INTERVAL * 2);
+  memset(seen, 0, sizeof(seen));
+}
+
+int
+main(int argc, char **argv)
+{
+  char names[NUMFILES][PATH_MAX];
+  char *paths[NUMFILES];
+  struct watchpaths_opts opts;
+  int i, idx, wait;
+
+  if(argc != 2){
+    errx(1, "USAGE: t_watchpaths_poll DIR\n");
+  }
+  for(i = 0; i < NUMFILES; i++){
+    (void) snprintf(names[i], sizeof(names[i]), "%s/f%d", argv[1], i);
+    put(names[i], "alpha\n");
+    paths[i] = names[i];
+  }
+
+  ws = watchpaths_create(paths, NUMFILES, callback, NULL);
+  if(ws == NULL){
+    err(2, "Unable to create watch set");
+  }
+  if(watchpaths_poll(ws, -1, 1) != -1 || errno != EINVAL){
+    errx(2, "Negative interval accepted");
+  }
+  if(watchpaths_poll(ws, INTERVAL, 1) == -1){
+    err(2, "Unable to poll");
+  }
+  wait = watchpaths_timeout(ws);
+  if(wait < 0 || wait > INTERVAL){
+    errx(2, "Timeout %d does not cover the poll", wait);
+  }
+  pump(-1, INTERVAL * 2);
+
+  /* later than the resolution of the file system clock */
+  (void) usleep(20000);
+  poke(names[NUMFILES - 1], 'b');
+  expect(NUMFILES - 1, "a write through a mapping");
+
+  if(watchpaths_remove(ws, names[0]) == -1){
+    err(2, "Unable to remove %s", names[0]);
+  }
+  (void) usleep(20000);
+  poke(names[NUMFILES - 1], 'c');
+  expect(NUMFILES - 1, "a write through a mapping once a path was removed");
+  poke(names[1], 'd');
+  expect(1, "a write to a path moved in the sweep");
+
+  /* a change of mode alone is reported only to a path which asks */
+  memset(&opts, 0, sizeof(opts));
+  opts.path = names[0];
+  opts.mask = NOTE_WRITE | NOTE_ATTRIB;
+  opts.openflags = -1;
+  idx = watchpaths_add_opts(ws, &opts);
+  if(idx == -1 || idx > NUMFILES){
+    err(2, "Unable to add %s", names[0]);
+  }
+  pump(-1, INTERVAL * 2);
+  (void) usleep(20000);
+  if(chmod(names[2], 0600) == -1){
+    err(2, "Unable to change the mode of %s", names[2]);
+  }
+  pump(-1, INTERVAL * 2);
+  if(seen[2] != 0){
+    errx(2, "NOTE_ATTRIB reported to a path which did not ask for it");
+  }
+  if(chmod(names[0], 0600) == -1){
+    err(2, "Unable to change the mode of %s", names[0]);
+  }
+  expect(idx, "a change of mode");
+  if(lastflags[idx] != NOTE_ATTRIB){
+    errx(2, "A change of mode reported with fflags %x", lastflags[idx]);
+  }
+
+  if(watchpaths_poll(ws, 0, 0) == -1){
+    err(2, "Unable to stop polling");
+  }
+  if(watchpaths_timeout(ws) != -1){
+    errx(2, "Timeout set with polling off");
+  }
+
+  watchpaths_destroy(ws);
+  return 0;
+}
@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2015, Expanded Possibilities, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided
+ * with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *  CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+ *  BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ *  ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ *  THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+/*
+ * t_watchpaths_restore_times DIR FILES REPS
+ *
+ * Watches FILES paths in one directory below DIR, then REPS times
+ * swaps in a second directory holding the same names and reports how
+ * long the watch set takes to watch the paths again and report every
+ * one of them. Each swap is a recovery storm for a single reappearing
+ * directory, which is where the lookups are batched.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <err.h>
+#include <assert.h>
+
+#include "../watchpaths.h"
+#include "../splint_defs.h"
+
+/* how long to wait for a recovery before giving up, in ms */
+#define EVENT_TIMEOUT 10000
+
+static struct watchset *ws;
+static char *seen;
+static int size;
+static int missing;
+
+static void
+callback(/*@unused@*/ u_int flags, int idx, /*@unused@*/ void *data,
+         /*@unused@*/ int *cont)
+{
+  if(idx < 0 || idx >= size){
+    errx(3, "Callback for unknown index %d", idx);
+  }
+  if(!seen[idx]){
+    seen[idx] = 1;
+    missing--;
+  }
+}
+
+static double
+usecs(void)
+{
+  struct timespec ts;
+
+  if(-1 == clock_gettime(CLOCK_MONOTONIC, &ts)){
+    err(2, "Unable to read clock");
+  }
+  return (double) ts.tv_sec * 1e6 + (double) ts.tv_nsec / 1e3;
+}
+
+/* as in t_watchpaths_times, kqueue needs a descriptor per path */
+static void
+raise_nofile(rlim_t want)
+{
+  struct rlimit rl;
+
+  if(0 == getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < want){
+    rl.rlim_cur = (rl.rlim_max != RLIM_INFINITY && rl.rlim_max < want) ?
+      rl.rlim_max : want;
+    (void) setrlimit(RLIMIT_NOFILE, &rl);
+  }
+}
+
+/* dispatches for up to `ms' milliseconds, or until all paths are seen */
+static void
+pump(int ms, int all)
+{
+  struct pollfd pfd;
+  double end = usecs() + ms * 1e3;
+  double left;
+
+  pfd.fd = watchpaths_fd(ws);
+  pfd.events = POLLIN;
+  while((!all || missing > 0) && (left = end - usecs()) > 0){
+    (void) poll(&pfd, 1, (int) (left / 1e3) + 1);
+    if(watchpaths_dispatch(ws, 0) == -1){
+      err(2, "Unable to dispatch");
+    }
+  }
+}
+
+static void
+fill(const char *dir)
+{
+  char path[PATH_MAX];
+  int i, fd;
+
+  if(-1 == mkdir(dir, 0755)){
+    err(2, "Unable to create %s", dir);
+  }
+  for(i = 0; i < size; i++){
+    (void) snprintf(path, sizeof(path), "%s/f%d", dir, i);
+    fd = open(path, O_WRONLY | O_CREAT, 0644);
+    if(fd == -1){
+      err(2, "Unable to create %s", path);
+    }
+    (void) close(fd);
+  }
+}
+
+static void
+empty(const char *dir)
+{
+  char path[PATH_MAX];
+  int i;
+
+  for(i = 0; i < size; i++){
+    (void) snprintf(path, sizeof(path), "%s/f%d", dir, i);
+    (void) unlink(path);
+  }
+  (void) rmdir(dir);
+}
+
+static void
+move(const char *from, const char *to)
+{
+  if(-1 == rename(from, to)){
+    err(2, "Unable to rename %s to %s", from, to);
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  char **paths;
+  double start;
+  int i, reps;
+
+  if(argc != 4){
+    errx(1, "USAGE: t_watchpaths_restore_times DIR FILES REPS\n");
+  }
+  if(-1 == chdir(argv[1])){
+    err(2, "Unable to enter %s", argv[1]);
+  }
+  size = atoi(argv[2]);
+  reps = atoi(argv[3]);
+  assert(size > 0 && reps > 0);
+  raise_nofile((rlim_t) size + 64);
+
+  fill("d");
+  fill("d.alt");
+  paths = calloc((size_t) size, sizeof(char *));
+  seen = malloc((size_t) size);
+  assert(paths != NULL && seen != NULL);
+  for(i = 0; i < size; i++){
+    paths[i] = malloc(32);
+    assert(paths[i] != NULL);
+    (void) snprintf(paths[i], 32, "d/f%d", i);
+  }
+
+  ws = watchpaths_create(paths, size, callback, NULL);
+  if(ws == NULL){
+    err(2, "Unable to watch %d paths", size);
+  }
+
+  for(i = 0; i < reps; i++){
+    /* nothing from the last swap may be left over */
+    pump(200, 0);
+    memset(seen, 0, (size_t) size);
+    missing = size;
+
+    start = usecs();
+    move("d", "d.tmp");
+    move("d.alt", "d");
+    pump(EVENT_TIMEOUT, 1);
+    start = usecs() - start;
+    if(missing > 0){
+      errx(2, "%d of %d paths not reported after a swap", missing, size);
+    }
+    move("d.tmp", "d.alt");
+    fprintf(stderr, "paths: %8d usec/recovery: %10.0f usec/path: %6.2f\n",
+            size, start, start / size);
+  }
+
+  watchpaths_destroy(ws);
+  for(i = 0; i < size; i++){
+    free(paths[i]);
+  }
+  free(paths);
+  free(seen);
+  empty("d");
+  empty("d.alt");
+  return 0;
+}
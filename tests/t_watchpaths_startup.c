@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2015, Expanded Possibilities, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided
+ * with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *  CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+ *  BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ *  ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ *  THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+/*
+ * t_watchpaths_startup DIR SIZE THREADS [THREADS ...]
+ *
+ * Creates SIZE relative paths below DIR, spread over a few nested
+ * directories and needing canonicalization, then for each THREADS
+ * reports the time watchpaths_create_threads() takes to start watching
+ * them. Watch registration is serialized, so the figures show what the
+ * threads save on canonicalizing and looking up the paths.
+ *
+ * Also checks that the outcome does not depend on THREADS: with two
+ * bad paths in the set, the error of the earlier one is reported.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <err.h>
+#include <assert.h>
+
+#include "../watchpaths.h"
+#include "../splint_defs.h"
+
+#define DIRS 32
+
+static void
+callback(/*@unused@*/ u_int flags, /*@unused@*/ int idx,
+         /*@unused@*/ void *data, /*@unused@*/ int *cont)
+{
+}
+
+static double
+usecs(void)
+{
+  struct timespec ts;
+
+  if(-1 == clock_gettime(CLOCK_MONOTONIC, &ts)){
+    err(2, "Unable to read clock");
+  }
+  return (double) ts.tv_sec * 1e6 + (double) ts.tv_nsec / 1e3;
+}
+
+/* as in t_watchpaths_times, kqueue needs a descriptor per path */
+static void
+raise_nofile(rlim_t want)
+{
+  struct rlimit rl;
+
+  if(0 == getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < want){
+    rl.rlim_cur = (rl.rlim_max != RLIM_INFINITY && rl.rlim_max < want) ?
+      rl.rlim_max : want;
+    (void) setrlimit(RLIMIT_NOFILE, &rl);
+  }
+}
+
+/* returns the errno of creating a watch set for `paths', or 0 */
+static int
+attempt(char **paths, int size, int threads)
+{
+  struct watchset *ws;
+
+  errno = 0;
+  ws = watchpaths_create_threads(paths, size, callback, NULL, threads);
+  if(ws == NULL){
+    return errno;
+  }
+  watchpaths_destroy(ws);
+  return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+  char **paths;
+  char *longpath;
+  char *saved[2];
+  double start;
+  int i, size, threads;
+
+  if(argc < 4){
+    errx(1, "USAGE: t_watchpaths_startup DIR SIZE THREADS [THREADS ...]\n");
+  }
+  if(-1 == chdir(argv[1])){
+    err(2, "Unable to enter %s", argv[1]);
+  }
+  size = atoi(argv[2]);
+  assert(size > 2);
+  raise_nofile((rlim_t) size + 64);
+
+  paths = calloc((size_t) size, sizeof(char *));
+  assert(paths != NULL);
+  for(i = 0; i < size; i++){
+    paths[i] = malloc(PATH_MAX);
+    assert(paths[i] != NULL);
+    (void) snprintf(paths[i], PATH_MAX, "d%d", i % DIRS);
+    if(-1 == mkdir(paths[i], 0755) && errno != EEXIST){
+      err(2, "Unable to create %s", paths[i]);
+    }
+    (void) snprintf(paths[i], PATH_MAX, "./d%d//x/../f%d", i % DIRS, i);
+  }
+
+  longpath = malloc(PATH_MAX + 2);
+  assert(longpath != NULL);
+  memset(longpath, 'a', PATH_MAX + 1);
+  longpath[0] = '/';
+  longpath[PATH_MAX + 1] = '\0';
+
+  for(i = 3; i < argc; i++){
+    threads = atoi(argv[i]);
+    assert(threads > 0);
+
+    start = usecs();
+    if(0 != attempt(paths, size, threads)){
+      err(2, "Unable to watch %d paths on %d threads", size, threads);
+    }
+    start = usecs() - start;
+    fprintf(stderr, "paths: %8d threads: %3d usec/path: %8.2f\n",
+            size, threads, start / size);
+
+    /* the earlier of the two bad paths decides the error */
+    saved[0] = paths[size / 2];
+    saved[1] = paths[size - 1];
+    paths[size / 2] = longpath;
+    paths[size - 1] = NULL;
+    if(ENAMETOOLONG != attempt(paths, size, threads)){
+      errx(2, "Expected ENAMETOOLONG on %d threads", threads);
+    }
+    paths[size / 2] = NULL;
+    paths[size - 1] = longpath;
+    if(EINVAL != attempt(paths, size, threads)){
+      errx(2, "Expected EINVAL on %d threads", threads);
+    }
+    paths[size / 2] = saved[0];
+    paths[size - 1] = saved[1];
+  }
+
+  for(i = 0; i < size; i++){
+    free(paths[i]);
+  }
+  free(paths);
+  free(longpath);
+  for(i = 0; i < DIRS; i++){
+    char dir[16];
+
+    (void) snprintf(dir, sizeof(dir), "d%d", i);
+    (void) rmdir(dir);
+  }
+  return 0;
+}
@@ -0,0 +1,283 @@
+/*
+ * Copyright (c) 2015, Expanded Possibilities, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided
+ * with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *  CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+ *  BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ *  ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ *  THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+/*
+ * t_watchpaths_state DIR
+ *
+ * Watches files under DIR with a state file, stops, changes some of
+ * them and watches them again. Checks that nothing is reported on the
+ * first use of the state file, that only the files changed while
+ * nothing watched are reported on the next, counting a file created but
+ * not one touched without a change of content, that a change reported
+ * while watching is not reported again, that a path removed before its
+ * change is reported is left out, and that the records survive
+ * the state file growing. Also checks that a state file in use by
+ * another process and a file which is not a state file are refused.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "../watchpaths.h"
+#include "../splint_defs.h"
+
+/* how long to dispatch for the callbacks due at startup, in ms */
+#define QUIET_TIME 300
+
+/* enough paths to grow a state file, which starts with room for 768 */
+#define MANY 2000
+
+static struct watchset *ws;
+static int *seen;
+static int numpaths;
+
+static void
+callback(u_int flags, int idx, /*@unused@*/ void *data,
+         /*@unused@*/ int *cont)
+{
+  if(idx < 0 || idx >= numpaths){
+    errx(3, "Callback for unknown index %d", idx);
+  }
+  if(flags != NOTE_WRITE){
+    errx(3, "Callback for index %d with fflags %x", idx, flags);
+  }
+  seen[idx]++;
+}
+
+static void
+put(const char *path, const char *buf)
+{
+  int fd;
+
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd == -1 || (ssize_t) strlen(buf) != write(fd, buf, strlen(buf))){
+    err(2, "Unable to write %s", path);
+  }
+  (void) close(fd);
+}
+
+static long long
+now_ms(void)
+{
+  struct timespec ts;
+
+  (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* dispatches for `ms' milliseconds */
+static void
+pump(int ms)
+{
+  struct pollfd pfd;
+  long long end = now_ms() + ms;
+  long long left;
+  int timeout;
+
+  pfd.fd = watchpaths_fd(ws);
+  pfd.events = POLLIN;
+  while((left = end - now_ms()) > 0){
+    timeout = watchpaths_timeout(ws);
+    (void) poll(&pfd, 1, timeout != -1 && timeout < left ?
+                timeout : (int) left);
+    if(watchpaths_dispatch(ws, 0) == -1){
+      err(2, "Unable to dispatch");
+    }
+  }
+}
+
+/* starts watching `paths' with the state file `state' */
+static void
+start(char **paths, int count, const char *state)
+{
+  numpaths = count;
+  memset(seen, 0, (size_t) count * sizeof(int));
+  ws = watchpaths_create(paths, count, callback, NULL);
+  if(ws == NULL){
+    err(2, "Unable to create watch set");
+  }
+  if(watchpaths_fingerprint(ws, 1) == -1){
+    err(2, "Unable to fingerprint");
+  }
+  if(watchpaths_state(ws, state) == -1){
+    err(2, "Unable to use state file %s", state);
+  }
+  pump(QUIET_TIME);
+}
+
+/* checks that exactly the paths in `want', ending with -1, were seen */
+static void
+check(const int *want, const char *what)
+{
+  int i, j;
+
+  for(i = 0; i < numpaths; i++){
+    for(j = 0; want[j] != -1 && want[j] != i; j++);
+    if(want[j] == -1 && seen[i] != 0){
+      errx(2, "Path %d reported %s", i, what);
+    } else if(want[j] != -1 && seen[i] != 1){
+      errx(2, "Path %d reported %d times %s", i, seen[i], what);
+    }
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  static const int none[] = {-1};
+  static const int missed[] = {1, 3, -1};
+  static const int one[] = {MANY - 1, -1};
+  struct timespec times[2];
+  char state[PATH_MAX], bogus[PATH_MAX];
+  char *paths[MANY];
+  struct stat finfo;
+  pid_t pid;
+  int i, status;
+
+  if(argc != 2){
+    errx(1, "USAGE: t_watchpaths_state DIR\n");
+  }
+  (void) snprintf(state, sizeof(state), "%s/state", argv[1]);
+  (void) snprintf(bogus, sizeof(bogus), "%s/bogus", argv[1]);
+  seen = calloc(MANY, sizeof(int));
+  if(seen == NULL){
+    err(2, "Unable to allocate counts");
+  }
+  for(i = 0; i < MANY; i++){
+    paths[i] = malloc(PATH_MAX);
+    if(paths[i] == NULL){
+      err(2, "Unable to allocate path");
+    }
+    (void) snprintf(paths[i], PATH_MAX, "%s/f%d", argv[1], i);
+  }
+  /* the fourth path is missing until the watch set is stopped */
+  put(paths[0], "alpha\n");
+  put(paths[1], "beta\n");
+  put(paths[2], "gamma\n");
+
+  start(paths, 4, state);
+  check(none, "on the first use of the state file");
+  put(paths[0], "ALPHA\n");
+  pump(QUIET_TIME);
+  check((const int []) {0, -1}, "while watching");
+
+  /* another process may not use the state file at the same time */
+  pid = fork();
+  if(pid == -1){
+    err(2, "Unable to fork");
+  } else if(pid == 0){
+    _exit(watchpaths_state(ws, state) == -1 && errno == EBUSY ? 0 : 1);
+  }
+  if(-1 == waitpid(pid, &status, 0) || !WIFEXITED(status) ||
+     WEXITSTATUS(status) != 0){
+    errx(2, "State file used by two processes at once");
+  }
+  watchpaths_destroy(ws);
+
+  /* while nothing watches */
+  put(paths[1], "BETA, LONGER\n");
+  put(paths[2], "gamma\n");
+  times[0].tv_sec = times[1].tv_sec = time(NULL) - 100;
+  times[0].tv_nsec = times[1].tv_nsec = 0;
+  if(-1 == utimensat(AT_FDCWD, paths[2], times, 0)){
+    err(2, "Unable to set times of %s", paths[2]);
+  }
+  put(paths[3], "delta\n");
+
+  start(paths, 4, state);
+  check(missed, "after a restart");
+  watchpaths_destroy(ws);
+  start(paths, 4, state);
+  check(none, "after a second restart");
+  watchpaths_destroy(ws);
+
+  /* the records of the first paths outlast growing the file */
+  for(i = 4; i < MANY; i++){
+    put(paths[i], "epsilon\n");
+  }
+  start(paths, MANY, state);
+  check(none, "on adding paths");
+  watchpaths_destroy(ws);
+  put(paths[MANY - 1], "EPSILON, LONGER\n");
+  start(paths, MANY, state);
+  check(one, "after growing the state file");
+  watchpaths_destroy(ws);
+
+  /* a path removed while due a callback is not reported */
+  put(paths[1], "BETA, LONGER STILL\n");
+  numpaths = 4;
+  memset(seen, 0, (size_t) numpaths * sizeof(int));
+  ws = watchpaths_create(paths, 4, callback, NULL);
+  if(ws == NULL){
+    err(2, "Unable to create watch set");
+  }
+  if(watchpaths_state(ws, state) == -1){
+    err(2, "Unable to use state file %s", state);
+  }
+  if(watchpaths_remove(ws, paths[1]) == -1){
+    err(2, "Unable to remove %s", paths[1]);
+  }
+  pump(QUIET_TIME);
+  check(none, "once removed");
+  watchpaths_destroy(ws);
+
+  /* a file which is not a state file is left alone */
+  put(bogus, "not a state file\n");
+  ws = watchpaths_create(paths, 1, callback, NULL);
+  if(ws == NULL){
+    err(2, "Unable to create watch set");
+  }
+  if(watchpaths_state(ws, bogus) != -1 || errno != EINVAL){
+    errx(2, "Used a file which is not a state file");
+  }
+  if(-1 == stat(bogus, &finfo) || finfo.st_size != 17){
+    errx(2, "Changed a file which is not a state file");
+  }
+  watchpaths_destroy(ws);
+
+  for(i = 0; i < MANY; i++){
+    free(paths[i]);
+  }
+  free(seen);
+  return 0;
+}
@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2015, Expanded Possibilities, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided
+ * with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *  CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+ *  BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ *  ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ *  THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+
+/*
+ * t_watchpaths_stats DIR
+ *
+ * Watches files under DIR and checks that the counters of the watch
+ * set follow what it does: the paths, watches and descriptors it
+ * holds, the events it reads and reports, the writes it skips for
+ * leaving the content unchanged, and the lookups and watches made
+ * again once a removed directory returns.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "../watchpaths.h"
+#include "../splint_defs.h"
+
+/* how long to wait for a counter to move before giving up, in ms */
+#define EVENT_TIMEOUT 5000
+
+static struct watchset *ws;
+static struct watchpaths_stats st;
+
+static void
+callback(/*@unused@*/ u_int flags, /*@unused@*/ int idx,
+         /*@unused@*/ void *data, /*@unused@*/ int *cont)
+{
+}
+
+static void
+put(const char *path, const char *content)
+{
+  int fd;
+
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd == -1 || (ssize_t) strlen(content) !=
+     write(fd, content, strlen(content))){
+    err(2, "Unable to write %s", path);
+  }
+  (void) close(fd);
+}
+
+static long long
+now_ms(void)
+{
+  struct timespec ts;
+
+  (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* dispatches until the counter at `c' within `st' passes `least' */
+static void
+await(const unsigned long *c, unsigned long least, const char *what)
+{
+  struct pollfd pfd;
+  long long end = now_ms() + EVENT_TIMEOUT;
+  long long left;
+
+  pfd.fd = watchpaths_fd(ws);
+  pfd.events = POLLIN;
+  watchpaths_stats(ws, &st);
+  while(*c < least && (left = end - now_ms()) > 0){
+    (void) poll(&pfd, 1, (int) left);
+    if(watchpaths_dispatch(ws, 0) == -1){
+      err(2, "Unable to dispatch");
+    }
+    watchpaths_stats(ws, &st);
+  }
+  if(*c < least){
+    errx(2, "%s is %lu rather than at least %lu", what, *c, least);
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  char dir[PATH_MAX], file[PATH_MAX], other[PATH_MAX];
+  char *paths[2];
+  unsigned long rechecks, rearms, callbacks;
+
+  if(argc != 2){
+    errx(1, "USAGE: t_watchpaths_stats DIR\n");
+  }
+
+  (void) snprintf(dir, sizeof(dir), "%s/d", argv[1]);
+  (void) snprintf(file, sizeof(file), "%s/d/f", argv[1]);
+  (void) snprintf(other, sizeof(other), "%s/g", argv[1]);
+  if(-1 == mkdir(dir, 0755)){
+    err(2, "Unable to create %s", dir);
+  }
+  put(file, "one");
+  put(other, "same");
+
+  paths[0] = file;
+  paths[1] = other;
+  ws = watchpaths_create(paths, 2, callback, NULL);
+  if(ws == NULL){
+    err(2, "Unable to create watch set");
+  }
+  if(watchpaths_fingerprint(ws, 1) == -1){
+    err(2, "Unable to fingerprint");
+  }
+  watchpaths_stats(ws, &st);
+  if(st.paths != 2 || st.watches == 0 || st.descriptors == 0 ||
+     st.events != 0 || st.callbacks != 0){
+    errx(2, "Counters are off at the outset");
+  }
+
+  put(file, "two");
+  await(&st.callbacks, 1, "callbacks");
+  if(st.wakeups == 0 || st.events == 0 || st.batchmax == 0 ||
+     st.writes == 0){
+    errx(2, "The write was not counted");
+  }
+
+  put(other, "same");
+  await(&st.suppressed, 1, "suppressed");
+
+  rechecks = st.rechecks;
+  rearms = st.rearms;
+  callbacks = st.callbacks;
+  if(-1 == unlink(file) || -1 == rmdir(dir)){
+    err(2, "Unable to remove %s", dir);
+  }
+  if(-1 == mkdir(dir, 0755)){
+    err(2, "Unable to create %s", dir);
+  }
+  put(file, "three");
+  await(&st.callbacks, callbacks + 1, "callbacks");
+  if(st.rechecks <= rechecks || st.rearms < rearms + 2){
+    errx(2, "The return of %s was not looked up and watched", dir);
+  }
+
+  if(watchpaths_remove(ws, other) == -1){
+    err(2, "Unable to remove %s", other);
+  }
+  watchpaths_stats(ws, &st);
+  if(st.paths != 1){
+    errx(2, "paths is %lu rather than 1", st.paths);
+  }
+
+  watchpaths_destroy(ws);
+  return 0;
+}
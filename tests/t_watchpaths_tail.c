@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2015, Expanded Possibilities, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided
+ * with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *  CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+ *  BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ *  ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ *  THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+
+/*
+ * t_watchpaths_tail DIR
+ *
+ * Tails a file below DIR with a state file. Checks that what the file
+ * held at the outset is not passed, that each append is passed once and
+ * alone, that a truncated file is passed again from its beginning with
+ * WP_TRUNCATED, that a rotation passes what was appended to the old
+ * file before the new one with WP_ROTATED, and that a watch set made
+ * again with the same state file passes only what was appended while
+ * nothing watched.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "../watchpaths.h"
+#include "../splint_defs.h"
+
+/* how long to wait for an event before giving up, in ms */
+#define EVENT_TIMEOUT 5000
+
+static struct watchset *ws;
+static char seen[256];
+static size_t seenlen;
+static u_int seenflags;
+
+static void
+tailed(u_int flags, int idx, const struct watchpaths_file *file,
+       /*@unused@*/ void *data, /*@unused@*/ int *cont)
+{
+  ssize_t got;
+
+  if(idx != 0){
+    errx(3, "Callback for unknown index %d", idx);
+  }
+  seenflags |= flags;
+  if(file->fd == -1){
+    return;
+  }
+  if(file->length == 0 && (flags & (WP_TRUNCATED | WP_ROTATED)) == 0){
+    errx(3, "Callback with nothing appended");
+  }
+  if(seenlen + (size_t) file->length >= sizeof(seen)){
+    errx(3, "Passed more than was written");
+  }
+  got = pread(file->fd, seen + seenlen, (size_t) file->length,
+              file->offset);
+  if(got != file->length){
+    errx(3, "Unable to read the range passed");
+  }
+  seenlen += (size_t) got;
+  seen[seenlen] = '\0';
+}
+
+static void
+put(const char *path, int flags, const char *text)
+{
+  int fd;
+
+  fd = open(path, O_WRONLY | O_CREAT | flags, 0644);
+  if(fd == -1 || (ssize_t) strlen(text) != write(fd, text, strlen(text))){
+    err(2, "Unable to write %s", path);
+  }
+  (void) close(fd);
+}
+
+static long long
+now_ms(void)
+{
+  struct timespec ts;
+
+  (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* dispatches until `want' has been passed, and a little longer */
+static void
+expect(const char *want, u_int flags)
+{
+  struct pollfd pfd;
+  long long end = now_ms() + EVENT_TIMEOUT;
+  long long left;
+
+  pfd.fd = watchpaths_fd(ws);
+  pfd.events = POLLIN;
+  while(strcmp(seen, want) != 0 && (left = end - now_ms()) > 0){
+    (void) poll(&pfd, 1, (int) left);
+    if(watchpaths_dispatch(ws, 0) == -1){
+      err(2, "Unable to dispatch");
+    }
+  }
+  (void) poll(&pfd, 1, 100);
+  (void) watchpaths_dispatch(ws, 0);
+  if(strcmp(seen, want) != 0){
+    errx(2, "Passed \"%s\" rather than \"%s\"", seen, want);
+  }
+  if((seenflags & flags) != flags){
+    errx(2, "Passed fflags %#x rather than %#x", seenflags, flags);
+  }
+  seen[0] = '\0';
+  seenlen = 0;
+  seenflags = 0;
+}
+
+static void
+start(char **paths, const char *state)
+{
+  ws = watchpaths_create(paths, 1, NULL, NULL);
+  if(ws == NULL){
+    err(2, "Unable to create watch set");
+  }
+  if(watchpaths_tail(ws, 1) != -1 || errno != EINVAL){
+    errx(2, "Tail mode set without an open callback");
+  }
+  if(watchpaths_open(ws, tailed, O_RDONLY, 0) == -1 ||
+     watchpaths_tail(ws, 1) == -1 || watchpaths_state(ws, state) == -1){
+    err(2, "Unable to tail %s", paths[0]);
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  char path[PATH_MAX], aside[PATH_MAX], state[PATH_MAX];
+  char *paths[1];
+
+  if(argc != 2){
+    errx(1, "USAGE: t_watchpaths_tail DIR\n");
+  }
+  (void) snprintf(path, sizeof(path), "%s/log", argv[1]);
+  (void) snprintf(aside, sizeof(aside), "%s/log.1", argv[1]);
+  (void) snprintf(state, sizeof(state), "%s/state", argv[1]);
+  paths[0] = path;
+  put(path, O_TRUNC, "before\n");
+
+  start(paths, state);
+  put(path, O_APPEND, "one\n");
+  expect("one\n", 0);
+  put(path, O_APPEND, "two\n");
+  put(path, O_APPEND, "three\n");
+  expect("two\nthree\n", 0);
+
+  put(path, O_TRUNC, "new\n");
+  expect("new\n", WP_TRUNCATED);
+
+  put(path, O_APPEND, "last\n");
+  if(-1 == rename(path, aside)){
+    err(2, "Unable to rename %s to %s", path, aside);
+  }
+  put(path, O_EXCL, "fresh\n");
+  expect("last\nfresh\n", WP_ROTATED);
+
+  /* carried on from the state file */
+  watchpaths_destroy(ws);
+  put(path, O_APPEND, "while down\n");
+  start(paths, state);
+  expect("while down\n", 0);
+  put(path, O_APPEND, "after\n");
+  expect("after\n", 0);
+
+  watchpaths_destroy(ws);
+  return 0;
+}
@@ -0,0 +1,295 @@
+/*
+ * Copyright (c) 2015, Expanded Possibilities, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided
+ * with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *  CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+ *  BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ *  ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ *  THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+/*
+ * t_watchpaths_times DIR EVENTS SIZE [SIZE ...]
+ *
+ * For each SIZE, watches SIZE files created under DIR and reports the
+ * average time from a write to one of them until the callback has
+ * acknowledged it, over EVENTS writes spread across the files. Since
+ * the work done per event should not depend on the number of paths
+ * watched, the figures should stay flat as SIZE grows.
+ *
+ * Also reports the memory the watching process gains per path when
+ * the watch set is created, from the growth of its maximum resident
+ * set size. Memory held by the kernel for the watches is not counted.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <err.h>
+#include <assert.h>
+
+#include "../watchpaths.h"
+#include "../splint_defs.h"
+
+/* how long to wait for an acknowledgement before giving up, in ms */
+#define ACK_TIMEOUT 5000
+
+static int ackfd = -1;
+
+static void
+callback(/*@unused@*/ u_int flags, /*@unused@*/ int idx,
+         /*@unused@*/ void *data, /*@unused@*/ int *cont)
+{
+  char c = 'a';
+
+  while(-1 == write(ackfd, &c, 1) && errno == EINTR);
+}
+
+static double
+usecs(void)
+{
+  struct timespec ts;
+
+  if(-1 == clock_gettime(CLOCK_MONOTONIC, &ts)){
+    err(2, "Unable to read clock");
+  }
+  return (double) ts.tv_sec * 1e6 + (double) ts.tv_nsec / 1e3;
+}
+
+static void
+touch(const char *path)
+{
+  int fd;
+
+  fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if(fd == -1 || 1 != write(fd, "x", 1)){
+    err(2, "Unable to write %s", path);
+  }
+  (void) close(fd);
+}
+
+/* returns nonzero if an acknowledgement arrived within `timeout' ms */
+static int
+ack(int fd, int timeout)
+{
+  struct pollfd pfd;
+  char c;
+  ssize_t got;
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  if(poll(&pfd, 1, timeout) <= 0){
+    return 0;
+  }
+  while((got = read(fd, &c, 1)) == -1 && errno == EINTR);
+  if(got == 0){
+    errx(2, "Watcher exited, the watch limits may be too low");
+  }
+  return got == 1;
+}
+
+/*
+ * Kqueue needs a descriptor per path, so raise the soft limit as far
+ * as the hard limit allows.
+ */
+static void
+raise_nofile(rlim_t want)
+{
+  struct rlimit rl;
+
+  if(0 == getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < want){
+    rl.rlim_cur = (rl.rlim_max != RLIM_INFINITY && rl.rlim_max < want) ?
+      rl.rlim_max : want;
+    (void) setrlimit(RLIMIT_NOFILE, &rl);
+  }
+}
+
+/* returns the maximum resident set size of this process in bytes */
+static double
+maxrss(void)
+{
+  struct rusage ru;
+
+  if(-1 == getrusage(RUSAGE_SELF, &ru)){
+    err(2, "Unable to read resource usage");
+  }
+#ifdef __APPLE__
+  return (double) ru.ru_maxrss;
+#else
+  return (double) ru.ru_maxrss * 1024;
+#endif
+}
+
+/* returns the bytes per path taken by a watch set for `paths' */
+static double
+footprint(char **paths, int size)
+{
+  struct watchset *ws = NULL;
+  double bytes;
+  int fds[2];
+  int status;
+  pid_t pid;
+
+  if(-1 == pipe(fds)){
+    err(2, "Unable to create pipe");
+  }
+  pid = fork();
+  if(pid == -1){
+    err(2, "Unable to fork");
+  } else if(pid == 0){
+    /* a fresh process, so the growth is that of the watch set alone */
+    (void) close(fds[0]);
+    raise_nofile((rlim_t) size + 64);
+    bytes = maxrss();
+    ws = watchpaths_create(paths, size, callback, NULL);
+    if(ws == NULL){
+      _exit(3);
+    }
+    bytes = (maxrss() - bytes) / size;
+    if(sizeof(bytes) != write(fds[1], &bytes, sizeof(bytes))){
+      _exit(3);
+    }
+    _exit(0);
+  }
+  (void) close(fds[1]);
+  if(sizeof(bytes) != read(fds[0], &bytes, sizeof(bytes))){
+    errx(2, "Unable to create a watch set for %d paths", size);
+  }
+  (void) close(fds[0]);
+  while(-1 == waitpid(pid, &status, 0) && errno == EINTR);
+  return bytes;
+}
+
+static double
+measure(const char *dir, int events, int size, /*@out@*/ double *bytes)
+{
+  char **paths;
+  char sub[PATH_MAX];
+  int acks[2];
+  int i, status;
+  pid_t pid;
+  double start;
+
+  (void) snprintf(sub, sizeof(sub), "%s/n%d", dir, size);
+  if(-1 == mkdir(sub, 0755) && errno != EEXIST){
+    err(2, "Unable to create %s", sub);
+  }
+
+  paths = calloc((size_t) size, sizeof(char *));
+  assert(paths != NULL);
+  for(i = 0; i < size; i++){
+    paths[i] = malloc(PATH_MAX);
+    assert(paths[i] != NULL);
+    if(snprintf(paths[i], PATH_MAX, "%s/f%d", sub, i) >= PATH_MAX){
+      errx(2, "Path too long below %s", sub);
+    }
+    touch(paths[i]);
+  }
+
+  if(-1 == pipe(acks)){
+    err(2, "Unable to create pipe");
+  }
+
+  pid = fork();
+  if(pid == -1){
+    err(2, "Unable to fork");
+  } else if(pid == 0){
+    (void) close(acks[0]);
+    ackfd = acks[1];
+    raise_nofile((rlim_t) size + 64);
+    (void) watchpaths(paths, size, callback, NULL);
+    _exit(3);
+  }
+  (void) close(acks[1]);
+
+  /* write until the watcher is ready, then let it settle */
+  for(i = 0; !ack(acks[0], 100); i++){
+    if(i * 100 > ACK_TIMEOUT * 10){
+      errx(2, "Watcher for %d paths never became ready", size);
+    }
+    touch(paths[0]);
+  }
+  while(ack(acks[0], 100));
+
+  start = usecs();
+  for(i = 0; i < events; i++){
+    /* stride through the files so consecutive writes differ */
+    touch(paths[(int) (((long) i * 7919) % size)]);
+    if(!ack(acks[0], ACK_TIMEOUT)){
+      errx(2, "No callback for write %d of %d paths", i, size);
+    }
+  }
+  start = usecs() - start;
+
+  (void) kill(pid, SIGTERM);
+  while(-1 == waitpid(pid, &status, 0) && errno == EINTR);
+  (void) close(acks[0]);
+
+  *bytes = footprint(paths, size);
+
+  for(i = 0; i < size; i++){
+    (void) unlink(paths[i]);
+    free(paths[i]);
+  }
+  free(paths);
+  (void) rmdir(sub);
+
+  return start / events;
+}
+
+int
+main(int argc, char **argv)
+{
+  double usec, bytes;
+  int i, events, size;
+
+  if(argc < 4){
+    errx(1, "USAGE: t_watchpaths_times DIR EVENTS SIZE [SIZE ...]\n");
+  }
+
+  events = atoi(argv[2]);
+  assert(events > 0);
+
+  for(i = 3; i < argc; i++){
+    size = atoi(argv[i]);
+    assert(size > 0);
+    usec = measure(argv[1], events, size, &bytes);
+    fprintf(stderr, "paths: %8d usec/event: %10.1f bytes/path: %8.0f\n",
+            size, usec, bytes);
+  }
+  return 0;
+}
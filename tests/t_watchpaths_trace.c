@@ -0,0 +1,240 @@
+/*
+ * Copyright (c) 2015, Expanded Possibilities, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided
+ * with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *  CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+ *  BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ *  ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ *  THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+
+/*
+ * t_watchpaths_trace DIR
+ *
+ * Watches a file under DIR with a trace of a few records. Checks that
+ * the trace file has a proper header, that the records of a write hold
+ * its reading, the callback falling due, starting and finishing, and
+ * a note made by the callback, each carrying when the write was read,
+ * that the ring wraps, and that the latencies of a slow callback land
+ * within 3% in the histogram of its stage. Also checks that tracing is
+ * refused while there are workers.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "../watchpaths.h"
+#include "../splint_defs.h"
+
+/* how long to wait for a callback before giving up, in ms */
+#define EVENT_TIMEOUT 5000
+
+/* how long the callback takes, in ns */
+#define SLOW 20000000LL
+
+/* the records asked for, rounded up to 16 */
+#define RECORDS 9
+
+static struct watchset *ws;
+static int seen;
+
+static void
+callback(/*@unused@*/ u_int flags, int idx, /*@unused@*/ void *data,
+         /*@unused@*/ int *cont)
+{
+  struct timespec ts = {0, SLOW};
+
+  seen++;
+  watchpaths_trace_note(ws, WP_TRACE_FORK, idx, 42);
+  (void) nanosleep(&ts, NULL);
+}
+
+static void
+touch(const char *path)
+{
+  int fd;
+
+  fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if(fd == -1 || 1 != write(fd, "x", 1)){
+    err(2, "Unable to write %s", path);
+  }
+  (void) close(fd);
+}
+
+static long long
+now_ms(void)
+{
+  struct timespec ts;
+
+  (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* writes `path' and dispatches until its callback has been invoked */
+static void
+report(const char *path)
+{
+  struct pollfd pfd;
+  long long end = now_ms() + EVENT_TIMEOUT;
+  long long left;
+  int was = seen;
+
+  touch(path);
+  pfd.fd = watchpaths_fd(ws);
+  pfd.events = POLLIN;
+  while(seen == was && (left = end - now_ms()) > 0){
+    (void) poll(&pfd, 1, (int) left);
+    if(watchpaths_dispatch(ws, 0) == -1){
+      err(2, "Unable to dispatch");
+    }
+  }
+  if(seen == was){
+    errx(2, "No callback for %s", path);
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  char file[PATH_MAX], trace[PATH_MAX];
+  char *paths[1];
+  struct watchpaths_tracehead *head = NULL;
+  struct watchpaths_trace *recs = NULL;
+  struct watchpaths_trace *r = NULL;
+  struct watchpaths_latency lat;
+  const int order[] = {WP_TRACE_READ, WP_TRACE_DUE, WP_TRACE_START,
+                       WP_TRACE_FORK, WP_TRACE_FINISH};
+  struct stat finfo;
+  int64_t origin = 0;
+  uint64_t i;
+  int fd, next = 0;
+
+  if(argc != 2){
+    errx(1, "USAGE: t_watchpaths_trace DIR\n");
+  }
+  (void) snprintf(file, sizeof(file), "%s/f", argv[1]);
+  (void) snprintf(trace, sizeof(trace), "%s/trace", argv[1]);
+  touch(file);
+
+  paths[0] = file;
+  ws = watchpaths_create(paths, 1, callback, NULL);
+  if(ws == NULL){
+    err(2, "Unable to create watch set");
+  }
+  if(watchpaths_trace(ws, trace, 0) != -1 || errno != EINVAL){
+    errx(2, "A trace of no records was made");
+  }
+  if(watchpaths_trace(ws, trace, RECORDS) == -1){
+    err(2, "Unable to trace to %s", trace);
+  }
+
+  fd = open(trace, O_RDONLY);
+  if(fd == -1 || -1 == fstat(fd, &finfo)){
+    err(2, "Unable to open %s", trace);
+  }
+  head = mmap(NULL, (size_t) finfo.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if(head == MAP_FAILED){
+    err(2, "Unable to map %s", trace);
+  }
+  (void) close(fd);
+  recs = (struct watchpaths_trace *) (head + 1);
+  if(memcmp(head->magic, WP_TRACE_MAGIC, sizeof(head->magic)) != 0 ||
+     head->order != WP_TRACE_ORDER || head->version != WP_TRACE_VERSION ||
+     head->recsize != sizeof(struct watchpaths_trace) ||
+     head->capacity != 16 || head->head != 0 ||
+     (size_t) finfo.st_size != sizeof(*head) + 16 * sizeof(*recs)){
+    errx(2, "The header of the trace is off");
+  }
+
+  report(file);
+  for(i = 0; i < head->head; i++){
+    r = &recs[i];
+    if(r->seq != i + 1 || r->origin > r->time){
+      errx(2, "Record %d is off", (int) i);
+    }
+    if(next < 5 && r->kind == order[next]){
+      if(next == 0){
+        origin = r->origin;
+      } else if(r->origin != origin || r->index != 0){
+        errx(2, "Record %d is not of the write", (int) i);
+      }
+      if(r->kind == WP_TRACE_FORK && r->value != 42){
+        errx(2, "The note was not recorded");
+      }
+      next++;
+    }
+  }
+  if(next != 5){
+    errx(2, "The records of the write are missing");
+  }
+
+  while(head->head <= head->capacity){
+    report(file);
+  }
+  for(i = head->head - head->capacity; i < head->head; i++){
+    if(recs[i % head->capacity].seq != i + 1){
+      errx(2, "The ring did not wrap");
+    }
+  }
+
+  if(watchpaths_latency(ws, WP_STAGES, &lat) != -1 || errno != EINVAL){
+    errx(2, "The latency of a bogus stage was reported");
+  }
+  if(watchpaths_latency(ws, WP_STAGE_CALLBACK, &lat) == -1 ||
+     lat.count != (unsigned long) seen || lat.p50 < SLOW ||
+     lat.p50 > SLOW * 3 / 2 || lat.max < lat.p50){
+    errx(2, "The callback latencies are off");
+  }
+  if(watchpaths_latency(ws, WP_STAGE_DISPATCH, &lat) == -1 ||
+     lat.count != (unsigned long) seen || lat.p50 > lat.p99 ||
+     lat.p99 > lat.max){
+    errx(2, "The dispatch latencies are off");
+  }
+  if(watchpaths_latency(ws, WP_STAGE_QUEUE, &lat) == -1 || lat.count != 0){
+    errx(2, "Queue latencies were counted without workers");
+  }
+
+  if(watchpaths_workers(ws, 2) == -1){
+    err(2, "Unable to start workers");
+  }
+  if(watchpaths_trace(ws, NULL, 0) != -1 || errno != EBUSY){
+    errx(2, "Tracing changed while there were workers");
+  }
+
+  watchpaths_destroy(ws);
+  return 0;
+}
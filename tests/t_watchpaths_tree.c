@@ -0,0 +1,252 @@
+/*
+ * Copyright (c) 2015, Expanded Possibilities, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided
+ * with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *  CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+ *  BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ *  ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ *  THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+/*
+ * t_watchpaths_tree DIR
+ *
+ * Watches a directory tree under DIR. Checks that the entries which
+ * exist at the outset are not reported, that writes anywhere in the
+ * tree are reported with the path of the entry relative to the root,
+ * that directories created later are watched, including those filled
+ * before they could be, that the removal of a subtree is reported,
+ * that batch records carry the entry, and that nothing is reported
+ * once the tree is removed.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "../watchpaths.h"
+#include "../splint_defs.h"
+
+/* how long to wait for an event before giving up, in ms */
+#define EVENT_TIMEOUT 5000
+
+static struct watchset *ws;
+static int tree = -1;
+static int seen;
+static const char *want;
+static u_int wantflags;
+static int hit;
+
+static void
+check(int idx, u_int flags, /*@null@*/ const char *entry)
+{
+  seen++;
+  if(idx != tree){
+    errx(3, "Callback for index %d rather than the tree", idx);
+  }
+  if(want != NULL && entry != NULL && strcmp(entry, want) == 0 &&
+     (flags & wantflags) != 0){
+    hit = 1;
+  }
+}
+
+static void
+callback(u_int flags, int idx, /*@unused@*/ void *data,
+         /*@unused@*/ int *cont)
+{
+  check(idx, flags, watchpaths_entry(ws));
+}
+
+static void
+batch(const struct watchpaths_event *events, int count,
+      /*@unused@*/ void *data, /*@unused@*/ int *cont)
+{
+  int i;
+
+  for(i = 0; i < count; i++){
+    check(events[i].index, events[i].fflags, events[i].entry);
+  }
+}
+
+static void
+touch(const char *dir, const char *name)
+{
+  char path[PATH_MAX];
+  int fd;
+
+  (void) snprintf(path, sizeof(path), "%s/%s", dir, name);
+  fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if(fd == -1 || 1 != write(fd, "x", 1)){
+    err(2, "Unable to write %s", path);
+  }
+  (void) close(fd);
+}
+
+static void
+makedir(const char *dir, const char *name)
+{
+  char path[PATH_MAX];
+
+  (void) snprintf(path, sizeof(path), "%s/%s", dir, name);
+  if(-1 == mkdir(path, 0755)){
+    err(2, "Unable to create %s", path);
+  }
+}
+
+static void
+removeentry(const char *dir, const char *name)
+{
+  char path[PATH_MAX];
+
+  (void) snprintf(path, sizeof(path), "%s/%s", dir, name);
+  if(-1 == remove(path)){
+    err(2, "Unable to remove %s", path);
+  }
+}
+
+static long long
+now_ms(void)
+{
+  struct timespec ts;
+
+  (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* dispatches for up to `ms' milliseconds, or until `want' is seen */
+static void
+pump(int ms)
+{
+  struct pollfd pfd;
+  long long end = now_ms() + ms;
+  long long left;
+
+  pfd.fd = watchpaths_fd(ws);
+  pfd.events = POLLIN;
+  while(!hit && (left = end - now_ms()) > 0){
+    (void) poll(&pfd, 1, (int) left);
+    if(watchpaths_dispatch(ws, 0) == -1){
+      err(2, "Unable to dispatch");
+    }
+  }
+}
+
+static void
+expect(const char *entry, u_int flags)
+{
+  want = entry;
+  wantflags = flags;
+  hit = 0;
+  pump(EVENT_TIMEOUT);
+  if(!hit){
+    errx(2, "No callback for entry %s", entry);
+  }
+  want = NULL;
+  hit = 0;
+}
+
+int
+main(int argc, char **argv)
+{
+  char root[PATH_MAX];
+
+  if(argc != 2){
+    errx(1, "USAGE: t_watchpaths_tree DIR\n");
+  }
+
+  (void) snprintf(root, sizeof(root), "%s/t", argv[1]);
+  makedir(argv[1], "t");
+  makedir(root, "a");
+  makedir(root, "a/b");
+  touch(root, "a/b/f");
+
+  ws = watchpaths_create(NULL, 0, callback, NULL);
+  if(ws == NULL){
+    err(2, "Unable to create watch set");
+  }
+  tree = watchpaths_tree(ws, root);
+  if(tree == -1){
+    err(2, "Unable to watch tree %s", root);
+  }
+  if(watchpaths_tree(ws, root) != -1 || errno != EEXIST){
+    errx(2, "Tree watched twice");
+  }
+  pump(300);
+  if(seen != 0){
+    errx(2, "Entries which existed at the outset were reported");
+  }
+
+  touch(root, "a/b/f");
+  expect("a/b/f", NOTE_WRITE);
+  touch(root, "top");
+  expect("top", NOTE_WRITE);
+
+  makedir(root, "new");
+  expect("new", NOTE_WRITE);
+  touch(root, "new/g");
+  expect("new/g", NOTE_WRITE);
+
+  /* filled before the tree can have watched it */
+  makedir(root, "x");
+  makedir(root, "x/y");
+  touch(root, "x/y/z");
+  expect("x/y/z", NOTE_WRITE);
+  touch(root, "x/y/z");
+  expect("x/y/z", NOTE_WRITE);
+
+  removeentry(root, "a/b/f");
+  removeentry(root, "a/b");
+  removeentry(root, "a");
+  expect("a", NOTE_DELETE);
+
+  watchpaths_batch(ws, batch);
+  touch(root, "new/g");
+  expect("new/g", NOTE_WRITE);
+  watchpaths_batch(ws, NULL);
+
+  if(watchpaths_remove(ws, root) == -1){
+    err(2, "Unable to remove tree %s", root);
+  }
+  pump(300);
+  seen = 0;
+  touch(root, "new/g");
+  touch(root, "top");
+  pump(300);
+  if(seen != 0){
+    errx(2, "Callback after the tree was removed");
+  }
+
+  watchpaths_destroy(ws);
+  return 0;
+}
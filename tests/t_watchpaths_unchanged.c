@@ -0,0 +1,237 @@
+/*
+ * Copyright (c) 2015, Expanded Possibilities, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided
+ * with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *  CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+ *  BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ *  ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ *  THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+/*
+ * t_watchpaths_unchanged DIR
+ *
+ * Watches files under DIR with fingerprinting on. Checks that
+ * rewriting a file with the same content, replacing it with a copy of
+ * itself or changing its permissions is not reported, while a change
+ * of content is, even one of a single byte in a large file or one which
+ * keeps the size and comes at once, or one which recreates a removed
+ * file. Also checks that paths added later are fingerprinted, and that
+ * turning fingerprinting off reports every write again.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "../watchpaths.h"
+#include "../splint_defs.h"
+
+/* how long to wait for an event before giving up, in ms */
+#define EVENT_TIMEOUT 5000
+
+/* how long to wait for an event which should not come, in ms */
+#define QUIET_TIME 300
+
+/* the size of the large file, which is not a multiple of the stripe */
+#define LARGE_SIZE (3 * 1024 * 1024 + 17)
+
+static struct watchset *ws;
+static int seen[2];
+
+static void
+callback(/*@unused@*/ u_int flags, int idx, /*@unused@*/ void *data,
+         /*@unused@*/ int *cont)
+{
+  if(idx >= 0 && idx < 2){
+    seen[idx]++;
+  }
+}
+
+static void
+put(const char *path, const char *buf, size_t len)
+{
+  int fd;
+
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd == -1 || (ssize_t) len != write(fd, buf, len)){
+    err(2, "Unable to write %s", path);
+  }
+  (void) close(fd);
+}
+
+/* replaces `path' with a new file holding `buf', as editors do */
+static void
+replace(const char *path, const char *buf, size_t len)
+{
+  char tmp[PATH_MAX];
+
+  (void) snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  put(tmp, buf, len);
+  if(-1 == rename(tmp, path)){
+    err(2, "Unable to rename %s", tmp);
+  }
+}
+
+static long long
+now_ms(void)
+{
+  struct timespec ts;
+
+  (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* dispatches for up to `ms' milliseconds, or until `idx' is reported */
+static void
+pump(int idx, int ms)
+{
+  struct pollfd pfd;
+  long long end = now_ms() + ms;
+  long long left;
+
+  pfd.fd = watchpaths_fd(ws);
+  pfd.events = POLLIN;
+  while((idx < 0 || seen[idx] == 0) && (left = end - now_ms()) > 0){
+    (void) poll(&pfd, 1, (int) left);
+    if(watchpaths_dispatch(ws, 0) == -1){
+      err(2, "Unable to dispatch");
+    }
+  }
+}
+
+static void
+expect(int idx, const char *what)
+{
+  seen[0] = seen[1] = 0;
+  pump(idx, EVENT_TIMEOUT);
+  if(seen[idx] == 0){
+    errx(2, "No callback after %s", what);
+  }
+  /* let the rest of the events for the same change go by */
+  pump(-1, QUIET_TIME);
+  seen[0] = seen[1] = 0;
+}
+
+static void
+expect_none(const char *what)
+{
+  seen[0] = seen[1] = 0;
+  pump(-1, QUIET_TIME);
+  if(seen[0] != 0 || seen[1] != 0){
+    errx(2, "Callback after %s", what);
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  char path[PATH_MAX], other[PATH_MAX];
+  char *paths[1];
+  char *large = NULL;
+  int fd, i;
+
+  if(argc != 2){
+    errx(1, "USAGE: t_watchpaths_unchanged DIR\n");
+  }
+  (void) snprintf(path, sizeof(path), "%s/conf", argv[1]);
+  (void) snprintf(other, sizeof(other), "%s/other", argv[1]);
+
+  put(path, "alpha\n", 6);
+  paths[0] = path;
+  ws = watchpaths_create(paths, 1, callback, NULL);
+  if(ws == NULL){
+    err(2, "Unable to create watch set");
+  }
+  if(watchpaths_fingerprint(ws, 1) == -1){
+    err(2, "Unable to fingerprint");
+  }
+
+  put(path, "alpha\n", 6);
+  expect_none("a rewrite with the same content");
+  if(-1 == chmod(path, 0600)){
+    err(2, "Unable to change mode of %s", path);
+  }
+  expect_none("a change of mode");
+  put(path, "gamma\n", 6);
+  expect(0, "a change of content of the same size");
+  replace(path, "gamma\n", 6);
+  expect_none("replacement by a copy");
+  replace(path, "delta\n", 6);
+  expect(0, "replacement by another file");
+
+  large = malloc(LARGE_SIZE);
+  if(large == NULL){
+    err(2, "Unable to allocate large file");
+  }
+  for(i = 0; i < LARGE_SIZE; i++){
+    large[i] = (char) (i * 7 + i / 4096);
+  }
+  put(path, large, LARGE_SIZE);
+  expect(0, "a large write");
+  put(path, large, LARGE_SIZE);
+  expect_none("a large rewrite with the same content");
+  fd = open(path, O_WRONLY);
+  if(fd == -1 || 1 != pwrite(fd, "!", 1, LARGE_SIZE / 2)){
+    err(2, "Unable to write %s", path);
+  }
+  (void) close(fd);
+  expect(0, "a change of one byte of a large file");
+  free(large);
+
+  if(-1 == unlink(path)){
+    err(2, "Unable to remove %s", path);
+  }
+  pump(-1, QUIET_TIME);
+  put(path, "delta\n", 6);
+  expect(0, "recreation");
+
+  put(other, "beta\n", 5);
+  if(watchpaths_add(ws, other) != 1){
+    err(2, "Unable to add %s", other);
+  }
+  put(other, "beta\n", 5);
+  expect_none("a rewrite of an added path with the same content");
+  put(other, "BETA\n", 5);
+  expect(1, "a change of an added path");
+
+  if(watchpaths_fingerprint(ws, 0) == -1){
+    err(2, "Unable to stop fingerprinting");
+  }
+  put(path, "delta\n", 6);
+  expect(0, "a rewrite with fingerprinting off");
+
+  watchpaths_destroy(ws);
+  return 0;
+}
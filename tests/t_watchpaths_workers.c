@@ -0,0 +1,250 @@
+/*
+ * Copyright (c) 2015, Expanded Possibilities, Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided
+ * with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *  CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+ *  BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ *  ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ *  THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+/*
+ * t_watchpaths_workers DIR
+ *
+ * Watches NUMTREES trees under DIR with NUMWORKERS workers running
+ * slow callbacks, while another thread creates NUMENTRIES entries in
+ * each. Checks that the callbacks for a tree run one at a time and see
+ * its entries in order, that callbacks for different trees run side
+ * by side, that a callback which sets *cont to zero stops
+ * watchpaths_run(), after which no callback runs, and that the queue
+ * statistics add up.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "../watchpaths.h"
+#include "../splint_defs.h"
+
+#define NUMTREES 4
+#define NUMWORKERS 3
+#define NUMENTRIES 50
+
+/* how long each callback takes, in ms */
+#define CALLBACK_MS 2
+
+/* how long to wait for the entries to be seen before giving up, in s */
+#define EVENT_TIMEOUT 20
+
+static struct watchset *ws;
+static char roots[NUMTREES][PATH_MAX];
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int running[NUMTREES];
+static int last[NUMTREES];
+static int seen[NUMTREES];
+static int concurrent;
+static int most;
+static int calls;
+static int failed;
+
+static void
+sleep_ms(long ms)
+{
+  struct timespec ts;
+
+  ts.tv_sec = ms / 1000;
+  ts.tv_nsec = (ms % 1000) * 1000000;
+  while(-1 == nanosleep(&ts, &ts) && errno == EINTR);
+}
+
+static void
+callback(/*@unused@*/ u_int flags, int idx, /*@unused@*/ void *data,
+         int *cont)
+{
+  const char *entry = watchpaths_entry(ws);
+  int n;
+
+  if(idx < 0 || idx >= NUMTREES || entry == NULL){
+    return;
+  }
+  if(strcmp(entry, "stop") == 0){
+    *cont = 0;
+    return;
+  }
+  n = atoi(entry);
+
+  (void) pthread_mutex_lock(&lock);
+  calls++;
+  if(running[idx]++ != 0){
+    warnx("Callbacks for tree %d overlapped", idx);
+    failed = 1;
+  }
+  if(n < last[idx]){
+    warnx("Entry %d of tree %d seen after entry %d", n, idx, last[idx]);
+    failed = 1;
+  }
+  if(n > last[idx]){
+    last[idx] = n;
+    seen[idx]++;
+  }
+  if(++concurrent > most){
+    most = concurrent;
+  }
+  (void) pthread_mutex_unlock(&lock);
+
+  sleep_ms(CALLBACK_MS);
+
+  (void) pthread_mutex_lock(&lock);
+  concurrent--;
+  running[idx]--;
+  (void) pthread_mutex_unlock(&lock);
+}
+
+static void
+create(const char *dir, const char *name)
+{
+  char path[PATH_MAX];
+  int fd;
+
+  (void) snprintf(path, sizeof(path), "%s/%s", dir, name);
+  fd = open(path, O_WRONLY | O_CREAT, 0644);
+  if(fd == -1){
+    err(2, "Unable to create %s", path);
+  }
+  (void) close(fd);
+}
+
+/* creates the entries, then, once they have all been seen, "stop" */
+/*@null@*/
+static void *
+writer(/*@unused@*/ void *arg)
+{
+  char name[16];
+  int i, t, done;
+
+  for(i = 1; i <= NUMENTRIES; i++){
+    (void) snprintf(name, sizeof(name), "%d", i);
+    for(t = 0; t < NUMTREES; t++){
+      create(roots[t], name);
+    }
+  }
+  for(i = 0; i < EVENT_TIMEOUT * 100; i++){
+    (void) pthread_mutex_lock(&lock);
+    for(done = 1, t = 0; t < NUMTREES; t++){
+      done = done && last[t] == NUMENTRIES;
+    }
+    (void) pthread_mutex_unlock(&lock);
+    if(done){
+      break;
+    }
+    sleep_ms(10);
+  }
+  create(roots[1], "stop");
+  return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+  struct watchpaths_queue queue;
+  pthread_t thread;
+  int t, before;
+
+  if(argc != 2){
+    errx(1, "USAGE: t_watchpaths_workers DIR\n");
+  }
+
+  ws = watchpaths_create(NULL, 0, callback, NULL);
+  if(ws == NULL){
+    err(2, "Unable to create watch set");
+  }
+  for(t = 0; t < NUMTREES; t++){
+    (void) snprintf(roots[t], sizeof(roots[t]), "%s/%d", argv[1], t);
+    if(-1 == mkdir(roots[t], 0755)){
+      err(2, "Unable to create %s", roots[t]);
+    }
+    if(watchpaths_tree(ws, roots[t]) != t){
+      err(2, "Unable to watch tree %s", roots[t]);
+    }
+  }
+  if(watchpaths_workers(ws, -1) != -1 || errno != EINVAL){
+    errx(2, "Negative worker count accepted");
+  }
+  if(watchpaths_workers(ws, NUMWORKERS) == -1){
+    err(2, "Unable to start workers");
+  }
+
+  if(pthread_create(&thread, NULL, writer, NULL) != 0){
+    errx(2, "Unable to start writer");
+  }
+  if(watchpaths_run(ws) == -1){
+    err(2, "Unable to watch");
+  }
+  (void) pthread_join(thread, NULL);
+
+  (void) pthread_mutex_lock(&lock);
+  before = calls;
+  (void) pthread_mutex_unlock(&lock);
+  create(roots[2], "late");
+  sleep_ms(200);
+  (void) pthread_mutex_lock(&lock);
+  if(calls != before || concurrent != 0){
+    warnx("Callback ran after watchpaths_run() returned");
+    failed = 1;
+  }
+  (void) pthread_mutex_unlock(&lock);
+
+  for(t = 0; t < NUMTREES; t++){
+    if(last[t] != NUMENTRIES){
+      warnx("Tree %d saw %d of %d entries", t, last[t], NUMENTRIES);
+      failed = 1;
+    }
+  }
+  if(most < 2){
+    warnx("Callbacks for different trees never ran side by side");
+    failed = 1;
+  }
+  watchpaths_queued(ws, &queue);
+  if(queue.queued != 0 || queue.handed < (unsigned long) calls ||
+     queue.deepest == 0){
+    warnx("Queue statistics queued %lu deepest %lu handed %lu for %d calls",
+          queue.queued, queue.deepest, queue.handed, calls);
+    failed = 1;
+  }
+
+  watchpaths_destroy(ws);
+  return failed ? 2 : 0;
+}
@@ -30,17 +30,22 @@
  */
 
 #include <sys/types.h>
-#include <sys/event.h>
 #include <sys/time.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 #include <stdio.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include <libgen.h>
 #include <string.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "watchpaths.h"
@@ -48,6 +53,26 @@
 #include "reallocarray.h"
 #include "splint_defs.h"
 
+/* watchpaths.h chooses the event backend */
+#ifdef WP_INOTIFY
+#include <sys/inotify.h>
+#ifndef WP_NO_URING
+#define WP_URING
+#include <sys/sysmacros.h>
+#include <linux/io_uring.h>
+#endif
+#else
+#include <sys/event.h>
+#endif
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/vfs.h>
+#else
+#include <sys/param.h>
+#include <sys/mount.h>
+#endif
+
 #ifndef WP_DEBUG
 #define WP_DEBUG 0
 #endif
@@ -83,422 +108,8683 @@ typedef /*@null@*/ char* nullcharp_t;
 #define OPEN_MODE O_RDONLY
 #endif
 
+/*
+ * A file which cannot be watched for one of these reasons may become
+ * watchable when it is recreated, so it is left for its parent to find
+ * again rather than treated as a failure.
+ */
+#define PASSING(err) ((err) == ENOENT || (err) == ENOTDIR ||  \
+                      (err) == EACCES || (err) == EPERM)
+
+#ifndef WP_INOTIFY
+/*
+ * Registrations made with EV_CLEAR persist until their descriptor is
+ * closed, so only paths which were re-opened need to be passed to
+ * kevent(2) again. Define WP_ONESHOT to re-register each path after
+ * each of its events instead, dropping any events which occur while
+ * its callback runs.
+ */
+#ifdef WP_ONESHOT
+#define EV_MODE EV_ONESHOT
+#else
+#define EV_MODE EV_CLEAR
+#endif
+#endif
+
+#ifdef WP_INOTIFY
+/*
+ * Masks passed to inotify_add_watch(2). A directory only needs to
+ * report changes to its entries and a file only needs to report
+ * changes to its contents. Both report their own removal so that the
+ * paths beneath them can be dropped at once.
+ *
+ * A directory within a tree also reports writes to its files, which
+ * have no watch of their own, see tree_report().
+ *
+ * A file is only watched for changes to its contents if one of the
+ * paths naming it wants them reported, see node_wants(). The masks are
+ * only ever added to, since inotify_add_watch(2) would otherwise replace
+ * the mask of an inode which is watched on behalf of several paths at
+ * once.
+ */
+#define WATCH_SELF_MASK (IN_DELETE_SELF | IN_MOVE_SELF)
+#define WATCH_DIR_MASK  (WATCH_SELF_MASK | IN_CREATE | IN_DELETE |      \
+                         IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+#define WATCH_FILE_MASK (WATCH_SELF_MASK | IN_MODIFY | IN_CLOSE_WRITE)
+#define WATCH_TREE_MASK (WATCH_DIR_MASK | IN_MODIFY)
+
+/* large enough for many events carrying a NAME_MAX name each */
+#define EVENT_BUFF_SIZE (64 * 1024)
+#endif
+
+#ifndef WP_INOTIFY
+/*
+ * struct kwatch
+ *
+ * A descriptor registered with kqueue. This is the first member of
+ * struct pathnode, so the udata of an event points to both.
+ *
+ * fd:        the descriptor, or -1
+ * dirty:     nonzero while the watch is on the dirty list
+ * dirtynext: the next watch on the dirty list
+ * dirtyprev: the previous watch on the dirty list, or NULL at its head
+ */
+struct kwatch {
+  int fd;
+  int dirty;
+  /*@null@*/ /*@dependent@*/ struct kwatch *dirtynext;
+  /*@null@*/ /*@dependent@*/ struct kwatch *dirtyprev;
+};
+#endif
+
+struct pathnode;
+struct pathinfo;
+
+/*
+ * Deadlines are kept in a hierarchical timer wheel of WHEEL_LEVELS
+ * levels of WHEEL_SLOTS slots each, with a resolution of 1 ms. Level 0
+ * holds the timers due within the current run of WHEEL_SLOTS ms, one
+ * slot per ms, and each level above holds WHEEL_SLOTS times the span
+ * of the level below per slot. A timer is moved down a level when its
+ * slot comes up, so arming, resetting and expiring a timer all take
+ * constant time. The levels cover 2^30 ms, about 12 days; timers due
+ * further off wait on a separate list which is sorted back into the
+ * wheel whenever the top level wraps around.
+ */
+#define WHEEL_BITS   6
+#define WHEEL_SLOTS  (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 5
+
+/*
+ * struct wptimer
+ *
+ * A deadline in the timer wheel, see timer_add().
+ *
+ * expires: when the timer is due, in ms
+ * owner:   the path whose deadline this is, or NULL for the tick
+ * next:    the next timer in the same list
+ * pprev:   the link pointing to this timer, or NULL if it is not armed
+ * where:   the slot holding the timer, numbered level * WHEEL_SLOTS +
+ *          slot, or -1 if it is on one of the other lists
+ */
+struct wptimer {
+  long long expires;
+  /*@null@*/ /*@dependent@*/ struct pathinfo *owner;
+  /*@null@*/ /*@dependent@*/ struct wptimer *next;
+  /*@null@*/ /*@dependent@*/ struct wptimer **pprev;
+  int where;
+};
+
 /*
  * struct pathinfo
  *
  * This holds the per-path state for watchpaths, allowing callers to
  * watch multiple paths simultaneously. These variables were extracted
  * from watchpath (single path version) when converting to the current
- * version which simultaneously watches multiple paths.
- *
- * dev:        the device id of the leaf node
- * path:       the path to be watched
- * slashes:    an array of pointers to the '/' characters in `path'
- * nextslash:  a pointer to the next element of `slashes' to examine
- * endslash:   a pointer to the final element of `slashes'
- * ke:         a reference to the kevent structure passed to kevent(2)
- *             for this path. It points to an element of the changelist
- *             array.
+ * version which simultaneously watches multiple paths. Only the state
+ * used while dispatching events is kept here; the name of the path is
+ * kept apart in struct pathname.
+ *
+ * node:       the node of the path trie naming the same file, or NULL
+ *             once removed
+ * next, prev: the neighbours of this path among those naming `node'.
+ *             Once removed, `next' links the free list instead.
+ * worknext:   the next path due a callback, see queue_leaves()
  * index:      the index in the array of paths to watch which corresponds
- *             to this structure.
- * fdp:        a pointer used to extract the file descriptor from a kevent
+ *             to this structure. It is kept when the path is removed, and
+ *             given to the next path added.
+ * pending:    the fflags of the events held back by the debounce stage,
+ *             or 0 if none are, see notify()
+ * heappos:    the position of this path in ws->heap while `pending' is
+ *             not 0
+ * first:      when the first of the pending events was seen, in ms
+ * origin:     when the first of the pending events was read, in ns, see
+ *             emit()
+ * due:        when the pending events are to be reported, in ms
+ * deadline:   the inactivity deadline of the path in ms, or 0 if none,
+ *             see watchpaths_deadline()
+ * timer:      the timer which expires `deadline' ms after the last event
+ * tree:       nonzero if the path is the root of a tree, whose entries
+ *             are reported as well, see watchpaths_tree()
+ * print:      the fingerprint of the content of the path, or NULL if
+ *             it is not kept, see watchpaths_fingerprint()
+ * file:       the descriptor and mapping handed to the open callback,
+ *             or NULL until it is first invoked, see file_get()
+ * pollslot:   the position of the path in ws->snaps, or -1 if it is not
+ *             polled, see watchpaths_poll()
+ * stateslot:  the position of the record of the path in the state file,
+ *             or -1 if it has none, see watchpaths_state()
+ * missslot:   the position of the path in ws->missed, or -1 if it is not
+ *             due a callback for a change made while nothing watched
+ * mask:       the fflags the callback wants for the path, see
+ *             struct watchpaths_opts
+ * data:       passed to the callback in place of ws->blob, or NULL
+ * openflags:  the flags the open callback opens the path with, or -1
+ *             for ws->openflags
+ * fresh:      nonzero when the leaf was just created empty and the
+ *             callback is held back until it is first written or closed
+ *             (inotify only)
  */
 struct pathinfo {
-  dev_t dev;
-  /*@owned@*/ char *path;
-  /*@owned@*/ nullcharp_t *slashes;
-  /*@dependent@*/ nullcharp_t *nextslash;
-  /*@dependent@*/ nullcharp_t *endslash;
-  /*@dependent@*/ struct kevent *ke;
+  /*@dependent@*/ struct pathnode *node;
+  /*@null@*/ /*@dependent@*/ struct pathinfo *next;
+  /*@null@*/ /*@dependent@*/ struct pathinfo *prev;
+  /*@null@*/ /*@dependent@*/ struct pathinfo *worknext;
   int index;
-  /*@dependent@*/ long *fdp;
+  u_int pending;
+  size_t heappos;
+  long long first;
+  long long origin;
+  long long due;
+  long long deadline;
+  struct wptimer timer;
+  int tree;
+  /*@null@*/ /*@owned@*/ struct fingerprint *print;
+  /*@null@*/ /*@owned@*/ struct openfile *file;
+  int pollslot;
+  long stateslot;
+  int missslot;
+  u_int mask;
+  /*@null@*/ /*@dependent@*/ void *data;
+  int openflags;
+#ifdef WP_INOTIFY
+  int fresh;
+#endif
+};
+
+/*
+ * struct fingerprint
+ *
+ * What was last seen of the content of a path, so that a write which
+ * leaves it as it was can be told apart, see print_check().
+ *
+ * dev, ino: the file seen
+ * size:     its size
+ * mtime:    its modification time
+ * taken:    when the fingerprint was taken, on the realtime clock
+ * hash:     the hash of the content, see HASH_P1
+ * valid:    nonzero if the fields above describe a regular file, zero if
+ *           the path was missing or could not be read
+ */
+struct fingerprint {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  time_t taken;
+  uint64_t hash;
+  int valid;
 };
 
+/*
+ * struct openfile
+ *
+ * The file last handed to the open callback for a path, kept so that
+ * the next event for the same file reuses it, see file_get().
+ *
+ * fd:       the file opened with ws->openflags, or -1 if none is held
+ * view:     a mapping of the whole file, or NULL
+ * size:     the size of `view'
+ * dev, ino: the file `fd' and `view' belong to, or (dev_t) -1 if none
+ * tdev,
+ * tino:     in tail mode, the file whose bytes up to `pos' have been
+ *           passed to the callback, or (dev_t) -1 if none, see
+ *           watchpaths_tail()
+ * pos:      the offset in it of the first byte yet to be passed
+ */
+struct openfile {
+  int fd;
+  /*@null@*/ void *view;
+  size_t size;
+  dev_t dev;
+  ino_t ino;
+  dev_t tdev;
+  ino_t tino;
+  off_t pos;
+};
 
-/*@null@*/
-static nullcharp_t *find_slashes(char *path, int len, /*@out@*/ size_t *sout);
+/*
+ * The content hash is xxHash64. Its four accumulators take alternate
+ * words of each 32 byte stripe and do not depend on one another, so the
+ * loop keeps several multipliers busy at once, or is vectorized by the
+ * compiler, and runs at several bytes per cycle.
+ */
+#define HASH_P1 0x9E3779B185EBCA87ULL
+#define HASH_P2 0xC2B2AE3D27D4EB4FULL
+#define HASH_P3 0x165667B19E3779F9ULL
+#define HASH_P4 0x85EBCA77C2B2AE63ULL
+#define HASH_P5 0x27D4EB2F165667C5ULL
+#define HASH_ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
 
-static int    walk_to_extant_parent(struct pathinfo *pinfo);
+/* the size of the blocks in which files are read to be hashed */
+#define PRINT_BUFF_SIZE (64 * 1024)
 
+/* the modification and change times in a struct stat, which Darwin
+ * names apart */
+#ifdef __APPLE__
+#define ST_MTIM(finfo) ((finfo).st_mtimespec)
+#define ST_CTIM(finfo) ((finfo).st_ctimespec)
+#else
+#define ST_MTIM(finfo) ((finfo).st_mtim)
+#define ST_CTIM(finfo) ((finfo).st_ctim)
+#endif
 
-/* find_slashes
+/*
+ * struct pollsnap
  *
- * Returns an array of pointers to the slashes in the path argument.
+ * What was last seen of a path which is polled rather than left to the
+ * kernel, see poll_one(). The snapshots of all of the polled paths lie
+ * in one dense array, ws->snaps, which a sweep walks from end to end.
  *
- * This is similar to what one might achieve by running strsep(3) in a
- * loop. The major differences are the safety imparted by the length
- * parameter and that NUL-byte writing is left for the caller to
- * perform when appropriate .
+ * ino:     the inode of the file
+ * size:    its size
+ * mtime:   its modification time, in ns
+ * ctime:   its change time, in ns
+ * index:   the index of the path
+ * present: nonzero if the path named a file when last polled
+ */
+struct pollsnap {
+  ino_t ino;
+  off_t size;
+  long long mtime;
+  long long ctime;
+  int index;
+  int present;
+};
+
+/*
+ * A sweep over the polled paths is spread over the poll interval in
+ * slices of POLL_SLICE ms, each polling the paths which fell due during
+ * it, so that a large number of polled paths costs a steady trickle of
+ * stat(2) calls rather than a spike once per interval.
+ */
+#define POLL_SLICE 10
+
+/* a timespec in ns, as kept in struct pollsnap */
+#define TS_NS(ts) ((long long) (ts).tv_sec * 1000000000 + (ts).tv_nsec)
+
+/*
+ * struct statehead
  *
- * The caller sets the value at one of the pointers to '\0' in order
- * to "truncate" the path string at a particular parent directory.
+ * The header of a state file, see watchpaths_state(). The file is the
+ * header followed by `capacity' records, and is mapped whole, so that a
+ * record is brought up to date by storing into it. The fields have
+ * fixed widths; a file written on a machine of the other byte order is
+ * refused rather than misread.
  *
- * Common usage:
- *  if(*nextslash) **nextslash = '\0';
- *  CODE THAT USES SHORTENED PATH
- *  if(*nextslash) **nextslash = '/';
+ * magic:    STATE_MAGIC
+ * order:    STATE_ORDER, as stored by the machine which wrote the file
+ * version:  STATE_VERSION
+ * recsize:  the size of a record, sizeof(struct staterec)
+ * capacity: the number of records, a power of two
+ * used:     the number of records in use
+ */
+struct statehead {
+  char magic[8];
+  uint64_t order;
+  uint32_t version;
+  uint32_t recsize;
+  uint64_t capacity;
+  uint64_t used;
+  char spare[24];
+};
+
+/*
+ * struct staterec
  *
- * The reason for `if(*nextslash)' is that the 0th "slash" pointer
- * returned is set to NULL, so that the caller's slash-walking loop
- * can distinguish between the leaf and one of its parent directories.
+ * What was last seen of a watched path, kept in a state file. The
+ * records form an open addressed hash table keyed by a hash of the
+ * path, see state_find(). Records are never removed, so a path which
+ * is watched again finds what was last seen of it.
  *
- * ARGUMENTS
+ * key:   the hash of the path, see state_key(), or 0 if the record is
+ *        free
+ * dev:   the device of the file seen
+ * ino:   its inode
+ * size:  its size
+ * mtime: its modification time, in ns
+ * taken: when the record was made, in seconds on the realtime clock
+ * hash:  the hash of the content, if STATE_HASHED
+ * flags: STATE_PRESENT if the path named a file, STATE_HASHED if
+ *        `hash' is known, STATE_TAILED if the tail fields are
+ * taildev,
+ * tailino: the file last passed to the open callback in tail mode,
+ *          see watchpaths_tail()
+ * tailpos: the bytes of it passed once the callback returned
+ */
+struct staterec {
+  uint64_t key;
+  uint64_t dev;
+  uint64_t ino;
+  int64_t size;
+  int64_t mtime;
+  int64_t taken;
+  uint64_t hash;
+  uint32_t flags;
+  uint32_t spare;
+  uint64_t taildev;
+  uint64_t tailino;
+  int64_t tailpos;
+};
+
+/*
+ * struct staterec1
  *
- * path: the string to search
- * len:  the length of the path string or zero to calculate the length
- * sout: a pointer to a size_t which will be populated with the length
- *       of the return array
+ * A record of a state file of version 1, which had no tail fields.
+ * Such a file is rewritten at the current version when it is opened,
+ * see state_rewrite().
  */
+struct staterec1 {
+  uint64_t key;
+  uint64_t dev;
+  uint64_t ino;
+  int64_t size;
+  int64_t mtime;
+  int64_t taken;
+  uint64_t hash;
+  uint32_t flags;
+  uint32_t spare;
+};
 
-/*@null@*/
-static nullcharp_t *
-find_slashes(char *path, int len, /*@out@*/ size_t *sout)
-{
-  size_t max = 0;
-  size_t i = 0;
-  size_t count = 1;
-  char *p = path;
-  nullcharp_t *out = NULL;
+#define STATE_MAGIC   "WPSTATE"
+#define STATE_ORDER   0x0102030405060708ULL
+#define STATE_VERSION 2
+#define STATE_MIN     1024
+#define STATE_PRESENT 1
+#define STATE_HASHED  2
+#define STATE_TAILED  4
 
-  /* count the number of slashes */
-  max = len > 0 ? (size_t) len : PATH_MAX;
-  while(i < max && *p != '\0'){
-    if(*(p++) == '/'){
-      count++;
-    }
-  }
+/* the size of a state file holding `cap' records */
+#define STATE_SIZE(cap) \
+  (sizeof(struct statehead) + (size_t) (cap) * sizeof(struct staterec))
+#define STATE_SIZE1(cap) \
+  (sizeof(struct statehead) + (size_t) (cap) * sizeof(struct staterec1))
 
-  out = reallocarray(NULL, count, sizeof(nullcharp_t));
-  if(out == NULL){
-    *sout = 0;
-    return NULL; /* keeps errno */
-  }
+/*
+ * struct pathname
+ *
+ * The name of a watched path, which is needed only to add and remove
+ * paths, see name_find().
+ *
+ * path: the path to be watched, stored in the arena, or NULL once
+ *       removed
+ * hash: the hash of `path', see hash_name()
+ * len:  the length of `path'
+ */
+struct pathname {
+  /*@null@*/ /*@dependent@*/ char *path;
+  size_t hash;
+  size_t len;
+};
 
-  p = path;
-  /* count is always at least 1 */
-  for(i = count - 1; i > 0; i--){
-    while(*p != '/'){
-      p++;
-    }
-    out[i] = p++;
-  }
-  out[0] = NULL; /* hack to detect slash record for leaf */
-  *sout = count;
-  return out;
-}
+/*
+ * The paths are allocated SLAB_SIZE at a time, so a large watch set
+ * costs a handful of allocations rather than several per path. Within
+ * a slab the state used while dispatching lies in one dense array and
+ * the names in another, so events touch as few cache lines as
+ * possible. Slabs never move, so the trie refers to paths directly.
+ */
+#define SLAB_BITS 6
+#define SLAB_SIZE (1 << SLAB_BITS)
+
+struct pathslab {
+  struct pathinfo info[SLAB_SIZE];
+  struct pathname name[SLAB_SIZE];
+};
+
+/* the state and the name of the path at an index */
+#define PINFO(ws, i) \
+  (&(ws)->slabs[(i) >> SLAB_BITS]->info[(i) & (SLAB_SIZE - 1)])
+#define PNAME(ws, i) \
+  (&(ws)->slabs[(i) >> SLAB_BITS]->name[(i) & (SLAB_SIZE - 1)])
 
 /*
- * walk_to_extant_parent
+ * struct arenachunk
  *
- * Given a pointer to a pinfo struct, modifies the structure to
- * reference the first parent directory of pinfo->path which actually
- * exists.
+ * A block of the arena holding the bytes of the watched paths. Paths
+ * are packed end to end with their NUL bytes, see arena_copy().
  *
- * Stops at device boundaries.
- *
- * Returns 0 if successful, returns -1 and sets errno otherwise.
+ * next: the block filled before this one
+ * used: the number of bytes of `bytes' in use
+ * size: the number of bytes in `bytes'
  */
-static int
-walk_to_extant_parent(struct pathinfo *pinfo)
-{
-  struct stat finfo;
+struct arenachunk {
+  /*@null@*/ /*@owned@*/ struct arenachunk *next;
+  size_t used;
+  size_t size;
+  char bytes[];
+};
 
-  /*
-   * start at the leaf every time in case multiple path elements were
-   * created at once, such as by mv
-   */
-  pinfo->nextslash = pinfo->slashes;
-  if(*pinfo->fdp >= 0){
-    /* don't leak file descriptors */
-    while(-1 == close((int)*pinfo->fdp) && errno == EINTR);
-  }
+#define ARENA_CHUNK (64 * 1024)
 
-  /*
-   * loop over each parent directory until one is encountered that
-   * exists or returns an error other than one of the ones that may go
-   * away when the missing directory is recreated
-   */
-  for(*pinfo->fdp = (long) open(pinfo->path, OPEN_MODE);
-      /* open(2) errors checked in caller */
-      *pinfo->fdp == -1 &&
-      (errno == ENOENT ||
-       errno == ENOTDIR ||
-       errno == EACCES ||
-       errno == EPERM ||
-       errno == EINTR) && pinfo->nextslash < pinfo->endslash;
-      pinfo->nextslash++){
-    if(errno == EINTR) continue;
-
-    /* temporarily truncate pinfo->path at the next slash */
-    if(*pinfo->nextslash) **pinfo->nextslash = '\0';
-    debug_printf("open %s: ", pinfo->path);
-    *pinfo->fdp = (long) open(pinfo->path, OPEN_MODE);
-    debug_printf("%ld\n", *pinfo->fdp);
-    /* restore the slash in pinfo->path */
-    if(*pinfo->nextslash) **pinfo->nextslash = '/';
-
-    if(*pinfo->fdp >= 0){
-      if(-1 == fstat((int) *pinfo->fdp, &finfo)){
-        /* let caller see errno */
-        return -1;
-      }
-      if(pinfo->dev == -1){
-        /* bootstrap initial device choice */
-        pinfo->dev = finfo.st_dev;
-      } else if(finfo.st_dev != pinfo->dev){
-	errno = EXDEV; /* bad cross-device traversal */
-        return -1;
-      }
-    }
-  }
-  if(pinfo->nextslash > pinfo->slashes){
-    pinfo->nextslash--;
-  }
-  return 0;
-}
+/*
+ * The directories of a tree are read CRAWL_BUFF_SIZE bytes of entries
+ * at a time, see node_crawl(). The entries found which are to be
+ * watched are marked with one of the FOUND_ values: a directory is
+ * opened relative to its parent and read in turn, a regular file
+ * (kqueue only) is opened relative to its parent, and anything else,
+ * which is only watched when a path names it, is resolved by its path.
+ */
+#define CRAWL_BUFF_SIZE (256 * 1024)
+#define FOUND_DIR  1
+#define FOUND_FILE 2
+#define FOUND_PATH 3
 
+#ifdef __linux__
 /*
- * Caller documentation is in watchpaths.h
- * Implementation discussion follows.
+ * struct crawldirent
  *
- * Watchpaths attempts to monitor for changes in any one of a list of
- * specified files. It uses the kqueue/kevent API to do so. This API
- * does not have an option for monitoring path names, but does allow
- * monitoring file descriptors.
+ * An entry as returned by getdents64(2), which the C library need not
+ * declare.
+ */
+struct crawldirent {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+#endif
+
+/*
+ * The patterns given to watchpaths_filter() are compiled together into
+ * one automaton, whose states each stand for the set of positions
+ * reached in all of the patterns at once, so the entry of an event is
+ * classified in a single pass over its bytes however many patterns
+ * there are. The states are built as entries first reach them and are
+ * kept, up to FILTER_STATES of them, beyond which they are built
+ * afresh. Each pattern sets FILTER_INCLUDE or FILTER_EXCLUDE in the
+ * states in which it has matched.
+ */
+#define FILTER_STATES 1024
+#define FILTER_INCLUDE 1
+#define FILTER_EXCLUDE 2
+
+/* whether byte `c' is in the byte set `set' */
+#define BYTE_IN(set, c) (((set)[(c) >> 3] & (1 << ((c) & 7))) != 0)
+
+/*
+ * struct globpos
  *
- * Several design considerations follow from this fact:
+ * A position within a compiled pattern.
  *
- * 1. watchpaths() only functions properly if it is able to call
- *    open(2) on the file. On systems where O_EVTONLY mode is
- *    supported that open mode is used. Otherwise, O_RDONLY is used.
+ * bytes:  the bytes which lead on to `next', one bit each
+ * next:   the position reached after one of `bytes', or -1
+ * eps:    the positions reached without reading a byte, or -1
+ * accept: FILTER_INCLUDE or FILTER_EXCLUDE if the pattern has matched
+ *         once it gets here, or 0
+ */
+struct globpos {
+  unsigned char bytes[32];
+  int next;
+  int eps[2];
+  int accept;
+};
+
+/*
+ * struct filterstate
  *
- * 2. If files are renamed, such as by a "safe write" operation, work
- *    is required to obtain the file descriptor of the file now
- *    existing at the path.
+ * A state of the automaton.
  *
- * 3. If a file is deleted, there is no mechanism in kqueue to watch
- *    for its recreation. watchpaths() therefore begins watching its
- *    parent directory for writes. When such a write is detected, the
- *    function attempts to open the missing file again. This pattern
- *    is repeated for each parent directory via the
- *    walk_to_extant_parent() function defined above.
+ * next:  the state reached after a byte of each class, or NULL if it
+ *        has not been built yet
+ * flags: the FILTER_ values of the patterns which match here
+ * dead:  nonzero if no position is left, so no pattern can match later
+ * hash:  the hash of `set'
+ * set:   the positions of the state, one bit each
+ */
+struct filterstate {
+  /*@null@*/ /*@dependent@*/ struct filterstate **next;
+  int flags;
+  int dead;
+  size_t hash;
+  unsigned long set[];
+};
+
+#define SET_BITS (sizeof(unsigned long) * CHAR_BIT)
+#define SET_IN(set, i) \
+  (((set)[(i) / SET_BITS] & (1UL << ((i) % SET_BITS))) != 0)
+
+/*
+ * struct pathfilter
  *
- * In order to conserve memory, path walking is achieved not by
- * maintaining multiple copies of prefixes of the target path, but
- * rather by replacing '/' characters in the target path with NUL
- * bytes as needed, similar to the operation of strsep(3).
+ * The patterns of a watch set, see watchpaths_filter().
  *
- * All paths are copied by watchpaths, so callers need not worry hat
- * these changes will alter data in the caller's view.
+ * pos:        the positions of all of the patterns
+ * numpos:     the number of entries in `pos'
+ * maxpos:     the number of entries allocated for `pos'
+ * starts:     the first position of each pattern
+ * numstarts:  the number of patterns
+ * includes:   the number of include patterns
+ * classes:    the class of each byte. Bytes which no pattern tells
+ *             apart share a class, which keeps the states small.
+ * reps:       a byte of each class
+ * numclasses: the number of classes
+ * words:      the number of words in the set of a state
+ * table:      the states built, hashed by their sets
+ * numstates:  the number of states in `table'
+ * start:      the state before the first byte, or NULL if not built
+ * scratch:    storage for the set of a state being built
+ * stack:      storage for following the positions reached without
+ *             reading a byte
  */
-int
-watchpaths(char **inpaths, int numpaths,
-           void (*callback) (u_int, int, void *, int *), void *blob)
-{
-  /*@owned@*/ struct kevent *changelist = NULL;
-  int kq = -1;
-  /*@owned@*/ struct kevent *eventbuff = NULL;
-  /*@dependent@*/ struct kevent *evt = NULL;
-  int eventcount = 0;
-  int i = 0;
-  int cont = 1; /* &cont is passed to callback, if set to 0, main loop ends */
-  int ret = -1; /* stores return value for watchpaths */
-  size_t numslashes = 0;
-  /*@owned@*/ char *basepath = NULL;
-  /*@owned@*/ struct pathinfo *pinfos = NULL;
-  /*@dependent@*/ struct pathinfo *pinfo = NULL;
-  u_int typemask = 0;
-  u_int types[] = {NOTE_DELETE,
-                   NOTE_WRITE,
-                   NOTE_EXTEND,
-#ifdef NOTE_TRUNCATE
-                   NOTE_TRUNCATE,
-#endif
-                   NOTE_RENAME};
-  char *type_names[] = {"Delete",
-                        "Write",
-                        "Extend",
-#ifdef NOTE_TRUNCATE
-                        "Truncate",
-#endif
-                        "Rename"};
-  int numtypes = 0;
-
-  /* calculate mask to use in EV_SET call */
-  numtypes = (int) (sizeof(types) / sizeof(types[0]));
-  for(i = 0; i < numtypes; i++){
-   typemask |= types[i];
-  }
+struct pathfilter {
+  /*@null@*/ /*@owned@*/ struct globpos *pos;
+  int numpos;
+  int maxpos;
+  /*@null@*/ /*@owned@*/ int *starts;
+  int numstarts;
+  int includes;
+  unsigned char classes[256];
+  unsigned char reps[256];
+  int numclasses;
+  size_t words;
+  /*@owned@*/ struct filterstate *table[FILTER_STATES * 2];
+  int numstates;
+  /*@null@*/ /*@dependent@*/ struct filterstate *start;
+  /*@null@*/ /*@owned@*/ unsigned long *scratch;
+  /*@null@*/ /*@owned@*/ int *stack;
+};
 
-  kq = kqueue();
-  if(kq == -1){
-    report_error("Unable to create queue");
-    goto ERR;
-  }
+/*
+ * Given threads, watchpaths_create_threads() hands out the paths to
+ * canonicalize and probe STARTUP_BATCH at a time, and starts a thread
+ * only for each STARTUP_MIN paths, below which one costs more than it
+ * saves.
+ */
+#define STARTUP_BATCH 64
+#define STARTUP_MIN   1024
 
-  pinfos = reallocarray(NULL, numpaths, sizeof(struct pathinfo));
-  if(pinfos == NULL){
-    report_error("Unable to allocate path info storage");
-    goto ERR;
-  }
+/*
+ * struct startpath
+ *
+ * The outcome of canonicalizing one path during a threaded startup.
+ *
+ * off:    the offset of the path in the buffer of its thread
+ * len:    the length of the path
+ * hash:   the hash of the path, see hash_name()
+ * worker: the thread which canonicalized the path
+ * err:    0 if successful, or the errno of the failure
+ * msg:    a description of the failure, as path_copy() would report it
+ */
+struct startpath {
+  size_t off;
+  size_t len;
+  size_t hash;
+  int worker;
+  int err;
+  /*@null@*/ /*@observer@*/ const char *msg;
+};
 
-  changelist = reallocarray(NULL, numpaths, sizeof(struct kevent));
-  if(changelist == NULL){
-    report_error("Unable to allocate event setup storage");
-    goto ERR;
-  }
+struct startup;
 
-  /* Following "+ 1" is to include space for an error event per kevent(2) */
-  eventbuff = reallocarray(NULL, numpaths + 1, sizeof(struct kevent));
-  if(eventbuff == NULL){
-    report_error("Unable to allocate event storage");
-    goto ERR;
-  }
+/*
+ * struct startworker
+ *
+ * One thread of a threaded startup. The calling thread is the first.
+ *
+ * thread: the thread, unless it is the calling thread
+ * st:     the work shared by the threads
+ * buf:    the paths canonicalized by the thread, packed end to end
+ * used:   the number of bytes of `buf' in use
+ * size:   the number of bytes allocated for `buf'
+ * id:     the position of this structure in st->workers
+ */
+struct startworker {
+  pthread_t thread;
+  /*@dependent@*/ struct startup *st;
+  /*@null@*/ /*@owned@*/ char *buf;
+  size_t used;
+  size_t size;
+  int id;
+};
 
-  for(i = 0; i < numpaths; i++){
-    pinfos[i].index = i;
-    pinfos[i].path = NULL;
-    if(!inpaths[i]){
-      errno = EINVAL;
-      report_error("NULL pathname provided to watchpaths");
-      goto ERR;
-    }
-    if(inpaths[i][0] == '/'){
-      /* absolute paths are used literally without canonicalization */
-      /* TODO: consider canonicalizing all paths */
-      pinfos[i].path = strndup(inpaths[i], PATH_MAX);
-      if(pinfos[i].path == NULL){
-        report_error("Unable to allocate space for path of file to watch");
-        goto ERR;
-      }
-    } else {
-      /*
-       * basepath is stores the current directory, it is only
-       * calculated once
-       */
-      if(basepath == NULL){
-/*@-nullpass@*/
-        basepath = getcwd(NULL, 0);
-/*@=nullpass@*/
-        if(basepath == NULL){
-          report_error("Unable to find current path, needed for watching"
-                       " relative paths");
-          goto ERR;
-        }
-      }
-      pinfos[i].path = canonicalpath(basepath, inpaths[i], NULL, 0, NULL);
-      if(pinfos[i].path == NULL){
-        report_error("Unable to find path for file to watch");
-        goto ERR;
-      }
-    }
+/*
+ * struct startup
+ *
+ * The work shared by the threads of a threaded startup, see
+ * watchpaths_create_threads().
+ *
+ * lock:       guards `next'
+ * next:       the first path not yet handed out
+ * count:      the number of paths
+ * probing:    zero while canonicalizing, nonzero while probing
+ * inpaths:    the paths as passed by the caller
+ * basepath:   the current directory, or NULL if none was needed or it
+ *             could not be found
+ * cwderr:     the errno of the failure to find the current directory
+ * paths:      the outcome for each path
+ * ws:         the watch set being created
+ * workers:    the threads
+ * numworkers: the number of entries in `workers'
+ */
+struct startup {
+  pthread_mutex_t lock;
+  int next;
+  int count;
+  int probing;
+  /*@dependent@*/ char **inpaths;
+  /*@null@*/ /*@dependent@*/ const char *basepath;
+  int cwderr;
+  /*@null@*/ /*@owned@*/ struct startpath *paths;
+  /*@dependent@*/ struct watchset *ws;
+  /*@null@*/ /*@owned@*/ struct startworker *workers;
+  int numworkers;
+};
 
-    /* TODO: consider emitting the list of watched paths */
-    debug_printf("Watching for %s\n", pinfos[i].path);
-    pinfos[i].slashes = find_slashes(pinfos[i].path, 0, &numslashes);
-    if(pinfos[i].slashes == NULL){
-      report_error("Unable to allocate space to track slashes in pathname");
-      goto ERR;
-    }
-    pinfos[i].endslash = pinfos[i].slashes + numslashes;
-    pinfos[i].nextslash = pinfos[i].slashes;
-    pinfos[i].dev = -1;
-    EV_SET(&changelist[i], -1, EVFILT_VNODE, EV_ADD | EV_ONESHOT, typemask,
-           0, &pinfos[i]);
-    pinfos[i].ke = &changelist[i];
-    pinfos[i].fdp = (long *)&(changelist[i].ident);
+/*
+ * Given workers, see watchpaths_workers(), the callbacks of a dispatch
+ * are handed to them rather than run by the dispatching thread. The
+ * callbacks for an index always go to the same worker, which runs them
+ * one at a time in order, so the callbacks for one path never overlap
+ * while those for different paths run side by side. Each worker has a
+ * ring of POOL_RING jobs, filled by the dispatching thread alone and
+ * emptied by the worker alone, so the hand-off takes no lock. The
+ * locks are only taken to sleep when a ring is empty, or full.
+ */
+#define POOL_RING 1024
 
-    if(walk_to_extant_parent(&pinfos[i]) == -1){
-       report_error("unable to do parent walk");
-       goto ERR;
-    }
+/* the ring positions are shared between threads without a lock */
+#define SHARED_GET(p)    __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define SHARED_SET(p, v) __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
 
-    if(*pinfos[i].fdp == -1){
-      report_error("unable to open file for watching");
-      goto ERR;
-    }
-  }
+/*
+ * The counters of ws->stats are written by the dispatching thread alone
+ * and may be read by any, see watchpaths_stats(). A relaxed store of
+ * the sum is a plain store on common machines, so counting costs no
+ * more than an unshared increment, and no reader sees a torn value.
+ */
+#define STAT_ADD(c, n) __atomic_store_n(&(c), (c) + (n), __ATOMIC_RELAXED)
+#define STAT_INC(c)    STAT_ADD(c, 1UL)
+#define STAT_DEC(c)    STAT_ADD(c, ~0UL)
+#define STAT_GET(c)    __atomic_load_n(&(c), __ATOMIC_RELAXED)
 
-  while(cont != 0){
-    evt = eventbuff;
-    /* TODO: support timespec from caller */
-    eventcount = kevent(kq, changelist, numpaths, evt, numpaths + 1, NULL);
+/*
+ * The latencies of each stage, see watchpaths_latency(), are counted in
+ * the buckets of a log-linear histogram, as HDR histograms are: values
+ * below HIST_SUB ns have a bucket each, and each doubling above them is
+ * split into HIST_SUB buckets, so a value shares its bucket only with
+ * those within 1/HIST_SUB of it. Values of 2^HIST_TOP ns, over an hour,
+ * or more share the last bucket. The workers count into the same
+ * histograms as the dispatching thread, with a relaxed atomic addition,
+ * which costs little beside a callback.
+ */
+#define HIST_BITS    5
+#define HIST_SUB     (1 << HIST_BITS)
+#define HIST_TOP     42
+#define HIST_BUCKETS ((HIST_TOP - HIST_BITS + 1) * HIST_SUB)
 
-    if(eventcount > 0){
-      for(; evt < &eventbuff[eventcount]; evt++){
-        if(evt->flags & EV_ERROR){
-          errno = (int) evt->data;
-          report_error("error in event list");
-          /* exit to stop loops */
-          goto ERR;
-        } else {
-          pinfo = evt->udata;
-
-          if(WP_DEBUG){
-            /* temporarily truncate pinfo->path at the next slash */
-            if(*pinfo->nextslash) **pinfo->nextslash = '\0';
-            debug_printf("EVT: %s\n", pinfo->path);
-            /* restore the slash in pinfo->path */
-            if(*pinfo->nextslash) **pinfo->nextslash = '/';
-
-            for(i = 0; i < numtypes; i++){
-              if(0 != (evt->fflags & types[i])){ /* '0 != ...' for splint */
-                debug_printf("--Matched: %s\n", type_names[i]);
-              }
-            }
-          }
+struct wphist {
+  unsigned long counts[HIST_BUCKETS];
+};
 
-          /*
-           * NOTE_DELETE might be a new file copied onto the old path.
-           */
-          if(evt->fflags & (NOTE_DELETE | NOTE_RENAME)){
-            pinfo->nextslash++;
-            if(pinfo->nextslash >= pinfo->endslash){
-              debug_print("Parents deleted to root of device. Giving up.\n");
-              goto ERR;
-            }
-          }
+/* the records of a trace, following its header */
+#define TRACE_RECS(head) ((struct watchpaths_trace *) ((head) + 1))
 
-          if(*pinfo->nextslash){
-            /* *pinfo->nextslash == 0 when examining leaf */
-            if(walk_to_extant_parent(pinfo) == -1){
-               report_error("unable to do parent walk");
-               goto ERR;
-            }
-            if(*pinfo->fdp == -1){
-              report_error("Unrecoverable error encountered trying "
-                           "to open a file");
-              goto ERR;
-            }
-          }
+/* the most records a trace may hold */
+#define TRACE_MAX ((size_t) 1 << 24)
 
-          if(pinfo->nextslash == pinfo->slashes){
-            /* A watched path was modified. Execute the callback. */
-/*@-noeffect@*/
-            callback(evt->fflags, pinfo->index, blob, &cont);
-/*@=noeffect@*/
-          }
+/*
+ * struct cbjob
+ *
+ * A callback handed to a worker.
+ *
+ * index:  the index, as passed to the callback
+ * fflags: the fflags, as passed to the callback
+ * entry:  a copy of the entry for watchpaths_entry(), or NULL
+ * data:   the data, as passed to the callback
+ * origin: when the event behind the callback was read, in ns
+ * due:    when the callback was handed over, in ns
+ */
+struct cbjob {
+  int index;
+  u_int fflags;
+  /*@null@*/ /*@owned@*/ char *entry;
+  /*@null@*/ /*@dependent@*/ void *data;
+  long long origin;
+  long long due;
+};
+
+/*
+ * struct cbworker
+ *
+ * A thread running callbacks, see pool_work().
+ *
+ * thread:   the thread
+ * lock:     held to sleep on `wake' or `room'
+ * wake:     signalled when a job is added while the worker sleeps
+ * room:     signalled when a job is taken while the dispatcher waits
+ * head:     the count of jobs taken, written by the worker alone
+ * tail:     the count of jobs added, written by the dispatcher alone
+ * sleeping: nonzero while the worker waits for a job
+ * waiting:  nonzero while the dispatcher waits for room in `ring'
+ * quit:     nonzero once the worker is to exit when `ring' is empty
+ * deepest:  the most jobs ever in `ring' at once
+ * entry:    the entry of the callback being run, see watchpaths_entry()
+ * origin:   the origin of the callback being run, or 0, see
+ *           watchpaths_trace_note()
+ * ws:       the watch set
+ * ring:     the jobs, at their counts modulo POOL_RING
+ */
+struct cbworker {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t room;
+  unsigned long head;
+  unsigned long tail;
+  int sleeping;
+  int waiting;
+  int quit;
+  unsigned long deepest;
+  /*@null@*/ /*@dependent@*/ const char *entry;
+  long long origin;
+  /*@dependent@*/ struct watchset *ws;
+  struct cbjob ring[POOL_RING];
+};
+
+/*
+ * struct lookup
+ *
+ * A node looked up ahead of being armed, see node_arm().
+ *
+ * finfo: what was found, if `err' is 0
+ * err:   0, or the errno of the lookup
+ */
+struct lookup {
+  struct stat finfo;
+  int err;
+};
+
+#ifdef WP_URING
+/*
+ * When a directory reappears, node_resolve() looks up each of the
+ * watched entries within it, and each slice of a poll sweep looks up
+ * the paths which fell due, see poll_run(). With RING_MIN or more of
+ * them, the lookups are made RING_ENTRIES at a time through an
+ * io_uring, which costs one system call per batch rather than one per
+ * lookup, and the kernel spreads them over its own workers. Without
+ * io_uring, or on a kernel which can not stat through it, they are made
+ * one at a time.
+ */
+#define RING_ENTRIES 64
+#define RING_MIN     8
+
+/*
+ * How many times to retry while the kernel is short of room for a batch,
+ * and how long to pause, in ns, while waiting for the kernel to finish
+ * with one which could not be waited for, see ring_stat().
+ */
+#define RING_RETRIES 8
+#define RING_PAUSE   1000000
+
+/*
+ * struct statring
+ *
+ * An io_uring, with its rings mapped, see ring_open().
+ *
+ * fd:        the io_uring descriptor
+ * sq, cq:    the submission and completion rings, which are one mapping
+ *            where the kernel allows it
+ * sqsize,
+ * cqsize:    the sizes of the mappings of `sq' and `cq'
+ * sqes:      the submission entries
+ * sqesize:   the size of the mapping of `sqes'
+ * sqtail,
+ * sqmask,
+ * sqarray:   the fields of `sq' written when submitting
+ * cqhead,
+ * cqtail,
+ * cqmask:    the fields of `cq' used when reaping
+ * cqes:      the completion entries
+ */
+struct statring {
+  int fd;
+  void *sq;
+  void *cq;
+  size_t sqsize;
+  size_t cqsize;
+  /*@dependent@*/ struct io_uring_sqe *sqes;
+  size_t sqesize;
+  /*@dependent@*/ unsigned *sqtail;
+  /*@dependent@*/ unsigned *sqmask;
+  /*@dependent@*/ unsigned *sqarray;
+  /*@dependent@*/ unsigned *cqhead;
+  /*@dependent@*/ unsigned *cqtail;
+  /*@dependent@*/ unsigned *cqmask;
+  /*@dependent@*/ struct io_uring_cqe *cqes;
+};
+
+/*
+ * struct prestat
+ *
+ * One lookup of a batch made through the io_uring, see ring_stat().
+ *
+ * node: the node looked up
+ * path: what is looked up, `name' or the path of `node'
+ * stx:  filled in by the kernel
+ * look: the result, with `err' -1 until it is known
+ * name: the name of `node', NUL-terminated
+ */
+struct prestat {
+  /*@dependent@*/ struct pathnode *node;
+  /*@dependent@*/ const char *path;
+  struct statx stx;
+  struct lookup look;
+  char name[NAME_MAX + 1];
+};
+#endif
+
+#define CWD_MSG "Unable to find current path, needed for watching " \
+  "relative paths"
+
+/* slash positions are kept as 16-bit offsets, see find_slashes() */
+#if PATH_MAX > USHRT_MAX
+#error "PATH_MAX is too large for 16-bit slash offsets"
+#endif
+
+/*
+ * struct pathnode
+ *
+ * One element of the trie of watched paths. Paths which share a prefix
+ * share the nodes for it, so each directory is represented, and
+ * watched, once no matter how many paths pass through it. The root
+ * node stands for "/".
+ *
+ * A node is watched exactly when it exists and its parent is watched.
+ * The nodes which do not exist are those the watched ones are waiting
+ * for, and everything below them.
+ *
+ * kw / wd:    the kernel watch on the node, if it is being watched
+ * wdnext,
+ * wdprev:     the other nodes sharing `wd' (inotify only). Nodes share
+ *             a watch descriptor when their paths name the same inode.
+ * parent:     the node for the directory containing this one
+ * children:   an open-addressed hash table of the nodes for the entries
+ *             of this one which are part of watched paths
+ * mask:       the number of slots in `children' minus one
+ * used:       the number of occupied slots in `children'
+ * leaves:     the paths which name this node
+ * worknext:   the next node to be passed an event, see inotify_event()
+ * dev, ino:   identify the file last watched for this node. `dev' is
+ *             (dev_t) -1 until the node is first watched.
+ * hash:       the hash of `name', see hash_name()
+ * len:        the length of `name'
+ * trees:      the number of trees rooted at this node
+ * intree:     nonzero if the node is the root of a tree or lies beneath
+ *             one, so that its entries are watched as well
+ * keep:       nonzero if a tree keeps the node although no path passes
+ *             through it: while it is watched, or, if it is not, as a
+ *             record of a file system mounted within the tree. Cleared
+ *             when its parent stops being watched.
+ * found:      one of the FOUND_ values while node_crawl() is to enter
+ *             the node, or 0
+ * dir:        nonzero if the file last watched for the node was a
+ *             directory
+ * name:       the name of the node in its parent, not NUL-terminated
+ */
+struct pathnode {
+#ifdef WP_INOTIFY
+  int wd;
+  /*@null@*/ /*@dependent@*/ struct pathnode *wdnext;
+  /*@null@*/ /*@dependent@*/ struct pathnode *wdprev;
+#else
+  struct kwatch kw; /* must be first, see struct kwatch */
+#endif
+  /*@null@*/ /*@dependent@*/ struct pathnode *parent;
+  /*@null@*/ /*@owned@*/ struct pathnode **children;
+  size_t mask;
+  size_t used;
+  /*@null@*/ /*@dependent@*/ struct pathinfo *leaves;
+  /*@null@*/ /*@dependent@*/ struct pathnode *worknext;
+  dev_t dev;
+  ino_t ino;
+  size_t hash;
+  size_t len;
+  u_int trees;
+  unsigned char intree;
+  unsigned char keep;
+  unsigned char found;
+  unsigned char dir;
+  char name[];
+};
+
+#ifdef WP_INOTIFY
+/*
+ * struct wdslot
+ *
+ * One entry in the watch descriptor table.
+ *
+ * wd:   the watch descriptor, or -1 if the slot is empty
+ * head: the first node watched by `wd'
+ */
+struct wdslot {
+  int wd;
+  /*@null@*/ /*@dependent@*/ struct pathnode *head;
+};
+#endif
+
+/*
+ * struct watchset
+ *
+ * The state shared by every path in one watch set, as returned by
+ * watchpaths_create().
+ *
+ * With kqueue:
+ *
+ * kq:         the kqueue descriptor
+ * dirty:      the watches whose descriptor has changed since the last
+ *             call to kevent(2), and so must be registered with the next
+ *             call. This keeps the cost of each call in proportion to the
+ *             number of nodes which changed rather than the number of
+ *             paths watched.
+ * changelist: storage for the registrations of the dirty watches, which
+ *             holds `maxnodes' entries
+ * eventbuff:  storage for the events returned by kevent(2), which holds
+ *             `maxevents' entries
+ *
+ * With inotify:
+ *
+ * fd:         the inotify descriptor. One is used for all of the paths, so
+ *             the number of paths watched is not limited by RLIMIT_NOFILE.
+ * slots:      an open-addressed hash table mapping watch descriptors to
+ *             the nodes they watch
+ * mask:       the number of slots minus one. The slot count is a power of
+ *             two. inotify hands out watch descriptors sequentially, so the
+ *             low bits of the descriptor are used directly as the hash.
+ * used:       the number of occupied slots
+ * eventbuff:  storage for the events read from `fd'
+ * evoff,
+ * evlen:      the offset of the next event in `eventbuff' not yet handled,
+ *             and the end of the events read. Events read but not handled
+ *             are kept for the next watchpaths_dispatch().
+ *
+ * With both:
+ *
+ * slabs:      the state and name for each path by index, see PINFO()
+ *             and PNAME(). The array of slabs grows by doubling.
+ * numslabs:   the number of entries allocated for `slabs'
+ * numpaths:   the number of indexes handed out
+ * maxpaths:   the number of paths the allocated slabs hold
+ * byname:     an open-addressed hash table of the indexes of the paths
+ *             by name, so that a path can be removed without a search.
+ *             Empty slots hold -1.
+ * namemask:   the number of slots in `byname' minus one
+ * nameused:   the number of occupied slots in `byname'
+ * arena:      the block of the arena being filled, see arena_copy()
+ * arenalive:  the bytes of the arena holding watched paths
+ * arenadead:  the bytes of the arena left by removed paths, which are
+ *             reclaimed by arena_compact()
+ * freepinfo:  the removed paths whose index can be given out again
+ * deadpinfo:  the paths removed during watchpaths_dispatch(), which may
+ *             still be queued for a callback
+ * deadnodes:  the nodes removed during watchpaths_dispatch(), which may
+ *             still be referred to by pending events. They are linked
+ *             through their `parent'.
+ * dispatching: nonzero while watchpaths_dispatch() runs
+ * quiet:      the debounce window in ms, or 0 to report events at once
+ * maxdelay:   the longest time in ms that events are held back, or 0
+ * now:        the time in ms at which the events being handled were read
+ * nowns:      the same time in ns
+ * origin:     the time in ns at which the events being handled were
+ *             read from the kernel, or 0 if they were not, see emit()
+ * cborigin:   the origin of the callback run by the dispatching thread,
+ *             or 0, see watchpaths_trace_note()
+ * stamp:      the same time on the realtime clock, given to the batch
+ *             callback (only kept with a batch callback)
+ * heap:       a binary min-heap of the paths with pending events, ordered
+ *             by when they are due
+ * heapused:   the number of paths in `heap'
+ * heapmax:    the number of entries allocated for `heap'
+ * wheel:      the timer wheel, see WHEEL_LEVELS
+ * wheelbits:  for each level of `wheel', a bit set for each slot in use
+ * wheelfar:   the timers due beyond the span of `wheel'
+ * wheeldue:   the timers found to be due, which are yet to expire
+ * wheelnow:   the time in ms up to which the wheel has been run. The
+ *             slot of a timer is chosen relative to it.
+ * tick:       the timer for the periodic callback, see watchpaths_tick()
+ * tickms:     the period of `tick' in ms, or 0 if there is none
+ * root:       the root of the trie of watched paths
+ * numnodes:   the number of nodes in the trie
+ * work:       the paths due a callback for the event being handled
+ * worktail:   the end of `work'
+ * typemask:   the fflags reported to the callback
+ * callback, blob, cont: as passed to and used by watchpaths()
+ * batch:      the batch callback, or NULL to invoke `callback' per event
+ * opened:     the open callback, invoked per event rather than
+ *             `callback', or NULL, see watchpaths_open()
+ * openflags:  the flags the files are opened with for `opened'
+ * openmap:    nonzero if the files are mapped for `opened' as well
+ * tailing:    nonzero if `opened' is passed only the bytes appended to
+ *             each file, see watchpaths_tail()
+ * batchbuf:   the events gathered for `batch' during one dispatch. It is
+ *             kept between dispatches, so that steady state delivery
+ *             allocates nothing.
+ * batchused:  the number of events in `batchbuf'
+ * batchmax:   the number of entries allocated for `batchbuf'
+ * treeq:      the events for the entries of trees seen while handling
+ *             one event, which are reported once it has been handled,
+ *             see tree_report()
+ * treeqused:  the number of events in `treeq'
+ * treeqmax:   the number of entries allocated for `treeq'
+ * entries:    the arena holding the entry names of the events reported
+ *             for trees, emptied after each dispatch
+ * entry:      the entry name for the callback being executed, see
+ *             watchpaths_entry()
+ * announce:   nonzero while the entries of trees found by node_crawl()
+ *             are to be reported
+ * filter:     the patterns an entry of a tree must pass to be reported,
+ *             or NULL to report every entry, see watchpaths_filter()
+ * prints:     nonzero if the paths added are fingerprinted, see
+ *             watchpaths_fingerprint()
+ * printbuf:   storage for the content of a file being fingerprinted,
+ *             which holds PRINT_BUFF_SIZE bytes
+ * snaps:      the snapshots of the polled paths, see struct pollsnap
+ * numpolled:  the number of entries in use in `snaps'
+ * maxpolled:  the number of entries allocated for `snaps'
+ * pollms:     the poll interval in ms, or 0 if nothing is polled
+ * pollall:    nonzero if every path is polled, rather than those on file
+ *             systems which do not report changes, see poll_silent()
+ * pollnext:   the position in `snaps' of the next path to poll
+ * pollstart:  when the sweep under way began, in ms
+ * polldue:    when the next slice of the sweep is due, in ms
+ * statefd:    the state file, locked, or -1 if there is none, see
+ *             watchpaths_state()
+ * statepath:  the path of the state file, or NULL
+ * statehead:  the state file, mapped whole, or NULL
+ * statesize:  the size of the mapping of `statehead'
+ * staterecs:  the records of the state file, following its header
+ * missed:     the indices of the paths found to have changed while
+ *             nothing watched them, due a callback, see state_deliver()
+ * nummissed:  the number of entries in use in `missed'
+ * maxmissed:  the number of entries allocated for `missed'
+ * pool:       the threads running the callbacks, or NULL to run them
+ *             on the dispatching thread, see watchpaths_workers()
+ * poolsize:   the number of entries in `pool'
+ * halted:     nonzero once a callback run by a worker has set *cont to
+ *             zero, shared with the workers
+ * haltpipe:   written by the worker which sets `halted', to wake
+ *             watchpaths_run(), or -1 until there are workers
+ * handed:     the number of callbacks handed to the workers
+ * stalls:     the number of times a worker had no room for a callback
+ * stats:      the counters reported by watchpaths_stats(), see STAT_ADD
+ * hist:       the latencies of each stage, see HIST_BITS
+ * trace:      the trace file, mapped whole, or NULL if there is none, see
+ *             watchpaths_trace()
+ * tracesize:  the size of the mapping of `trace'
+ * crawlbuf:   storage for the entries read by node_crawl() (Linux only)
+ * ring:       the io_uring for looking up many nodes at once, or NULL
+ *             until it is first needed, see RING_MIN (inotify only)
+ * noring:     nonzero once the io_uring is found to be of no use, so that
+ *             the nodes are looked up one at a time (inotify only)
+ * pollbatch:  the RING_ENTRIES lookups of a batch of polled paths, or
+ *             NULL until it is first needed, see poll_ring() (inotify
+ *             only)
+ * pathbuf:    storage for the path of a node, see node_path(), or of a
+ *             path being added, see path_copy()
+ * slashes:    storage for the slash offsets of a path, see find_slashes()
+ */
+struct watchset {
+#ifdef WP_INOTIFY
+  int fd;
+  /*@null@*/ /*@owned@*/ struct wdslot *slots;
+  size_t mask;
+  size_t used;
+  /*@null@*/ /*@owned@*/ char *eventbuff;
+  size_t evoff;
+  size_t evlen;
+#else
+  int kq;
+  /*@null@*/ /*@dependent@*/ struct kwatch *dirty;
+  /*@null@*/ /*@owned@*/ struct kevent *changelist;
+  /*@null@*/ /*@owned@*/ struct kevent *eventbuff;
+  size_t maxnodes;
+  size_t maxevents;
+#endif
+  /*@null@*/ /*@owned@*/ struct pathslab **slabs;
+  int numslabs;
+  int numpaths;
+  int maxpaths;
+  /*@null@*/ /*@owned@*/ int *byname;
+  size_t namemask;
+  size_t nameused;
+  /*@null@*/ /*@owned@*/ struct arenachunk *arena;
+  size_t arenalive;
+  size_t arenadead;
+  /*@null@*/ /*@dependent@*/ struct pathinfo *freepinfo;
+  /*@null@*/ /*@dependent@*/ struct pathinfo *deadpinfo;
+  /*@null@*/ /*@dependent@*/ struct pathnode *deadnodes;
+  int dispatching;
+  long long quiet;
+  long long maxdelay;
+  long long now;
+  long long nowns;
+  long long origin;
+  long long cborigin;
+  struct timespec stamp;
+  /*@null@*/ /*@owned@*/ struct pathinfo **heap;
+  size_t heapused;
+  size_t heapmax;
+  /*@null@*/ /*@dependent@*/ struct wptimer *wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+  unsigned long long wheelbits[WHEEL_LEVELS];
+  /*@null@*/ /*@dependent@*/ struct wptimer *wheelfar;
+  /*@null@*/ /*@dependent@*/ struct wptimer *wheeldue;
+  long long wheelnow;
+  struct wptimer tick;
+  long long tickms;
+  /*@null@*/ /*@owned@*/ struct pathnode *root;
+  size_t numnodes;
+  /*@null@*/ /*@dependent@*/ struct pathinfo *work;
+  /*@dependent@*/ struct pathinfo **worktail;
+  u_int typemask;
+  void (*callback) (u_int, int, void *, int *);
+  /*@dependent@*/ void *blob;
+  int cont; /* &cont is passed to callback, if set to 0, main loop ends */
+  /*@null@*/ void (*batch) (const struct watchpaths_event *, int, void *,
+                            int *);
+  /*@null@*/ void (*opened) (u_int, int, const struct watchpaths_file *,
+                             void *, int *);
+  int openflags;
+  int openmap;
+  int tailing;
+  /*@null@*/ /*@owned@*/ struct watchpaths_event *batchbuf;
+  size_t batchused;
+  size_t batchmax;
+  /*@null@*/ /*@owned@*/ struct watchpaths_event *treeq;
+  size_t treeqused;
+  size_t treeqmax;
+  /*@null@*/ /*@owned@*/ struct arenachunk *entries;
+  /*@null@*/ /*@dependent@*/ const char *entry;
+  int announce;
+  /*@null@*/ /*@owned@*/ struct pathfilter *filter;
+  int prints;
+  /*@null@*/ /*@owned@*/ unsigned char *printbuf;
+  /*@null@*/ /*@owned@*/ struct pollsnap *snaps;
+  int numpolled;
+  int maxpolled;
+  long long pollms;
+  int pollall;
+  int pollnext;
+  long long pollstart;
+  long long polldue;
+  int statefd;
+  /*@null@*/ /*@owned@*/ char *statepath;
+  /*@null@*/ /*@dependent@*/ struct statehead *statehead;
+  size_t statesize;
+  /*@null@*/ /*@dependent@*/ struct staterec *staterecs;
+  /*@null@*/ /*@owned@*/ int *missed;
+  int nummissed;
+  int maxmissed;
+  /*@null@*/ /*@owned@*/ struct cbworker *pool;
+  int poolsize;
+  int halted;
+  int haltpipe[2];
+  unsigned long handed;
+  unsigned long stalls;
+  struct watchpaths_stats stats;
+  struct wphist hist[WP_STAGES];
+  /*@null@*/ /*@dependent@*/ struct watchpaths_tracehead *trace;
+  size_t tracesize;
+#ifdef __linux__
+  /*@null@*/ /*@owned@*/ char *crawlbuf;
+#endif
+#ifdef WP_URING
+  /*@null@*/ /*@owned@*/ struct statring *ring;
+  int noring;
+  /*@null@*/ /*@owned@*/ struct prestat *pollbatch;
+#endif
+  char pathbuf[PATH_MAX];
+  u_short slashes[PATH_MAX + 1];
+};
+
+#ifdef WP_INOTIFY
+#define WATCHED(node) ((node)->wd != -1)
+#else
+#define WATCHED(node) ((node)->kw.fd != -1)
+#endif
+
+/*
+ * A descriptor on the parent directory of a node, through which the
+ * node is looked up by its name alone, or -1 to use its path, see
+ * node_open(). With kqueue the watch of the parent serves. inotify
+ * holds no descriptors, so only node_resolve() has one to pass down.
+ */
+#ifdef WP_INOTIFY
+#define PARENT_FD(node) (-1)
+#else
+#define PARENT_FD(node) ((node)->parent != NULL ? (node)->parent->kw.fd : -1)
+#endif
+
+/*
+ * A tree does not reach into another file system mounted within it,
+ * unless another tree is rooted there. FOREIGN() is whether `node',
+ * once its device is known, is such a mount point which no path
+ * needs, and CRAWLS() whether the entries of `node' are watched as
+ * part of a tree.
+ */
+#define FOREIGN(node) ((node)->intree && (node)->trees == 0 &&            \
+                       (node)->leaves == NULL && (node)->used == 0 &&     \
+                       (node)->parent != NULL && (node)->parent->intree && \
+                       (node)->dev != (node)->parent->dev)
+#define CRAWLS(node) ((node)->intree && (node)->dir &&                    \
+                      ((node)->trees > 0 || (node)->parent == NULL ||     \
+                       (node)->dev == (node)->parent->dev))
+
+/*
+ * The flags the open callback opens the path of `pinfo' with, and the
+ * data passed to the callbacks for the path at index `i', which is -1
+ * for the tick. See struct watchpaths_opts.
+ */
+#define OPEN_FLAGS(ws, pinfo) \
+  ((pinfo)->openflags != -1 ? (pinfo)->openflags : (ws)->openflags)
+#define PATH_DATA(ws, i) \
+  ((i) >= 0 && PINFO(ws, i)->data != NULL ? PINFO(ws, i)->data : (ws)->blob)
+
+/* The events reported to the callback, and their names for debugging */
+static const u_int types[] = {NOTE_DELETE,
+                              NOTE_WRITE,
+                              NOTE_EXTEND,
+#ifdef NOTE_TRUNCATE
+                              NOTE_TRUNCATE,
+#endif
+                              NOTE_RENAME};
+static const char *type_names[] = {"Delete",
+                                   "Write",
+                                   "Extend",
+#ifdef NOTE_TRUNCATE
+                                   "Truncate",
+#endif
+                                   "Rename"};
+#define NUMTYPES ((int) (sizeof(types) / sizeof(types[0])))
+
+static size_t find_slashes(const char *path, size_t len, u_short *out);
+
+static size_t hash_name(const char *name, size_t len);
+/*@null@*/ /*@dependent@*/
+static struct pathnode *node_child(struct pathnode *node, const char *name,
+                                   size_t len, size_t hash);
+/*@null@*/ /*@dependent@*/
+static struct pathnode *node_new(struct watchset *ws,
+                                 /*@null@*/ struct pathnode *parent,
+                                 const char *name, size_t len);
+static void   node_free(/*@only@*/ struct pathnode *node);
+static void   node_prune(struct watchset *ws, struct pathnode *node);
+static void   node_unlink(struct watchset *ws, struct pathnode *node);
+static int    path_insert(struct watchset *ws, struct pathinfo *pinfo,
+                          const char *path, size_t plen,
+                          /*@null@*/ struct pathnode **first);
+static void   path_remove(struct watchset *ws, struct pathinfo *pinfo);
+static int    path_copy(struct watchset *ws, /*@null@*/ const char *inpath,
+                        char **basepath, /*@out@*/ size_t *len);
+static int    path_canon(/*@null@*/ const char *inpath,
+                         /*@null@*/ const char *basepath, char *out,
+                         /*@out@*/ size_t *len, /*@out@*/ const char **msg);
+static int    path_name(struct watchset *ws, struct pathinfo *pinfo,
+                        const char *path, size_t hash, size_t len);
+/*@null@*/ /*@dependent@*/
+static char  *arena_copy(struct arenachunk **arena, const char *path,
+                         size_t len);
+static void   arena_compact(struct watchset *ws);
+static void   arena_free(/*@null@*/ /*@only@*/ struct arenachunk *chunk);
+/*@null@*/ /*@dependent@*/
+static struct pathinfo *pinfo_new(struct watchset *ws);
+static int    opts_check(const struct watchpaths_opts *opts);
+static void   pinfo_opts(struct pathinfo *pinfo,
+                         /*@null@*/ const struct watchpaths_opts *opts);
+/*@null@*/ /*@dependent@*/
+static int   *name_find(struct watchset *ws, const char *path, size_t len,
+                        size_t hash);
+static int    name_insert(struct watchset *ws, int index);
+static void   name_remove(struct watchset *ws, int *slot);
+static void   reap(struct watchset *ws);
+static int    startup_begin(struct startup *st, struct watchset *ws,
+                            char **inpaths, int numpaths, int threads,
+                            /*@null@*/ const char *basepath, int cwderr);
+static void   startup_run(struct startup *st);
+/*@null@*/
+static void  *startup_work(void *arg);
+static void   startup_canon(struct startworker *w, int i);
+static void   startup_end(struct startup *st);
+static int    dispatch_events(struct watchset *ws, int max_events);
+static void   mark_read(struct watchset *ws, unsigned long count);
+static void   hist_add(struct wphist *h, long long ns);
+static long long hist_top(size_t i);
+static void   trace_add(struct watchset *ws, int kind, int index,
+                        u_int fflags, int value, long long origin,
+                        long long time);
+static void   trace_close(struct watchset *ws);
+/*@null@*/ /*@dependent@*/
+static char  *node_path(struct watchset *ws, struct pathnode *node);
+
+static int    node_open(struct watchset *ws, struct pathnode *node, int at,
+                        int flags);
+static int    node_stat(struct watchset *ws, struct pathnode *node, int at,
+                        /*@out@*/ struct stat *finfo);
+static int    node_arm(struct watchset *ws, struct pathnode *node, int at,
+                       /*@null@*/ const struct lookup *known);
+static u_int  node_wants(struct watchset *ws, struct pathnode *node);
+static void   node_disarm(struct watchset *ws, struct pathnode *node);
+static void   node_drop(struct watchset *ws, struct pathnode *node);
+static int    node_resolve(struct watchset *ws, struct pathnode *node,
+                           int at, /*@null@*/ const struct lookup *known);
+#ifdef WP_URING
+static int    ring_open(struct watchset *ws);
+static void   ring_close(struct watchset *ws);
+static int    ring_reap(struct watchset *ws, struct prestat *ps);
+static void   ring_drain(struct watchset *ws, struct prestat *ps, int left);
+static int    ring_stat(struct watchset *ws, int at, struct prestat *ps,
+                        int count);
+static int    ring_resolve(struct watchset *ws, struct pathnode *node,
+                           int fd);
+#endif
+static int    node_check(struct watchset *ws, struct pathnode *node,
+                         int dead);
+static int    node_arm_at(struct watchset *ws, struct pathnode *node, int fd,
+                          const char *name, /*@out@*/ int *dirfd);
+static int    node_enter(struct watchset *ws, struct pathnode *node, int fd);
+static int    node_crawl(struct watchset *ws, struct pathnode *node, int fd,
+                         int fresh);
+static int    crawl_entry(struct watchset *ws, struct pathnode *node, int fd,
+                          const char *name, unsigned char type, int fresh);
+static int    tree_crawl(struct watchset *ws, struct pathnode *node, int at,
+                         int fresh);
+static void   tree_mark(struct pathnode *node);
+static void   tree_unmark(struct pathnode *node);
+static void   tree_sweep(struct watchset *ws, struct pathnode *node);
+static void   tree_report(struct watchset *ws, struct pathnode *dir,
+                          const char *name, size_t len, u_int fflags);
+static void   tree_queue(struct watchset *ws, struct pathinfo *pinfo,
+                         u_int fflags, const char *entry, size_t len);
+static void   tree_flush(struct watchset *ws);
+static int    filter_compile(struct pathfilter *f, const char *pattern,
+                             int accept);
+static int    filter_pos(struct pathfilter *f);
+static void   filter_bytes(struct globpos *g, int lo, int hi, int slash);
+static int    filter_dirs(struct pathfilter *f, int at);
+static void   filter_classes(struct pathfilter *f);
+static void   filter_reset(struct pathfilter *f);
+static void   filter_free(/*@null@*/ /*@only@*/ struct pathfilter *f);
+static void   filter_close(struct pathfilter *f, int sp);
+/*@null@*/ /*@dependent@*/
+static struct filterstate *filter_state(struct pathfilter *f);
+/*@null@*/ /*@dependent@*/
+static struct filterstate *filter_step(struct pathfilter *f,
+                                       struct filterstate *st, int c);
+static int    filter_passes(struct pathfilter *f, const char *entry,
+                            size_t len);
+static int    path_add(struct watchset *ws, const char *inpath, int tree,
+                       /*@null@*/ const struct watchpaths_opts *opts);
+/*@null@*/
+static struct watchset *set_create(char **inpaths,
+                                   /*@null@*/
+                                   const struct watchpaths_opts *opts,
+                                   int numpaths,
+                                   void (*callback) (u_int, int, void *,
+                                                     int *),
+                                   void *blob, int threads);
+
+static void   queue_leaves(struct watchset *ws, struct pathnode *node);
+/*@null@*/ /*@dependent@*/
+static struct pathinfo *dequeue(struct watchset *ws);
+static void   deliver(struct watchset *ws, u_int fflags,
+                      /*@null@*/ struct pathnode *created);
+static void   notify(struct watchset *ws, struct pathinfo *pinfo,
+                     u_int fflags);
+static void   deadline_restart(struct watchset *ws, struct pathinfo *pinfo);
+static long long now_ms(void);
+static long long now_ns(void);
+static void   set_now(struct watchset *ws);
+static void   emit(struct watchset *ws, int index, u_int fflags);
+/*@null@*/
+static void  *pool_work(void *arg);
+static void   pool_wait(struct cbworker *w, unsigned long most);
+static void   pool_push(struct watchset *ws, int index, u_int fflags,
+                        long long origin, long long due);
+static void   pool_stop(struct watchset *ws);
+static void   flush_batch(struct watchset *ws);
+static int    file_get(struct watchset *ws, int index,
+                       /*@out@*/ struct watchpaths_file *file,
+                       u_int *fflags);
+static int    file_map(struct watchset *ws, struct openfile *of, int fd,
+                       struct watchpaths_file *file);
+/*@null@*/ /*@dependent@*/
+static struct openfile *file_alloc(struct pathinfo *pinfo);
+static void   file_drop(struct watchset *ws, struct openfile *of);
+static void   file_free(struct watchset *ws, struct pathinfo *pinfo);
+static int    tail_start(struct watchset *ws, struct pathinfo *pinfo);
+static void   tail_record(struct watchset *ws, int index);
+static void   heap_place(struct watchset *ws, struct pathinfo *pinfo,
+                         size_t pos);
+static void   heap_down(struct watchset *ws, size_t pos);
+static void   heap_remove(struct watchset *ws, struct pathinfo *pinfo);
+static void   fire_due(struct watchset *ws);
+static int    print_check(struct watchset *ws, struct pathinfo *pinfo);
+static uint64_t print_round(uint64_t acc, uint64_t word);
+static void   print_start(/*@out@*/ uint64_t acc[4]);
+static size_t print_stripes(uint64_t acc[4], const unsigned char *p,
+                            size_t len);
+static uint64_t print_finish(const uint64_t acc[4], uint64_t total,
+                             const unsigned char *p, size_t len);
+static int    poll_silent(struct watchset *ws, struct pathinfo *pinfo);
+static int    poll_add(struct watchset *ws, struct pathinfo *pinfo);
+static void   poll_drop(struct watchset *ws, struct pathinfo *pinfo);
+static int    poll_snap(struct watchset *ws, struct pollsnap *snap,
+                        struct pathinfo *pinfo,
+                        /*@null@*/ const struct lookup *known);
+static int    poll_one(struct watchset *ws, int slot,
+                       /*@null@*/ const struct lookup *known);
+#ifdef WP_URING
+static int    poll_ring(struct watchset *ws, long long target);
+#endif
+static int    poll_run(struct watchset *ws);
+static int    print_file(struct watchset *ws, int fd, /*@out@*/ uint64_t *hash);
+static uint64_t state_key(const char *path, size_t len);
+static int    state_open(struct watchset *ws, const char *file);
+static void   state_close(struct watchset *ws);
+static long   state_find(struct watchset *ws, uint64_t key);
+static int    state_rewrite(struct watchset *ws, uint64_t cap);
+static int    state_attach(struct watchset *ws, struct pathinfo *pinfo);
+static void   state_record(struct watchset *ws, struct pathinfo *pinfo,
+                           /*@null@*/ const struct stat *finfo,
+                           /*@null@*/ const uint64_t *hash);
+static void   state_deliver(struct watchset *ws);
+static int    state_miss(struct watchset *ws, int index);
+static void   timer_add(struct watchset *ws, struct wptimer *t);
+static void   timer_del(struct watchset *ws, struct wptimer *t);
+static int    lowest_bit(unsigned long long bits);
+static long long wheel_next(struct watchset *ws);
+static void   wheel_run(struct watchset *ws, long long now);
+static void   debug_event(struct watchset *ws, struct pathnode *node,
+                          u_int fflags);
+
+#ifndef WP_INOTIFY
+static void   mark_dirty(struct watchset *ws, struct kwatch *kw);
+static void   unmark_dirty(struct watchset *ws, struct kwatch *kw);
+static int    kqueue_event(struct watchset *ws, struct kevent *evt);
+static int    collect_dirty(struct watchset *ws);
+static int    flush_dirty(struct watchset *ws);
+static int    grow_changes(struct watchset *ws);
+static void   grow_events(struct watchset *ws);
+#endif
+
+#ifdef WP_INOTIFY
+/*@null@*/ /*@dependent@*/
+static struct wdslot *wd_find(struct watchset *ws, int wd);
+/*@null@*/ /*@dependent@*/
+static struct wdslot *wd_insert(struct watchset *ws, int wd);
+static void   wd_remove(struct watchset *ws, struct wdslot *slot);
+static int    wd_attach(struct watchset *ws, struct pathnode *node, int wd);
+static void   wd_detach(struct watchset *ws, struct pathnode *node);
+static int    node_rescan(struct watchset *ws, struct pathnode *node);
+static int    is_empty(struct watchset *ws, struct pathinfo *pinfo);
+static u_int  translate_event(struct pathinfo *pinfo,
+                              struct inotify_event *ie);
+static int    inotify_event(struct watchset *ws, struct inotify_event *ie);
+static unsigned long inotify_count(const char *buf, size_t len);
+#endif
+
+
+/* find_slashes
+ *
+ * Records the offsets of the slashes in the path argument in `out',
+ * and returns the number of offsets recorded.
+ *
+ * This is similar to what one might achieve by running strsep(3) in a
+ * loop. The major differences are the safety imparted by the length
+ * parameter and that the path is left untouched. Offsets are 16 bits
+ * wide, which is enough for any path up to PATH_MAX bytes long, so a
+ * path's slashes take a quarter of the space pointers would.
+ *
+ * The offsets are recorded from the right, so out[count - 1] is the
+ * first slash. out[0] holds the length of the path rather than the
+ * offset of a slash, so that the name following each slash ends at the
+ * offset before it, and the caller's slash-walking loop can
+ * distinguish between the leaf and one of its parent directories.
+ *
+ * Common usage:
+ *  for(i = count - 1; i > 0; i--)
+ *    NAME IS path + out[i] + 1 UP TO path + out[i - 1]
+ *
+ * ARGUMENTS
+ *
+ * path: the string to search
+ * len:  the length of the path string or zero to calculate the length,
+ *       which must be less than PATH_MAX
+ * out:  storage for the offsets, with room for at least one more than
+ *       the number of slashes in `path'
+ */
+static size_t
+find_slashes(const char *path, size_t len, u_short *out)
+{
+  size_t i = 0;
+  size_t count = 1;
+  size_t next;
+
+  if(len == 0){
+    len = strnlen(path, PATH_MAX - 1);
+  }
+
+  /* count the number of slashes */
+  for(i = 0; i < len; i++){
+    if(path[i] == '/'){
+      count++;
+    }
+  }
+
+  out[0] = (u_short) len;
+  /* count is always at least 1 */
+  for(i = 0, next = count - 1; next > 0; i++){
+    if(path[i] == '/'){
+      out[next--] = (u_short) i;
+    }
+  }
+  return count;
+}
+
+/*
+ * hash_name
+ *
+ * Returns the FNV-1a hash of the `len' bytes at `name'.
+ */
+static size_t
+hash_name(const char *name, size_t len)
+{
+  size_t hash = 2166136261u;
+  size_t i;
+
+  for(i = 0; i < len; i++){
+    hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+  }
+  return hash;
+}
+
+/*
+ * node_child
+ *
+ * Returns the child of `node' named by the `len' bytes at `name', whose
+ * hash is `hash', or NULL if no watched path passes through it.
+ */
+/*@null@*/ /*@dependent@*/
+static struct pathnode *
+node_child(struct pathnode *node, const char *name, size_t len, size_t hash)
+{
+  struct pathnode *child = NULL;
+  size_t i;
+
+  if(node->children == NULL){
+    return NULL;
+  }
+  for(i = hash & node->mask; (child = node->children[i]) != NULL;
+      i = (i + 1) & node->mask){
+    if(child->hash == hash && child->len == len &&
+       memcmp(child->name, name, len) == 0){
+      return child;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * node_new
+ *
+ * Creates an unwatched node named by the `len' bytes at `name' and adds
+ * it to the children of `parent', if any. The table of children is
+ * doubled in size whenever it would become more than half full.
+ *
+ * Returns NULL and sets errno if memory cannot be allocated.
+ */
+/*@null@*/ /*@dependent@*/
+static struct pathnode *
+node_new(struct watchset *ws, struct pathnode *parent, const char *name,
+         size_t len)
+{
+  /*@owned@*/ struct pathnode **old = NULL;
+  struct pathnode *node = NULL;
+  size_t i, j, oldcount;
+
+  if(parent != NULL &&
+     (parent->children == NULL || (parent->used + 1) * 2 > parent->mask + 1)){
+    old = parent->children;
+    oldcount = old == NULL ? 0 : parent->mask + 1;
+    parent->children = reallocarray(NULL, oldcount == 0 ? 4 : oldcount * 2,
+                                    sizeof(struct pathnode *));
+    if(parent->children == NULL){
+      parent->children = old;
+      return NULL; /* keeps errno */
+    }
+    parent->mask = (oldcount == 0 ? 4 : oldcount * 2) - 1;
+    for(i = 0; i <= parent->mask; i++){
+      parent->children[i] = NULL;
+    }
+    for(i = 0; i < oldcount; i++){
+      if(old[i] != NULL){
+        for(j = old[i]->hash & parent->mask; parent->children[j] != NULL;
+            j = (j + 1) & parent->mask);
+        parent->children[j] = old[i];
+      }
+    }
+    free(old);
+  }
+
+  node = malloc(sizeof(struct pathnode) + len);
+  if(node == NULL){
+    return NULL; /* keeps errno */
+  }
+#ifdef WP_INOTIFY
+  node->wd = -1;
+  node->wdnext = NULL;
+  node->wdprev = NULL;
+#else
+  node->kw.fd = -1;
+  node->kw.dirty = 0;
+  node->kw.dirtynext = NULL;
+  node->kw.dirtyprev = NULL;
+#endif
+  node->parent = parent;
+  node->children = NULL;
+  node->mask = 0;
+  node->used = 0;
+  node->leaves = NULL;
+  node->worknext = NULL;
+  node->dev = (dev_t) -1;
+  node->ino = 0;
+  node->hash = hash_name(name, len);
+  node->len = len;
+  node->trees = 0;
+  /* whatever is added beneath a tree is part of it */
+  node->intree = parent != NULL && parent->intree;
+  node->keep = 0;
+  node->found = 0;
+  node->dir = 0;
+  memcpy(node->name, name, len);
+
+  if(parent != NULL){
+    for(i = node->hash & parent->mask; parent->children[i] != NULL;
+        i = (i + 1) & parent->mask);
+    parent->children[i] = node;
+    parent->used++;
+  }
+  ws->numnodes++;
+  return node;
+}
+
+/*
+ * node_free
+ *
+ * Frees `node' and everything beneath it, closing any descriptors.
+ */
+static void
+node_free(struct pathnode *node)
+{
+  size_t i;
+
+  for(i = 0; node->children != NULL && i <= node->mask; i++){
+    if(node->children[i] != NULL){
+      node_free(node->children[i]);
+    }
+  }
+#ifndef WP_INOTIFY
+  if(node->kw.fd >= 0){
+    while(-1 == close(node->kw.fd) && errno == EINTR);
+  }
+#endif
+  free(node->children);
+  free(node);
+}
+
+/*
+ * path_insert
+ *
+ * Adds `path', which is `plen' bytes long, to the trie, creating the
+ * nodes for any of its elements not already there, and attaches `pinfo'
+ * to the node for its leaf. If `first' is not NULL, it receives the
+ * first node created, or NULL if the path only used existing nodes.
+ *
+ * Returns 0 if successful, returns -1 and sets errno otherwise.
+ */
+static int
+path_insert(struct watchset *ws, struct pathinfo *pinfo, const char *path,
+            size_t plen, struct pathnode **first)
+{
+  u_short *slashes = ws->slashes;
+  struct pathnode *node = ws->root;
+  struct pathnode *child = NULL;
+  const char *name = NULL;
+  size_t count = 0;
+  size_t i, len;
+
+  if(first != NULL){
+    *first = NULL;
+  }
+  count = find_slashes(path, plen, slashes);
+
+  /* slashes[count - 1] is the first slash, slashes[0] is the end */
+  for(i = count - 1; i > 0; i--){
+    name = path + slashes[i] + 1;
+    len = (size_t) (slashes[i - 1] - slashes[i] - 1);
+    if(len == 0){
+      /* runs of slashes and a trailing slash add nothing */
+      continue;
+    }
+    child = node_child(node, name, len, hash_name(name, len));
+    if(child == NULL){
+      child = node_new(ws, node, name, len);
+      if(child == NULL){
+        /* drop the nodes created so far, which lead nowhere */
+        node_prune(ws, node);
+        return -1;
+      }
+      if(first != NULL && *first == NULL){
+        *first = child;
+      }
+    }
+    node = child;
+  }
+
+  pinfo->node = node;
+  pinfo->prev = NULL;
+  pinfo->next = node->leaves;
+  if(pinfo->next != NULL){
+    pinfo->next->prev = pinfo;
+  }
+  node->leaves = pinfo;
+  return 0;
+}
+
+/*
+ * node_prune
+ *
+ * Removes `node' from the trie if no path names it or passes through
+ * it and no tree keeps it, and then its parent in the same way.
+ */
+static void
+node_prune(struct watchset *ws, struct pathnode *node)
+{
+  struct pathnode *parent = NULL;
+
+  while((parent = node->parent) != NULL &&
+        node->leaves == NULL && node->used == 0 && !node->keep){
+    node_unlink(ws, node);
+    node = parent;
+  }
+}
+
+/*
+ * node_unlink
+ *
+ * Stops watching `node', which has no children, and removes it from
+ * the trie. It is freed at once unless watchpaths_dispatch() is
+ * running, as pending events may still refer to it, in which case it
+ * is freed by reap().
+ */
+static void
+node_unlink(struct watchset *ws, struct pathnode *node)
+{
+  struct pathnode *parent = node->parent;
+  size_t i, j, home;
+
+  if(parent == NULL){
+    return;
+  }
+  node_disarm(ws, node);
+
+  /* remove it from the children of `parent' without tombstones */
+  for(i = node->hash & parent->mask; parent->children[i] != node;
+      i = (i + 1) & parent->mask);
+  for(j = (i + 1) & parent->mask; parent->children[j] != NULL;
+      j = (j + 1) & parent->mask){
+    home = parent->children[j]->hash & parent->mask;
+    /* leave entries whose home lies cyclically within (i, j] */
+    if(i <= j ? (i < home && home <= j) : (i < home || home <= j)){
+      continue;
+    }
+    parent->children[i] = parent->children[j];
+    i = j;
+  }
+  parent->children[i] = NULL;
+  parent->used--;
+  ws->numnodes--;
+
+  if(ws->dispatching){
+    node->parent = ws->deadnodes;
+    ws->deadnodes = node;
+  } else {
+    node_free(node);
+  }
+}
+
+/*
+ * path_remove
+ *
+ * Detaches `pinfo' from the trie and prunes the nodes no longer needed.
+ * The index of `pinfo' is given out again once no callback for it can
+ * be pending.
+ */
+static void
+path_remove(struct watchset *ws, struct pathinfo *pinfo)
+{
+  struct pathnode *node = pinfo->node;
+  struct pathname *pname = NULL;
+
+  heap_remove(ws, pinfo);
+  timer_del(ws, &pinfo->timer);
+  pinfo->deadline = 0;
+  free(pinfo->print);
+  pinfo->print = NULL;
+  file_free(ws, pinfo);
+  poll_drop(ws, pinfo);
+  pinfo->stateslot = -1;
+  if(pinfo->missslot != -1){
+    /* the index may be given out again before the list is done */
+    ws->missed[pinfo->missslot] = -1;
+    pinfo->missslot = -1;
+  }
+  if(node != NULL){
+    if(pinfo->next != NULL){
+      pinfo->next->prev = pinfo->prev;
+    }
+    if(pinfo->prev != NULL){
+      pinfo->prev->next = pinfo->next;
+    } else {
+      node->leaves = pinfo->next;
+    }
+    pinfo->node = NULL;
+    if(pinfo->tree){
+      pinfo->tree = 0;
+      node->trees--;
+      if(node->trees == 0 && (node->parent == NULL || !node->parent->intree)){
+        /* nothing watches the entries now, unless a path passes by */
+        tree_unmark(node);
+        tree_sweep(ws, node);
+      }
+    }
+    node_prune(ws, node);
+  }
+  pname = PNAME(ws, pinfo->index);
+  if(pname->path != NULL){
+    ws->arenalive -= pname->len + 1;
+    ws->arenadead += pname->len + 1;
+    pname->path = NULL;
+    STAT_DEC(ws->stats.paths);
+  }
+  pinfo->prev = NULL;
+
+  if(ws->dispatching){
+    /* deliver() skips it should it be queued */
+    pinfo->next = ws->deadpinfo;
+    ws->deadpinfo = pinfo;
+  } else {
+    pinfo->next = ws->freepinfo;
+    ws->freepinfo = pinfo;
+    arena_compact(ws);
+  }
+}
+
+/*
+ * path_canon
+ *
+ * Stores the path to be watched for `inpath' in `out', which holds
+ * PATH_MAX bytes, and its length in *len. Absolute paths are copied
+ * literally, relative ones are made absolute against `basepath' with
+ * canonicalpath(). Touches nothing else, so it may run on any thread.
+ *
+ * Returns 0 if successful, returns -1, sets errno and points *msg at a
+ * description of the failure otherwise.
+ */
+static int
+path_canon(const char *inpath, const char *basepath, char *out,
+           size_t *len, const char **msg)
+{
+  *len = 0;
+  if(!inpath){
+    errno = EINVAL;
+    *msg = "NULL pathname provided to watchpaths";
+    return -1;
+  }
+  if(inpath[0] == '/'){
+    /* absolute paths are used literally without canonicalization */
+    /* TODO: consider canonicalizing all paths */
+    *len = strnlen(inpath, PATH_MAX);
+    if(*len == PATH_MAX){
+      errno = ENAMETOOLONG;
+      *msg = "Path of file to watch is too long";
+      return -1;
+    }
+    memcpy(out, inpath, *len + 1);
+    return 0;
+  }
+  if(canonicalpath(basepath, inpath, out, PATH_MAX, NULL) == NULL){
+    *msg = "Unable to find path for file to watch";
+    return -1;
+  }
+  *len = strlen(out);
+  return 0;
+}
+
+/*
+ * path_copy
+ *
+ * Stores the path to be watched for `inpath' in ws->pathbuf and its
+ * length in *len, see path_canon(). The current directory is found
+ * once and kept in *basepath, which the caller must free.
+ *
+ * Returns 0 if successful, returns -1 and sets errno otherwise.
+ */
+static int
+path_copy(struct watchset *ws, const char *inpath, char **basepath,
+          size_t *len)
+{
+  const char *msg = NULL;
+
+  /*
+   * basepath is stores the current directory, it is only
+   * calculated once
+   */
+  if(inpath != NULL && inpath[0] != '/' && *basepath == NULL){
+/*@-nullpass@*/
+    *basepath = getcwd(NULL, 0);
+/*@=nullpass@*/
+    if(*basepath == NULL){
+      *len = 0;
+      report_error(CWD_MSG);
+      return -1;
+    }
+  }
+  if(path_canon(inpath, *basepath, ws->pathbuf, len, &msg) == -1){
+    report_error(msg);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * path_name
+ *
+ * Gives `pinfo' the `len' bytes at `path', whose hash is `hash', as its
+ * name, copying them to the arena and entering the path in the table
+ * of paths by name.
+ *
+ * Returns 0 if successful, returns -1 and sets errno otherwise.
+ */
+static int
+path_name(struct watchset *ws, struct pathinfo *pinfo, const char *path,
+          size_t hash, size_t len)
+{
+  struct pathname *pname = PNAME(ws, pinfo->index);
+  char *copy = NULL;
+
+  copy = arena_copy(&ws->arena, path, len);
+  if(copy == NULL){
+    return -1; /* keeps errno */
+  }
+  pname->path = copy;
+  pname->hash = hash;
+  pname->len = len;
+  ws->arenalive += len + 1;
+  STAT_INC(ws->stats.paths);
+  if(name_insert(ws, pinfo->index) == -1){
+    return -1; /* keeps errno, the caller removes the path */
+  }
+  return 0;
+}
+
+/*
+ * arena_copy
+ *
+ * Returns a copy of the `len' bytes at `path', and a NUL byte, packed
+ * into `arena' after the strings copied before it. A new block is
+ * started when the current one is full. The space taken by a path is
+ * reclaimed by arena_compact() once it is removed. The entry names
+ * reported for trees have an arena of their own, which is emptied after
+ * each dispatch.
+ *
+ * Returns NULL and sets errno if memory cannot be allocated.
+ */
+/*@null@*/ /*@dependent@*/
+static char *
+arena_copy(struct arenachunk **arena, const char *path, size_t len)
+{
+  /*@owned@*/ struct arenachunk *chunk = *arena;
+  char *copy = NULL;
+  size_t size;
+
+  if(chunk == NULL || chunk->size - chunk->used < len + 1){
+    size = len + 1 > ARENA_CHUNK ? len + 1 : ARENA_CHUNK;
+    chunk = malloc(sizeof(struct arenachunk) + size);
+    if(chunk == NULL){
+      return NULL; /* keeps errno */
+    }
+    chunk->next = *arena;
+    chunk->used = 0;
+    chunk->size = size;
+    *arena = chunk;
+  }
+  copy = chunk->bytes + chunk->used;
+  memcpy(copy, path, len);
+  copy[len] = '\0';
+  chunk->used += len + 1;
+  return copy;
+}
+
+/*
+ * arena_compact
+ *
+ * Copies the paths still watched into a single new block of the arena
+ * and frees the old blocks, once removed paths take up more of the
+ * arena than the watched ones. Each copy is paid for by the removals
+ * which preceded it, so the cost is constant when amortized. Nothing
+ * is done if memory cannot be allocated, as the old blocks still work.
+ */
+static void
+arena_compact(struct watchset *ws)
+{
+  /*@owned@*/ struct arenachunk *old = ws->arena;
+  struct pathname *pname = NULL;
+  size_t size;
+  int i;
+
+  if(ws->arenadead < ARENA_CHUNK || ws->arenadead < ws->arenalive){
+    return;
+  }
+  size = ws->arenalive > ARENA_CHUNK ? ws->arenalive : ARENA_CHUNK;
+  ws->arena = malloc(sizeof(struct arenachunk) + size);
+  if(ws->arena == NULL){
+    ws->arena = old;
+    return;
+  }
+  ws->arena->next = NULL;
+  ws->arena->used = 0;
+  ws->arena->size = size;
+  for(i = 0; i < ws->numpaths; i++){
+    pname = PNAME(ws, i);
+    if(pname->path != NULL){
+      /* the new block has room for every path, so this cannot fail */
+      pname->path = arena_copy(&ws->arena, pname->path, pname->len);
+    }
+  }
+  ws->arenadead = 0;
+  arena_free(old);
+}
+
+/*
+ * arena_free
+ *
+ * Frees `chunk' and the blocks filled before it.
+ */
+static void
+arena_free(struct arenachunk *chunk)
+{
+  struct arenachunk *next = NULL;
+
+  for(; chunk != NULL; chunk = next){
+    next = chunk->next;
+    free(chunk);
+  }
+}
+
+/*
+ * pinfo_new
+ *
+ * Returns a blank path entry, reusing the index of a removed path if
+ * there is one. Otherwise the next index is used, adding a slab when
+ * the last is full, and doubling the array of slabs when that is full,
+ * so the cost is constant when amortized.
+ *
+ * Returns NULL and sets errno if memory cannot be allocated.
+ */
+/*@null@*/ /*@dependent@*/
+static struct pathinfo *
+pinfo_new(struct watchset *ws)
+{
+  /*@owned@*/ struct pathslab **grown = NULL;
+  struct pathinfo *pinfo = ws->freepinfo;
+  int count;
+
+  if(pinfo != NULL){
+    ws->freepinfo = pinfo->next;
+  } else {
+    if(ws->numpaths == ws->maxpaths){
+      if(ws->maxpaths > INT_MAX - SLAB_SIZE){
+        errno = ENOMEM;
+        return NULL;
+      }
+      count = ws->maxpaths >> SLAB_BITS;
+      if(count == ws->numslabs){
+        count = count == 0 ? 4 : count * 2;
+        grown = reallocarray(ws->slabs, count, sizeof(struct pathslab *));
+        if(grown == NULL){
+          return NULL; /* keeps errno */
+        }
+        ws->slabs = grown;
+        ws->numslabs = count;
+      }
+      ws->slabs[ws->maxpaths >> SLAB_BITS] = malloc(sizeof(struct pathslab));
+      if(ws->slabs[ws->maxpaths >> SLAB_BITS] == NULL){
+        return NULL; /* keeps errno */
+      }
+      ws->maxpaths += SLAB_SIZE;
+    }
+    pinfo = PINFO(ws, ws->numpaths);
+    pinfo->index = ws->numpaths++;
+  }
+
+  PNAME(ws, pinfo->index)->path = NULL;
+  pinfo->node = NULL;
+  pinfo->next = NULL;
+  pinfo->prev = NULL;
+  pinfo->worknext = NULL;
+  pinfo->pending = 0;
+  pinfo->heappos = 0;
+  pinfo->deadline = 0;
+  pinfo->tree = 0;
+  pinfo->print = NULL;
+  pinfo->file = NULL;
+  pinfo->pollslot = -1;
+  pinfo->stateslot = -1;
+  pinfo->missslot = -1;
+  pinfo->mask = ~0u;
+  pinfo->data = NULL;
+  pinfo->openflags = -1;
+  pinfo->timer.owner = pinfo;
+  pinfo->timer.next = NULL;
+  pinfo->timer.pprev = NULL;
+  pinfo->timer.where = -1;
+#ifdef WP_INOTIFY
+  pinfo->fresh = 0;
+#endif
+  return pinfo;
+}
+
+/*
+ * opts_check
+ *
+ * Returns 0 if `opts' may be given to pinfo_opts(), or returns -1 and
+ * sets errno to EINVAL if its flags would create or truncate the file,
+ * as watchpaths_open() refuses.
+ */
+static int
+opts_check(const struct watchpaths_opts *opts)
+{
+  if(opts->openflags != -1 &&
+     (opts->openflags & (O_CREAT | O_EXCL | O_TRUNC)) != 0){
+    errno = EINVAL;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * pinfo_opts
+ *
+ * Gives `pinfo' the options of `opts', if not NULL, which must be set
+ * before the path is first watched, see node_wants().
+ */
+static void
+pinfo_opts(struct pathinfo *pinfo,
+           /*@null@*/ const struct watchpaths_opts *opts)
+{
+  if(opts == NULL){
+    return;
+  }
+  pinfo->mask = opts->mask == 0 ? ~0u : opts->mask;
+#ifdef WP_INOTIFY
+  /* appends are reported as writes */
+  if(pinfo->mask & NOTE_EXTEND){
+    pinfo->mask |= NOTE_WRITE;
+  }
+#endif
+  pinfo->data = opts->data;
+  pinfo->openflags = opts->openflags;
+}
+
+/*
+ * name_find
+ *
+ * Returns the slot of `byname' holding the index of a path equal to
+ * the `len' bytes at `path', whose hash is `hash', or NULL if the path
+ * is not watched.
+ */
+/*@null@*/ /*@dependent@*/
+static int *
+name_find(struct watchset *ws, const char *path, size_t len, size_t hash)
+{
+  struct pathname *pname = NULL;
+  size_t i;
+
+  if(ws->byname == NULL){
+    return NULL;
+  }
+  for(i = hash & ws->namemask; ws->byname[i] != -1;
+      i = (i + 1) & ws->namemask){
+    pname = PNAME(ws, ws->byname[i]);
+    if(pname->hash == hash && pname->len == len &&
+       memcmp(pname->path, path, len) == 0){
+      return &ws->byname[i];
+    }
+  }
+  return NULL;
+}
+
+/*
+ * name_insert
+ *
+ * Adds the path at `index' to the table of paths by name. The table is
+ * doubled in size whenever it would become more than half full.
+ *
+ * Returns 0 if successful, returns -1 and sets errno otherwise.
+ */
+static int
+name_insert(struct watchset *ws, int index)
+{
+  /*@owned@*/ int *old = NULL;
+  size_t i, j, oldcount;
+
+  if(ws->byname == NULL || (ws->nameused + 1) * 2 > ws->namemask + 1){
+    old = ws->byname;
+    oldcount = old == NULL ? 0 : ws->namemask + 1;
+    ws->byname = reallocarray(NULL, oldcount == 0 ? 16 : oldcount * 2,
+                              sizeof(int));
+    if(ws->byname == NULL){
+      ws->byname = old;
+      return -1; /* keeps errno */
+    }
+    ws->namemask = (oldcount == 0 ? 16 : oldcount * 2) - 1;
+    for(i = 0; i <= ws->namemask; i++){
+      ws->byname[i] = -1;
+    }
+    for(i = 0; i < oldcount; i++){
+      if(old[i] != -1){
+        for(j = PNAME(ws, old[i])->hash & ws->namemask; ws->byname[j] != -1;
+            j = (j + 1) & ws->namemask);
+        ws->byname[j] = old[i];
+      }
+    }
+    free(old);
+  }
+
+  /* watchpaths_create() allows a path to be given twice */
+  for(i = PNAME(ws, index)->hash & ws->namemask; ws->byname[i] != -1;
+      i = (i + 1) & ws->namemask);
+  ws->byname[i] = index;
+  ws->nameused++;
+  return 0;
+}
+
+/*
+ * name_remove
+ *
+ * Empties `slot' of the table of paths by name, shifting back any
+ * entries whose probe sequence passed through it.
+ */
+static void
+name_remove(struct watchset *ws, int *slot)
+{
+  size_t i, j, home;
+
+  i = (size_t) (slot - ws->byname);
+  for(j = (i + 1) & ws->namemask; ws->byname[j] != -1;
+      j = (j + 1) & ws->namemask){
+    home = PNAME(ws, ws->byname[j])->hash & ws->namemask;
+    /* leave entries whose home lies cyclically within (i, j] */
+    if(i <= j ? (i < home && home <= j) : (i < home || home <= j)){
+      continue;
+    }
+    ws->byname[i] = ws->byname[j];
+    i = j;
+  }
+  ws->byname[i] = -1;
+  ws->nameused--;
+}
+
+/*
+ * node_path
+ *
+ * Returns the path of `node', which is assembled in ws->pathbuf and
+ * so is only valid until the next call.
+ *
+ * Returns NULL and sets errno if the path is longer than PATH_MAX.
+ */
+/*@null@*/ /*@dependent@*/
+static char *
+node_path(struct watchset *ws, struct pathnode *node)
+{
+  struct pathnode *n = NULL;
+  size_t len = 0;
+
+  if(node->parent == NULL){
+    return strcpy(ws->pathbuf, "/");
+  }
+  for(n = node; n->parent != NULL; n = n->parent){
+    len += n->len + 1;
+  }
+  if(len >= sizeof(ws->pathbuf)){
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+
+  /* fill from the right, as the nodes are visited leaf first */
+  ws->pathbuf[len] = '\0';
+  for(n = node; n->parent != NULL; n = n->parent){
+    len -= n->len;
+    memcpy(ws->pathbuf + len, n->name, n->len);
+    ws->pathbuf[--len] = '/';
+  }
+  return ws->pathbuf;
+}
+
+#ifndef WP_INOTIFY
+/*
+ * mark_dirty
+ *
+ * Adds `kw' to the list of watches to register with the next call to
+ * kevent(2), unless it is already there.
+ */
+static void
+mark_dirty(struct watchset *ws, struct kwatch *kw)
+{
+  if(!kw->dirty){
+    kw->dirty = 1;
+    kw->dirtyprev = NULL;
+    kw->dirtynext = ws->dirty;
+    if(kw->dirtynext != NULL){
+      kw->dirtynext->dirtyprev = kw;
+    }
+    ws->dirty = kw;
+  }
+}
+
+/*
+ * unmark_dirty
+ *
+ * Removes `kw' from the dirty list, if it is there.
+ */
+static void
+unmark_dirty(struct watchset *ws, struct kwatch *kw)
+{
+  if(kw->dirty){
+    if(kw->dirtynext != NULL){
+      kw->dirtynext->dirtyprev = kw->dirtyprev;
+    }
+    if(kw->dirtyprev != NULL){
+      kw->dirtyprev->dirtynext = kw->dirtynext;
+    } else {
+      ws->dirty = kw->dirtynext;
+    }
+    kw->dirty = 0;
+    kw->dirtynext = NULL;
+    kw->dirtyprev = NULL;
+  }
+}
+
+
+#else /* WP_INOTIFY */
+
+/*
+ * wd_find
+ *
+ * Returns the slot holding watch descriptor `wd', or NULL if `wd' is
+ * not in the table.
+ */
+/*@null@*/ /*@dependent@*/
+static struct wdslot *
+wd_find(struct watchset *ws, int wd)
+{
+  size_t i;
+
+  if(ws->slots == NULL){
+    return NULL;
+  }
+  for(i = (size_t) wd & ws->mask; ws->slots[i].wd != -1;
+      i = (i + 1) & ws->mask){
+    if(ws->slots[i].wd == wd){
+      return &ws->slots[i];
+    }
+  }
+  return NULL;
+}
+
+/*
+ * wd_insert
+ *
+ * Returns the slot holding watch descriptor `wd', claiming an empty
+ * slot for it if it is not yet in the table. The table is doubled in
+ * size whenever it would become more than half full.
+ *
+ * Returns NULL and sets errno if the table cannot be grown.
+ */
+/*@null@*/ /*@dependent@*/
+static struct wdslot *
+wd_insert(struct watchset *ws, int wd)
+{
+  /*@owned@*/ struct wdslot *old = NULL;
+  struct wdslot *slot = NULL;
+  size_t i, oldcount;
+
+  if(ws->slots == NULL || (ws->used + 1) * 2 > ws->mask + 1){
+    old = ws->slots;
+    oldcount = old == NULL ? 0 : ws->mask + 1;
+    ws->slots = reallocarray(NULL, oldcount == 0 ? 16 : oldcount * 2,
+                             sizeof(struct wdslot));
+    if(ws->slots == NULL){
+      ws->slots = old;
+      return NULL; /* keeps errno */
+    }
+    ws->mask = (oldcount == 0 ? 16 : oldcount * 2) - 1;
+    for(i = 0; i <= ws->mask; i++){
+      ws->slots[i].wd = -1;
+      ws->slots[i].head = NULL;
+    }
+    ws->used = 0;
+    for(i = 0; i < oldcount; i++){
+      if(old[i].wd != -1){
+        /* cannot recurse again, the table is now large enough */
+        wd_insert(ws, old[i].wd)->head = old[i].head;
+      }
+    }
+    free(old);
+  }
+
+  for(i = (size_t) wd & ws->mask; ws->slots[i].wd != -1;
+      i = (i + 1) & ws->mask){
+    if(ws->slots[i].wd == wd){
+      return &ws->slots[i];
+    }
+  }
+  slot = &ws->slots[i];
+  slot->wd = wd;
+  slot->head = NULL;
+  ws->used++;
+  return slot;
+}
+
+/*
+ * wd_remove
+ *
+ * Empties `slot', shifting back any entries whose probe sequence
+ * passed through it so that no tombstones are needed.
+ */
+static void
+wd_remove(struct watchset *ws, struct wdslot *slot)
+{
+  size_t i, j, home;
+
+  i = (size_t) (slot - ws->slots);
+  for(j = (i + 1) & ws->mask; ws->slots[j].wd != -1; j = (j + 1) & ws->mask){
+    home = (size_t) ws->slots[j].wd & ws->mask;
+    /* leave entries whose home lies cyclically within (i, j] */
+    if(i <= j ? (i < home && home <= j) : (i < home || home <= j)){
+      continue;
+    }
+    ws->slots[i] = ws->slots[j];
+    i = j;
+  }
+  ws->slots[i].wd = -1;
+  ws->slots[i].head = NULL;
+  ws->used--;
+}
+
+/*
+ * wd_detach
+ *
+ * Removes `node' from the list of nodes attached to its watch
+ * descriptor. The kernel watch is removed along with the last node
+ * using it.
+ */
+static void
+wd_detach(struct watchset *ws, struct pathnode *node)
+{
+  struct wdslot *slot = NULL;
+
+  if(node->wd == -1){
+    return;
+  }
+  if(node->wdnext != NULL){
+    node->wdnext->wdprev = node->wdprev;
+  }
+  if(node->wdprev != NULL){
+    node->wdprev->wdnext = node->wdnext;
+  } else if((slot = wd_find(ws, node->wd)) != NULL){
+    slot->head = node->wdnext;
+    if(slot->head == NULL){
+      /* fails harmlessly if the kernel has already dropped the watch */
+      (void) inotify_rm_watch(ws->fd, node->wd);
+      wd_remove(ws, slot);
+      STAT_DEC(ws->stats.watches);
+    }
+  }
+  node->wd = -1;
+  node->wdnext = NULL;
+  node->wdprev = NULL;
+}
+
+/*
+ * wd_attach
+ *
+ * Moves `node' from the list of its current watch descriptor, if any,
+ * to the list of `wd'.
+ *
+ * Returns 0 if successful, returns -1 and sets errno otherwise, in
+ * which case `node' is left unwatched and the kernel watch `wd' is
+ * removed unless another node uses it.
+ */
+static int
+wd_attach(struct watchset *ws, struct pathnode *node, int wd)
+{
+  struct wdslot *slot = NULL;
+  int saved_errno;
+
+  if(node->wd == wd){
+    return 0;
+  }
+  wd_detach(ws, node);
+
+  slot = wd_insert(ws, wd);
+  if(slot == NULL){
+    if(wd_find(ws, wd) == NULL){
+      /* nothing would ever read its events or remove it */
+      saved_errno = errno;
+      (void) inotify_rm_watch(ws->fd, wd);
+      errno = saved_errno;
+    }
+    return -1;
+  }
+  node->wdprev = NULL;
+  node->wdnext = slot->head;
+  if(node->wdnext != NULL){
+    node->wdnext->wdprev = node;
+  } else {
+    STAT_INC(ws->stats.watches);
+  }
+  slot->head = node;
+  node->wd = wd;
+  return 0;
+}
+#endif /* WP_INOTIFY */
+
+/*
+ * node_open
+ *
+ * Opens the file of `node' with `flags', looking up its name alone in
+ * the directory open as `at', or its whole path if `at' is -1 or can
+ * not be searched.
+ *
+ * Returns the descriptor, or -1 and sets errno.
+ */
+static int
+node_open(struct watchset *ws, struct pathnode *node, int at, int flags)
+{
+  char name[NAME_MAX + 1];
+  char *path = NULL;
+  int fd = -1;
+
+  if(at != -1 && node->len <= NAME_MAX){
+    memcpy(name, node->name, node->len);
+    name[node->len] = '\0';
+    while((fd = openat(at, name, flags)) == -1 && errno == EINTR);
+    if(fd != -1 || errno != EBADF){
+      return fd;
+    }
+  }
+  path = node_path(ws, node);
+  if(path == NULL){
+    return -1;
+  }
+  while((fd = open(path, flags)) == -1 && errno == EINTR);
+  return fd;
+}
+
+/*
+ * node_stat
+ *
+ * Fills in `finfo' for the file of `node', looking it up as
+ * node_open() would.
+ *
+ * Returns 0 if successful, returns -1 and sets errno otherwise.
+ */
+static int
+node_stat(struct watchset *ws, struct pathnode *node, int at,
+          struct stat *finfo)
+{
+  char name[NAME_MAX + 1];
+  char *path = NULL;
+  int ret = -1;
+
+  if(at != -1 && node->len <= NAME_MAX){
+    memcpy(name, node->name, node->len);
+    name[node->len] = '\0';
+    while((ret = fstatat(at, name, finfo, 0)) == -1 && errno == EINTR);
+    if(ret == 0 || errno != EBADF){
+      return ret;
+    }
+  }
+  path = node_path(ws, node);
+  if(path == NULL){
+    return -1;
+  }
+  while((ret = stat(path, finfo)) == -1 && errno == EINTR);
+  return ret;
+}
+
+/*
+ * node_wants
+ *
+ * Returns the fflags to watch the file of `node' for, when it is not a
+ * directory: those which the paths naming it want reported, along with
+ * its removal and renaming, which are needed to find the file put in
+ * its place. A node within a tree, or which no path names, is watched
+ * for all of them. A path added to a node already watched does not
+ * widen its watch, so the options of a path must be set before it is
+ * inserted, see pinfo_opts().
+ */
+static u_int
+node_wants(struct watchset *ws, struct pathnode *node)
+{
+  struct pathinfo *pinfo = NULL;
+  u_int want = NOTE_DELETE | NOTE_RENAME;
+
+  if(node->intree || node->leaves == NULL){
+    return ws->typemask;
+  }
+  for(pinfo = node->leaves; pinfo != NULL; pinfo = pinfo->next){
+    want |= pinfo->mask;
+  }
+  return want & ws->typemask;
+}
+
+/*
+ * node_arm
+ *
+ * Starts watching the file of `node', which is looked up by name in
+ * the directory open as `at', or by its path if `at' is -1, so that a
+ * node deep in a tree is armed at the cost of one path element rather
+ * than all of them. With inotify, a lookup already made is taken from
+ * `known' if it is not NULL; kqueue looks at the descriptor it opens.
+ *
+ * A directory which reappears on another device is refused, as it was
+ * most likely a mount point which has been unmounted. watchpaths() does
+ * not cross device boundaries while waiting for paths to reappear. Nor
+ * does a tree reach into a file system mounted within it: a node found
+ * only by the tree is refused as well, and kept as a record of the
+ * mount point, see FOREIGN().
+ *
+ * Returns 0 if successful, returns -1 and sets errno otherwise.
+ */
+static int
+node_arm(struct watchset *ws, struct pathnode *node, int at,
+         const struct lookup *known)
+{
+  struct stat finfo;
+#ifdef WP_INOTIFY
+  char proc[32 + NAME_MAX + 1];
+  char *path = NULL;
+  uint32_t mask;
+  int wd = -1;
+#else
+  int fd = -1;
+#endif
+
+#ifdef WP_INOTIFY
+  if(known != NULL && known->err != 0){
+    errno = known->err;
+    return -1;
+  } else if(known != NULL){
+    finfo = known->finfo;
+  } else if(node_stat(ws, node, at, &finfo) == -1){
+    return -1;
+  }
+  mask = S_ISDIR(finfo.st_mode) ?
+    (node->intree ? WATCH_TREE_MASK : WATCH_DIR_MASK) | IN_MASK_ADD :
+    (node_wants(ws, node) & NOTE_WRITE) != 0 ? WATCH_FILE_MASK | IN_MASK_ADD :
+    WATCH_SELF_MASK | IN_MASK_ADD;
+  if(at != -1 && node->len <= NAME_MAX){
+    /* name the entry through the descriptor, falling back without /proc */
+    (void) snprintf(proc, sizeof(proc), "/proc/self/fd/%d/%.*s", at,
+                    (int) node->len, node->name);
+    wd = inotify_add_watch(ws->fd, proc, mask);
+  }
+  if(wd == -1 && (at == -1 || node->len > NAME_MAX || errno == ENOENT)){
+    path = node_path(ws, node);
+    if(path == NULL){
+      return -1;
+    }
+    wd = inotify_add_watch(ws->fd, path, mask);
+  }
+  debug_printf("watch %.*s: %d\n", (int) node->len, node->name, wd);
+  if(wd == -1 || wd_attach(ws, node, wd) == -1){
+    return -1;
+  }
+#else
+  (void) known;
+  fd = node_open(ws, node, at, OPEN_MODE);
+  debug_printf("watch %.*s: %d\n", (int) node->len, node->name, fd);
+  if(fd == -1){
+    return -1;
+  }
+  node->kw.fd = fd;
+  STAT_INC(ws->stats.watches);
+  STAT_INC(ws->stats.descriptors);
+  mark_dirty(ws, &node->kw);
+  if(-1 == fstat(fd, &finfo)){
+    node_disarm(ws, node);
+    return -1;
+  }
+#endif
+
+  if(node->used > 0 && node->dev != (dev_t) -1 && finfo.st_dev != node->dev){
+    node_disarm(ws, node);
+    errno = EXDEV; /* bad cross-device traversal */
+    return -1;
+  }
+  node->dev = finfo.st_dev;
+  node->ino = finfo.st_ino;
+  if(FOREIGN(node)){
+    node_disarm(ws, node);
+    node->keep = 1;
+    errno = EXDEV;
+    return -1;
+  }
+  node->dir = S_ISDIR(finfo.st_mode) != 0;
+#ifdef WP_INOTIFY
+  node->keep = node->intree && node->dir;
+#else
+  node->keep = node->intree;
+#endif
+  STAT_INC(ws->stats.rearms);
+  return 0;
+}
+
+/*
+ * node_disarm
+ *
+ * Stops watching the file at the path of `node'.
+ */
+static void
+node_disarm(struct watchset *ws, struct pathnode *node)
+{
+#ifdef WP_INOTIFY
+  wd_detach(ws, node);
+#else
+  if(node->kw.fd >= 0){
+    unmark_dirty(ws, &node->kw);
+    /* closing the descriptor also drops the registration */
+    while(-1 == close(node->kw.fd) && errno == EINTR);
+    node->kw.fd = -1;
+    STAT_DEC(ws->stats.watches);
+    STAT_DEC(ws->stats.descriptors);
+  }
+#endif
+  node->keep = 0;
+}
+
+/*
+ * node_drop
+ *
+ * Stops watching `node' and every watched node beneath it. Only the
+ * watched part of the subtree is visited, which is connected since a
+ * node is only watched while its parent is. Nothing beneath is kept
+ * for a tree any longer, see tree_sweep().
+ */
+static void
+node_drop(struct watchset *ws, struct pathnode *node)
+{
+  struct pathnode *child = NULL;
+  size_t i;
+
+  for(i = 0; node->children != NULL && i <= node->mask; i++){
+    child = node->children[i];
+    if(child != NULL && WATCHED(child)){
+      node_drop(ws, child);
+    } else if(child != NULL){
+      child->keep = 0;
+    }
+  }
+  node_disarm(ws, node);
+}
+
+/*
+ * node_resolve
+ *
+ * Starts watching `node', whose parent is watched and open as `at' if
+ * that is not -1, if it exists, and then each of its children in turn.
+ * The paths naming the nodes found are queued for the callback.
+ *
+ * A node which cannot be watched for a reason which may go away when
+ * it is recreated is left for its parent to report. The entries of a
+ * directory in a tree are read first, which watches the children
+ * found there, so only the rest are looked up by name. Each is looked
+ * up in its parent alone, so recreating a whole chain of directories
+ * costs the same per directory however deep it lies. Many entries of
+ * one directory are looked up together, see RING_MIN. `known' is as
+ * for node_arm().
+ *
+ * Returns 0 if successful, returns -1 and sets errno otherwise.
+ */
+static int
+node_resolve(struct watchset *ws, struct pathnode *node, int at,
+             const struct lookup *known)
+{
+  struct pathnode *child = NULL;
+  size_t i;
+  int fd = -1;
+  int ret = 0;
+#ifdef WP_INOTIFY
+  int saved_errno;
+#endif
+
+  if(node_arm(ws, node, at, known) == -1){
+    if(PASSING(errno) || (errno == EXDEV && node->keep)){
+      return 0;
+    }
+    /* let caller see errno */
+    return -1;
+  }
+
+  queue_leaves(ws, node);
+  if(CRAWLS(node) && tree_crawl(ws, node, at, 1) == -1){
+    return -1;
+  }
+#ifdef WP_INOTIFY
+  for(i = 0; node->dir && node->children != NULL && i <= node->mask; i++){
+    if(node->children[i] != NULL && !node->children[i]->keep){
+      /* the children are looked up through the directory */
+      fd = node_open(ws, node, at, O_PATH | O_DIRECTORY | O_CLOEXEC);
+      break;
+    }
+  }
+#else
+  fd = node->kw.fd;
+#endif
+#ifdef WP_URING
+  if(fd != -1 && node->used >= RING_MIN && ring_open(ws) == 0){
+    ret = ring_resolve(ws, node, fd);
+  } else
+#endif
+  for(i = 0; ret == 0 && node->children != NULL && i <= node->mask; i++){
+    child = node->children[i];
+    if(child != NULL && !child->keep){
+      ret = node_resolve(ws, child, fd, NULL);
+    }
+  }
+#ifdef WP_INOTIFY
+  if(fd != -1){
+    saved_errno = errno;
+    while(-1 == close(fd) && errno == EINTR);
+    errno = saved_errno;
+  }
+#endif
+  return ret;
+}
+
+#ifdef WP_URING
+/*
+ * ring_open
+ *
+ * Sets up the io_uring of the watch set, unless it is already set up.
+ * Once that has failed, as it does on kernels without io_uring or where
+ * it is forbidden, it is not tried again.
+ *
+ * Returns 0 if the io_uring is ready, or -1 if the nodes are to be
+ * looked up one at a time.
+ */
+static int
+ring_open(struct watchset *ws)
+{
+  struct io_uring_params params;
+  struct statring *r = NULL;
+
+  if(ws->ring != NULL){
+    return 0;
+  }
+  if(ws->noring){
+    return -1;
+  }
+  ws->noring = 1;
+  r = malloc(sizeof(struct statring));
+  if(r == NULL){
+    return -1;
+  }
+  memset(&params, 0, sizeof(params));
+  r->fd = (int) syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+  if(r->fd == -1){
+    debug_printf("io_uring unavailable: %s\n", strerror(errno));
+    free(r);
+    return -1;
+  }
+  (void) fcntl(r->fd, F_SETFD, FD_CLOEXEC);
+  STAT_INC(ws->stats.descriptors);
+
+  r->sqsize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  r->cqsize = params.cq_off.cqes +
+    params.cq_entries * sizeof(struct io_uring_cqe);
+  if(params.features & IORING_FEAT_SINGLE_MMAP){
+    if(r->cqsize > r->sqsize){
+      r->sqsize = r->cqsize;
+    }
+    r->cqsize = 0;
+  }
+  r->sqesize = params.sq_entries * sizeof(struct io_uring_sqe);
+  r->sq = mmap(NULL, r->sqsize, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  r->cq = r->cqsize == 0 ? r->sq :
+    mmap(NULL, r->cqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+         r->fd, IORING_OFF_CQ_RING);
+  r->sqes = mmap(NULL, r->sqesize, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  ws->ring = r;
+  if(r->sq == MAP_FAILED || r->cq == MAP_FAILED || r->sqes == MAP_FAILED){
+    report_error("Unable to map io_uring");
+    ring_close(ws);
+    return -1;
+  }
+
+  r->sqtail = (unsigned *) ((char *) r->sq + params.sq_off.tail);
+  r->sqmask = (unsigned *) ((char *) r->sq + params.sq_off.ring_mask);
+  r->sqarray = (unsigned *) ((char *) r->sq + params.sq_off.array);
+  r->cqhead = (unsigned *) ((char *) r->cq + params.cq_off.head);
+  r->cqtail = (unsigned *) ((char *) r->cq + params.cq_off.tail);
+  r->cqmask = (unsigned *) ((char *) r->cq + params.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *) ((char *) r->cq + params.cq_off.cqes);
+  ws->noring = 0;
+  return 0;
+}
+
+/*
+ * ring_close
+ *
+ * Tears down the io_uring of the watch set, if any.
+ */
+static void
+ring_close(struct watchset *ws)
+{
+  struct statring *r = ws->ring;
+
+  if(r == NULL){
+    return;
+  }
+  if(r->sqes != MAP_FAILED){
+    (void) munmap(r->sqes, r->sqesize);
+  }
+  if(r->cq != r->sq && r->cq != MAP_FAILED){
+    (void) munmap(r->cq, r->cqsize);
+  }
+  if(r->sq != MAP_FAILED){
+    (void) munmap(r->sq, r->sqsize);
+  }
+  while(-1 == close(r->fd) && errno == EINTR);
+  STAT_DEC(ws->stats.descriptors);
+  free(r);
+  ws->ring = NULL;
+}
+
+/*
+ * ring_reap
+ *
+ * Takes the results of the lookups in `ps' which the kernel has
+ * completed since it was last called, see ring_stat().
+ *
+ * Returns how many there were.
+ */
+static int
+ring_reap(struct watchset *ws, struct prestat *ps)
+{
+  struct statring *r = ws->ring;
+  struct io_uring_cqe *cqe = NULL;
+  struct prestat *p = NULL;
+  unsigned head;
+  int done = 0;
+
+  head = *r->cqhead;
+  for(; head != __atomic_load_n(r->cqtail, __ATOMIC_ACQUIRE); head++){
+    cqe = &r->cqes[head & *r->cqmask];
+    p = &ps[cqe->user_data];
+    done++;
+    if(cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP){
+      /* a kernel which predates IORING_OP_STATX */
+      ws->noring = 1;
+    } else if(cqe->res == -EBADF){
+      /* node_stat() falls back to the path */
+    } else if(cqe->res < 0){
+      p->look.err = -cqe->res;
+    } else {
+      memset(&p->look.finfo, 0, sizeof(p->look.finfo));
+      p->look.finfo.st_dev = makedev(p->stx.stx_dev_major,
+                                     p->stx.stx_dev_minor);
+      p->look.finfo.st_ino = (ino_t) p->stx.stx_ino;
+      p->look.finfo.st_mode = (mode_t) p->stx.stx_mode;
+      p->look.finfo.st_size = (off_t) p->stx.stx_size;
+      p->look.finfo.st_mtim.tv_sec = (time_t) p->stx.stx_mtime.tv_sec;
+      p->look.finfo.st_mtim.tv_nsec = (long) p->stx.stx_mtime.tv_nsec;
+      p->look.finfo.st_ctim.tv_sec = (time_t) p->stx.stx_ctime.tv_sec;
+      p->look.finfo.st_ctim.tv_nsec = (long) p->stx.stx_ctime.tv_nsec;
+      p->look.err = 0;
+    }
+  }
+  __atomic_store_n(r->cqhead, head, __ATOMIC_RELEASE);
+  return done;
+}
+
+/*
+ * ring_drain
+ *
+ * Waits for the kernel to complete the `left' lookups in `ps' which it
+ * has taken, once io_uring_enter() can no longer be relied on to wait
+ * for them. It completes every lookup it takes, so this returns once
+ * `ps' is no longer written to.
+ */
+static void
+ring_drain(struct watchset *ws, struct prestat *ps, int left)
+{
+  struct timespec pause;
+  int done;
+
+  pause.tv_sec = 0;
+  pause.tv_nsec = RING_PAUSE;
+  while(left > 0){
+    done = ring_reap(ws, ps);
+    if(done == 0){
+      (void) nanosleep(&pause, NULL);
+    }
+    left -= done;
+  }
+}
+
+/*
+ * ring_stat
+ *
+ * Looks up the `count' paths in `ps', no more than RING_ENTRIES, in the
+ * directory open as `at', or AT_FDCWD, through the io_uring, with one
+ * system call to submit them and as few as the kernel allows to wait
+ * for them. Each lookup whose result is not known is left with `err'
+ * -1, so that the caller makes it itself. If the kernel can not stat
+ * through the io_uring, it is not used again. While the kernel is short
+ * of room, the completions already posted are reaped before trying
+ * again, up to RING_RETRIES times.
+ *
+ * Returns 0 once every lookup submitted has completed, or -1 if they
+ * could not be submitted or waited for, in which case those the kernel
+ * took are completed and the io_uring closed before returning, and it
+ * is not used again.
+ */
+static int
+ring_stat(struct watchset *ws, int at, struct prestat *ps, int count)
+{
+  struct statring *r = ws->ring;
+  struct io_uring_sqe *sqe = NULL;
+  unsigned tail, slot;
+  int i, done = 0, submitted = 0, retries = 0;
+  long ret;
+
+  tail = *r->sqtail;
+  for(i = 0; i < count; i++){
+    ps[i].look.err = -1;
+    slot = tail & *r->sqmask;
+    sqe = &r->sqes[slot];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = at;
+    sqe->addr = (uintptr_t) ps[i].path;
+    sqe->len = STATX_TYPE | STATX_MODE | STATX_INO | STATX_SIZE |
+      STATX_MTIME | STATX_CTIME;
+    sqe->off = (uintptr_t) &ps[i].stx;
+    sqe->user_data = (uint64_t) i;
+    r->sqarray[slot] = slot;
+    tail++;
+  }
+  /* the kernel reads the entries once it sees the new tail */
+  __atomic_store_n(r->sqtail, tail, __ATOMIC_RELEASE);
+
+  /* usually one call both submits the batch and waits for it */
+  while(submitted < count){
+    ret = syscall(__NR_io_uring_enter, r->fd, (unsigned) (count - submitted),
+                  (unsigned) (count - submitted), IORING_ENTER_GETEVENTS,
+                  NULL, 0);
+    if(ret != -1){
+      submitted += (int) ret;
+      retries = 0;
+    } else if(errno == EINTR){
+      continue;
+    } else if((errno == EAGAIN || errno == EBUSY) &&
+              ++retries < RING_RETRIES){
+      /* make room in the completion ring before trying again */
+      done += ring_reap(ws, ps);
+    } else if(submitted == 0){
+      /* nothing was submitted, so the caller looks them all up itself */
+      __atomic_store_n(r->sqtail, tail - (unsigned) count, __ATOMIC_RELEASE);
+      report_error("Unable to submit lookups to io_uring");
+      ws->noring = 1;
+      return 0;
+    } else {
+      report_error("Unable to submit lookups to io_uring");
+      goto FAIL;
+    }
+  }
+
+  retries = 0;
+  while(done < submitted){
+    i = ring_reap(ws, ps);
+    if(i > 0){
+      done += i;
+      retries = 0;
+      continue;
+    }
+    ret = syscall(__NR_io_uring_enter, r->fd, 0U,
+                  (unsigned) (submitted - done), IORING_ENTER_GETEVENTS,
+                  NULL, 0);
+    if(ret == -1 && errno != EINTR &&
+       ((errno != EAGAIN && errno != EBUSY) || ++retries >= RING_RETRIES)){
+      report_error("Unable to wait for io_uring");
+      goto FAIL;
+    }
+  }
+  return 0;
+
+ FAIL:
+  /* the kernel must be done with `ps' before the caller may reuse it */
+  ring_drain(ws, ps, submitted - done);
+  ring_close(ws);
+  ws->noring = 1;
+  return -1;
+}
+
+/*
+ * ring_resolve
+ *
+ * Does for the children of `node', open as `fd', what node_resolve()
+ * does one at a time, looking them up RING_ENTRIES at a time through
+ * the io_uring first.
+ *
+ * Returns 0 if successful, returns -1 and sets errno otherwise.
+ */
+static int
+ring_resolve(struct watchset *ws, struct pathnode *node, int fd)
+{
+  struct prestat *ps = NULL;
+  struct pathnode *child = NULL;
+  size_t i = 0;
+  int count, j, ret = 0;
+
+  /* each level of the recursion needs its own batch */
+  ps = reallocarray(NULL, RING_ENTRIES, sizeof(struct prestat));
+  if(ps == NULL){
+    return -1;
+  }
+  while(ret == 0 && node->children != NULL && i <= node->mask){
+    for(count = 0; count < RING_ENTRIES && i <= node->mask; i++){
+      child = node->children[i];
+      if(child != NULL && !child->keep){
+        ps[count].node = child;
+        ps[count].path = ps[count].name;
+        if(child->len > NAME_MAX){
+          /* node_stat() looks it up by its path instead */
+          ps[count].name[0] = '\0';
+        } else {
+          memcpy(ps[count].name, child->name, child->len);
+          ps[count].name[child->len] = '\0';
+        }
+        count++;
+      }
+    }
+    if(ws->noring){
+      for(j = 0; j < count; j++){
+        ps[j].look.err = -1;
+      }
+    } else if(ring_stat(ws, fd, ps, count) == -1){
+      /* the io_uring is closed, so each is looked up by node_stat() */
+      for(j = 0; j < count; j++){
+        ps[j].look.err = -1;
+      }
+    }
+    for(j = 0; ret == 0 && j < count; j++){
+      ret = node_resolve(ws, ps[j].node, fd,
+                         ps[j].look.err == -1 || ps[j].name[0] == '\0' ?
+                         NULL : &ps[j].look);
+    }
+  }
+  free(ps);
+  return ret;
+}
+#endif
+
+/*
+ * node_check
+ *
+ * Brings `node' up to date after an event which suggests that the file
+ * at its path was created, removed or replaced. If the file watched is
+ * no longer there, as must be the case when `dead' is nonzero, the
+ * whole subtree is dropped at once and the part of it which exists now
+ * is watched again. The paths found to exist are queued for the
+ * callback.
+ *
+ * Returns 1 if the watch on `node' was dropped, 0 if it was kept or
+ * `node' was not watched, and -1 if watching can not continue.
+ */
+static int
+node_check(struct watchset *ws, struct pathnode *node, int dead)
+{
+  struct stat finfo;
+  int ret = 0;
+
+  STAT_INC(ws->stats.rechecks);
+  if(WATCHED(node)){
+    if(!dead){
+      ret = node_stat(ws, node, PARENT_FD(node), &finfo);
+      if(ret == -1 && errno == ENAMETOOLONG){
+        return -1;
+      }
+      if(ret == 0 && finfo.st_dev == node->dev && finfo.st_ino == node->ino){
+        return 0;
+      }
+    }
+    node_drop(ws, node);
+    if(node->intree){
+      /* whatever is found again is read afresh */
+      tree_sweep(ws, node);
+    }
+    ret = 1;
+  }
+
+  if(node->parent != NULL && !WATCHED(node->parent)){
+    /* the parent will look again once it is recreated */
+    return ret;
+  }
+  if(node_resolve(ws, node, PARENT_FD(node), NULL) == -1){
+    report_error("unable to watch path");
+    return -1;
+  }
+  return ret;
+}
+
+/*
+ * node_arm_at
+ *
+ * Starts watching the entry `name' of the directory open as `fd' for
+ * `node', as node_arm() would, but without assembling its path. A
+ * directory is also opened for reading, and left open in *dirfd for the
+ * caller to close; otherwise *dirfd is -1. Links are not followed, so
+ * a tree does not reach outside of itself.
+ *
+ * Returns 0 if successful, returns -1 and sets errno otherwise.
+ */
+static int
+node_arm_at(struct watchset *ws, struct pathnode *node, int fd,
+            const char *name, int *dirfd)
+{
+  struct stat finfo;
+  int rfd = -1;
+  int foreign = 0;
+  int saved_errno;
+#ifdef WP_INOTIFY
+  char proc[32];
+  char *path = NULL;
+  int wd = -1;
+#endif
+
+  *dirfd = -1;
+  if(node->found == FOUND_DIR){
+    while((rfd = openat(fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+                        O_CLOEXEC)) == -1 && errno == EINTR);
+    if(rfd == -1){
+      return -1;
+    }
+  }
+#ifdef WP_INOTIFY
+  /* only directories have watches of their own in a tree */
+  if(rfd == -1 || -1 == fstat(rfd, &finfo)){
+    goto ERR;
+  }
+  node->dev = finfo.st_dev;
+  node->ino = finfo.st_ino;
+  if(FOREIGN(node)){
+    foreign = 1;
+    errno = EXDEV;
+    goto ERR;
+  }
+  /* name the directory by its descriptor, falling back without /proc */
+  (void) snprintf(proc, sizeof(proc), "/proc/self/fd/%d", rfd);
+  wd = inotify_add_watch(ws->fd, proc, WATCH_TREE_MASK | IN_MASK_ADD);
+  if(wd == -1 && errno == ENOENT && (path = node_path(ws, node)) != NULL){
+    wd = inotify_add_watch(ws->fd, path, WATCH_TREE_MASK | IN_MASK_ADD);
+  }
+  debug_printf("watch %s: %d\n", name, wd);
+  if(wd == -1 || wd_attach(ws, node, wd) == -1){
+    goto ERR;
+  }
+#else
+  while((node->kw.fd = openat(fd, name, OPEN_MODE | O_NOFOLLOW |
+                              O_CLOEXEC)) == -1 && errno == EINTR);
+  debug_printf("watch %s: %d\n", name, node->kw.fd);
+  if(node->kw.fd == -1){
+    goto ERR;
+  }
+  STAT_INC(ws->stats.watches);
+  STAT_INC(ws->stats.descriptors);
+  mark_dirty(ws, &node->kw);
+  if(-1 == fstat(node->kw.fd, &finfo)){
+    goto ERR;
+  }
+  node->dev = finfo.st_dev;
+  node->ino = finfo.st_ino;
+  if(FOREIGN(node)){
+    foreign = 1;
+    errno = EXDEV;
+    goto ERR;
+  }
+#endif
+  node->dir = S_ISDIR(finfo.st_mode) != 0;
+  node->keep = 1;
+  *dirfd = rfd;
+  STAT_INC(ws->stats.rearms);
+  return 0;
+
+ERR:
+  saved_errno = errno;
+  node_disarm(ws, node);
+  node->keep = (unsigned char) foreign;
+  if(rfd != -1){
+    while(-1 == close(rfd) && errno == EINTR);
+  }
+  errno = saved_errno;
+  return -1;
+}
+
+/*
+ * node_enter
+ *
+ * Starts watching `node', which node_crawl() found in the directory
+ * open as `fd', and reads its entries in turn if it is a directory.
+ * The paths naming it are queued for the callback. A node which is
+ * not part of the tree, but is named by a path, is resolved by path.
+ *
+ * Returns 0 if successful, returns -1 and sets errno otherwise.
+ */
+static int
+node_enter(struct watchset *ws, struct pathnode *node, int fd)
+{
+  char name[NAME_MAX + 1];
+  int dirfd = -1;
+  int ret;
+  int saved_errno;
+
+  if(node->found == FOUND_PATH || node->len > NAME_MAX){
+    node->found = 0;
+    return node_resolve(ws, node, fd, NULL);
+  }
+  memcpy(name, node->name, node->len);
+  name[node->len] = '\0';
+  ret = node_arm_at(ws, node, fd, name, &dirfd);
+  node->found = 0;
+  if(ret == -1){
+    /* links and other file systems are not part of the tree */
+    return PASSING(errno) || errno == ELOOP || errno == EMLINK ||
+      errno == EXDEV ? 0 : -1;
+  }
+
+  queue_leaves(ws, node);
+  if(dirfd != -1){
+    ret = CRAWLS(node) ? node_crawl(ws, node, dirfd, 1) : 0;
+    saved_errno = errno;
+    while(-1 == close(dirfd) && errno == EINTR);
+    errno = saved_errno;
+  }
+  return ret;
+}
+
+/*
+ * node_crawl
+ *
+ * Reads the entries of the directory of `node', which is open as `fd',
+ * and watches those which are part of its tree or named by a path,
+ * descending into the directories among them. The entries are opened
+ * relative to their directory, so no path is assembled on the way
+ * down, and on Linux they are read in large blocks with getdents64(2).
+ * Every entry of a directory is read before any is entered, so a
+ * single buffer serves the whole descent. `fresh' is nonzero if the
+ * directory has just appeared, see crawl_entry().
+ *
+ * Returns 0 if successful, returns -1 and sets errno otherwise.
+ */
+static int
+node_crawl(struct watchset *ws, struct pathnode *node, int fd, int fresh)
+{
+  struct pathnode *child = NULL;
+#ifdef __linux__
+  struct crawldirent *de = NULL;
+  long got, off;
+#else
+  DIR *dir = NULL;
+  struct dirent *de = NULL;
+  int dfd = -1;
+  int saved_errno;
+#endif
+  size_t i;
+
+#ifdef __linux__
+  if(ws->crawlbuf == NULL){
+    ws->crawlbuf = malloc(CRAWL_BUFF_SIZE);
+    if(ws->crawlbuf == NULL){
+      return -1; /* keeps errno */
+    }
+  }
+  for(;;){
+    got = syscall(SYS_getdents64, fd, ws->crawlbuf, CRAWL_BUFF_SIZE);
+    if(got == -1 && errno == EINTR){
+      continue;
+    } else if(got == -1){
+      return PASSING(errno) ? 0 : -1;
+    } else if(got == 0){
+      break;
+    }
+    for(off = 0; off < got; off += de->d_reclen){
+      de = (struct crawldirent *) (ws->crawlbuf + off);
+      if(crawl_entry(ws, node, fd, de->d_name, de->d_type, fresh) == -1){
+        return -1;
+      }
+    }
+  }
+#else
+  /* the stream takes over its descriptor, so give it a copy */
+  dfd = dup(fd);
+  if(dfd == -1 || (dir = fdopendir(dfd)) == NULL){
+    saved_errno = errno;
+    if(dfd != -1){
+      while(-1 == close(dfd) && errno == EINTR);
+    }
+    errno = saved_errno;
+    return -1;
+  }
+  while((de = readdir(dir)) != NULL){
+    if(crawl_entry(ws, node, fd, de->d_name, de->d_type, fresh) == -1){
+      saved_errno = errno;
+      (void) closedir(dir);
+      errno = saved_errno;
+      return -1;
+    }
+  }
+  (void) closedir(dir);
+#endif
+
+#ifndef WP_INOTIFY
+  /* make room to register the watches of the entries found */
+  if(grow_changes(ws) == -1){
+    return -1;
+  }
+#endif
+
+  for(i = 0; node->children != NULL && i <= node->mask; i++){
+    child = node->children[i];
+    if(child != NULL && child->found != 0 && node_enter(ws, child, fd) == -1){
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * crawl_entry
+ *
+ * Handles the entry `name' of the directory of `node', which is open as
+ * `fd', of the type given by readdir(3). An entry which is not watched
+ * yet is marked for node_crawl() to enter if it is part of the tree or
+ * named by a path, and is reported to the trees as having been written
+ * when node_crawl() runs while dispatching. Entries with no watch of
+ * their own, which are all but the directories with inotify, can only
+ * be known to be new if the whole directory is `fresh'.
+ *
+ * Returns 0 if successful, returns -1 and sets errno otherwise.
+ */
+static int
+crawl_entry(struct watchset *ws, struct pathnode *node, int fd,
+            const char *name, unsigned char type, int fresh)
+{
+  struct pathnode *child = NULL;
+  struct stat finfo;
+  size_t len;
+  int found;
+
+  if(name[0] == '.' &&
+     (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))){
+    return 0;
+  }
+  len = strlen(name);
+
+  if(type == DT_UNKNOWN){
+    /* some file systems leave the type to be looked up */
+    if(-1 == fstatat(fd, name, &finfo, AT_SYMLINK_NOFOLLOW)){
+      return 0;
+    }
+    found = S_ISDIR(finfo.st_mode) ? FOUND_DIR :
+      S_ISREG(finfo.st_mode) ? FOUND_FILE : FOUND_PATH;
+  } else {
+    found = type == DT_DIR ? FOUND_DIR :
+      type == DT_REG ? FOUND_FILE : FOUND_PATH;
+  }
+#ifdef WP_INOTIFY
+  /* a file is watched through its directory */
+  if(found == FOUND_FILE){
+    found = FOUND_PATH;
+  }
+#endif
+
+  child = node_child(node, name, len, hash_name(name, len));
+  if(child != NULL && (WATCHED(child) || child->keep)){
+    /* already watched, or another file system mounted here */
+    return 0;
+  }
+  if(child == NULL && found == FOUND_PATH){
+    if(fresh && ws->announce){
+      tree_report(ws, node, name, len, NOTE_WRITE);
+    }
+    return 0;
+  }
+  if(child == NULL){
+    child = node_new(ws, node, name, len);
+    if(child == NULL){
+      return -1; /* keeps errno */
+    }
+  }
+  child->found = (unsigned char) found;
+  if(ws->announce){
+    tree_report(ws, node, name, len, NOTE_WRITE);
+  }
+  return 0;
+}
+
+/*
+ * tree_crawl
+ *
+ * Opens the directory of `node', whose entries are part of a tree, by
+ * its path and reads its entries, see node_crawl().
+ *
+ * Returns 0 if successful, returns -1 and sets errno otherwise.
+ */
+static int
+tree_crawl(struct watchset *ws, struct pathnode *node, int at, int fresh)
+{
+  int fd = -1;
+  int ret;
+  int saved_errno;
+
+  fd = node_open(ws, node, at, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if(fd == -1){
+    /* gone again, which its own event reports */
+    return PASSING(errno) ? 0 : -1;
+  }
+  ret = node_crawl(ws, node, fd, fresh);
+  saved_errno = errno;
+  while(-1 == close(fd) && errno == EINTR);
+  errno = saved_errno;
+  return ret;
+}
+
+/*
+ * tree_mark
+ *
+ * Makes `node' and everything beneath it part of a tree.
+ */
+static void
+tree_mark(struct pathnode *node)
+{
+  size_t i;
+
+  node->intree = 1;
+  for(i = 0; node->children != NULL && i <= node->mask; i++){
+    if(node->children[i] != NULL){
+      tree_mark(node->children[i]);
+    }
+  }
+}
+
+/*
+ * tree_unmark
+ *
+ * Takes `node', the root of a tree no longer watched, and everything
+ * beneath it out of the tree, except for the trees rooted beneath it.
+ * The nodes only the tree needed are then removed by tree_sweep().
+ */
+static void
+tree_unmark(struct pathnode *node)
+{
+  size_t i;
+
+  node->intree = 0;
+  node->keep = 0;
+  for(i = 0; node->children != NULL && i <= node->mask; i++){
+    if(node->children[i] != NULL && node->children[i]->trees == 0){
+      tree_unmark(node->children[i]);
+    }
+  }
+}
+
+/*
+ * tree_sweep
+ *
+ * Removes the nodes beneath `node' which no path names or passes
+ * through and no tree keeps, such as those of a subtree which went
+ * away.
+ */
+static void
+tree_sweep(struct watchset *ws, struct pathnode *node)
+{
+  struct pathnode *child = NULL;
+  size_t i = 0;
+
+  while(node->children != NULL && i <= node->mask){
+    child = node->children[i];
+    if(child != NULL){
+      tree_sweep(ws, child);
+      if(child->leaves == NULL && child->used == 0 && !child->keep){
+        /* a later child may have moved into slot `i' */
+        node_unlink(ws, child);
+        continue;
+      }
+    }
+    i++;
+  }
+}
+
+/*
+ * queue_leaves
+ *
+ * Appends the paths naming `node' to the paths due a callback, skipping
+ * any already queued. Handling an event gathers them before any
+ * callback runs, so the callback sees the trie in a consistent state.
+ */
+static void
+queue_leaves(struct watchset *ws, struct pathnode *node)
+{
+  struct pathinfo *pinfo = NULL;
+
+  for(pinfo = node->leaves; pinfo != NULL; pinfo = pinfo->next){
+    if(pinfo->worknext != NULL || ws->worktail == &pinfo->worknext){
+      continue;
+    }
+    *ws->worktail = pinfo;
+    ws->worktail = &pinfo->worknext;
+  }
+  *ws->worktail = NULL;
+}
+
+/*
+ * dequeue
+ *
+ * Removes and returns the first path due a callback, or returns NULL
+ * once there are none.
+ */
+/*@null@*/ /*@dependent@*/
+static struct pathinfo *
+dequeue(struct watchset *ws)
+{
+  struct pathinfo *pinfo = ws->work;
+
+  if(pinfo != NULL){
+    ws->work = pinfo->worknext;
+    if(ws->work == NULL){
+      ws->worktail = &ws->work;
+    }
+    pinfo->worknext = NULL;
+  }
+  return pinfo;
+}
+
+/*
+ * deliver
+ *
+ * Executes the callback for each queued path with the given fflags,
+ * then empties the queue. With inotify, a queued path whose leaf is
+ * `created' and empty is held back instead, see is_empty().
+ */
+static void
+deliver(struct watchset *ws, u_int fflags, struct pathnode *created)
+{
+  struct pathinfo *pinfo = NULL;
+
+  while((pinfo = dequeue(ws)) != NULL){
+    if(pinfo->node == NULL){
+      /* removed by an earlier callback */
+      continue;
+    }
+#ifdef WP_INOTIFY
+    if(pinfo->node == created && is_empty(ws, pinfo)){
+      pinfo->fresh = 1;
+      continue;
+    }
+    pinfo->fresh = 0;
+#else
+    (void) created;
+#endif
+    /* A watched path was modified. */
+    notify(ws, pinfo, fflags);
+  }
+}
+
+/*
+ * notify
+ *
+ * Executes the callback for `pinfo' with the given fflags, or, when
+ * debouncing, adds the fflags to those pending for `pinfo'. The pending
+ * fflags are reported together once no event has been seen for the
+ * quiet window, or once the maximum delay has passed since the first
+ * of them, whichever comes first. See fire_due().
+ *
+ * The paths with pending events are kept in a heap ordered by when
+ * they are due, so that each event costs O(log n) in the number of
+ * paths debouncing at once.
+ *
+ * The inactivity deadline of `pinfo', if any, is restarted, unless the
+ * path does not want any of the fflags, in which case nothing is done.
+ */
+static void
+notify(struct watchset *ws, struct pathinfo *pinfo, u_int fflags)
+{
+  /*@owned@*/ struct pathinfo **grown = NULL;
+  size_t count;
+  int isnew = 0;
+
+  if(fflags != 0 && (fflags &= pinfo->mask) == 0){
+    return;
+  }
+  deadline_restart(ws, pinfo);
+  if(pinfo->pollslot != -1){
+    /* so that the sweep does not report the same change again */
+    (void) poll_snap(ws, &ws->snaps[pinfo->pollslot], pinfo, NULL);
+  }
+
+  if(ws->quiet == 0){
+    /* report anything held back from before debouncing was turned off */
+    fflags |= pinfo->pending;
+    heap_remove(ws, pinfo);
+    if(pinfo->print != NULL && print_check(ws, pinfo)){
+      STAT_INC(ws->stats.suppressed);
+    } else {
+      emit(ws, pinfo->index, fflags);
+    }
+    return;
+  }
+  if(fflags == 0){
+    return;
+  }
+
+  if(pinfo->pending == 0){
+    if(ws->heapused == ws->heapmax){
+      count = ws->heapmax == 0 ? 16 : ws->heapmax * 2;
+      grown = reallocarray(ws->heap, count, sizeof(struct pathinfo *));
+      if(grown == NULL){
+        /* report the event at once rather than lose it */
+        emit(ws, pinfo->index, fflags);
+        return;
+      }
+      ws->heap = grown;
+      ws->heapmax = count;
+    }
+    pinfo->first = ws->now;
+    pinfo->origin = ws->origin != 0 ? ws->origin : now_ns();
+    ws->heapused++;
+    isnew = 1;
+  }
+  pinfo->pending |= fflags;
+
+  /* the due time never moves earlier, so the path can only sink */
+  pinfo->due = ws->now + ws->quiet;
+  if(ws->maxdelay != 0 && pinfo->first + ws->maxdelay < pinfo->due){
+    pinfo->due = pinfo->first + ws->maxdelay;
+  }
+  if(isnew){
+    /* added at the bottom, so it may need to rise */
+    heap_place(ws, pinfo, ws->heapused - 1);
+  } else {
+    heap_down(ws, pinfo->heappos);
+  }
+}
+
+/*
+ * deadline_restart
+ *
+ * Puts the inactivity deadline of `pinfo', if any, off after an event.
+ */
+static void
+deadline_restart(struct watchset *ws, struct pathinfo *pinfo)
+{
+  if(pinfo->deadline != 0){
+    timer_del(ws, &pinfo->timer);
+    pinfo->timer.expires = ws->now + pinfo->deadline;
+    timer_add(ws, &pinfo->timer);
+  }
+}
+
+/*
+ * now_ms
+ *
+ * Returns the time on the monotonic clock in ms.
+ */
+static long long
+now_ms(void)
+{
+  struct timespec ts;
+
+  if(-1 == clock_gettime(CLOCK_MONOTONIC, &ts)){
+    return 0;
+  }
+  return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * now_ns
+ *
+ * Returns the time on the monotonic clock in ns.
+ */
+static long long
+now_ns(void)
+{
+  struct timespec ts;
+
+  if(-1 == clock_gettime(CLOCK_MONOTONIC, &ts)){
+    return 0;
+  }
+  return TS_NS(ts);
+}
+
+/*
+ * set_now
+ *
+ * Records the time at which the events being handled were read. The
+ * realtime clock is only read when there is a batch callback to see it.
+ */
+static void
+set_now(struct watchset *ws)
+{
+  ws->nowns = now_ns();
+  ws->now = ws->nowns / 1000000;
+  if(ws->batch != NULL && -1 == clock_gettime(CLOCK_REALTIME, &ws->stamp)){
+    ws->stamp.tv_sec = 0;
+    ws->stamp.tv_nsec = 0;
+  }
+}
+
+/*
+ * heap_place
+ *
+ * Moves `pinfo' up the heap from `pos' to its place.
+ */
+static void
+heap_place(struct watchset *ws, struct pathinfo *pinfo, size_t pos)
+{
+  size_t parent;
+
+  while(pos > 0){
+    parent = (pos - 1) / 2;
+    if(ws->heap[parent]->due <= pinfo->due){
+      break;
+    }
+    ws->heap[pos] = ws->heap[parent];
+    ws->heap[pos]->heappos = pos;
+    pos = parent;
+  }
+  ws->heap[pos] = pinfo;
+  pinfo->heappos = pos;
+}
+
+/*
+ * heap_down
+ *
+ * Moves the path at `pos' down the heap to its place.
+ */
+static void
+heap_down(struct watchset *ws, size_t pos)
+{
+  struct pathinfo *pinfo = ws->heap[pos];
+  size_t child;
+
+  while((child = pos * 2 + 1) < ws->heapused){
+    if(child + 1 < ws->heapused &&
+       ws->heap[child + 1]->due < ws->heap[child]->due){
+      child++;
+    }
+    if(pinfo->due <= ws->heap[child]->due){
+      break;
+    }
+    ws->heap[pos] = ws->heap[child];
+    ws->heap[pos]->heappos = pos;
+    pos = child;
+  }
+  ws->heap[pos] = pinfo;
+  pinfo->heappos = pos;
+}
+
+/*
+ * heap_remove
+ *
+ * Takes `pinfo' out of the heap and discards its pending events.
+ */
+static void
+heap_remove(struct watchset *ws, struct pathinfo *pinfo)
+{
+  struct pathinfo *last = NULL;
+  size_t pos = pinfo->heappos;
+
+  if(pinfo->pending == 0){
+    return;
+  }
+  pinfo->pending = 0;
+  last = ws->heap[--ws->heapused];
+  if(last != pinfo){
+    /* fill the hole with the last path, which may need to go either way */
+    heap_place(ws, last, pos);
+    heap_down(ws, last->heappos);
+  }
+}
+
+/*
+ * fire_due
+ *
+ * Executes the callback for each path whose pending events are due,
+ * stopping early if a callback sets *cont to zero.
+ */
+static void
+fire_due(struct watchset *ws)
+{
+  struct pathinfo *pinfo = NULL;
+  u_int fflags;
+
+  set_now(ws);
+  while(ws->cont != 0 && ws->heapused > 0 && ws->heap[0]->due <= ws->now){
+    pinfo = ws->heap[0];
+    fflags = pinfo->pending;
+    heap_remove(ws, pinfo);
+    if(pinfo->print != NULL && print_check(ws, pinfo)){
+      STAT_INC(ws->stats.suppressed);
+    } else {
+      ws->origin = pinfo->origin;
+      emit(ws, pinfo->index, fflags);
+    }
+  }
+  ws->origin = 0;
+}
+
+/*
+ * print_check
+ *
+ * Takes the fingerprint of the file now at the path of `pinfo' and
+ * compares it with the one taken before. The cheap fields are compared
+ * first: the same file with the same size and modification time is
+ * taken to be unchanged without reading it, unless it was modified
+ * within a second of the fingerprint being taken, too soon for a file
+ * system with coarse timestamps to have told a later write apart. Any
+ * other file is hashed, so that one rewritten or replaced with the same
+ * bytes is still found to be unchanged.
+ *
+ * The file is read through `printbuf' rather than mapped, as a file
+ * truncated while mapped would raise SIGBUS in the watching process.
+ *
+ * Returns nonzero if the content is the same as before, or 0 if it has
+ * changed, or if the path is missing, is not a regular file or can not
+ * be read, or if there was no fingerprint to compare with.
+ */
+static int
+print_check(struct watchset *ws, struct pathinfo *pinfo)
+{
+  struct fingerprint *fp = pinfo->print;
+  struct stat finfo;
+  uint64_t hash;
+  int fd, same;
+
+  fd = node_open(ws, pinfo->node, PARENT_FD(pinfo->node),
+                 O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  if(fd == -1 || -1 == fstat(fd, &finfo) || !S_ISREG(finfo.st_mode)){
+    goto MISSING;
+  }
+  if(fp->valid && fp->dev == finfo.st_dev && fp->ino == finfo.st_ino &&
+     fp->size == finfo.st_size &&
+     fp->mtime.tv_sec == ST_MTIM(finfo).tv_sec &&
+     fp->mtime.tv_nsec == ST_MTIM(finfo).tv_nsec &&
+     fp->mtime.tv_sec + 1 < fp->taken){
+    while(-1 == close(fd) && errno == EINTR);
+    return 1;
+  }
+
+  if(print_file(ws, fd, &hash) == -1){
+    goto MISSING;
+  }
+  while(-1 == close(fd) && errno == EINTR);
+
+  same = fp->valid && fp->hash == hash;
+  fp->dev = finfo.st_dev;
+  fp->ino = finfo.st_ino;
+  fp->size = finfo.st_size;
+  fp->mtime = ST_MTIM(finfo);
+  fp->taken = time(NULL);
+  fp->hash = hash;
+  fp->valid = 1;
+  return same;
+
+MISSING:
+  if(fd != -1){
+    while(-1 == close(fd) && errno == EINTR);
+  }
+  fp->valid = 0;
+  return 0;
+}
+
+/*
+ * print_file
+ *
+ * Stores in *hash the content hash of the file open as `fd', read from
+ * where it stands through ws->printbuf.
+ *
+ * Returns 0 if successful, returns -1 and sets errno otherwise.
+ */
+static int
+print_file(struct watchset *ws, int fd, uint64_t *hash)
+{
+  uint64_t acc[4];
+  uint64_t total = 0;
+  size_t filled, used;
+  ssize_t got = 1;
+
+  print_start(acc);
+  do {
+    /* fill the buffer, so that only the last block is partial */
+    for(filled = 0; filled < PRINT_BUFF_SIZE && got != 0;
+        filled += (size_t) got){
+      while((got = read(fd, ws->printbuf + filled,
+                        PRINT_BUFF_SIZE - filled)) == -1 && errno == EINTR);
+      if(got == -1){
+        report_error("Unable to read file to fingerprint");
+        return -1;
+      }
+    }
+    used = print_stripes(acc, ws->printbuf, filled);
+    total += filled;
+  } while(got != 0);
+  *hash = print_finish(acc, total, ws->printbuf + used, filled - used);
+  return 0;
+}
+
+/*
+ * print_round
+ *
+ * Mixes `word' into one of the accumulators of the content hash.
+ */
+static uint64_t
+print_round(uint64_t acc, uint64_t word)
+{
+  acc += word * HASH_P2;
+  acc = HASH_ROTL(acc, 31);
+  return acc * HASH_P1;
+}
+
+/*
+ * print_start
+ *
+ * Sets up the accumulators of the content hash, see HASH_P1.
+ */
+static void
+print_start(uint64_t acc[4])
+{
+  acc[0] = HASH_P1 + HASH_P2;
+  acc[1] = HASH_P2;
+  acc[2] = 0;
+  acc[3] = 0 - HASH_P1;
+}
+
+/*
+ * print_stripes
+ *
+ * Mixes the whole 32 byte stripes of the `len' bytes at `p' into the
+ * accumulators. Words are copied out with memcpy(), which compiles to a
+ * plain load, so `p' need not be aligned.
+ *
+ * Returns the number of bytes consumed.
+ */
+static size_t
+print_stripes(uint64_t acc[4], const unsigned char *p, size_t len)
+{
+  uint64_t a0 = acc[0], a1 = acc[1], a2 = acc[2], a3 = acc[3];
+  uint64_t w[4];
+  size_t off;
+
+  for(off = 0; off + 32 <= len; off += 32){
+    memcpy(w, p + off, sizeof(w));
+    a0 = print_round(a0, w[0]);
+    a1 = print_round(a1, w[1]);
+    a2 = print_round(a2, w[2]);
+    a3 = print_round(a3, w[3]);
+  }
+  acc[0] = a0;
+  acc[1] = a1;
+  acc[2] = a2;
+  acc[3] = a3;
+  return off;
+}
+
+/*
+ * print_finish
+ *
+ * Returns the content hash of `total' bytes, given the accumulators
+ * after their whole stripes and the `len' bytes at `p' left over.
+ */
+static uint64_t
+print_finish(const uint64_t acc[4], uint64_t total, const unsigned char *p,
+             size_t len)
+{
+  const unsigned char *end = p + len;
+  uint64_t h, word;
+  uint32_t half;
+  int i;
+
+  if(total >= 32){
+    h = HASH_ROTL(acc[0], 1) + HASH_ROTL(acc[1], 7) +
+      HASH_ROTL(acc[2], 12) + HASH_ROTL(acc[3], 18);
+    for(i = 0; i < 4; i++){
+      h = (h ^ print_round(0, acc[i])) * HASH_P1 + HASH_P4;
+    }
+  } else {
+    h = HASH_P5;
+  }
+  h += total;
+
+  for(; p + 8 <= end; p += 8){
+    memcpy(&word, p, 8);
+    h ^= print_round(0, word);
+    h = HASH_ROTL(h, 27) * HASH_P1 + HASH_P4;
+  }
+  if(p + 4 <= end){
+    memcpy(&half, p, 4);
+    h ^= (uint64_t) half * HASH_P1;
+    h = HASH_ROTL(h, 23) * HASH_P2 + HASH_P3;
+    p += 4;
+  }
+  for(; p < end; p++){
+    h ^= (uint64_t) *p * HASH_P5;
+    h = HASH_ROTL(h, 11) * HASH_P1;
+  }
+
+  h ^= h >> 33;
+  h *= HASH_P2;
+  h ^= h >> 29;
+  h *= HASH_P3;
+  h ^= h >> 32;
+  return h;
+}
+
+/*
+ * poll_silent
+ *
+ * Returns nonzero if the path of `pinfo' lies on a file system whose
+ * changes the kernel does not report, such as NFS, SMB or a FUSE mount,
+ * where a write made by another machine or by the file system daemon
+ * raises no event. A missing path is judged by the nearest directory
+ * above it which exists.
+ */
+static int
+poll_silent(struct watchset *ws, struct pathinfo *pinfo)
+{
+  struct pathnode *node = NULL;
+  struct statfs sfs;
+  char *path = NULL;
+#ifdef __linux__
+  static const unsigned long silent[] = {
+    0x6969,     /* NFS */
+    0x517B,     /* SMB */
+    0xFF534D42, /* CIFS */
+    0xFE534D42, /* SMB2 */
+    0x65735546, /* FUSE */
+    0x01021997, /* 9P */
+    0x00C36400, /* Ceph */
+    0x5346414F, /* AFS */
+    0x73757245, /* Coda */
+    0x0BD00BD0  /* Lustre */
+  };
+  size_t i;
+#else
+  static const char *silent[] = {"nfs", "smbfs", "cifs", "fuse", "afpfs",
+                                 "webdav", NULL};
+  const char **name = NULL;
+#endif
+
+  for(node = pinfo->node; node != NULL; node = node->parent){
+    path = node_path(ws, node);
+    if(path != NULL && statfs(path, &sfs) == 0){
+      break;
+    }
+  }
+  if(node == NULL){
+    return 0;
+  }
+#ifdef __linux__
+  for(i = 0; i < sizeof(silent) / sizeof(silent[0]); i++){
+    if((unsigned long) sfs.f_type == silent[i]){
+      return 1;
+    }
+  }
+#else
+  for(name = silent; *name != NULL; name++){
+    if(strncmp(sfs.f_fstypename, *name, strlen(*name)) == 0){
+      return 1;
+    }
+  }
+#endif
+  return 0;
+}
+
+/*
+ * poll_add
+ *
+ * Starts polling the path of `pinfo', taking its first snapshot.
+ *
+ * Returns 0 if successful, or -1 if there was no memory for it.
+ */
+static int
+poll_add(struct watchset *ws, struct pathinfo *pinfo)
+{
+  /*@owned@*/ struct pollsnap *grown = NULL;
+  int count;
+
+  if(pinfo->pollslot != -1){
+    return 0;
+  }
+  if(ws->numpolled == ws->maxpolled){
+    if(ws->maxpolled > INT_MAX / 2){
+      errno = ENOMEM;
+      return -1;
+    }
+    count = ws->maxpolled == 0 ? 64 : ws->maxpolled * 2;
+    grown = reallocarray(ws->snaps, (size_t) count, sizeof(struct pollsnap));
+    if(grown == NULL){
+      return -1;
+    }
+    ws->snaps = grown;
+    ws->maxpolled = count;
+  }
+  pinfo->pollslot = ws->numpolled++;
+  ws->snaps[pinfo->pollslot].index = pinfo->index;
+  ws->snaps[pinfo->pollslot].present = 0;
+  return poll_snap(ws, &ws->snaps[pinfo->pollslot], pinfo, NULL) == -1 &&
+    errno == ENAMETOOLONG ? -1 : 0;
+}
+
+/*
+ * poll_drop
+ *
+ * Stops polling the path of `pinfo', if it is polled. The last snapshot
+ * fills the hole, so the array stays dense; should the sweep already
+ * have passed the hole, the path moved into it waits for the next one.
+ */
+static void
+poll_drop(struct watchset *ws, struct pathinfo *pinfo)
+{
+  int slot = pinfo->pollslot;
+
+  if(slot == -1){
+    return;
+  }
+  pinfo->pollslot = -1;
+  if(slot != --ws->numpolled){
+    ws->snaps[slot] = ws->snaps[ws->numpolled];
+    PINFO(ws, ws->snaps[slot].index)->pollslot = slot;
+  }
+}
+
+/*
+ * poll_snap
+ *
+ * Records in `snap' what the path of `pinfo' names now. A lookup
+ * already made is taken from `known' if it is not NULL.
+ *
+ * Returns 1 if the path names a different file than before, or one
+ * where there was none, 0 if it names the same file or none, and -1 if
+ * the path could not be looked up, with errno set.
+ */
+static int
+poll_snap(struct watchset *ws, struct pollsnap *snap, struct pathinfo *pinfo,
+          const struct lookup *known)
+{
+  struct stat finfo;
+  int moved;
+
+  if(known != NULL && known->err != 0){
+    errno = known->err;
+    snap->present = 0;
+    return PASSING(errno) ? 0 : -1;
+  } else if(known != NULL){
+    finfo = known->finfo;
+  } else if(-1 == node_stat(ws, pinfo->node, PARENT_FD(pinfo->node),
+                            &finfo)){
+    snap->present = 0;
+    return PASSING(errno) ? 0 : -1;
+  }
+  moved = !snap->present || snap->ino != finfo.st_ino;
+  snap->ino = finfo.st_ino;
+  snap->size = finfo.st_size;
+  snap->mtime = TS_NS(ST_MTIM(finfo));
+  snap->ctime = TS_NS(ST_CTIM(finfo));
+  snap->present = 1;
+  return moved;
+}
+
+/*
+ * poll_one
+ *
+ * Polls the path whose snapshot is at `slot' in ws->snaps, reporting a
+ * change of its size or modification time as NOTE_WRITE, and a change
+ * of its change time alone as NOTE_ATTRIB, if the mask of the path
+ * names it. A path which names another
+ * file than before is looked up again in the trie as well, so that the
+ * kernel watches follow it where they still can. `known' is as for
+ * poll_snap().
+ *
+ * Returns 0, or -1 if watching can not continue.
+ */
+static int
+poll_one(struct watchset *ws, int slot, const struct lookup *known)
+{
+  struct pollsnap *snap = &ws->snaps[slot];
+  struct pollsnap was = *snap;
+  struct pathinfo *pinfo = PINFO(ws, snap->index);
+  u_int fflags = 0;
+  u_int want = ws->typemask;
+  int moved;
+
+  STAT_INC(ws->stats.polls);
+  moved = poll_snap(ws, snap, pinfo, known);
+  if(moved == -1){
+    return errno == ENAMETOOLONG ? -1 : 0;
+  }
+  if(!snap->present){
+    /* removal is not reported, as with the kernel watches */
+    return 0;
+  }
+  if(moved || snap->size != was.size || snap->mtime != was.mtime){
+    fflags = NOTE_WRITE;
+  } else if(snap->ctime != was.ctime){
+    fflags = NOTE_ATTRIB;
+  }
+  if(moved){
+    if(node_check(ws, pinfo->node, 0) == -1){
+      return -1;
+    }
+    /* only the path polled is reported, below */
+    while(dequeue(ws) != NULL);
+  }
+  if(pinfo->mask != ~0u){
+    /* only a path whose own mask names it is told of NOTE_ATTRIB */
+    want |= pinfo->mask & NOTE_ATTRIB;
+  }
+  if((fflags & want) != 0){
+    notify(ws, pinfo, fflags & want);
+  }
+  return 0;
+}
+
+#ifdef WP_URING
+/*
+ * poll_ring
+ *
+ * Polls the paths from ws->pollnext on, up to RING_ENTRIES of them and
+ * none due at or after `target', as poll_one() does, looking them all
+ * up through the io_uring first. A callback may remove paths, which
+ * moves other snapshots into their slots, so a lookup is only used
+ * while its slot still holds the path it was made for. The batch is
+ * allocated once and kept in ws->pollbatch for every slice after.
+ *
+ * Returns 0, or -1 if watching can not continue.
+ */
+static int
+poll_ring(struct watchset *ws, long long target)
+{
+  struct prestat *ps = NULL;
+  struct pollsnap *snap = NULL;
+  int count, i, slot, ret = 0;
+
+  if(ws->pollbatch == NULL){
+    ws->pollbatch = reallocarray(NULL, RING_ENTRIES, sizeof(struct prestat));
+    if(ws->pollbatch == NULL){
+      /* looked up one at a time instead */
+      return poll_one(ws, ws->pollnext++, NULL);
+    }
+  }
+  ps = ws->pollbatch;
+  for(count = 0; count < RING_ENTRIES && ws->pollnext + count < target &&
+        ws->pollnext + count < ws->numpolled; count++){
+    snap = &ws->snaps[ws->pollnext + count];
+    ps[count].node = PINFO(ws, snap->index)->node;
+    ps[count].path = PNAME(ws, snap->index)->path;
+  }
+  if(ring_stat(ws, AT_FDCWD, ps, count) == -1){
+    /* the io_uring is closed, so each is looked up by node_stat() */
+    for(i = 0; i < count; i++){
+      ps[i].look.err = -1;
+    }
+  }
+  for(i = 0; ret == 0 && ws->cont != 0 && i < count; i++){
+    slot = ws->pollnext++;
+    if(slot >= ws->numpolled){
+      break;
+    }
+    snap = &ws->snaps[slot];
+    ret = poll_one(ws, slot, ps[i].look.err == -1 ||
+                   PINFO(ws, snap->index)->node != ps[i].node ||
+                   PNAME(ws, snap->index)->path != ps[i].path ?
+                   NULL : &ps[i].look);
+  }
+  return ret;
+}
+#endif
+
+/*
+ * poll_run
+ *
+ * Polls the paths which have fallen due since the last slice of the
+ * sweep, that is as many of them as the part of the poll interval that
+ * has passed, and starts the next sweep once the interval is over. A
+ * watch set left alone for longer than the interval polls every path
+ * once, rather than making up the sweeps it missed. Stops early if a
+ * callback sets *cont to zero. A slice of RING_MIN or more paths is
+ * looked up in batches, see poll_ring().
+ *
+ * Returns 0, or -1 if watching can not continue.
+ */
+static int
+poll_run(struct watchset *ws)
+{
+  long long elapsed;
+  long long target;
+
+  if(ws->numpolled == 0 || ws->now < ws->polldue){
+    return 0;
+  }
+  elapsed = ws->now - ws->pollstart;
+  target = elapsed >= ws->pollms ? ws->numpolled :
+    ws->numpolled * elapsed / ws->pollms;
+  while(ws->cont != 0 && ws->pollnext < ws->numpolled &&
+        ws->pollnext < target){
+#ifdef WP_URING
+    if(target - ws->pollnext >= RING_MIN &&
+       ws->numpolled - ws->pollnext >= RING_MIN && ring_open(ws) == 0 &&
+       !ws->noring){
+      if(poll_ring(ws, target) == -1){
+        return -1;
+      }
+      continue;
+    }
+#endif
+    if(poll_one(ws, ws->pollnext++, NULL) == -1){
+      return -1;
+    }
+  }
+  if(ws->pollnext >= ws->numpolled && elapsed >= ws->pollms){
+    ws->pollnext = 0;
+    ws->pollstart += ws->pollms;
+    if(ws->pollstart + ws->pollms <= ws->now){
+      ws->pollstart = ws->now;
+    }
+  }
+  ws->polldue = ws->now + (ws->pollms < POLL_SLICE ? ws->pollms : POLL_SLICE);
+  if(ws->polldue > ws->pollstart + ws->pollms){
+    ws->polldue = ws->pollstart + ws->pollms;
+  }
+  return 0;
+}
+
+/*
+ * state_key
+ *
+ * Returns the key of the record of the path which is `len' bytes long
+ * at `path', its content hash, which is never 0.
+ */
+static uint64_t
+state_key(const char *path, size_t len)
+{
+  const unsigned char *p = (const unsigned char *) path;
+  uint64_t acc[4];
+  uint64_t key;
+  size_t used;
+
+  print_start(acc);
+  used = print_stripes(acc, p, len);
+  key = print_finish(acc, len, p + used, len - used);
+  /* 0 marks a free record */
+  return key == 0 ? 1 : key;
+}
+
+/*
+ * state_open
+ *
+ * Opens the state file `file', creating it if need be, locks it, so
+ * that two watch sets do not write to the same records, and maps it.
+ * A file which holds anything other than a state file this can read is
+ * refused and left as it is.
+ *
+ * Returns 0 if successful, returns -1 and sets errno otherwise.
+ */
+static int
+state_open(struct watchset *ws, const char *file)
+{
+  struct statehead *head = NULL;
+  struct stat finfo;
+  struct flock lock;
+  int fd, saved_errno;
+
+  ws->statepath = strdup(file);
+  if(ws->statepath == NULL){
+    return -1;
+  }
+  while((fd = open(file, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1 &&
+        errno == EINTR);
+  if(fd == -1){
+    goto ERR;
+  }
+  ws->statefd = fd;
+  STAT_INC(ws->stats.descriptors);
+  memset(&lock, 0, sizeof(lock));
+  lock.l_type = F_WRLCK;
+  lock.l_whence = SEEK_SET;
+  if(-1 == fcntl(fd, F_SETLK, &lock)){
+    /* another process keeps its state there */
+    errno = EBUSY;
+    goto ERR;
+  }
+  if(-1 == fstat(fd, &finfo)){
+    goto ERR;
+  }
+  if(finfo.st_size == 0){
+    if(-1 == ftruncate(fd, (off_t) STATE_SIZE(STATE_MIN))){
+      goto ERR;
+    }
+    ws->statesize = STATE_SIZE(STATE_MIN);
+  } else if((size_t) finfo.st_size < sizeof(struct statehead) ||
+            (uintmax_t) finfo.st_size > SIZE_MAX){
+    errno = EINVAL;
+    goto ERR;
+  } else {
+    ws->statesize = (size_t) finfo.st_size;
+  }
+  head = mmap(NULL, ws->statesize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(head == MAP_FAILED){
+    goto ERR;
+  }
+  ws->statehead = head;
+  ws->staterecs = (struct staterec *) (head + 1);
+
+  if(finfo.st_size == 0){
+    /* the records are zeroed, and so free, by ftruncate() */
+    memcpy(head->magic, STATE_MAGIC, sizeof(head->magic));
+    head->order = STATE_ORDER;
+    head->version = STATE_VERSION;
+    head->recsize = (uint32_t) sizeof(struct staterec);
+    head->capacity = STATE_MIN;
+    head->used = 0;
+  } else if(memcmp(head->magic, STATE_MAGIC, sizeof(head->magic)) != 0 ||
+            head->order != STATE_ORDER ||
+            (head->version != STATE_VERSION && head->version != 1) ||
+            head->recsize != (head->version == 1 ?
+                              sizeof(struct staterec1) :
+                              sizeof(struct staterec)) ||
+            head->capacity < STATE_MIN || head->capacity > LONG_MAX ||
+            (head->capacity & (head->capacity - 1)) != 0 ||
+            head->capacity > (SIZE_MAX - sizeof(struct statehead)) /
+            sizeof(struct staterec) ||
+            (head->version == 1 ? STATE_SIZE1(head->capacity) :
+             STATE_SIZE(head->capacity)) != ws->statesize ||
+            head->used >= head->capacity){
+    errno = EINVAL;
+    goto ERR;
+  } else if(head->version == 1 &&
+            state_rewrite(ws, head->capacity) == -1){
+    goto ERR;
+  }
+  return 0;
+
+ERR:
+  saved_errno = errno;
+  state_close(ws);
+  errno = saved_errno;
+  return -1;
+}
+
+/*
+ * state_close
+ *
+ * Writes out, unmaps and closes the state file, if any, forgetting the
+ * paths found to have changed which are still due a callback.
+ */
+static void
+state_close(struct watchset *ws)
+{
+  int i;
+
+  for(i = 0; i < ws->numpaths; i++){
+    PINFO(ws, i)->stateslot = -1;
+    PINFO(ws, i)->missslot = -1;
+  }
+  if(ws->statehead != NULL){
+    /* so that the records outlast the machine, not only the process */
+    (void) msync(ws->statehead, ws->statesize, MS_SYNC);
+    (void) munmap(ws->statehead, ws->statesize);
+  }
+  if(ws->statefd != -1){
+    while(-1 == close(ws->statefd) && errno == EINTR);
+    STAT_DEC(ws->stats.descriptors);
+  }
+  free(ws->statepath);
+  free(ws->missed);
+  ws->statefd = -1;
+  ws->statepath = NULL;
+  ws->statehead = NULL;
+  ws->staterecs = NULL;
+  ws->statesize = 0;
+  ws->missed = NULL;
+  ws->nummissed = 0;
+  ws->maxmissed = 0;
+}
+
+/*
+ * state_find
+ *
+ * Returns the position of the record keyed `key', or of the free
+ * record where it belongs if there is none, or -1 if neither can be
+ * found, as in a damaged file.
+ */
+static long
+state_find(struct watchset *ws, uint64_t key)
+{
+  uint64_t mask = ws->statehead->capacity - 1;
+  uint64_t i, probes;
+
+  for(i = key & mask, probes = 0; probes <= mask;
+      i = (i + 1) & mask, probes++){
+    if(ws->staterecs[i].key == 0 || ws->staterecs[i].key == key){
+      return (long) i;
+    }
+  }
+  return -1;
+}
+
+/*
+ * state_rewrite
+ *
+ * Copies the records of the state file into a new file of `cap'
+ * records at the current version, which is renamed over it once
+ * written out, so that the file is whole whenever the process or the
+ * machine stops. This doubles the capacity of the file, and brings one
+ * of version 1 up to date.
+ *
+ * Returns 0 if successful, returns -1 and sets errno otherwise, leaving
+ * the state file as it was.
+ */
+static int
+state_rewrite(struct watchset *ws, uint64_t cap)
+{
+  struct statehead *old = ws->statehead;
+  struct statehead *head = NULL;
+  struct staterec *recs = NULL;
+  struct staterec1 *old1 = (struct staterec1 *) (old + 1);
+  struct staterec rec;
+  struct pathinfo *pinfo = NULL;
+  struct pathname *pname = NULL;
+  struct flock lock;
+  char *tmp = NULL;
+  uint64_t i, j;
+  size_t size = 0, len;
+  int fd = -1, k, saved_errno;
+
+  if(cap > LONG_MAX ||
+     cap > (SIZE_MAX - sizeof(struct statehead)) / sizeof(struct staterec)){
+    errno = ENOMEM;
+    return -1;
+  }
+  size = STATE_SIZE(cap);
+  len = strlen(ws->statepath);
+  tmp = malloc(len + sizeof(".new"));
+  if(tmp == NULL){
+    return -1;
+  }
+  memcpy(tmp, ws->statepath, len);
+  memcpy(tmp + len, ".new", sizeof(".new"));
+
+  while((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1 &&
+        errno == EINTR);
+  if(fd == -1){
+    goto ERR;
+  }
+  memset(&lock, 0, sizeof(lock));
+  lock.l_type = F_WRLCK;
+  lock.l_whence = SEEK_SET;
+  if(-1 == fcntl(fd, F_SETLK, &lock) || -1 == ftruncate(fd, (off_t) size)){
+    goto ERR;
+  }
+  head = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(head == MAP_FAILED){
+    head = NULL;
+    goto ERR;
+  }
+  recs = (struct staterec *) (head + 1);
+  *head = *old;
+  head->version = STATE_VERSION;
+  head->recsize = (uint32_t) sizeof(struct staterec);
+  head->capacity = cap;
+  for(i = 0; i < old->capacity; i++){
+    if(old->version == 1){
+      memset(&rec, 0, sizeof(rec));
+      rec.key = old1[i].key;
+      rec.dev = old1[i].dev;
+      rec.ino = old1[i].ino;
+      rec.size = old1[i].size;
+      rec.mtime = old1[i].mtime;
+      rec.taken = old1[i].taken;
+      rec.hash = old1[i].hash;
+      rec.flags = old1[i].flags;
+    } else {
+      rec = ws->staterecs[i];
+    }
+    if(rec.key == 0){
+      continue;
+    }
+    for(j = rec.key & (cap - 1); recs[j].key != 0; j = (j + 1) & (cap - 1));
+    recs[j] = rec;
+  }
+  if(-1 == msync(head, size, MS_SYNC) || -1 == rename(tmp, ws->statepath)){
+    goto ERR;
+  }
+  free(tmp);
+
+  (void) munmap(old, ws->statesize);
+  while(-1 == close(ws->statefd) && errno == EINTR);
+  ws->statefd = fd;
+  ws->statehead = head;
+  ws->staterecs = recs;
+  ws->statesize = size;
+  for(k = 0; k < ws->numpaths; k++){
+    pinfo = PINFO(ws, k);
+    if(pinfo->stateslot != -1){
+      pname = PNAME(ws, k);
+      pinfo->stateslot = state_find(ws, state_key(pname->path, pname->len));
+    }
+  }
+  return 0;
+
+ERR:
+  saved_errno = errno;
+  if(head != NULL){
+    (void) munmap(head, size);
+  }
+  if(fd != -1){
+    (void) unlink(tmp);
+    while(-1 == close(fd) && errno == EINTR);
+  }
+  free(tmp);
+  errno = saved_errno;
+  return -1;
+}
+
+/*
+ * state_attach
+ *
+ * Finds the record of the path of `pinfo' in the state file, adding
+ * one if there is none, and compares it with the file the path names
+ * now. If the path names a file where it named none, or another file,
+ * or one whose size or modification time differs, the path is due a
+ * callback, see state_deliver(). A file whose only difference is its
+ * modification time is hashed, if the content hash was recorded, and
+ * counts as changed only if the hash differs. A path with no record has
+ * no history to compare with, and is recorded without a callback. A
+ * path which no longer names a file is not reported, as a removal is
+ * not reported while watching either. In tail mode, a path whose record
+ * leaves bytes of the file there now yet to be passed is due a callback
+ * too, see tail_start().
+ *
+ * Returns 0 if successful, returns -1 and sets errno otherwise.
+ */
+static int
+state_attach(struct watchset *ws, struct pathinfo *pinfo)
+{
+  struct pathname *pname = PNAME(ws, pinfo->index);
+  struct fingerprint *fp = pinfo->print;
+  struct staterec *r = NULL;
+  struct stat finfo;
+  uint64_t key, hash;
+  const uint64_t *known = NULL;
+  long slot;
+  int fd, changed, pending;
+
+  if(pinfo->node == NULL || pinfo->tree){
+    return 0;
+  }
+  key = state_key(pname->path, pname->len);
+  slot = state_find(ws, key);
+  if(slot != -1 && ws->staterecs[slot].key == key){
+    r = &ws->staterecs[slot];
+  } else {
+    /* kept no more than three quarters full, so that probes stay short */
+    if((ws->statehead->used + 1) * 4 > ws->statehead->capacity * 3 &&
+       state_rewrite(ws, ws->statehead->capacity * 2) == -1){
+      return -1;
+    }
+    slot = state_find(ws, key);
+    if(slot == -1){
+      errno = EINVAL;
+      return -1;
+    }
+    ws->staterecs[slot].key = key;
+    ws->staterecs[slot].flags = 0;
+    ws->statehead->used++;
+  }
+  pinfo->stateslot = slot;
+  pending = ws->tailing ? tail_start(ws, pinfo) : 0;
+  if(pending == -1){
+    errno = ENOMEM;
+    return -1;
+  }
+
+  if(-1 == node_stat(ws, pinfo->node, PARENT_FD(pinfo->node), &finfo)){
+    state_record(ws, pinfo, NULL, NULL);
+    return 0;
+  }
+  if(r == NULL){
+    state_record(ws, pinfo, &finfo, NULL);
+    return 0;
+  }
+
+  if((r->flags & STATE_PRESENT) == 0 || r->dev != (uint64_t) finfo.st_dev ||
+     r->ino != (uint64_t) finfo.st_ino || r->size != finfo.st_size){
+    changed = 1;
+  } else if(r->mtime == TS_NS(ST_MTIM(finfo)) &&
+            ST_MTIM(finfo).tv_sec + 1 < r->taken){
+    /* written no later than the second before it was recorded */
+    changed = 0;
+  } else if((r->flags & STATE_HASHED) == 0 || !S_ISREG(finfo.st_mode)){
+    changed = 1;
+  } else if(fp != NULL && fp->valid && fp->dev == finfo.st_dev &&
+            fp->ino == finfo.st_ino && fp->size == finfo.st_size &&
+            fp->mtime.tv_sec == ST_MTIM(finfo).tv_sec &&
+            fp->mtime.tv_nsec == ST_MTIM(finfo).tv_nsec){
+    /* hashed a moment ago by watchpaths_fingerprint() */
+    changed = fp->hash != r->hash;
+  } else {
+    changed = 1;
+    if(ws->printbuf == NULL){
+      ws->printbuf = malloc(PRINT_BUFF_SIZE);
+    }
+    fd = node_open(ws, pinfo->node, PARENT_FD(pinfo->node),
+                   O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if(ws->printbuf != NULL && fd != -1 && print_file(ws, fd, &hash) == 0){
+      changed = hash != r->hash;
+      known = &hash;
+    }
+    if(fd != -1){
+      while(-1 == close(fd) && errno == EINTR);
+    }
+  }
+  state_record(ws, pinfo, &finfo, known);
+  return changed || pending ? state_miss(ws, pinfo->index) : 0;
+}
+
+/*
+ * state_miss
+ *
+ * Queues the path at `index' for a callback on the next dispatch, see
+ * state_deliver(), unless it is queued already.
+ *
+ * Returns 0 if successful, returns -1 and sets errno otherwise.
+ */
+static int
+state_miss(struct watchset *ws, int index)
+{
+  /*@owned@*/ int *grown = NULL;
+  struct pathinfo *pinfo = PINFO(ws, index);
+  int count;
+
+  if(pinfo->missslot != -1){
+    return 0;
+  }
+  if(ws->nummissed == ws->maxmissed){
+    if(ws->maxmissed > INT_MAX / 2){
+      errno = ENOMEM;
+      return -1;
+    }
+    count = ws->maxmissed == 0 ? 64 : ws->maxmissed * 2;
+    grown = reallocarray(ws->missed, (size_t) count, sizeof(int));
+    if(grown == NULL){
+      return -1;
+    }
+    ws->missed = grown;
+    ws->maxmissed = count;
+  }
+  pinfo->missslot = ws->nummissed;
+  ws->missed[ws->nummissed++] = index;
+  return 0;
+}
+
+/*
+ * state_record
+ *
+ * Stores in the record of `pinfo' that its path names the file
+ * described by `finfo', or none if `finfo' is NULL. The content hash is
+ * taken from `hash' if it is not NULL, or else from the fingerprint of
+ * the path, if it describes the same file. The record is written to the
+ * mapping alone, which the kernel writes back in its own time; should
+ * the process die, the record is still there for the next one.
+ */
+static void
+state_record(struct watchset *ws, struct pathinfo *pinfo,
+             const struct stat *finfo, const uint64_t *hash)
+{
+  struct staterec *r = &ws->staterecs[pinfo->stateslot];
+  struct fingerprint *fp = pinfo->print;
+
+  /* the tail fields are kept by tail_record() alone */
+  if(finfo == NULL){
+    r->flags &= STATE_TAILED;
+    return;
+  }
+  r->dev = (uint64_t) finfo->st_dev;
+  r->ino = (uint64_t) finfo->st_ino;
+  r->size = (int64_t) finfo->st_size;
+  r->mtime = (int64_t) TS_NS(ST_MTIM(*finfo));
+  r->taken = (int64_t) time(NULL);
+  r->flags = STATE_PRESENT | (r->flags & STATE_TAILED);
+  if(hash == NULL && fp != NULL && fp->valid && fp->dev == finfo->st_dev &&
+     fp->ino == finfo->st_ino && fp->size == finfo->st_size &&
+     fp->mtime.tv_sec == ST_MTIM(*finfo).tv_sec &&
+     fp->mtime.tv_nsec == ST_MTIM(*finfo).tv_nsec){
+    /* the size and time are trusted no further than the content read */
+    hash = &fp->hash;
+    r->taken = (int64_t) fp->taken;
+  }
+  if(hash != NULL){
+    r->hash = *hash;
+    r->flags |= STATE_HASHED;
+  }
+}
+
+/*
+ * state_deliver
+ *
+ * Executes the callback, with NOTE_WRITE, for each path found by
+ * state_attach() to have changed while nothing watched it, unless a
+ * callback sets *cont to zero first, in which case the rest wait for
+ * the next dispatch. The paths removed since are -1, see path_remove().
+ */
+static void
+state_deliver(struct watchset *ws)
+{
+  struct pathinfo *pinfo = NULL;
+  int i, j;
+
+  if(ws->nummissed == 0){
+    return;
+  }
+  set_now(ws);
+  /* a callback may add paths, and so move `missed' */
+  for(i = 0; i < ws->nummissed && ws->cont != 0; i++){
+    if(ws->missed[i] == -1){
+      continue;
+    }
+    pinfo = PINFO(ws, ws->missed[i]);
+    pinfo->missslot = -1;
+    if((pinfo->mask & NOTE_WRITE) != 0){
+      emit(ws, pinfo->index, NOTE_WRITE);
+    }
+  }
+  ws->nummissed -= i;
+  memmove(ws->missed, ws->missed + i, (size_t) ws->nummissed * sizeof(int));
+  for(j = 0; j < ws->nummissed; j++){
+    if(ws->missed[j] != -1){
+      PINFO(ws, ws->missed[j])->missslot = j;
+    }
+  }
+}
+
+/*
+ * hist_add
+ *
+ * Counts the latency `ns' in the histogram `h', see HIST_BITS.
+ */
+static void
+hist_add(struct wphist *h, long long ns)
+{
+  unsigned long long v = ns < 0 ? 0 : (unsigned long long) ns;
+  int top;
+  size_t i;
+
+  if(v < HIST_SUB){
+    i = (size_t) v;
+  } else {
+    top = 63 - __builtin_clzll(v);
+    i = top >= HIST_TOP ? HIST_BUCKETS - 1 :
+      (size_t) (top - HIST_BITS + 1) * HIST_SUB +
+      (size_t) ((v >> (top - HIST_BITS)) & (HIST_SUB - 1));
+  }
+  (void) __atomic_fetch_add(&h->counts[i], 1UL, __ATOMIC_RELAXED);
+}
+
+/*
+ * hist_top
+ *
+ * Returns the largest value which falls in bucket `i' of a histogram.
+ */
+static long long
+hist_top(size_t i)
+{
+  size_t mag;
+
+  if(i < HIST_SUB){
+    return (long long) i;
+  }
+  mag = i / HIST_SUB + HIST_BITS - 1;
+  return (long long) (((HIST_SUB + i % HIST_SUB + 1) << (mag - HIST_BITS)) -
+                      1);
+}
+
+/*
+ * trace_add
+ *
+ * Adds a record of kind `kind' to the trace of `ws', if any. A position
+ * in the ring is claimed with one atomic addition, so any number of
+ * threads may add records at once, and the record is filled in as
+ * described for struct watchpaths_trace.
+ */
+static void
+trace_add(struct watchset *ws, int kind, int index, u_int fflags, int value,
+          long long origin, long long time)
+{
+  struct watchpaths_tracehead *head = ws->trace;
+  struct watchpaths_trace *r = NULL;
+  uint64_t seq;
+
+  if(head == NULL){
+    return;
+  }
+  seq = __atomic_fetch_add(&head->head, 1, __ATOMIC_RELAXED);
+  r = &TRACE_RECS(head)[seq & (head->capacity - 1)];
+  __atomic_store_n(&r->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  r->time = time;
+  r->origin = origin;
+  r->index = index;
+  r->fflags = fflags;
+  r->kind = kind;
+  r->value = value;
+  __atomic_store_n(&r->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * trace_close
+ *
+ * Stops tracing, leaving the trace file in place.
+ */
+static void
+trace_close(struct watchset *ws)
+{
+  if(ws->trace != NULL){
+    (void) munmap(ws->trace, ws->tracesize);
+  }
+  ws->trace = NULL;
+  ws->tracesize = 0;
+}
+
+/*
+ * timer_add
+ *
+ * Arms `t' to expire at t->expires. The level of the wheel is chosen by
+ * the highest group of WHEEL_BITS bits in which the expiry differs from
+ * ws->wheelnow, and the slot by the expiry's bits in that group, so a
+ * timer reaches level 0 exactly when the wheel reaches its expiry.
+ */
+static void
+timer_add(struct watchset *ws, struct wptimer *t)
+{
+  struct wptimer **head = NULL;
+  long long diff;
+  int level = 0;
+  int slot;
+
+  t->where = -1;
+  if(t->expires <= ws->wheelnow){
+    head = &ws->wheeldue;
+  } else {
+    diff = t->expires ^ ws->wheelnow;
+    while(level < WHEEL_LEVELS && (diff >> (WHEEL_BITS * (level + 1))) != 0){
+      level++;
+    }
+    if(level == WHEEL_LEVELS){
+      head = &ws->wheelfar;
+    } else {
+      slot = (int) ((t->expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1));
+      head = &ws->wheel[level][slot];
+      ws->wheelbits[level] |= 1ULL << slot;
+      t->where = level * WHEEL_SLOTS + slot;
+    }
+  }
+
+  t->next = *head;
+  if(t->next != NULL){
+    t->next->pprev = &t->next;
+  }
+  t->pprev = head;
+  *head = t;
+}
+
+/*
+ * timer_del
+ *
+ * Disarms `t', if it is armed.
+ */
+static void
+timer_del(struct watchset *ws, struct wptimer *t)
+{
+  int level, slot;
+
+  if(t->pprev == NULL){
+    return;
+  }
+  *t->pprev = t->next;
+  if(t->next != NULL){
+    t->next->pprev = t->pprev;
+  }
+  if(t->where != -1){
+    level = t->where / WHEEL_SLOTS;
+    slot = t->where % WHEEL_SLOTS;
+    if(ws->wheel[level][slot] == NULL){
+      ws->wheelbits[level] &= ~(1ULL << slot);
+    }
+  }
+  t->next = NULL;
+  t->pprev = NULL;
+}
+
+/*
+ * lowest_bit
+ *
+ * Returns the position of the lowest bit set in `bits', which must not
+ * be 0.
+ */
+static int
+lowest_bit(unsigned long long bits)
+{
+  int pos = 0;
+  int width;
+
+  for(width = 32; width > 0; width /= 2){
+    if((bits & ((1ULL << width) - 1)) == 0){
+      bits >>= width;
+      pos += width;
+    }
+  }
+  return pos;
+}
+
+/*
+ * wheel_next
+ *
+ * Returns the time in ms at which the wheel next needs to be run, or -1
+ * if no timer is armed. This may be before any timer expires, when
+ * timers are due to move down a level.
+ *
+ * Every timer on a level lies in a slot after the one ws->wheelnow
+ * falls in, and the slots of a level come up only once the levels
+ * below have run their course, so the first slot in use on the lowest
+ * level in use is the next to come up.
+ */
+static long long
+wheel_next(struct watchset *ws)
+{
+  int level;
+  int shift;
+
+  if(ws->wheeldue != NULL){
+    return ws->wheelnow;
+  }
+  for(level = 0; level < WHEEL_LEVELS; level++){
+    if(ws->wheelbits[level] != 0){
+      shift = WHEEL_BITS * (level + 1);
+      return ((ws->wheelnow >> shift) << shift) |
+        ((long long) lowest_bit(ws->wheelbits[level]) << (shift - WHEEL_BITS));
+    }
+  }
+  if(ws->wheelfar != NULL){
+    shift = WHEEL_BITS * WHEEL_LEVELS;
+    return ((ws->wheelnow >> shift) + 1) << shift;
+  }
+  return -1;
+}
+
+/*
+ * wheel_run
+ *
+ * Runs the wheel up to `now', expiring the timers which are due and
+ * moving the others closer to level 0. Stops early if a callback sets
+ * *cont to zero, leaving the remaining timers due.
+ *
+ * A path whose deadline expires is reported with WP_STALE and is not
+ * rearmed until its next event. The tick is reported with WP_TICK and
+ * is rearmed at once.
+ */
+static void
+wheel_run(struct watchset *ws, long long now)
+{
+  /*@dependent@*/ struct wptimer *pending = NULL;
+  struct wptimer *t = NULL;
+  long long next;
+  int level;
+  int slot;
+
+  while(ws->cont != 0 && (next = wheel_next(ws)) != -1 && next <= now){
+    ws->wheelnow = next;
+
+    /* take the list which came up, so callbacks can disarm its timers */
+    if(ws->wheeldue != NULL){
+      pending = ws->wheeldue;
+      ws->wheeldue = NULL;
+    } else {
+      for(level = 0; level < WHEEL_LEVELS && ws->wheelbits[level] == 0;
+          level++);
+      if(level < WHEEL_LEVELS){
+        slot = lowest_bit(ws->wheelbits[level]);
+        pending = ws->wheel[level][slot];
+        ws->wheel[level][slot] = NULL;
+        ws->wheelbits[level] &= ~(1ULL << slot);
+      } else {
+        pending = ws->wheelfar;
+        ws->wheelfar = NULL;
+      }
+    }
+    if(pending != NULL){
+      pending->pprev = &pending;
+    }
+
+    while((t = pending) != NULL){
+      timer_del(ws, t);
+      if(t->expires > ws->wheelnow || ws->cont == 0){
+        timer_add(ws, t);
+      } else if(t->owner == NULL){
+        t->expires += ws->tickms;
+        if(t->expires <= now){
+          /* ticks missed while the caller was away are not made up */
+          t->expires = now + ws->tickms;
+        }
+        timer_add(ws, t);
+        emit(ws, -1, WP_TICK);
+      } else {
+        emit(ws, t->owner->index, WP_STALE);
+      }
+    }
+  }
+  if(ws->cont != 0 && now > ws->wheelnow){
+    ws->wheelnow = now;
+  }
+}
+
+/*
+ * emit
+ *
+ * Executes the callback for the path at `index' with the given fflags,
+ * or hands it to a worker, or, with a batch callback, adds the event to
+ * those gathered for it. The record of the path in the state file, if
+ * any, is brought up to date first.
+ *
+ * The time from ws->origin, when the event was read, to now counts
+ * towards WP_STAGE_DISPATCH. Events which were not read from the kernel,
+ * such as those of timers, are due as soon as they arise.
+ */
+static void
+emit(struct watchset *ws, int index, u_int fflags)
+{
+  /*@owned@*/ struct watchpaths_event *grown = NULL;
+  struct watchpaths_event *evt = NULL;
+  struct pathinfo *pinfo = NULL;
+  struct watchpaths_file file;
+  struct stat finfo;
+  size_t count;
+  long long due, origin, done;
+  u_int all;
+  int more;
+
+  if(index >= 0 && (fflags & WP_STALE) == 0 &&
+     (pinfo = PINFO(ws, index))->stateslot != -1){
+    /* recorded as it is now, so that a restart knows it was reported */
+    state_record(ws, pinfo, node_stat(ws, pinfo->node, PARENT_FD(pinfo->node),
+                                      &finfo) == -1 ? NULL : &finfo, NULL);
+  }
+  STAT_INC(ws->stats.callbacks);
+  if(fflags & NOTE_DELETE){
+    STAT_INC(ws->stats.deletes);
+  }
+  if(fflags & (NOTE_WRITE | NOTE_EXTEND)){
+    STAT_INC(ws->stats.writes);
+  }
+  if(fflags & NOTE_ATTRIB){
+    STAT_INC(ws->stats.attribs);
+  }
+  if(fflags & NOTE_RENAME){
+    STAT_INC(ws->stats.renames);
+  }
+  due = now_ns();
+  origin = ws->origin != 0 ? ws->origin : due;
+  hist_add(&ws->hist[WP_STAGE_DISPATCH], due - origin);
+  trace_add(ws, WP_TRACE_DUE, index, fflags, 0, origin, due);
+  if(ws->batch == NULL && ws->pool != NULL){
+    pool_push(ws, index, fflags, origin, due);
+    return;
+  }
+  if(ws->batch == NULL && ws->opened != NULL){
+    /* the rest of a file rotated away goes before the file now there */
+    do {
+      all = fflags;
+      more = file_get(ws, index, &file, &all);
+      if(more == -1){
+        /* nothing was appended */
+        STAT_INC(ws->stats.suppressed);
+        return;
+      }
+      ws->cborigin = origin;
+      trace_add(ws, WP_TRACE_START, index, all, 0, origin, due);
+/*@-noeffect@*/
+      ws->opened(all, index, &file, PATH_DATA(ws, index), &ws->cont);
+/*@=noeffect@*/
+      done = now_ns();
+      hist_add(&ws->hist[WP_STAGE_CALLBACK], done - due);
+      trace_add(ws, WP_TRACE_FINISH, index, all, 0, origin, done);
+      ws->cborigin = 0;
+      tail_record(ws, index);
+    } while(more == 1 && ws->cont != 0);
+    return;
+  }
+  if(ws->batch == NULL){
+    /* Execute the callback. */
+    ws->cborigin = origin;
+    trace_add(ws, WP_TRACE_START, index, fflags, 0, origin, due);
+/*@-noeffect@*/
+    ws->callback(fflags, index, PATH_DATA(ws, index), &ws->cont);
+/*@=noeffect@*/
+    done = now_ns();
+    hist_add(&ws->hist[WP_STAGE_CALLBACK], done - due);
+    trace_add(ws, WP_TRACE_FINISH, index, fflags, 0, origin, done);
+    ws->cborigin = 0;
+    return;
+  }
+
+  if(ws->batchused == ws->batchmax){
+    count = ws->batchmax == 0 ? 64 : ws->batchmax * 2;
+    /* the count handed to the batch callback is an int */
+    if(ws->batchmax <= INT_MAX / 2){
+      grown = reallocarray(ws->batchbuf, count,
+                           sizeof(struct watchpaths_event));
+    }
+    if(grown == NULL){
+      /* hand over what has been gathered to make room rather than lose it */
+      flush_batch(ws);
+    } else {
+      ws->batchbuf = grown;
+      ws->batchmax = count;
+    }
+  }
+  evt = &ws->batchbuf[ws->batchused++];
+  evt->index = index;
+  evt->fflags = fflags;
+  evt->time = ws->stamp;
+  evt->entry = ws->entry;
+  evt->data = PATH_DATA(ws, index);
+}
+
+/*
+ * file_get
+ *
+ * Fills in `file' for the open callback with the file now at the path
+ * at `index'. The descriptor and mapping of the last event for the path
+ * are reused while it names the same file, and the mapping while the
+ * size is the same too, so that a burst of events for one file costs a
+ * lookup each rather than an open and a close. With kqueue, the
+ * descriptor of the watch itself is handed over when it was opened with
+ * the flags asked for the path, unless tailing, and a file opened for
+ * writing only is not mapped. The tick, the entries of trees, paths
+ * which are missing and files which cannot be opened get a descriptor
+ * of -1.
+ *
+ * In tail mode the range of bytes appended since the last callback is
+ * given as well, with WP_TRUNCATED or WP_ROTATED added to *fflags when
+ * the range starts afresh. When the file tailed has been renamed or
+ * removed, and is still held open, what was appended to it before it
+ * went is given first.
+ *
+ * Returns 1 if the file now at the path is due another call once this
+ * one is made, -1 if nothing was appended, so that no call is due, and
+ * 0 otherwise.
+ */
+static int
+file_get(struct watchset *ws, int index, struct watchpaths_file *file,
+         u_int *fflags)
+{
+  struct pathinfo *pinfo = NULL;
+  struct pathnode *node = NULL;
+  struct openfile *of = NULL;
+  struct stat finfo, held;
+  int fd, gone, flags;
+
+  file->fd = -1;
+  file->view = NULL;
+  file->size = 0;
+  file->offset = 0;
+  file->length = 0;
+  if(index < 0 || ws->entry != NULL){
+    return 0;
+  }
+  pinfo = PINFO(ws, index);
+  node = pinfo->node;
+  if(node == NULL || pinfo->tree){
+    return 0;
+  }
+  of = file_alloc(pinfo);
+  if(of == NULL){
+    report_error("Unable to allocate open file");
+    return 0;
+  }
+  flags = OPEN_FLAGS(ws, pinfo);
+
+  gone = node_stat(ws, node, PARENT_FD(node), &finfo) == -1;
+  if(ws->tailing && of->fd != -1 && of->dev == of->tdev &&
+     of->ino == of->tino &&
+     (gone || of->dev != finfo.st_dev || of->ino != finfo.st_ino) &&
+     fstat(of->fd, &held) == 0 && held.st_size > of->pos){
+    /* the file tailed went away with bytes yet to be passed */
+    file->fd = of->fd;
+    file->size = (size_t) held.st_size;
+    file->offset = of->pos;
+    file->length = held.st_size - of->pos;
+    of->pos = held.st_size;
+    if((flags & O_ACCMODE) != O_WRONLY){
+      (void) file_map(ws, of, of->fd, file);
+    }
+    return 1;
+  }
+  if(gone){
+    /* nothing to hand over, and nothing worth keeping */
+    file_drop(ws, of);
+    return 0;
+  }
+  if(of->dev != finfo.st_dev || of->ino != finfo.st_ino){
+    file_drop(ws, of);
+  }
+  fd = of->fd;
+#ifndef WP_INOTIFY
+  if(fd == -1 && !ws->tailing && flags == OPEN_MODE &&
+     node->kw.fd != -1 && node->dev == finfo.st_dev &&
+     node->ino == finfo.st_ino){
+    /* the watch has it open already; it is only borrowed for the call */
+    fd = node->kw.fd;
+  }
+#endif
+  if(fd == -1){
+    fd = node_open(ws, node, PARENT_FD(node), flags | O_CLOEXEC);
+    if(fd == -1){
+      report_error("Unable to open file for callback");
+      return 0;
+    }
+    if(fstat(fd, &finfo) == -1){
+      report_error("Unable to stat file for callback");
+      while(-1 == close(fd) && errno == EINTR);
+      return 0;
+    }
+    of->fd = fd;
+    STAT_INC(ws->stats.descriptors);
+  }
+  of->dev = finfo.st_dev;
+  of->ino = finfo.st_ino;
+  file->fd = fd;
+  if(!S_ISREG(finfo.st_mode)){
+    return 0;
+  }
+  file->size = (size_t) finfo.st_size;
+  file->length = finfo.st_size;
+
+  if(ws->tailing){
+    if(of->tdev != finfo.st_dev || of->tino != finfo.st_ino){
+      if(of->tdev != (dev_t) -1){
+        *fflags |= WP_ROTATED;
+      }
+      of->tdev = finfo.st_dev;
+      of->tino = finfo.st_ino;
+      of->pos = 0;
+    } else if(finfo.st_size < of->pos){
+      *fflags |= WP_TRUNCATED;
+      of->pos = 0;
+    }
+    file->offset = of->pos;
+    file->length = finfo.st_size - of->pos;
+    of->pos = finfo.st_size;
+    if(file->length == 0 && (*fflags & (WP_ROTATED | WP_TRUNCATED)) == 0){
+      return -1;
+    }
+  }
+  if((flags & O_ACCMODE) != O_WRONLY){
+    (void) file_map(ws, of, fd, file);
+  }
+  return 0;
+}
+
+/*
+ * file_map
+ *
+ * Maps the file open as `fd', of `file->size' bytes, into file->view if
+ * mapping was asked for, reusing the mapping in `of' if it is of the
+ * same size.
+ *
+ * Returns 0 if successful or if no mapping is wanted, returns -1 and
+ * sets errno otherwise.
+ */
+static int
+file_map(struct watchset *ws, struct openfile *of, int fd,
+         struct watchpaths_file *file)
+{
+  void *view = NULL;
+
+  if(!ws->openmap || file->size == 0){
+    return 0;
+  }
+  if(of->view != NULL && of->size != file->size){
+    (void) munmap(of->view, of->size);
+    of->view = NULL;
+  }
+  if(of->view == NULL){
+    view = mmap(NULL, file->size, PROT_READ, MAP_SHARED, fd, 0);
+    if(view == MAP_FAILED){
+      report_error("Unable to map file for callback");
+      return -1;
+    }
+    of->view = view;
+    of->size = file->size;
+  }
+  file->view = of->view;
+  return 0;
+}
+
+/*
+ * file_alloc
+ *
+ * Returns the open file of `pinfo', allocating an empty one if it has
+ * none, or NULL if memory could not be allocated.
+ */
+static struct openfile *
+file_alloc(struct pathinfo *pinfo)
+{
+  struct openfile *of = pinfo->file;
+
+  if(of != NULL){
+    return of;
+  }
+  of = malloc(sizeof(struct openfile));
+  if(of == NULL){
+    return NULL;
+  }
+  of->fd = -1;
+  of->view = NULL;
+  of->size = 0;
+  of->dev = (dev_t) -1;
+  of->ino = 0;
+  of->tdev = (dev_t) -1;
+  of->tino = 0;
+  of->pos = 0;
+  pinfo->file = of;
+  return of;
+}
+
+/*
+ * file_drop
+ *
+ * Closes and unmaps what `of' holds, keeping `of' for the next event.
+ */
+static void
+file_drop(struct watchset *ws, struct openfile *of)
+{
+  if(of->view != NULL){
+    (void) munmap(of->view, of->size);
+    of->view = NULL;
+    of->size = 0;
+  }
+  if(of->fd != -1){
+    while(-1 == close(of->fd) && errno == EINTR);
+    of->fd = -1;
+    STAT_DEC(ws->stats.descriptors);
+  }
+  of->dev = (dev_t) -1;
+  of->ino = 0;
+}
+
+/*
+ * tail_start
+ *
+ * Sets where tailing the path of `pinfo' begins: where the record of
+ * the path in the state file, if any, says the last callback left off,
+ * or else at the end of the file there now, so that only what is
+ * appended from now on is passed. A path which is missing starts at the
+ * beginning of whatever file is created there.
+ *
+ * Returns 1 if the record left bytes of the file there now yet to be
+ * passed, 0 if not, and -1 if memory could not be allocated.
+ */
+static int
+tail_start(struct watchset *ws, struct pathinfo *pinfo)
+{
+  struct openfile *of = NULL;
+  struct staterec *r = NULL;
+  struct stat finfo, held;
+  int found, fd, pending = 0;
+
+  if(pinfo->node == NULL || pinfo->tree){
+    return 0;
+  }
+  of = file_alloc(pinfo);
+  if(of == NULL){
+    return -1;
+  }
+  found = node_stat(ws, pinfo->node, PARENT_FD(pinfo->node), &finfo) == 0 &&
+    S_ISREG(finfo.st_mode);
+  if(pinfo->stateslot != -1 &&
+     ((r = &ws->staterecs[pinfo->stateslot])->flags & STATE_TAILED) != 0){
+    of->tdev = (dev_t) r->taildev;
+    of->tino = (ino_t) r->tailino;
+    of->pos = (off_t) r->tailpos;
+    pending = found && (of->tdev != finfo.st_dev ||
+                        of->tino != finfo.st_ino || of->pos != finfo.st_size);
+  } else if(of->tdev == (dev_t) -1 && found){
+    of->tdev = finfo.st_dev;
+    of->tino = finfo.st_ino;
+    of->pos = finfo.st_size;
+  }
+
+  if(found && of->fd == -1 && of->tdev == finfo.st_dev &&
+     of->tino == finfo.st_ino){
+    /* held from the outset, so that a rotation before the first event
+       does not take what was appended with it */
+    fd = node_open(ws, pinfo->node, PARENT_FD(pinfo->node),
+                   OPEN_FLAGS(ws, pinfo) | O_CLOEXEC);
+    if(fd != -1 && fstat(fd, &held) == 0 && held.st_dev == of->tdev &&
+       held.st_ino == of->tino){
+      of->fd = fd;
+      of->dev = held.st_dev;
+      of->ino = held.st_ino;
+      STAT_INC(ws->stats.descriptors);
+    } else if(fd != -1){
+      while(-1 == close(fd) && errno == EINTR);
+    }
+  }
+  return pending;
+}
+
+/*
+ * tail_record
+ *
+ * Stores how far the path at `index' has been tailed in its record in
+ * the state file, if any, once the callback has returned, so that a
+ * restart neither loses nor, unless the process dies during the
+ * callback, repeats a byte.
+ */
+static void
+tail_record(struct watchset *ws, int index)
+{
+  struct pathinfo *pinfo = NULL;
+  struct staterec *r = NULL;
+
+  if(!ws->tailing || index < 0){
+    return;
+  }
+  pinfo = PINFO(ws, index);
+  if(pinfo->file == NULL || pinfo->stateslot == -1 ||
+     pinfo->file->tdev == (dev_t) -1){
+    /* removed by the callback, or nothing to record */
+    return;
+  }
+  r = &ws->staterecs[pinfo->stateslot];
+  r->taildev = (uint64_t) pinfo->file->tdev;
+  r->tailino = (uint64_t) pinfo->file->tino;
+  r->tailpos = (int64_t) pinfo->file->pos;
+  r->flags |= STATE_TAILED;
+}
+
+/*
+ * file_free
+ *
+ * Drops and frees the open file of `pinfo', if any.
+ */
+static void
+file_free(struct watchset *ws, struct pathinfo *pinfo)
+{
+  if(pinfo->file != NULL){
+    file_drop(ws, pinfo->file);
+    free(pinfo->file);
+    pinfo->file = NULL;
+  }
+}
+
+/*
+ * flush_batch
+ *
+ * Passes the events gathered since the last call to the batch callback.
+ */
+static void
+flush_batch(struct watchset *ws)
+{
+  long long start;
+  int count;
+
+  if(ws->batch == NULL || ws->batchused == 0){
+    return;
+  }
+  count = (int) ws->batchused;
+  ws->batchused = 0;
+  start = now_ns();
+  trace_add(ws, WP_TRACE_START, -1, 0, count, 0, start);
+/*@-noeffect@*/
+  ws->batch(ws->batchbuf, count, ws->blob, &ws->cont);
+/*@=noeffect@*/
+  hist_add(&ws->hist[WP_STAGE_CALLBACK], now_ns() - start);
+  trace_add(ws, WP_TRACE_FINISH, -1, 0, count, 0, now_ns());
+}
+
+/*
+ * pool_work
+ *
+ * Runs the callbacks handed to the worker `arg' in order, sleeping
+ * while there are none, until told to quit once they are all run. A
+ * callback is dropped rather than run once any callback has set *cont
+ * to zero, see watchpaths_workers().
+ */
+/*@null@*/
+static void *
+pool_work(void *arg)
+{
+  struct cbworker *w = arg;
+  struct watchset *ws = w->ws;
+  struct cbjob *job = NULL;
+  unsigned long head;
+  long long start, done;
+  int cont;
+
+  for(head = w->head; ; head++){
+    if(head == SHARED_GET(&w->tail)){
+      (void) pthread_mutex_lock(&w->lock);
+      SHARED_SET(&w->sleeping, 1);
+      while(head == SHARED_GET(&w->tail) && !SHARED_GET(&w->quit)){
+        (void) pthread_cond_wait(&w->wake, &w->lock);
+      }
+      SHARED_SET(&w->sleeping, 0);
+      (void) pthread_mutex_unlock(&w->lock);
+      if(head == SHARED_GET(&w->tail)){
+        return NULL;
+      }
+    }
+
+    job = &w->ring[head % POOL_RING];
+    if(!SHARED_GET(&ws->halted)){
+      cont = 1;
+      w->entry = job->entry;
+      w->origin = job->origin;
+      start = now_ns();
+      hist_add(&ws->hist[WP_STAGE_QUEUE], start - job->due);
+      trace_add(ws, WP_TRACE_START, job->index, job->fflags, 0, job->origin,
+                start);
+/*@-noeffect@*/
+      ws->callback(job->fflags, job->index, job->data, &cont);
+/*@=noeffect@*/
+      done = now_ns();
+      hist_add(&ws->hist[WP_STAGE_CALLBACK], done - start);
+      trace_add(ws, WP_TRACE_FINISH, job->index, job->fflags, 0, job->origin,
+                done);
+      w->entry = NULL;
+      w->origin = 0;
+      if(cont == 0){
+        SHARED_SET(&ws->halted, 1);
+        /* wake watchpaths_run(), which may be waiting for events */
+        while(-1 == write(ws->haltpipe[1], "", 1) && errno == EINTR);
+      }
+    }
+    free(job->entry);
+    job->entry = NULL;
+
+    SHARED_SET(&w->head, head + 1);
+    if(SHARED_GET(&w->waiting)){
+      (void) pthread_mutex_lock(&w->lock);
+      (void) pthread_cond_signal(&w->room);
+      (void) pthread_mutex_unlock(&w->lock);
+    }
+  }
+}
+
+/*
+ * pool_wait
+ *
+ * Waits until no more than `most' jobs are left in the ring of `w'.
+ */
+static void
+pool_wait(struct cbworker *w, unsigned long most)
+{
+  if(w->tail - SHARED_GET(&w->head) <= most){
+    return;
+  }
+  (void) pthread_mutex_lock(&w->lock);
+  SHARED_SET(&w->waiting, 1);
+  while(w->tail - SHARED_GET(&w->head) > most){
+    (void) pthread_cond_wait(&w->room, &w->lock);
+  }
+  SHARED_SET(&w->waiting, 0);
+  (void) pthread_mutex_unlock(&w->lock);
+}
+
+/*
+ * pool_push
+ *
+ * Hands the callback for the path at `index' with the given fflags,
+ * which fell due at `due' for an event read at `origin', to the worker
+ * for that index, waiting for room if its ring is full. The
+ * entry is copied, as the worker may run the callback after the
+ * dispatch is over. An entry which cannot be copied for lack of memory
+ * is lost, but the callback is still run.
+ */
+static void
+pool_push(struct watchset *ws, int index, u_int fflags, long long origin,
+          long long due)
+{
+  struct cbworker *w = &ws->pool[(index < 0 ? 0 : index) % ws->poolsize];
+  struct cbjob *job = NULL;
+  unsigned long depth;
+
+  if(SHARED_GET(&ws->halted)){
+    /* a callback run by a worker stopped watching */
+    ws->cont = 0;
+    return;
+  }
+  if(w->tail - SHARED_GET(&w->head) == POOL_RING){
+    ws->stalls++;
+    pool_wait(w, POOL_RING - 1);
+  }
+
+  job = &w->ring[w->tail % POOL_RING];
+  job->index = index;
+  job->fflags = fflags;
+  job->entry = NULL;
+  /* the index may be given to another path before the callback runs */
+  job->data = PATH_DATA(ws, index);
+  job->origin = origin;
+  job->due = due;
+  if(ws->entry != NULL){
+    job->entry = strdup(ws->entry);
+    if(job->entry == NULL){
+      report_error("Unable to allocate tree event storage");
+    }
+  }
+  SHARED_SET(&w->tail, w->tail + 1);
+  ws->handed++;
+
+  depth = w->tail - SHARED_GET(&w->head);
+  if(depth > w->deepest){
+    w->deepest = depth;
+  }
+  if(SHARED_GET(&w->sleeping)){
+    (void) pthread_mutex_lock(&w->lock);
+    (void) pthread_cond_signal(&w->wake);
+    (void) pthread_mutex_unlock(&w->lock);
+  }
+}
+
+/*
+ * pool_stop
+ *
+ * Stops the workers of `ws' once they have run the callbacks handed to
+ * them, and frees them.
+ */
+static void
+pool_stop(struct watchset *ws)
+{
+  struct cbworker *w = NULL;
+  int i;
+
+  if(ws->pool == NULL){
+    return;
+  }
+  for(i = 0; i < ws->poolsize; i++){
+    w = &ws->pool[i];
+    (void) pthread_mutex_lock(&w->lock);
+    SHARED_SET(&w->quit, 1);
+    (void) pthread_cond_signal(&w->wake);
+    (void) pthread_mutex_unlock(&w->lock);
+  }
+  for(i = 0; i < ws->poolsize; i++){
+    w = &ws->pool[i];
+    (void) pthread_join(w->thread, NULL);
+    (void) pthread_cond_destroy(&w->room);
+    (void) pthread_cond_destroy(&w->wake);
+    (void) pthread_mutex_destroy(&w->lock);
+  }
+  free(ws->pool);
+  ws->pool = NULL;
+  ws->poolsize = 0;
+}
+
+/*
+ * tree_report
+ *
+ * Reports the entry `name', which is `len' bytes long, of the directory
+ * of `dir' to every tree it lies in, with the given fflags. The name is
+ * given to each relative to the root of the tree, assembled from the
+ * right in ws->pathbuf while climbing towards the roots. The events are
+ * only queued, see tree_flush(), as the trie may be part way through a
+ * change.
+ */
+static void
+tree_report(struct watchset *ws, struct pathnode *dir, const char *name,
+            size_t len, u_int fflags)
+{
+  struct pathnode *n = NULL;
+  struct pathinfo *pinfo = NULL;
+  size_t pos = sizeof(ws->pathbuf) - 1;
+
+  fflags &= ws->typemask;
+  if(fflags == 0 || len > pos){
+    return;
+  }
+  ws->pathbuf[pos] = '\0';
+  pos -= len;
+  memcpy(ws->pathbuf + pos, name, len);
+
+  for(n = dir; n != NULL && n->intree; n = n->parent){
+    if(n->trees > 0 &&
+       (ws->filter == NULL ||
+        filter_passes(ws->filter, ws->pathbuf + pos,
+                      sizeof(ws->pathbuf) - 1 - pos))){
+      for(pinfo = n->leaves; pinfo != NULL; pinfo = pinfo->next){
+        if(pinfo->tree && (fflags & pinfo->mask) != 0){
+          tree_queue(ws, pinfo, fflags & pinfo->mask, ws->pathbuf + pos,
+                     sizeof(ws->pathbuf) - 1 - pos);
+        }
+      }
+    }
+    if(n->parent == NULL || n->len + 1 > pos){
+      break;
+    }
+    ws->pathbuf[--pos] = '/';
+    pos -= n->len;
+    memcpy(ws->pathbuf + pos, n->name, n->len);
+  }
+}
+
+/*
+ * tree_queue
+ *
+ * Queues an event with the given fflags for the entry `entry', which is
+ * `len' bytes long, of the tree `pinfo'. The entry is copied, as the
+ * callback may see it until the end of the dispatch. An event which
+ * cannot be queued for lack of memory is lost.
+ */
+static void
+tree_queue(struct watchset *ws, struct pathinfo *pinfo, u_int fflags,
+           const char *entry, size_t len)
+{
+  /*@owned@*/ struct watchpaths_event *grown = NULL;
+  struct watchpaths_event *evt = NULL;
+  char *copy = NULL;
+  size_t count;
+
+  if(ws->treeqused == ws->treeqmax){
+    count = ws->treeqmax == 0 ? 16 : ws->treeqmax * 2;
+    grown = reallocarray(ws->treeq, count, sizeof(struct watchpaths_event));
+    if(grown == NULL){
+      report_error("Unable to allocate tree event storage");
+      return;
+    }
+    ws->treeq = grown;
+    ws->treeqmax = count;
+  }
+  copy = arena_copy(&ws->entries, entry, len);
+  if(copy == NULL){
+    report_error("Unable to allocate tree event storage");
+    return;
+  }
+  evt = &ws->treeq[ws->treeqused++];
+  evt->index = pinfo->index;
+  evt->fflags = fflags;
+  evt->time = ws->stamp;
+  evt->entry = copy;
+  evt->data = NULL;
+}
+
+/*
+ * tree_flush
+ *
+ * Executes the callback for the events queued by tree_report(), once
+ * the event which produced them has been handled. They are not
+ * debounced, as the entries would be lost, but do put the inactivity
+ * deadline of their tree off.
+ */
+static void
+tree_flush(struct watchset *ws)
+{
+  struct watchpaths_event *evt = NULL;
+  struct pathinfo *pinfo = NULL;
+  size_t i;
+
+  for(i = 0; i < ws->treeqused; i++){
+    evt = &ws->treeq[i];
+    pinfo = PINFO(ws, evt->index);
+    if(pinfo->node == NULL){
+      /* removed by an earlier callback */
+      continue;
+    }
+    deadline_restart(ws, pinfo);
+    ws->entry = evt->entry;
+    emit(ws, evt->index, evt->fflags);
+    ws->entry = NULL;
+  }
+  ws->treeqused = 0;
+}
+
+/*
+ * filter_pos
+ *
+ * Adds a position, which leads nowhere, to the patterns of `f'. Returns
+ * its index, or -1 if memory is exhausted.
+ */
+static int
+filter_pos(struct pathfilter *f)
+{
+  /*@owned@*/ struct globpos *grown = NULL;
+  struct globpos *g = NULL;
+  int count;
+
+  if(f->numpos == f->maxpos){
+    count = f->maxpos == 0 ? 16 : f->maxpos * 2;
+    grown = reallocarray(f->pos, (size_t) count, sizeof(struct globpos));
+    if(grown == NULL){
+      report_error("Unable to allocate pattern storage");
+      return -1;
+    }
+    f->pos = grown;
+    f->maxpos = count;
+  }
+  g = &f->pos[f->numpos];
+  memset(g->bytes, 0, sizeof(g->bytes));
+  g->next = -1;
+  g->eps[0] = -1;
+  g->eps[1] = -1;
+  g->accept = 0;
+  return f->numpos++;
+}
+
+/*
+ * filter_bytes
+ *
+ * Adds the bytes from `lo' to `hi' to those which lead on from `g',
+ * leaving out the slash if `slash' is zero.
+ */
+static void
+filter_bytes(struct globpos *g, int lo, int hi, int slash)
+{
+  int c;
+
+  for(c = lo; c <= hi; c++){
+    if(slash || c != '/'){
+      g->bytes[c >> 3] |= (unsigned char) (1 << (c & 7));
+    }
+  }
+}
+
+/*
+ * filter_dirs
+ *
+ * Makes the position `at' match any number of whole path elements,
+ * each with its trailing slash, as "**" followed by a slash does.
+ * Returns the position reached after them, or -1 if memory is
+ * exhausted.
+ */
+static int
+filter_dirs(struct pathfilter *f, int at)
+{
+  int after = filter_pos(f);
+  int loop = filter_pos(f);
+  int slash = filter_pos(f);
+
+  if(after == -1 || loop == -1 || slash == -1){
+    return -1;
+  }
+  f->pos[at].eps[0] = after;
+  f->pos[at].eps[1] = loop;
+  filter_bytes(&f->pos[loop], 0, 255, 1);
+  f->pos[loop].next = loop;
+  f->pos[loop].eps[0] = slash;
+  filter_bytes(&f->pos[slash], '/', '/', 1);
+  f->pos[slash].next = after;
+  return after;
+}
+
+/*
+ * filter_compile
+ *
+ * Adds the positions of `pattern' to `f', marking those at which it
+ * matches with `accept'. A pattern without a slash, other than a
+ * trailing one, matches the last element of an entry in any
+ * directory; any other is matched against the whole entry. "*" and
+ * "?" match within one element, "**" as a whole element matches any
+ * number of them, "[...]" matches one of a class of bytes, which "!"
+ * or "^" at its start negates, and "\" takes the next byte as it is.
+ * A pattern also matches everything beneath an entry it matches.
+ * Returns the first position of the pattern, or -1 with errno set to
+ * EINVAL if the pattern is empty or has an unterminated class, or if
+ * memory is exhausted.
+ */
+static int
+filter_compile(struct pathfilter *f, const char *pattern, int accept)
+{
+  const char *p = pattern;
+  const char *end = NULL;
+  const char *elem = NULL;
+  const char *first = NULL;
+  struct globpos *g = NULL;
+  int start, cur, next, c, hi, neg, i;
+  int beneath = 1;
+  size_t len;
+
+  while(*p == '/'){
+    p++;
+  }
+  len = strlen(p);
+  while(len > 0 && p[len - 1] == '/'){
+    len--;
+  }
+  if(len == 0){
+    errno = EINVAL;
+    return -1;
+  }
+  end = p + len;
+  elem = p;
+
+  start = cur = filter_pos(f);
+  if(cur != -1 && p == pattern && memchr(p, '/', len) == NULL){
+    cur = filter_dirs(f, cur);
+  }
+  while(cur != -1 && p < end){
+    if(p[0] == '*' && p + 1 < end && p[1] == '*' && p == elem &&
+       (p + 2 == end || p[2] == '/')){
+      if(p + 2 == end){
+        /* a trailing "**" matches everything beneath */
+        filter_bytes(&f->pos[cur], 0, 255, 1);
+        f->pos[cur].next = cur;
+        beneath = 0;
+        p += 2;
+      }else{
+        cur = filter_dirs(f, cur);
+        p += 3;
+        elem = p;
+      }
+      continue;
+    }
+    next = filter_pos(f);
+    if(next == -1){
+      return -1;
+    }
+    g = &f->pos[cur];
+    c = (int) (unsigned char) *p++;
+    if(c == '*'){
+      while(p < end && *p == '*'){
+        p++;
+      }
+      filter_bytes(g, 0, 255, 0);
+      g->next = cur;
+      g->eps[0] = next;
+      cur = next;
+      continue;
+    }
+    if(c == '?'){
+      filter_bytes(g, 0, 255, 0);
+    }else if(c == '['){
+      neg = p < end && (*p == '!' || *p == '^');
+      if(neg){
+        p++;
+      }
+      for(first = p; p < end && (*p != ']' || p == first); ){
+        c = (int) (unsigned char) *p++;
+        if(c == '\\' && p < end){
+          c = (int) (unsigned char) *p++;
+        }
+        hi = c;
+        if(p + 1 < end && *p == '-' && p[1] != ']'){
+          p++;
+          hi = (int) (unsigned char) *p++;
+          if(hi == '\\' && p < end){
+            hi = (int) (unsigned char) *p++;
+          }
+        }
+        filter_bytes(g, c, hi, 0);
+      }
+      if(p == end){
+        errno = EINVAL;
+        return -1;
+      }
+      p++;
+      if(neg){
+        for(i = 0; i < (int) sizeof(g->bytes); i++){
+          g->bytes[i] = (unsigned char) ~g->bytes[i];
+        }
+        g->bytes['/' >> 3] &= (unsigned char) ~(1 << ('/' & 7));
+      }
+    }else{
+      if(c == '\\' && p < end){
+        c = (int) (unsigned char) *p++;
+      }
+      filter_bytes(g, c, c, 1);
+      if(c == '/'){
+        elem = p;
+      }
+    }
+    g->next = next;
+    cur = next;
+  }
+  if(cur == -1){
+    return -1;
+  }
+
+  f->pos[cur].accept = accept;
+  if(beneath){
+    next = filter_pos(f);
+    if(next == -1){
+      return -1;
+    }
+    filter_bytes(&f->pos[cur], '/', '/', 1);
+    f->pos[cur].next = next;
+    filter_bytes(&f->pos[next], 0, 255, 1);
+    f->pos[next].next = next;
+    f->pos[next].accept = accept;
+  }
+  return start;
+}
+
+/*
+ * filter_classes
+ *
+ * Divides the bytes into the fewest classes such that the bytes of a
+ * class lead to the same positions from every position of `f'.
+ */
+static void
+filter_classes(struct pathfilter *f)
+{
+  int remap[512];
+  int i, c, k, n, m;
+
+  memset(f->classes, 0, sizeof(f->classes));
+  n = 1;
+  for(i = 0; i < f->numpos; i++){
+    if(f->pos[i].next == -1){
+      continue;
+    }
+    for(k = 0; k < n * 2; k++){
+      remap[k] = -1;
+    }
+    m = 0;
+    for(c = 0; c < 256; c++){
+      k = f->classes[c] * 2 + (BYTE_IN(f->pos[i].bytes, c) ? 1 : 0);
+      if(remap[k] == -1){
+        remap[k] = m++;
+      }
+      f->classes[c] = (unsigned char) remap[k];
+    }
+    n = m;
+  }
+  for(c = 255; c >= 0; c--){
+    f->reps[f->classes[c]] = (unsigned char) c;
+  }
+  f->numclasses = n;
+}
+
+/*
+ * filter_reset
+ *
+ * Frees the states built for `f', which are built again as entries
+ * reach them.
+ */
+static void
+filter_reset(struct pathfilter *f)
+{
+  int i;
+
+  for(i = 0; i < FILTER_STATES * 2; i++){
+    free(f->table[i]);
+    f->table[i] = NULL;
+  }
+  f->numstates = 0;
+  f->start = NULL;
+}
+
+/*
+ * filter_free
+ *
+ * Frees `f' along with its patterns and states.
+ */
+static void
+filter_free(struct pathfilter *f)
+{
+  if(f == NULL){
+    return;
+  }
+  filter_reset(f);
+  free(f->pos);
+  free(f->starts);
+  free(f->scratch);
+  free(f->stack);
+  free(f);
+}
+
+/*
+ * filter_close
+ *
+ * Adds to f->scratch every position reached without reading a byte
+ * from those in it, starting from the `sp' positions on f->stack.
+ */
+static void
+filter_close(struct pathfilter *f, int sp)
+{
+  int i, k, e;
+
+  while(sp > 0){
+    i = f->stack[--sp];
+    for(k = 0; k < 2; k++){
+      e = f->pos[i].eps[k];
+      if(e != -1 && !SET_IN(f->scratch, e)){
+        f->scratch[e / SET_BITS] |= 1UL << (e % SET_BITS);
+        f->stack[sp++] = e;
+      }
+    }
+  }
+}
+
+/*
+ * filter_state
+ *
+ * Returns the state of `f' for the positions in f->scratch, building
+ * it if needed, or NULL if memory is exhausted. There must be room for
+ * another state.
+ */
+static struct filterstate *
+filter_state(struct pathfilter *f)
+{
+  struct filterstate *st = NULL;
+  size_t hash = 2166136261U;
+  size_t mask = FILTER_STATES * 2 - 1;
+  size_t i;
+  int c;
+
+  for(i = 0; i < f->words; i++){
+    hash = (hash ^ (size_t) f->scratch[i]) * 16777619U;
+    hash ^= hash >> 15;
+  }
+  for(i = hash & mask; f->table[i] != NULL; i = (i + 1) & mask){
+    if(f->table[i]->hash == hash &&
+       0 == memcmp(f->table[i]->set, f->scratch,
+                   f->words * sizeof(unsigned long))){
+      return f->table[i];
+    }
+  }
+
+  st = malloc(sizeof(struct filterstate) +
+              f->words * sizeof(unsigned long) +
+              (size_t) f->numclasses * sizeof(struct filterstate *));
+  if(st == NULL){
+    report_error("Unable to allocate pattern state");
+    return NULL;
+  }
+  memcpy(st->set, f->scratch, f->words * sizeof(unsigned long));
+  st->next = (struct filterstate **) (void *) (st->set + f->words);
+  for(c = 0; c < f->numclasses; c++){
+    st->next[c] = NULL;
+  }
+  st->hash = hash;
+  st->flags = 0;
+  st->dead = 1;
+  for(c = 0; c < f->numpos; c++){
+    if(SET_IN(st->set, c)){
+      st->flags |= f->pos[c].accept;
+      st->dead = 0;
+    }
+  }
+  f->table[i] = st;
+  f->numstates++;
+  return st;
+}
+
+/*
+ * filter_step
+ *
+ * Returns the state of `f' reached from `st' after a byte of class
+ * `c', building it and recording it in `st', or NULL if memory is
+ * exhausted. If the states are full, they are all freed first.
+ */
+static struct filterstate *
+filter_step(struct pathfilter *f, struct filterstate *st, int c)
+{
+  struct filterstate *next = NULL;
+  int b = (int) f->reps[c];
+  int sp = 0;
+  int i, n;
+
+  memset(f->scratch, 0, f->words * sizeof(unsigned long));
+  for(i = 0; i < f->numpos; i++){
+    n = f->pos[i].next;
+    if(n != -1 && SET_IN(st->set, i) && BYTE_IN(f->pos[i].bytes, b) &&
+       !SET_IN(f->scratch, n)){
+      f->scratch[n / SET_BITS] |= 1UL << (n % SET_BITS);
+      f->stack[sp++] = n;
+    }
+  }
+  filter_close(f, sp);
+
+  if(f->numstates >= FILTER_STATES){
+    filter_reset(f);
+    st = NULL;
+  }
+  next = filter_state(f);
+  if(st != NULL){
+    st->next[c] = next;
+  }
+  return next;
+}
+
+/*
+ * filter_passes
+ *
+ * Returns nonzero if the entry `entry', which is `len' bytes long,
+ * passes the patterns of `f': it matches no exclude pattern, and
+ * matches an include pattern if there are any. An entry which can not
+ * be classified for lack of memory passes.
+ */
+static int
+filter_passes(struct pathfilter *f, const char *entry, size_t len)
+{
+  struct filterstate *st = f->start;
+  struct filterstate *next = NULL;
+  size_t i;
+  int c, sp;
+
+  if(st == NULL){
+    memset(f->scratch, 0, f->words * sizeof(unsigned long));
+    for(sp = 0; sp < f->numstarts; sp++){
+      c = f->starts[sp];
+      f->scratch[c / SET_BITS] |= 1UL << (c % SET_BITS);
+      f->stack[sp] = c;
+    }
+    filter_close(f, sp);
+    if(f->numstates >= FILTER_STATES){
+      filter_reset(f);
+    }
+    st = f->start = filter_state(f);
+    if(st == NULL){
+      return 1;
+    }
+  }
+  for(i = 0; i < len && !st->dead; i++){
+    c = (int) f->classes[(unsigned char) entry[i]];
+    next = st->next[c];
+    if(next == NULL){
+      next = filter_step(f, st, c);
+      if(next == NULL){
+        return 1;
+      }
+    }
+    st = next;
+  }
+  return (st->flags & FILTER_EXCLUDE) == 0 &&
+    (f->includes == 0 || (st->flags & FILTER_INCLUDE) != 0);
+}
+
+/*
+ * debug_event
+ *
+ * Describes an event with the given fflags seen on `node'.
+ */
+static void
+debug_event(struct watchset *ws, struct pathnode *node, u_int fflags)
+{
+  char *path = NULL;
+  int i;
+
+  if(WP_DEBUG){
+    path = node_path(ws, node);
+    debug_printf("EVT: %s\n", path != NULL ? path : "?");
+
+    for(i = 0; i < NUMTYPES; i++){
+      if(0 != (fflags & types[i])){ /* '0 != ...' for splint */
+        debug_printf("--Matched: %s\n", type_names[i]);
+      }
+    }
+  }
+}
+
+#ifndef WP_INOTIFY
+/*
+ * kqueue_event
+ *
+ * Handles one event returned by kevent(2).
+ *
+ * kqueue does not name the entry of a directory which changed, so a
+ * write to a directory looks for each of its missing children, and
+ * reads the directory again if it is part of a tree. The removal of a
+ * watched child is reported on its own descriptor, as are the changes
+ * to the directories and regular files within a tree.
+ *
+ * Returns 0 if successful, -1 if watching can not continue.
+ */
+static int
+kqueue_event(struct watchset *ws, struct kevent *evt)
+{
+  struct kwatch *kw = evt->udata;
+  struct pathnode *node = (struct pathnode *) kw;
+  struct pathnode *child = NULL;
+  struct pathinfo *pinfo = NULL;
+  u_int fflags;
+  size_t i;
+  int entry;
+  int ret;
+
+  if(kw->fd == -1 || kw->dirty){
+    /* the event is for a descriptor closed since it was queued */
+    return 0;
+  }
+#ifdef WP_ONESHOT
+  /* the registration was consumed by this event */
+  mark_dirty(ws, kw);
+#endif
+  debug_event(ws, node, evt->fflags);
+  entry = node->parent != NULL && CRAWLS(node->parent);
+
+  /*
+   * NOTE_DELETE might be a new file copied onto the old path.
+   */
+  if(evt->fflags & (NOTE_DELETE | NOTE_RENAME)){
+    ret = node_check(ws, node, (evt->fflags & NOTE_DELETE) != 0);
+    if(ret == -1){
+      return -1;
+    }
+    if(entry){
+      /* an entry replaced at once has been written as well */
+      tree_report(ws, node->parent, node->name, node->len,
+                  (evt->fflags & (NOTE_DELETE | NOTE_RENAME)) |
+                  (WATCHED(node) ? NOTE_WRITE : 0));
+      node_prune(ws, node);
+    }
+    deliver(ws, evt->fflags, NULL);
+    if(ret == 1){
+      /* the rest of the event concerned the file no longer watched */
+      return 0;
+    }
+  }
+
+  if(evt->fflags & NOTE_WRITE){
+    if(CRAWLS(node) && tree_crawl(ws, node, PARENT_FD(node), 0) == -1){
+      report_error("unable to watch path");
+      return -1;
+    }
+    for(i = 0; node->children != NULL && i <= node->mask; i++){
+      child = node->children[i];
+      if(child != NULL && !WATCHED(child) && !child->keep &&
+         node_resolve(ws, child, kw->fd, NULL) == -1){
+        report_error("unable to watch path");
+        return -1;
+      }
+    }
+    deliver(ws, NOTE_WRITE, NULL);
+  }
+
+  /* the writes to a directory of a tree are reported as its entries */
+  fflags = evt->fflags & ~(u_int) (NOTE_DELETE | NOTE_RENAME);
+  if(node->dir){
+    fflags &= ~(u_int) (NOTE_WRITE | NOTE_EXTEND);
+  }
+  if(entry && fflags != 0){
+    tree_report(ws, node->parent, node->name, node->len, fflags);
+  }
+
+  queue_leaves(ws, node);
+  while((pinfo = dequeue(ws)) != NULL){
+    fflags = evt->fflags;
+    if(pinfo->tree && node->dir){
+      fflags &= ~(u_int) (NOTE_WRITE | NOTE_EXTEND);
+    }
+    if(pinfo->node != NULL && fflags != 0){
+      notify(ws, pinfo, fflags);
+    }
+  }
+  return 0;
+}
+#endif
+
+#ifdef WP_INOTIFY
+/*
+ * node_rescan
+ *
+ * Checks `node' and everything beneath it against the file system,
+ * queueing every path found to exist, and reads the directories of
+ * trees again. Used when inotify has dropped events.
+ *
+ * Returns 0 if successful, -1 if watching can not continue.
+ */
+static int
+node_rescan(struct watchset *ws, struct pathnode *node)
+{
+  size_t i;
+  int ret;
+
+  if(!WATCHED(node)){
+    /* the parent is watched, as its children are only visited then */
+    return node_resolve(ws, node, -1, NULL);
+  }
+  ret = node_check(ws, node, 0);
+  if(ret != 0){
+    /* the subtree was resolved afresh */
+    return ret == -1 ? -1 : 0;
+  }
+  queue_leaves(ws, node);
+  if(CRAWLS(node) && tree_crawl(ws, node, -1, 0) == -1){
+    return -1;
+  }
+  for(i = 0; node->children != NULL && i <= node->mask; i++){
+    if(node->children[i] != NULL &&
+       node_rescan(ws, node->children[i]) == -1){
+      return -1;
+    }
+  }
+  if(node->intree){
+    /* forget the entries found missing */
+    tree_sweep(ws, node);
+  }
+  return 0;
+}
+
+/*
+ * is_empty
+ *
+ * inotify reports the creation of a file before its creator has had a
+ * chance to write to it. Calling back at that moment would usually be
+ * followed by a second callback for the first write. Instead, a leaf
+ * which appears as an empty regular file is announced when it is first
+ * written or closed, whichever comes first.
+ *
+ * Returns nonzero if the leaf of `pinfo' is an empty regular file.
+ */
+static int
+is_empty(struct watchset *ws, struct pathinfo *pinfo)
+{
+  struct stat finfo;
+
+  return stat(PNAME(ws, pinfo->index)->path, &finfo) == 0 &&
+    S_ISREG(finfo.st_mode) && finfo.st_size == 0;
+}
+
+/*
+ * translate_event
+ *
+ * Converts the mask of an inotify event on the leaf of `pinfo' to the
+ * EVFILT_VNODE style fflags passed to the callback.
+ *
+ * A change to the entries of a directory is reported as NOTE_WRITE, as
+ * kqueue does. inotify does not distinguish appending from other
+ * writes, so NOTE_EXTEND is never reported. IN_CLOSE_WRITE only counts
+ * for a fresh leaf, see is_empty().
+ */
+static u_int
+translate_event(struct pathinfo *pinfo, struct inotify_event *ie)
+{
+  u_int fflags = 0;
+
+  if(ie->len == 0){
+    if(ie->mask & IN_MODIFY ||
+       (ie->mask & IN_CLOSE_WRITE && pinfo->fresh)){
+      fflags |= NOTE_WRITE;
+    }
+  } else if(ie->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)){
+    fflags |= NOTE_WRITE;
+  }
+  return fflags;
+}
+
+/*
+ * inotify_event
+ *
+ * Handles one event read from the inotify descriptor.
+ *
+ * An event naming an entry of a directory is passed to the child node
+ * of that name, which is found with a single lookup. The removal of a
+ * node drops its whole subtree at once. Within a tree, the entry is
+ * reported to the tree, and a directory which appears is watched.
+ *
+ * Returns 0 if successful, -1 if watching can not continue.
+ */
+static int
+inotify_event(struct watchset *ws, struct inotify_event *ie)
+{
+  struct wdslot *slot = NULL;
+  struct pathnode *nodes = NULL;
+  struct pathnode **tail = &nodes;
+  struct pathnode *node = NULL;
+  struct pathnode *nextnode = NULL;
+  struct pathnode *child = NULL;
+  struct pathinfo *pinfo = NULL;
+  u_int fflags = 0;
+  size_t len;
+  int tree;
+
+  slot = wd_find(ws, ie->wd);
+  if(slot == NULL){
+    /* the watch was removed after this event was queued */
+    return 0;
+  }
+
+  /* handling the event may detach nodes from `slot' or move it */
+  for(node = slot->head; node != NULL; node = node->wdnext){
+    *tail = node;
+    tail = &node->worknext;
+  }
+  *tail = NULL;
+
+  for(node = nodes; node != NULL; node = nextnode){
+    nextnode = node->worknext;
+    if(node->wd != ie->wd){
+      /* dropped while handling an earlier node */
+      continue;
+    }
+
+    if(ie->len == 0 && ie->mask & (IN_DELETE_SELF | IN_UNMOUNT | IN_IGNORED)){
+      debug_event(ws, node, NOTE_DELETE);
+      if(node_check(ws, node, 1) == -1){
+        return -1;
+      }
+      deliver(ws, NOTE_DELETE & ws->typemask, NULL);
+    } else if(ie->len == 0 && ie->mask & IN_MOVE_SELF){
+      debug_event(ws, node, NOTE_RENAME);
+      if(node_check(ws, node, 0) == -1){
+        return -1;
+      }
+      deliver(ws, NOTE_RENAME & ws->typemask, NULL);
+    } else {
+      len = ie->len > 0 ? strlen(ie->name) : 0;
+      tree = len > 0 && CRAWLS(node);
+      if(tree){
+        tree_report(ws, node, ie->name, len,
+                    ie->mask & IN_DELETE ? NOTE_DELETE :
+                    ie->mask & IN_MOVED_FROM ? NOTE_RENAME : NOTE_WRITE);
+      }
+      if(len > 0 &&
+         ie->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)){
+        child = node_child(node, ie->name, len, hash_name(ie->name, len));
+        if(child == NULL && tree && ie->mask & IN_ISDIR &&
+           ie->mask & (IN_CREATE | IN_MOVED_TO)){
+          child = node_new(ws, node, ie->name, len);
+          if(child == NULL){
+            report_error("Unable to allocate space to track elements of "
+                         "pathname");
+            return -1;
+          }
+        }
+        if(child != NULL){
+          /* report the removal of an entry as kqueue would on the entry */
+          fflags = ie->mask & IN_DELETE ? NOTE_DELETE :
+            ie->mask & IN_MOVED_FROM ? NOTE_RENAME : NOTE_WRITE;
+          debug_event(ws, child, fflags);
+          if(node_check(ws, child, 0) == -1){
+            return -1;
+          }
+          if(tree){
+            /* unless found again, or a path names it */
+            node_prune(ws, child);
+          }
+          deliver(ws, fflags & ws->typemask,
+                  ie->mask & IN_CREATE && !(ie->mask & IN_ISDIR) ?
+                  child : NULL);
+        }
+      }
+
+      /* the paths naming the node itself see a write, trees an entry */
+      queue_leaves(ws, node);
+      while((pinfo = dequeue(ws)) != NULL){
+        fflags = pinfo->node == NULL || (pinfo->tree && len > 0) ? 0 :
+          translate_event(pinfo, ie) & ws->typemask;
+        if(fflags != 0){
+          pinfo->fresh = 0;
+          notify(ws, pinfo, fflags);
         }
       }
-    } else {
+    }
+  }
+  return 0;
+}
+#endif
+
+/*
+ * Caller documentation is in watchpaths.h
+ * Implementation discussion follows.
+ *
+ * Watchpaths attempts to monitor for changes in any one of a list of
+ * specified files. It uses the kqueue/kevent API to do so. This API
+ * does not have an option for monitoring path names, but does allow
+ * monitoring file descriptors.
+ *
+ * Several design considerations follow from this fact:
+ *
+ * 1. watchpaths() only functions properly if it is able to call
+ *    open(2) on the file. On systems where O_EVTONLY mode is
+ *    supported that open mode is used. Otherwise, O_RDONLY is used.
+ *
+ * 2. If files are renamed, such as by a "safe write" operation, work
+ *    is required to obtain the file descriptor of the file now
+ *    existing at the path.
+ *
+ * 3. If a file is deleted, there is no mechanism in kqueue to watch
+ *    for its recreation. watchpaths() therefore watches every existing
+ *    parent directory of each path as well. When one of them is
+ *    written, its missing children are opened again, along with
+ *    everything beneath them which now exists. Each is looked up by
+ *    its name alone relative to its parent's descriptor, so the cost
+ *    of rearming does not grow with the depth of the path. When one of them is
+ *    deleted or renamed, everything beneath it is closed at once.
+ *
+ * 4. Registrations are only passed to kevent(2) for the descriptors
+ *    opened since the previous call, which are kept on a dirty list.
+ *    The work done per event therefore does not grow with the number
+ *    of paths watched. inotify watches persist in the same way.
+ *
+ * 5. The paths are kept in a trie with one node per path element, so
+ *    a directory shared by many paths, such as /var/db, is watched
+ *    once. Descriptors, kernel watches and memory therefore grow with
+ *    the number of distinct directories rather than with the number
+ *    of paths times their depth.
+ *
+ * 6. Only watchpaths() itself blocks. watchpaths_dispatch() handles
+ *    the events which are already queued and returns, so a watch set
+ *    can be serviced by an event loop through the descriptor returned
+ *    by watchpaths_fd(). watchpaths() waits on that descriptor with
+ *    poll(2). For kqueue, the dirty watches are registered before
+ *    watchpaths_dispatch() returns so that the descriptor becomes
+ *    readable for their events.
+ *
+ * 7. A tree, see watchpaths_tree(), keeps a node for each of its
+ *    directories, and with kqueue for each of its regular files, in
+ *    the same trie. Its directories are read relative to their
+ *    parent's descriptor, so the initial crawl assembles no paths,
+ *    and the changes to their entries are reported up the trie to the
+ *    roots of the trees they lie in.
+ *
+ * 8. The patterns of watchpaths_filter() are compiled into a single
+ *    automaton whose states are built lazily, as entries reach them,
+ *    over classes of bytes which no pattern tells apart. An entry is
+ *    checked against it once per tree root it is reported to, before
+ *    anything is queued.
+ *
+ * On Linux, inotify(7) is used instead. inotify watches are added by
+ * path, but each one follows the inode it was added for, so the same
+ * trie of watches is needed. All of the watches share one inotify
+ * descriptor, and events are routed to their nodes through a hash
+ * table of watch descriptors, so no descriptor is held per path.
+ * Events naming an entry of a directory go straight to the child node
+ * of that name. Events are translated to the kqueue fflags, which
+ * watchpaths.h defines for this purpose.
+ *
+ * In order to conserve memory, a node stores only its own name. The
+ * path of a node is assembled from those of its parents when it must
+ * be opened.
+ *
+ * All paths are copied by watchpaths, so callers need not worry hat
+ * these changes will alter data in the caller's view.
+ */
+struct watchset *
+watchpaths_create(char **inpaths, int numpaths,
+                  void (*callback) (u_int, int, void *, int *), void *blob)
+{
+  return watchpaths_create_threads(inpaths, numpaths, callback, blob, 1);
+}
+
+struct watchset *
+watchpaths_create_threads(char **inpaths, int numpaths,
+                          void (*callback) (u_int, int, void *, int *),
+                          void *blob, int threads)
+{
+  return set_create(inpaths, NULL, numpaths, callback, blob, threads);
+}
+
+struct watchset *
+watchpaths_create_opts(const struct watchpaths_opts *paths, int numpaths,
+                       void (*callback) (u_int, int, void *, int *),
+                       void *blob, int threads)
+{
+  /*@owned@*/ char **inpaths = NULL;
+  /*@null@*/ struct watchset *ws = NULL;
+  int i;
+
+  for(i = 0; i < numpaths; i++){
+    if(opts_check(&paths[i]) == -1){
+      return NULL;
+    }
+  }
+  /* the names alone, for the threads which canonicalize them */
+  inpaths = reallocarray(NULL, numpaths > 0 ? (size_t) numpaths : 1,
+                         sizeof(char *));
+  if(inpaths == NULL){
+    report_error("Unable to allocate startup storage");
+    return NULL;
+  }
+  for(i = 0; i < numpaths; i++){
+    inpaths[i] = (char *) paths[i].path;
+  }
+  ws = set_create(inpaths, paths, numpaths, callback, blob, threads);
+  free(inpaths);
+  return ws;
+}
+
+/*
+ * set_create
+ *
+ * Implements watchpaths_create_threads(), and watchpaths_create_opts()
+ * if `opts' is not NULL, in which case it describes the same paths as
+ * `inpaths' and has been checked.
+ */
+static struct watchset *
+set_create(char **inpaths, /*@null@*/ const struct watchpaths_opts *opts,
+           int numpaths, void (*callback) (u_int, int, void *, int *),
+           void *blob, int threads)
+{
+  /*@owned@*/ struct watchset *ws = NULL;
+  /*@owned@*/ char *basepath = NULL;
+  /*@dependent@*/ struct pathinfo *pinfo = NULL;
+  /*@dependent@*/ struct startpath *sp = NULL;
+  /*@dependent@*/ const char *path = NULL;
+  struct startup st;
+  size_t len, hash;
+  int cwderr = 0;
+  int i = 0;
+  int saved_errno;
+
+  st.paths = NULL;
+  st.workers = NULL;
+  st.numworkers = 0;
+
+  /* the watch set holds PATH_MAX buffers, so keep it off the stack */
+  ws = malloc(sizeof(struct watchset));
+  if(ws == NULL){
+    report_error("Unable to allocate watch set");
+    return NULL;
+  }
+  ws->slabs = NULL;
+  ws->numslabs = 0;
+  ws->numpaths = 0;
+  ws->maxpaths = 0;
+  ws->byname = NULL;
+  ws->namemask = 0;
+  ws->nameused = 0;
+  ws->arena = NULL;
+  ws->arenalive = 0;
+  ws->arenadead = 0;
+  ws->freepinfo = NULL;
+  ws->deadpinfo = NULL;
+  ws->deadnodes = NULL;
+  ws->dispatching = 0;
+  ws->quiet = 0;
+  ws->maxdelay = 0;
+  ws->now = 0;
+  ws->nowns = 0;
+  ws->origin = 0;
+  ws->cborigin = 0;
+  ws->stamp.tv_sec = 0;
+  ws->stamp.tv_nsec = 0;
+  ws->heap = NULL;
+  ws->heapused = 0;
+  ws->heapmax = 0;
+  memset(ws->wheel, 0, sizeof(ws->wheel));
+  memset(ws->wheelbits, 0, sizeof(ws->wheelbits));
+  ws->wheelfar = NULL;
+  ws->wheeldue = NULL;
+  ws->wheelnow = now_ms();
+  ws->tick.owner = NULL;
+  ws->tick.next = NULL;
+  ws->tick.pprev = NULL;
+  ws->tick.where = -1;
+  ws->tickms = 0;
+  ws->root = NULL;
+  ws->numnodes = 0;
+  ws->work = NULL;
+  ws->worktail = &ws->work;
+  ws->callback = callback;
+  ws->blob = blob;
+  ws->cont = 1;
+  ws->batch = NULL;
+  ws->opened = NULL;
+  ws->openflags = O_RDONLY;
+  ws->openmap = 0;
+  ws->tailing = 0;
+  ws->batchbuf = NULL;
+  ws->batchused = 0;
+  ws->batchmax = 0;
+  ws->treeq = NULL;
+  ws->treeqused = 0;
+  ws->treeqmax = 0;
+  ws->entries = NULL;
+  ws->entry = NULL;
+  ws->announce = 0;
+  ws->filter = NULL;
+  ws->prints = 0;
+  ws->printbuf = NULL;
+  ws->snaps = NULL;
+  ws->numpolled = 0;
+  ws->maxpolled = 0;
+  ws->pollms = 0;
+  ws->pollall = 0;
+  ws->pollnext = 0;
+  ws->pollstart = 0;
+  ws->polldue = 0;
+  ws->statefd = -1;
+  ws->statepath = NULL;
+  ws->statehead = NULL;
+  ws->statesize = 0;
+  ws->staterecs = NULL;
+  ws->missed = NULL;
+  ws->nummissed = 0;
+  ws->maxmissed = 0;
+  ws->trace = NULL;
+  ws->tracesize = 0;
+  ws->pool = NULL;
+  ws->poolsize = 0;
+  ws->halted = 0;
+  ws->haltpipe[0] = -1;
+  ws->haltpipe[1] = -1;
+  ws->handed = 0;
+  ws->stalls = 0;
+  memset(&ws->stats, 0, sizeof(ws->stats));
+  memset(ws->hist, 0, sizeof(ws->hist));
+#ifdef __linux__
+  ws->crawlbuf = NULL;
+#endif
+#ifdef WP_URING
+  ws->ring = NULL;
+  ws->noring = 0;
+  ws->pollbatch = NULL;
+#endif
+  ws->eventbuff = NULL;
+
+  /* calculate mask to use in EV_SET call */
+  ws->typemask = 0;
+  for(i = 0; i < NUMTYPES; i++){
+   ws->typemask |= types[i];
+  }
+
+#ifdef WP_INOTIFY
+  ws->slots = NULL;
+  ws->mask = 0;
+  ws->used = 0;
+  ws->evoff = 0;
+  ws->evlen = 0;
+  ws->fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+  if(ws->fd == -1){
+    report_error("Unable to create queue");
+    goto ERR;
+  }
+  STAT_INC(ws->stats.descriptors);
+#else
+  ws->dirty = NULL;
+  ws->changelist = NULL;
+  ws->maxnodes = 0;
+  ws->maxevents = 0;
+  ws->kq = kqueue();
+  if(ws->kq == -1){
+    report_error("Unable to create queue");
+    goto ERR;
+  }
+  STAT_INC(ws->stats.descriptors);
+#endif
+
+  ws->root = node_new(ws, NULL, "", 0);
+  if(ws->root == NULL){
+    report_error("Unable to allocate path trie");
+    goto ERR;
+  }
+
+  if(threads > numpaths / STARTUP_MIN){
+    threads = numpaths / STARTUP_MIN;
+  }
+  if(threads > 1){
+    /* the threads share the current directory, so find it up front */
+    for(i = 0; i < numpaths && basepath == NULL && cwderr == 0; i++){
+      if(inpaths[i] != NULL && inpaths[i][0] != '/'){
+/*@-nullpass@*/
+        basepath = getcwd(NULL, 0);
+/*@=nullpass@*/
+        cwderr = basepath == NULL ? errno : 0;
+      }
+    }
+    if(startup_begin(&st, ws, inpaths, numpaths, threads, basepath,
+                     cwderr) == -1){
+      report_error("Unable to allocate startup storage");
+      goto ERR;
+    }
+    startup_run(&st);
+  }
+
+  /*
+   * Paths are entered in order whether or not threads canonicalized
+   * them, so the watch set and the first error reported are the same
+   * either way.
+   */
+  for(i = 0; i < numpaths; i++){
+    /* the indexes handed out match those of `inpaths' */
+    pinfo = pinfo_new(ws);
+    if(pinfo == NULL){
+      report_error("Unable to allocate path info storage");
+      goto ERR;
+    }
+    pinfo_opts(pinfo, opts != NULL ? &opts[i] : NULL);
+    if(st.paths != NULL){
+      sp = &st.paths[i];
+      if(sp->err != 0){
+        errno = sp->err;
+        report_error(sp->msg);
+        goto ERR;
+      }
+      path = st.workers[sp->worker].buf + sp->off;
+      len = sp->len;
+      hash = sp->hash;
+    } else {
+      if(path_copy(ws, inpaths[i], &basepath, &len) == -1){
+        goto ERR;
+      }
+      path = ws->pathbuf;
+      hash = hash_name(path, len);
+    }
+
+    /* TODO: consider emitting the list of watched paths */
+    debug_printf("Watching for %s\n", path);
+    if(path_name(ws, pinfo, path, hash, len) == -1 ||
+       path_insert(ws, pinfo, PNAME(ws, i)->path, len, NULL) == -1){
+      report_error("Unable to allocate space to track elements of pathname");
+      goto ERR;
+    }
+  }
+
+  if(st.paths != NULL){
+    /*
+     * Looking up every path on the threads brings the directories
+     * along them into the kernel's caches, so the lookups made while
+     * registering the watches below, which must be made in turn, do
+     * not wait on the disk or the network one at a time.
+     */
+    st.probing = 1;
+    st.next = 0;
+    startup_run(&st);
+    startup_end(&st);
+  }
+
+#ifdef WP_INOTIFY
+  ws->eventbuff = malloc(EVENT_BUFF_SIZE);
+  if(ws->eventbuff == NULL){
+    report_error("Unable to allocate event storage");
+    goto ERR;
+  }
+#else
+  if(grow_changes(ws) == -1){
+    report_error("Unable to allocate event setup storage");
+    goto ERR;
+  }
+  grow_events(ws);
+  if(ws->eventbuff == NULL){
+    report_error("Unable to allocate event storage");
+    goto ERR;
+  }
+#endif
+
+  if(node_resolve(ws, ws->root, -1, NULL) == -1){
+    report_error("unable to watch path");
+    goto ERR;
+  }
+  if(!WATCHED(ws->root)){
+    report_error("unable to open file for watching");
+    goto ERR;
+  }
+  /* the paths which exist at the outset are not reported */
+  while(dequeue(ws) != NULL);
+
+#ifndef WP_INOTIFY
+  if(flush_dirty(ws) == -1){
+    goto ERR;
+  }
+#endif
+
+  free(basepath);
+  return ws;
+
+ERR:
+  saved_errno = errno;
+  startup_end(&st);
+  free(basepath);
+  watchpaths_destroy(ws);
+  errno = saved_errno;
+  return NULL;
+}
+
+/*
+ * startup_begin
+ *
+ * Prepares `st' for canonicalizing `numpaths' paths on `threads'
+ * threads, see startup_run().
+ *
+ * Returns 0 if successful, returns -1 and sets errno otherwise.
+ */
+static int
+startup_begin(struct startup *st, struct watchset *ws, char **inpaths,
+              int numpaths, int threads, const char *basepath, int cwderr)
+{
+  int i;
+
+  st->paths = reallocarray(NULL, numpaths, sizeof(struct startpath));
+  st->workers = reallocarray(NULL, threads, sizeof(struct startworker));
+  if(st->paths == NULL || st->workers == NULL ||
+     pthread_mutex_init(&st->lock, NULL) != 0){
+    free(st->paths);
+    free(st->workers);
+    st->paths = NULL;
+    st->workers = NULL;
+    return -1;
+  }
+  st->next = 0;
+  st->count = numpaths;
+  st->probing = 0;
+  st->inpaths = inpaths;
+  st->basepath = basepath;
+  st->cwderr = cwderr;
+  st->ws = ws;
+  st->numworkers = threads;
+  for(i = 0; i < threads; i++){
+    st->workers[i].st = st;
+    st->workers[i].buf = NULL;
+    st->workers[i].used = 0;
+    st->workers[i].size = 0;
+    st->workers[i].id = i;
+  }
+  return 0;
+}
+
+/*
+ * startup_run
+ *
+ * Works through the paths of `st' on its threads, including the
+ * calling one, and returns once all of them are done. Should a thread
+ * fail to start, the others do its share.
+ */
+static void
+startup_run(struct startup *st)
+{
+  int started;
+
+  for(started = 1; started < st->numworkers; started++){
+    if(pthread_create(&st->workers[started].thread, NULL, startup_work,
+                      &st->workers[started]) != 0){
+      break;
+    }
+  }
+  (void) startup_work(&st->workers[0]);
+  while(--started > 0){
+    (void) pthread_join(st->workers[started].thread, NULL);
+  }
+}
+
+/*
+ * startup_work
+ *
+ * The body of each startup thread. Takes STARTUP_BATCH paths at a time
+ * until none are left, then canonicalizes or probes each of them.
+ */
+static void *
+startup_work(void *arg)
+{
+  struct startworker *w = arg;
+  struct startup *st = w->st;
+  struct stat finfo;
+  int i, end;
+
+  for(;;){
+    (void) pthread_mutex_lock(&st->lock);
+    i = st->next;
+    end = st->count - i < STARTUP_BATCH ? st->count : i + STARTUP_BATCH;
+    st->next = end;
+    (void) pthread_mutex_unlock(&st->lock);
+    if(i == end){
+      return NULL;
+    }
+    for(; i < end; i++){
+      if(st->probing){
+        /* the answer is found again when the path is watched */
+        (void) stat(PNAME(st->ws, i)->path, &finfo);
+      } else {
+        startup_canon(w, i);
+      }
+    }
+  }
+}
+
+/*
+ * startup_canon
+ *
+ * Canonicalizes the path at `i' into the buffer of `w', recording the
+ * outcome in the shared array rather than reporting it, since the
+ * errors are reported in the order of the paths afterwards.
+ */
+static void
+startup_canon(struct startworker *w, int i)
+{
+  struct startup *st = w->st;
+  struct startpath *sp = &st->paths[i];
+  const char *in = st->inpaths[i];
+  char *grown = NULL;
+  size_t size;
+
+  sp->err = 0;
+  sp->msg = NULL;
+  if(w->size - w->used < PATH_MAX){
+    size = w->size == 0 ? 16 * PATH_MAX : w->size * 2;
+    grown = realloc(w->buf, size);
+    if(grown == NULL){
+      sp->err = errno;
+      sp->msg = "Unable to allocate space for path of file to watch";
+      return;
+    }
+    w->buf = grown;
+    w->size = size;
+  }
+  if(in != NULL && in[0] != '/' && st->basepath == NULL){
+    sp->err = st->cwderr;
+    sp->msg = CWD_MSG;
+    return;
+  }
+  if(path_canon(in, st->basepath, w->buf + w->used, &sp->len,
+                &sp->msg) == -1){
+    sp->err = errno;
+    return;
+  }
+  sp->off = w->used;
+  sp->hash = hash_name(w->buf + w->used, sp->len);
+  sp->worker = w->id;
+  w->used += sp->len + 1;
+}
+
+/*
+ * startup_end
+ *
+ * Frees what startup_begin() allocated, if anything.
+ */
+static void
+startup_end(struct startup *st)
+{
+  int i;
+
+  if(st->paths == NULL){
+    return;
+  }
+  for(i = 0; i < st->numworkers; i++){
+    free(st->workers[i].buf);
+  }
+  free(st->workers);
+  free(st->paths);
+  (void) pthread_mutex_destroy(&st->lock);
+  st->workers = NULL;
+  st->paths = NULL;
+}
+
+int
+watchpaths_add(struct watchset *ws, const char *inpath)
+{
+  return path_add(ws, inpath, 0, NULL);
+}
+
+int
+watchpaths_add_opts(struct watchset *ws, const struct watchpaths_opts *opts)
+{
+  if(opts_check(opts) == -1){
+    return -1;
+  }
+  return path_add(ws, opts->path, 0, opts);
+}
+
+int
+watchpaths_tree(struct watchset *ws, const char *inpath)
+{
+  return path_add(ws, inpath, 1, NULL);
+}
+
+const char *
+watchpaths_entry(struct watchset *ws)
+{
+  int i;
+
+  /* a worker sees the entry of the callback it runs */
+  for(i = 0; i < ws->poolsize; i++){
+    if(pthread_equal(ws->pool[i].thread, pthread_self())){
+      return ws->pool[i].entry;
+    }
+  }
+  return ws->entry;
+}
+
+int
+watchpaths_filter(struct watchset *ws, const char *pattern, int exclude)
+{
+  struct pathfilter *f = ws->filter;
+  /*@owned@*/ int *starts = NULL;
+  /*@owned@*/ int *stack = NULL;
+  /*@owned@*/ unsigned long *scratch = NULL;
+  int numpos = 0;
+  int start, saved;
+  size_t words;
+
+  if(pattern == NULL){
+    filter_free(ws->filter);
+    ws->filter = NULL;
+    return 0;
+  }
+  if(f == NULL){
+    f = malloc(sizeof(struct pathfilter));
+    if(f == NULL){
+      report_error("Unable to allocate patterns");
+      return -1;
+    }
+    /* all of the counts, and the state table, start out empty */
+    memset(f, 0, sizeof(struct pathfilter));
+    f->pos = NULL;
+    f->starts = NULL;
+    f->start = NULL;
+    f->scratch = NULL;
+    f->stack = NULL;
+    f->numclasses = 1;
+    ws->filter = f;
+  }
+  numpos = f->numpos;
+
+  starts = reallocarray(f->starts, (size_t) f->numstarts + 1, sizeof(int));
+  if(starts == NULL){
+    report_error("Unable to allocate patterns");
+    goto ERR;
+  }
+  f->starts = starts;
+  start = filter_compile(f, pattern,
+                         exclude ? FILTER_EXCLUDE : FILTER_INCLUDE);
+  if(start == -1){
+    goto ERR;
+  }
+  words = ((size_t) f->numpos + SET_BITS - 1) / SET_BITS;
+  scratch = reallocarray(f->scratch, words, sizeof(unsigned long));
+  if(scratch == NULL){
+    report_error("Unable to allocate patterns");
+    goto ERR;
+  }
+  f->scratch = scratch;
+  stack = reallocarray(f->stack, (size_t) f->numpos, sizeof(int));
+  if(stack == NULL){
+    report_error("Unable to allocate patterns");
+    goto ERR;
+  }
+  f->stack = stack;
+
+  /* the states built so far do not know the new pattern */
+  filter_reset(f);
+  f->starts[f->numstarts++] = start;
+  if(!exclude){
+    f->includes++;
+  }
+  f->words = words;
+  filter_classes(f);
+  return 0;
+
+ ERR:
+  f->numpos = numpos;
+  if(f->numstarts == 0){
+    saved = errno;
+    filter_free(f);
+    ws->filter = NULL;
+    errno = saved;
+  }
+  return -1;
+}
+
+/*
+ * path_add
+ *
+ * Implements watchpaths_add(), and watchpaths_tree() if `tree' is
+ * nonzero, giving the path the options of `opts' if not NULL.
+ */
+static int
+path_add(struct watchset *ws, const char *inpath, int tree,
+         /*@null@*/ const struct watchpaths_opts *opts)
+{
+  /*@owned@*/ char *basepath = NULL;
+  /*@dependent@*/ struct pathinfo *pinfo = NULL;
+  /*@dependent@*/ struct pathname *pname = NULL;
+  /*@dependent@*/ struct pathinfo *work = NULL;
+  /*@dependent@*/ struct pathinfo **worktail = NULL;
+  struct pathnode *first = NULL;
+  struct pathnode *node = NULL;
+  size_t hash, len;
+  int renew = 0;
+  int announce;
+  int ret;
+
+  ret = path_copy(ws, inpath, &basepath, &len);
+  free(basepath);
+  if(ret == -1){
+    return -1;
+  }
+  hash = hash_name(ws->pathbuf, len);
+  if(name_find(ws, ws->pathbuf, len, hash) != NULL){
+    errno = EEXIST;
+    return -1;
+  }
+
+  pinfo = pinfo_new(ws);
+  if(pinfo == NULL){
+    report_error("Unable to allocate path info storage");
+    return -1;
+  }
+  /* before the path is inserted, so that it is watched as it asks */
+  pinfo_opts(pinfo, opts);
+  debug_printf("Watching for %s\n", ws->pathbuf);
+  if(path_name(ws, pinfo, ws->pathbuf, hash, len) == -1){
+    report_error("Unable to allocate space to track elements of pathname");
+    path_remove(ws, pinfo);
+    return -1;
+  }
+  pname = PNAME(ws, pinfo->index);
+  if(path_insert(ws, pinfo, pname->path, len, &first) == -1
+#ifndef WP_INOTIFY
+     || grow_changes(ws) == -1
+#endif
+     ){
+    report_error("Unable to allocate space to track elements of pathname");
+    goto ERR;
+  }
+
+  node = pinfo->node;
+  if(tree){
+    pinfo->tree = 1;
+    node->trees++;
+    if(!node->intree){
+      tree_mark(node);
+      /* a directory already watched is watched again as a tree */
+      renew = WATCHED(node);
+    } else if(node->keep && !WATCHED(node)){
+      /* another file system mounted within a tree may be a tree too */
+      renew = WATCHED(node->parent);
+    }
+  }
+
+  /*
+   * Only the nodes created for this path need watching, and only if
+   * their parent is watched. Otherwise the parent watches for them.
+   */
+  if(renew || (first != NULL && WATCHED(first->parent))){
+    /* keep any callbacks queued by the event being dispatched */
+    work = ws->work;
+    worktail = ws->worktail;
+    ws->work = NULL;
+    ws->worktail = &ws->work;
+    /* the entries of a tree which exist at the outset are not reported */
+    announce = ws->announce;
+    ws->announce = 0;
+    if(renew){
+      node_drop(ws, node);
+      ret = node_resolve(ws, node, PARENT_FD(node), NULL);
+    } else {
+      ret = node_resolve(ws, first, PARENT_FD(first), NULL);
+    }
+    ws->announce = announce;
+    /* the path is not reported until it changes, as at the outset */
+    while(dequeue(ws) != NULL);
+    ws->work = work;
+    ws->worktail = work == NULL ? &ws->work : worktail;
+    if(ret == -1){
+      report_error("unable to watch path");
+      goto ERR;
+    }
+  }
+
+#ifndef WP_INOTIFY
+  if(!ws->dispatching){
+    grow_events(ws);
+    if(flush_dirty(ws) == -1){
+      goto ERR;
+    }
+  }
+#endif
+  if(ws->prints && !tree){
+    pinfo->print = malloc(sizeof(struct fingerprint));
+    if(pinfo->print == NULL){
+      report_error("Unable to allocate fingerprint");
+      goto ERR;
+    }
+    pinfo->print->valid = 0;
+    (void) print_check(ws, pinfo);
+  }
+  if(ws->pollms != 0 && !tree && (ws->pollall || poll_silent(ws, pinfo)) &&
+     poll_add(ws, pinfo) == -1){
+    report_error("Unable to allocate poll snapshot");
+    goto ERR;
+  }
+  if(ws->statehead != NULL && state_attach(ws, pinfo) == -1){
+    report_error("Unable to record path in state file");
+    goto ERR;
+  }
+  if(ws->tailing && ws->statehead == NULL && tail_start(ws, pinfo) == -1){
+    report_error("Unable to start tailing path");
+    errno = ENOMEM;
+    goto ERR;
+  }
+  return pinfo->index;
+
+ERR:
+  ret = errno;
+  /* the path was not watched before, so this finds `pinfo' */
+  name_remove(ws, name_find(ws, pname->path, pname->len, pname->hash));
+  path_remove(ws, pinfo);
+  errno = ret;
+  return -1;
+}
+
+int
+watchpaths_remove(struct watchset *ws, const char *inpath)
+{
+  /*@owned@*/ char *basepath = NULL;
+  /*@dependent@*/ int *slot = NULL;
+  int index;
+  size_t hash, len;
+  int found = 0;
+  int ret;
+
+  ret = path_copy(ws, inpath, &basepath, &len);
+  free(basepath);
+  if(ret == -1){
+    return -1;
+  }
+  hash = hash_name(ws->pathbuf, len);
+
+  /* watchpaths_create() may have been given the path more than once */
+  while((slot = name_find(ws, ws->pathbuf, len, hash)) != NULL){
+    index = *slot;
+    name_remove(ws, slot);
+    path_remove(ws, PINFO(ws, index));
+    found = 1;
+  }
+  if(!found){
+    errno = ENOENT;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * reap
+ *
+ * Frees the nodes and recycles the path entries removed while
+ * watchpaths_dispatch() ran, once no event or callback can refer to
+ * them, and reclaims the space of their names.
+ */
+static void
+reap(struct watchset *ws)
+{
+  struct pathnode *node = NULL;
+  struct pathinfo *pinfo = NULL;
+
+  while((node = ws->deadnodes) != NULL){
+    ws->deadnodes = node->parent;
+    node_free(node);
+  }
+  while((pinfo = ws->deadpinfo) != NULL){
+    ws->deadpinfo = pinfo->next;
+    pinfo->next = ws->freepinfo;
+    ws->freepinfo = pinfo;
+  }
+  arena_compact(ws);
+}
+
+int
+watchpaths_fd(struct watchset *ws)
+{
+#ifdef WP_INOTIFY
+  return ws->fd;
+#else
+  return ws->kq;
+#endif
+}
+
+#ifndef WP_INOTIFY
+/*
+ * collect_dirty
+ *
+ * Moves the watches on the dirty list to ws->changelist, to be passed
+ * to the next call to kevent(2).
+ *
+ * Returns the number of changes.
+ */
+static int
+collect_dirty(struct watchset *ws)
+{
+  /*@dependent@*/ struct kwatch *kw = NULL;
+  int numchanges = 0;
+
+  while((kw = ws->dirty) != NULL){
+    /* a pathnode, see struct kwatch */
+    EV_SET(&ws->changelist[numchanges++], kw->fd, EVFILT_VNODE,
+           EV_ADD | EV_MODE,
+           ((struct pathnode *) kw)->dir ? ws->typemask :
+           node_wants(ws, (struct pathnode *) kw), 0, kw);
+    unmark_dirty(ws, kw);
+  }
+  return numchanges;
+}
+
+/*
+ * flush_dirty
+ *
+ * Registers the watches on the dirty list with kqueue without waiting
+ * for events.
+ *
+ * Returns 0 if successful, returns -1 and sets errno otherwise.
+ */
+static int
+flush_dirty(struct watchset *ws)
+{
+  struct timespec zero = {0, 0};
+  int numchanges;
+
+  numchanges = collect_dirty(ws);
+  if(numchanges > 0 &&
+     -1 == kevent(ws->kq, ws->changelist, numchanges, NULL, 0, &zero)){
+    report_error("error registering events");
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * grow_changes
+ *
+ * Makes room in ws->changelist for every node to be dirty at once,
+ * doubling its size as needed.
+ *
+ * Returns 0 if successful, returns -1 and sets errno otherwise.
+ */
+static int
+grow_changes(struct watchset *ws)
+{
+  /*@owned@*/ struct kevent *grown = NULL;
+  size_t count = ws->maxnodes == 0 ? 16 : ws->maxnodes;
+
+  if(ws->numnodes <= ws->maxnodes){
+    return 0;
+  }
+  while(count < ws->numnodes){
+    count *= 2;
+  }
+  grown = reallocarray(ws->changelist, count, sizeof(struct kevent));
+  if(grown == NULL){
+    return -1; /* keeps errno */
+  }
+  ws->changelist = grown;
+  ws->maxnodes = count;
+  return 0;
+}
+
+/*
+ * grow_events
+ *
+ * Makes room in ws->eventbuff for an event per node and an error, as
+ * far as memory allows. A smaller buffer only means that events are
+ * retrieved over more calls to kevent(2). The buffer must not move
+ * while its events are being handled.
+ */
+static void
+grow_events(struct watchset *ws)
+{
+  /*@owned@*/ struct kevent *grown = NULL;
+  size_t count = ws->maxevents == 0 ? 16 : ws->maxevents;
+
+  /* Following "+ 1" is to include space for an error event per kevent(2) */
+  if(ws->numnodes + 1 <= ws->maxevents){
+    return;
+  }
+  while(count < ws->numnodes + 1){
+    count *= 2;
+  }
+  grown = reallocarray(ws->eventbuff, count, sizeof(struct kevent));
+  if(grown != NULL){
+    ws->eventbuff = grown;
+    ws->maxevents = count;
+  }
+}
+#endif
+
+int
+watchpaths_dispatch(struct watchset *ws, int max_events)
+{
+  int ret;
+
+  /* removals made by callbacks are finished by reap() */
+  ws->dispatching = 1;
+  ws->announce = 1;
+  ret = dispatch_events(ws, max_events);
+  ws->announce = 0;
+  /* the events gathered before an error are still reported */
+  tree_flush(ws);
+  flush_batch(ws);
+  ws->dispatching = 0;
+  if(ws->entries != NULL){
+    /* no callback can see the entries reported any longer */
+    arena_free(ws->entries->next);
+    ws->entries->next = NULL;
+    ws->entries->used = 0;
+  }
+  reap(ws);
+#ifndef WP_INOTIFY
+  /* catch up with the paths added by callbacks */
+  grow_events(ws);
+#endif
+  if(ws->pool != NULL && SHARED_GET(&ws->halted)){
+    ws->cont = 0;
+  }
+  return ret;
+}
+
+/*
+ * mark_read
+ *
+ * Counts and traces a read of the queue which found `count' events, and
+ * takes the time of the read, see set_now(), as that of the events.
+ */
+static void
+mark_read(struct watchset *ws, unsigned long count)
+{
+  ws->origin = ws->nowns;
+  trace_add(ws, WP_TRACE_READ, -1, 0,
+            count > INT_MAX ? INT_MAX : (int) count, ws->origin, ws->origin);
+  STAT_INC(ws->stats.wakeups);
+  STAT_ADD(ws->stats.events, count);
+  if(count > ws->stats.batchmax){
+    STAT_ADD(ws->stats.batchmax, count - ws->stats.batchmax);
+  }
+}
+
+#ifdef WP_INOTIFY
+/*
+ * inotify_count
+ *
+ * Returns the number of events in the `len' bytes read into `buf'.
+ */
+static unsigned long
+inotify_count(const char *buf, size_t len)
+{
+  const struct inotify_event *ie = NULL;
+  unsigned long count = 0;
+  size_t off;
+
+  for(off = 0; off < len; off += sizeof(struct inotify_event) + ie->len){
+    ie = (const struct inotify_event *) (buf + off);
+    count++;
+  }
+  return count;
+}
+#endif
+
+/*
+ * dispatch_events
+ *
+ * Implements watchpaths_dispatch().
+ */
+static int
+dispatch_events(struct watchset *ws, int max_events)
+{
+  int handled = 0;
+#ifdef WP_INOTIFY
+  /*@dependent@*/ struct inotify_event *evt = NULL;
+  ssize_t eventlen = 0;
+#else
+  /*@dependent@*/ struct kevent *evt = NULL;
+  struct timespec zero = {0, 0};
+  int eventcount = 0;
+  int numchanges = 0;
+  int want = 0;
+#endif
+
+  ws->cont = 1;
+  ws->origin = 0;
+  state_deliver(ws);
+  while(ws->cont != 0 && (max_events <= 0 || handled < max_events)){
+#ifdef WP_INOTIFY
+    if(ws->evoff >= ws->evlen){
+      eventlen = read(ws->fd, ws->eventbuff, EVENT_BUFF_SIZE);
+      if(eventlen == -1 && errno == EINTR){
+        continue;
+      } else if(eventlen == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+        /* drained */
+        break;
+      } else if(eventlen <= 0){
+        report_error("error reading inotify events");
+        return -1;
+      }
+      ws->evoff = 0;
+      ws->evlen = (size_t) eventlen;
+      set_now(ws);
+      mark_read(ws, inotify_count(ws->eventbuff, ws->evlen));
+    }
+
+    evt = (struct inotify_event *) (ws->eventbuff + ws->evoff);
+    ws->evoff += sizeof(struct inotify_event) + evt->len;
+    handled++;
+
+    if(evt->mask & IN_Q_OVERFLOW){
+      /*
+       * events were dropped, so every node must look again, and any
+       * of the paths might have been written
+       */
+      debug_print("Event queue overflowed. Checking all paths.\n");
+      if(node_rescan(ws, ws->root) == -1){
+        return -1;
+      }
+      deliver(ws, NOTE_WRITE, NULL);
+    } else if(inotify_event(ws, evt) == -1){
+      return -1;
+    }
+    tree_flush(ws);
+#else
+    want = ws->maxevents > INT_MAX ? INT_MAX : (int) ws->maxevents;
+    if(max_events > 0 && max_events - handled < want){
+      want = max_events - handled;
+    }
+
+    /* register only the watches whose descriptors changed */
+    numchanges = collect_dirty(ws);
+    evt = ws->eventbuff;
+    eventcount = kevent(ws->kq, ws->changelist, numchanges, evt, want, &zero);
+    if(eventcount == -1){
       report_error("error calling kevent");
+      return -1;
+    }
+
+    set_now(ws);
+    if(eventcount > 0){
+      mark_read(ws, (unsigned long) eventcount);
+    }
+    /* events retrieved are all handled, as EV_CLEAR would lose them */
+    for(; evt < &ws->eventbuff[eventcount]; evt++){
+      if(evt->flags & EV_ERROR){
+        errno = (int) evt->data;
+        report_error("error in event list");
+        return -1;
+      }
+      handled++;
+      if(kqueue_event(ws, evt) == -1){
+        return -1;
+      }
+      tree_flush(ws);
+    }
+    if(eventcount < want){
+      /* drained */
+      break;
+    }
+#endif
+  }
+  /* what follows was not read from the kernel */
+  ws->origin = 0;
+
+  fire_due(ws);
+  if(poll_run(ws) == -1){
+    return -1;
+  }
+  wheel_run(ws, ws->now);
+
+#ifndef WP_INOTIFY
+  /* make the descriptor report events for the watches armed above */
+  if(flush_dirty(ws) == -1){
+    return -1;
+  }
+#endif
+  return handled;
+}
+
+int
+watchpaths_debounce(struct watchset *ws, int quiet_ms, int max_ms)
+{
+  size_t i;
+
+  if(quiet_ms < 0 || max_ms < 0){
+    errno = EINVAL;
+    return -1;
+  }
+  ws->quiet = quiet_ms;
+  ws->maxdelay = max_ms;
+
+  /* the events already pending fall due under the new rules */
+  ws->now = now_ms();
+  for(i = 0; i < ws->heapused; i++){
+    if(ws->quiet == 0 || ws->heap[i]->due > ws->now + ws->quiet){
+      ws->heap[i]->due = ws->quiet == 0 ? ws->now : ws->now + ws->quiet;
+    }
+    if(ws->maxdelay != 0 &&
+       ws->heap[i]->first + ws->maxdelay < ws->heap[i]->due){
+      ws->heap[i]->due = ws->heap[i]->first + ws->maxdelay;
+    }
+  }
+  /* rebuild the heap bottom up */
+  for(i = ws->heapused / 2; i > 0; i--){
+    heap_down(ws, i - 1);
+  }
+  return 0;
+}
+
+void
+watchpaths_batch(struct watchset *ws,
+                 /*@null@*/ void (*batch) (const struct watchpaths_event *,
+                                          int, void *, int *))
+{
+  /* anything gathered is delivered by the callback it was gathered for */
+  flush_batch(ws);
+  ws->batch = batch;
+}
+
+int
+watchpaths_open(struct watchset *ws,
+                /*@null@*/ void (*opened) (u_int, int,
+                                           const struct watchpaths_file *,
+                                           void *, int *),
+                int flags, int map)
+{
+  int i;
+
+  if((flags & (O_CREAT | O_EXCL | O_TRUNC)) != 0 ||
+     (map && (flags & O_ACCMODE) == O_WRONLY)){
+    errno = EINVAL;
+    return -1;
+  }
+  if(ws->dispatching || ws->pool != NULL){
+    errno = EBUSY;
+    return -1;
+  }
+  for(i = 0; i < ws->numpaths; i++){
+    /* opened for another mode, or no longer wanted */
+    if(opened == NULL){
+      file_free(ws, PINFO(ws, i));
+    } else if(PINFO(ws, i)->file != NULL){
+      file_drop(ws, PINFO(ws, i)->file);
+    }
+  }
+  ws->opened = opened;
+  ws->openflags = flags;
+  ws->openmap = map != 0;
+  if(opened == NULL){
+    ws->tailing = 0;
+  }
+  return 0;
+}
+
+int
+watchpaths_tail(struct watchset *ws, int on)
+{
+  struct pathinfo *pinfo = NULL;
+  int i, pending;
+
+  if(ws->dispatching){
+    errno = EBUSY;
+    return -1;
+  }
+  if(on && ws->opened == NULL){
+    errno = EINVAL;
+    return -1;
+  }
+  if(!on){
+    ws->tailing = 0;
+    for(i = 0; i < ws->numpaths; i++){
+      if(PINFO(ws, i)->file != NULL){
+        PINFO(ws, i)->file->tdev = (dev_t) -1;
+      }
+    }
+    return 0;
+  }
+  ws->tailing = 1;
+  for(i = 0; i < ws->numpaths; i++){
+    pinfo = PINFO(ws, i);
+    pending = tail_start(ws, pinfo);
+    if(pending == 1){
+      pending = state_miss(ws, i);
+    }
+    if(pending == -1){
+      report_error("Unable to start tailing path");
+      (void) watchpaths_tail(ws, 0);
+      errno = ENOMEM;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int
+watchpaths_workers(struct watchset *ws, int threads)
+{
+  /*@owned@*/ struct cbworker *pool = NULL;
+  struct cbworker *w = NULL;
+  int i, err = 0;
+
+  if(threads < 0){
+    errno = EINVAL;
+    return -1;
+  }
+  if(ws->dispatching || (threads > 0 && ws->opened != NULL)){
+    errno = EBUSY;
+    return -1;
+  }
+  pool_stop(ws);
+  SHARED_SET(&ws->halted, 0);
+  if(threads == 0){
+    return 0;
+  }
+
+  if(ws->haltpipe[0] == -1){
+    if(-1 == pipe(ws->haltpipe)){
+      report_error("Unable to create worker pipe");
+      return -1;
+    }
+    STAT_ADD(ws->stats.descriptors, 2UL);
+    for(i = 0; i < 2; i++){
+      (void) fcntl(ws->haltpipe[i], F_SETFD, FD_CLOEXEC);
+      (void) fcntl(ws->haltpipe[i], F_SETFL,
+                   fcntl(ws->haltpipe[i], F_GETFL) | O_NONBLOCK);
+    }
+  }
+  pool = reallocarray(NULL, (size_t) threads, sizeof(struct cbworker));
+  if(pool == NULL){
+    report_error("Unable to allocate workers");
+    return -1;
+  }
+
+  for(i = 0; i < threads; i++){
+    w = &pool[i];
+    w->head = 0;
+    w->tail = 0;
+    w->sleeping = 0;
+    w->waiting = 0;
+    w->quit = 0;
+    w->deepest = 0;
+    w->entry = NULL;
+    w->ws = ws;
+    if((err = pthread_mutex_init(&w->lock, NULL)) != 0){
+      break;
+    }
+    if((err = pthread_cond_init(&w->wake, NULL)) != 0){
+      (void) pthread_mutex_destroy(&w->lock);
+      break;
+    }
+    if((err = pthread_cond_init(&w->room, NULL)) != 0){
+      (void) pthread_cond_destroy(&w->wake);
+      (void) pthread_mutex_destroy(&w->lock);
+      break;
+    }
+    if((err = pthread_create(&w->thread, NULL, pool_work, w)) != 0){
+      (void) pthread_cond_destroy(&w->room);
+      (void) pthread_cond_destroy(&w->wake);
+      (void) pthread_mutex_destroy(&w->lock);
+      break;
+    }
+  }
+  /* the workers started are stopped again if any failed to */
+  ws->pool = pool;
+  ws->poolsize = i;
+  if(err != 0){
+    pool_stop(ws);
+    errno = err;
+    report_error("Unable to start workers");
+    return -1;
+  }
+  return 0;
+}
+
+void
+watchpaths_queued(struct watchset *ws, struct watchpaths_queue *queue)
+{
+  struct cbworker *w = NULL;
+  int i;
+
+  queue->queued = 0;
+  queue->deepest = 0;
+  queue->handed = ws->handed;
+  queue->stalls = ws->stalls;
+  for(i = 0; i < ws->poolsize; i++){
+    w = &ws->pool[i];
+    queue->queued += w->tail - SHARED_GET(&w->head);
+    if(w->deepest > queue->deepest){
+      queue->deepest = w->deepest;
+    }
+  }
+}
+
+void
+watchpaths_stats(struct watchset *ws, struct watchpaths_stats *stats)
+{
+  stats->wakeups = STAT_GET(ws->stats.wakeups);
+  stats->events = STAT_GET(ws->stats.events);
+  stats->batchmax = STAT_GET(ws->stats.batchmax);
+  stats->deletes = STAT_GET(ws->stats.deletes);
+  stats->writes = STAT_GET(ws->stats.writes);
+  stats->attribs = STAT_GET(ws->stats.attribs);
+  stats->renames = STAT_GET(ws->stats.renames);
+  stats->rechecks = STAT_GET(ws->stats.rechecks);
+  stats->rearms = STAT_GET(ws->stats.rearms);
+  stats->callbacks = STAT_GET(ws->stats.callbacks);
+  stats->suppressed = STAT_GET(ws->stats.suppressed);
+  stats->polls = STAT_GET(ws->stats.polls);
+  stats->paths = STAT_GET(ws->stats.paths);
+  stats->watches = STAT_GET(ws->stats.watches);
+  stats->descriptors = STAT_GET(ws->stats.descriptors);
+}
+
+int
+watchpaths_fingerprint(struct watchset *ws, int on)
+{
+  struct pathinfo *pinfo = NULL;
+  int i;
+
+  if(!on){
+    ws->prints = 0;
+    for(i = 0; i < ws->numpaths; i++){
+      pinfo = PINFO(ws, i);
+      free(pinfo->print);
+      pinfo->print = NULL;
+    }
+    free(ws->printbuf);
+    ws->printbuf = NULL;
+    return 0;
+  }
+
+  if(ws->printbuf == NULL){
+    ws->printbuf = malloc(PRINT_BUFF_SIZE);
+    if(ws->printbuf == NULL){
+      report_error("Unable to allocate fingerprint buffer");
+      return -1;
+    }
+  }
+  ws->prints = 1;
+  for(i = 0; i < ws->numpaths; i++){
+    pinfo = PINFO(ws, i);
+    if(pinfo->node == NULL || pinfo->tree || pinfo->print != NULL){
+      continue;
+    }
+    pinfo->print = malloc(sizeof(struct fingerprint));
+    if(pinfo->print == NULL){
+      report_error("Unable to allocate fingerprint");
+      (void) watchpaths_fingerprint(ws, 0);
+      errno = ENOMEM;
+      return -1;
+    }
+    pinfo->print->valid = 0;
+    (void) print_check(ws, pinfo);
+  }
+  return 0;
+}
+
+int
+watchpaths_poll(struct watchset *ws, int interval_ms, int force)
+{
+  struct pathinfo *pinfo = NULL;
+  int i;
+
+  if(interval_ms < 0){
+    errno = EINVAL;
+    return -1;
+  }
+  ws->pollms = interval_ms;
+  ws->pollall = force;
+  for(i = 0; i < ws->numpaths; i++){
+    pinfo = PINFO(ws, i);
+    if(pinfo->node == NULL || pinfo->tree){
+      continue;
+    }
+    if(interval_ms == 0 || !(force || poll_silent(ws, pinfo))){
+      poll_drop(ws, pinfo);
+    } else if(poll_add(ws, pinfo) == -1){
+      report_error("Unable to allocate poll snapshot");
+      (void) watchpaths_poll(ws, 0, 0);
+      return -1;
+    }
+  }
+  /* a new sweep begins at once */
+  ws->pollnext = 0;
+  ws->pollstart = now_ms();
+  ws->polldue = ws->pollstart;
+  return 0;
+}
+
+int
+watchpaths_state(struct watchset *ws, const char *file)
+{
+  int i, saved_errno;
+
+  state_close(ws);
+  if(file == NULL){
+    return 0;
+  }
+  if(state_open(ws, file) == -1){
+    report_error("Unable to open state file");
+    return -1;
+  }
+  for(i = 0; i < ws->numpaths; i++){
+    if(state_attach(ws, PINFO(ws, i)) == -1){
+      saved_errno = errno;
+      report_error("Unable to record path in state file");
+      state_close(ws);
+      errno = saved_errno;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int
+watchpaths_trace(struct watchset *ws, const char *file, size_t records)
+{
+  struct watchpaths_tracehead *head = NULL;
+  size_t cap, size;
+  int fd, saved_errno;
+
+  if(ws->dispatching || ws->pool != NULL){
+    /* a callback or a worker may be adding a record */
+    errno = EBUSY;
+    return -1;
+  }
+  trace_close(ws);
+  if(file == NULL){
+    return 0;
+  }
+  if(records == 0 || records > TRACE_MAX){
+    errno = EINVAL;
+    return -1;
+  }
+  for(cap = 1; cap < records; cap *= 2);
+  size = sizeof(struct watchpaths_tracehead) +
+    cap * sizeof(struct watchpaths_trace);
+
+  while((fd = open(file, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) ==
+        -1 && errno == EINTR);
+  if(fd == -1){
+    report_error("Unable to open trace file");
+    return -1;
+  }
+  if(-1 == ftruncate(fd, (off_t) size) ||
+     MAP_FAILED == (head = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                MAP_SHARED, fd, 0))){
+    saved_errno = errno;
+    report_error("Unable to map trace file");
+    while(-1 == close(fd) && errno == EINTR);
+    errno = saved_errno;
+    return -1;
+  }
+  /* the mapping outlives the descriptor */
+  while(-1 == close(fd) && errno == EINTR);
+
+  memcpy(head->magic, WP_TRACE_MAGIC, sizeof(head->magic));
+  head->order = WP_TRACE_ORDER;
+  head->version = WP_TRACE_VERSION;
+  head->recsize = (uint32_t) sizeof(struct watchpaths_trace);
+  head->capacity = cap;
+  head->head = 0;
+  ws->trace = head;
+  ws->tracesize = size;
+  return 0;
+}
+
+void
+watchpaths_trace_note(struct watchset *ws, int kind, int index, int value)
+{
+  long long origin = ws->cborigin;
+  int i;
+
+  /* a worker notes the origin of the callback it runs */
+  for(i = 0; i < ws->poolsize; i++){
+    if(pthread_equal(ws->pool[i].thread, pthread_self())){
+      origin = ws->pool[i].origin;
+    }
+  }
+  trace_add(ws, kind, index, 0, value, origin, now_ns());
+}
+
+int
+watchpaths_latency(struct watchset *ws, int stage,
+                   struct watchpaths_latency *lat)
+{
+  static const double marks[] = {0.5, 0.9, 0.99, 0.999};
+  long long *values[4];
+  unsigned long counts[HIST_BUCKETS];
+  unsigned long seen = 0;
+  size_t i;
+  int next = 0;
+
+  if(stage < 0 || stage >= WP_STAGES){
+    errno = EINVAL;
+    return -1;
+  }
+  values[0] = &lat->p50;
+  values[1] = &lat->p90;
+  values[2] = &lat->p99;
+  values[3] = &lat->p999;
+  memset(lat, 0, sizeof(*lat));
+  /* a copy, so that the percentiles agree with the count */
+  for(i = 0; i < HIST_BUCKETS; i++){
+    counts[i] = STAT_GET(ws->hist[stage].counts[i]);
+    lat->count += counts[i];
+  }
+  for(i = 0; i < HIST_BUCKETS; i++){
+    if(counts[i] == 0){
+      continue;
+    }
+    seen += counts[i];
+    while(next < 4 && (double) seen >= marks[next] * (double) lat->count){
+      *values[next++] = hist_top(i);
+    }
+    lat->max = hist_top(i);
+  }
+  return 0;
+}
+
+int
+watchpaths_deadline(struct watchset *ws, int index, int ms)
+{
+  struct pathinfo *pinfo = NULL;
+
+  if(index < 0 || index >= ws->numpaths || ms < 0 ||
+     PNAME(ws, index)->path == NULL){
+    errno = EINVAL;
+    return -1;
+  }
+  pinfo = PINFO(ws, index);
+  timer_del(ws, &pinfo->timer);
+  pinfo->deadline = ms;
+  if(ms != 0){
+    pinfo->timer.expires = now_ms() + ms;
+    timer_add(ws, &pinfo->timer);
+  }
+  return 0;
+}
+
+int
+watchpaths_tick(struct watchset *ws, int ms)
+{
+  if(ms < 0){
+    errno = EINVAL;
+    return -1;
+  }
+  timer_del(ws, &ws->tick);
+  ws->tickms = ms;
+  if(ms != 0){
+    ws->tick.expires = now_ms() + ms;
+    timer_add(ws, &ws->tick);
+  }
+  return 0;
+}
+
+int
+watchpaths_timeout(struct watchset *ws)
+{
+  long long due;
+  long long wait;
+
+  if(ws->nummissed > 0){
+    /* changes made while nothing watched are reported at once */
+    return 0;
+  }
+  /* the nearest of the next debounced callback, deadline and poll */
+  due = wheel_next(ws);
+  if(ws->heapused > 0 && (due == -1 || ws->heap[0]->due < due)){
+    due = ws->heap[0]->due;
+  }
+  if(ws->numpolled > 0 && (due == -1 || ws->polldue < due)){
+    due = ws->polldue;
+  }
+  if(due == -1){
+    return -1;
+  }
+  wait = due - now_ms();
+  if(wait < 0){
+    return 0;
+  }
+  return wait > INT_MAX ? INT_MAX : (int) wait;
+}
+
+int
+watchpaths_run(struct watchset *ws)
+{
+  struct pollfd pfd[2];
+  char drain[64];
+  int i;
+
+  pfd[0].fd = watchpaths_fd(ws);
+  pfd[0].events = POLLIN;
+  /* a negative descriptor is ignored by poll(2) */
+  pfd[1].fd = ws->haltpipe[0];
+  pfd[1].events = POLLIN;
+  SHARED_SET(&ws->halted, 0);
+  ws->cont = 1;
+  while(ws->cont != 0){
+    /* wake for the next debounced callback or deadline, if any */
+    if(-1 == poll(pfd, 2, watchpaths_timeout(ws))){
+      if(errno == EINTR){
+        continue;
+      }
+      report_error("error waiting for events");
+      return -1;
+    }
+    if(pfd[1].fd != -1 && pfd[1].revents & POLLIN){
+      while(read(pfd[1].fd, drain, sizeof(drain)) > 0);
+    }
+    if(-1 == watchpaths_dispatch(ws, 0)){
       /* exit to stop loops */
-      goto ERR;
+      return -1;
     }
   }
+  /* no callback runs once this returns */
+  for(i = 0; i < ws->poolsize; i++){
+    pool_wait(&ws->pool[i], 0);
+  }
+  return 0;
+}
 
-  ret = 0;
+void
+watchpaths_destroy(struct watchset *ws)
+{
+  int i;
 
-ERR:
-  if(pinfos){
-    for(i = 0; i < numpaths; i++){
-      free(pinfos[i].slashes);
-      free(pinfos[i].path);
+  if(ws == NULL){
+    return;
+  }
+  /* the callbacks handed over are run before anything goes away */
+  pool_stop(ws);
+  state_close(ws);
+  trace_close(ws);
+  for(i = 0; i < 2; i++){
+    if(ws->haltpipe[i] != -1){
+      while(-1 == close(ws->haltpipe[i]) && errno == EINTR);
     }
   }
-  free(basepath);
-  free(pinfos);
-  free(changelist);
-  free(eventbuff);
+  reap(ws);
+  if(ws->root != NULL){
+    node_free(ws->root);
+  }
+#ifdef WP_INOTIFY
+  if(ws->fd != -1){
+    /* closing the descriptor drops every watch at once */
+    while(-1 == close(ws->fd) && errno == EINTR);
+  }
+  free(ws->slots);
+#else
+  if(ws->kq != -1){
+    while(-1 == close(ws->kq) && errno == EINTR);
+  }
+  free(ws->changelist);
+#endif
+  for(i = 0; i < ws->numpaths; i++){
+    free(PINFO(ws, i)->print);
+    file_free(ws, PINFO(ws, i));
+  }
+  for(i = 0; i < ws->maxpaths >> SLAB_BITS; i++){
+    free(ws->slabs[i]);
+  }
+  free(ws->slabs);
+  arena_free(ws->arena);
+  free(ws->byname);
+  free(ws->heap);
+  free(ws->batchbuf);
+  free(ws->treeq);
+  arena_free(ws->entries);
+  filter_free(ws->filter);
+  free(ws->printbuf);
+  free(ws->snaps);
+#ifdef __linux__
+  free(ws->crawlbuf);
+#endif
+#ifdef WP_URING
+  ring_close(ws);
+  free(ws->pollbatch);
+#endif
+  free(ws->eventbuff);
+  free(ws);
+}
+
+int
+watchpaths(char **inpaths, int numpaths,
+           void (*callback) (u_int, int, void *, int *), void *blob)
+{
+  /*@owned@*/ struct watchset *ws = NULL;
+  int ret; /* stores return value for watchpaths */
+  int saved_errno;
+
+  ws = watchpaths_create(inpaths, numpaths, callback, blob);
+  if(ws == NULL){
+    return -1;
+  }
+  ret = watchpaths_run(ws);
+
+  saved_errno = errno;
+  watchpaths_destroy(ws);
+  errno = saved_errno;
+  return ret;
+}
+
+int
+watchpaths_opts(const struct watchpaths_opts *paths, int numpaths,
+                void (*callback) (u_int, int, void *, int *), void *blob)
+{
+  /*@owned@*/ struct watchset *ws = NULL;
+  int ret;
+  int saved_errno;
+
+  ws = watchpaths_create_opts(paths, numpaths, callback, blob, 1);
+  if(ws == NULL){
+    return -1;
+  }
+  ret = watchpaths_run(ws);
+
+  saved_errno = errno;
+  watchpaths_destroy(ws);
+  errno = saved_errno;
   return ret;
 }
@@ -33,6 +33,8 @@
 #define __watchpaths_h_
 
 #include <sys/types.h>
+#include <stdint.h>
+#include <time.h>
 
 #ifndef u_int
 #ifdef uint32_t
@@ -50,6 +52,69 @@
 #endif
 #endif
 
+/*
+ * watchpaths uses inotify(7) on Linux and kqueue(2) elsewhere. Define
+ * WP_KQUEUE to use kqueue on Linux as well, such as via libkqueue.
+ */
+#if defined(__linux__) && !defined(WP_KQUEUE)
+#define WP_INOTIFY
+#endif
+
+#ifdef WP_INOTIFY
+/*
+ * inotify has no equivalent of the EVFILT_VNODE fflags, so events are
+ * translated to these values, which match those of kevent(2).
+ */
+#define NOTE_DELETE     0x0001
+#define NOTE_WRITE      0x0002
+#define NOTE_EXTEND     0x0004
+#define NOTE_ATTRIB     0x0008
+#define NOTE_LINK       0x0010
+#define NOTE_RENAME     0x0020
+#else
+#include <sys/event.h>
+#endif
+
+/*
+ * fflags passed to the callback for the timers set by
+ * watchpaths_deadline() and watchpaths_tick(). They are clear of those
+ * of kevent(2).
+ */
+#define WP_STALE        0x40000000
+#define WP_TICK         0x80000000
+
+/*
+ * fflags added for the open callback in tail mode when the range passed
+ * starts afresh at the beginning of the file, see watchpaths_tail().
+ */
+#define WP_TRUNCATED    0x20000000
+#define WP_ROTATED      0x10000000
+
+/*
+ * The stages whose latencies are kept, see watchpaths_latency().
+ */
+#define WP_STAGE_DISPATCH 0 /* from reading an event until it is due */
+#define WP_STAGE_QUEUE    1 /* from due until a worker starts the callback */
+#define WP_STAGE_CALLBACK 2 /* from the start of the callback to its end */
+#define WP_STAGES         3
+
+/*
+ * The kinds of the records of a trace, see watchpaths_trace(). The
+ * last three are for callers which run a program for each callback, as
+ * fwatch does, and are only recorded by watchpaths_trace_note().
+ */
+#define WP_TRACE_READ   1 /* events read from the kernel, `value' of them */
+#define WP_TRACE_DUE    2 /* a callback fell due */
+#define WP_TRACE_START  3 /* the callback started, or a batch callback */
+#define WP_TRACE_FINISH 4 /* the callback returned */
+#define WP_TRACE_FORK   5 /* about to fork */
+#define WP_TRACE_EXEC   6 /* about to exec, in process `value' */
+#define WP_TRACE_EXIT   7 /* the child exited with wait status `value' */
+
+#define WP_TRACE_MAGIC   "WPTRACE"
+#define WP_TRACE_ORDER   0x0102030405060708ULL
+#define WP_TRACE_VERSION 1
+
 /*
  * Execute a callback whenever the contents of one of the specified
  * paths is modified. The files described by the paths do not need to
@@ -75,7 +140,13 @@
  *
  * u_int fflags: A bit mask describing which event triggered the
  *               callback See list of fflags defined for EVFILT_VNODE
- *               in kevent(2)
+ *               in kevent(2). With inotify, only NOTE_DELETE,
+ *               NOTE_WRITE, NOTE_RENAME and NOTE_ATTRIB are reported;
+ *               appends and truncations are reported as NOTE_WRITE.
+ *               NOTE_ATTRIB comes only from polling, see
+ *               watchpaths_poll(), when the change time of a path
+ *               alone has changed, and only if the mask of the path
+ *               names it, see struct watchpaths_opts.
  *
  * int   index:  The index (in inpaths) of the pathname whose
  *               modification triggered the callback invocation
@@ -92,6 +163,575 @@
 int watchpaths(char **inpaths, int numpaths,
                void (*callback) (u_int, int, void *, int *), void *blob);
 
+/*
+ * The functions below divide the work of watchpaths() so that a watch
+ * set can be serviced from an existing event loop alongside sockets,
+ * timers and other watch sets, rather than taking over a thread.
+ *
+ * watchpaths_create() begins watching the paths, taking the same
+ * arguments as watchpaths(), and returns a handle to the watch set. It
+ * returns NULL and sets errno on failure. No callbacks are made until
+ * watchpaths_dispatch() is called.
+ *
+ * watchpaths_fd() returns a descriptor which becomes readable, as
+ * reported by poll(2), select(2) or epoll(7), when the watch set has
+ * events to dispatch. The descriptor belongs to the watch set and must
+ * not be read or closed by the caller.
+ *
+ * watchpaths_create_threads() is watchpaths_create() for very large
+ * watch sets, spreading the canonicalization of the paths, and the
+ * lookup of the directories along them, over up to `threads' threads.
+ * The watches themselves are still registered one at a time, in order,
+ * so the watch set, its indexes and the error reported for the first
+ * bad path are the same as those of watchpaths_create(). Small watch
+ * sets are handled without starting any thread.
+ *
+ * watchpaths_create_opts() is watchpaths_create_threads() for paths
+ * which are not all alike, taking a struct watchpaths_opts for each
+ * rather than its name alone. A path may ask for only some of the
+ * fflags, so that the events it does not want are dropped by the kernel
+ * where it can, and do not wake the process; a file is then watched for
+ * its removal and renaming and for its content only if asked, while
+ * directories, and the files within trees, are watched for everything
+ * as before. A path may carry a pointer passed to the callbacks for it
+ * in place of `blob', so that the callback reaches its own state for
+ * the path without looking the index up in an array of its own, and
+ * the flags the open callback opens it with, see watchpaths_open().
+ * Returns NULL with errno set to EINVAL if the flags of a path would
+ * create or truncate the file, and otherwise as watchpaths_create().
+ * watchpaths_opts() is watchpaths() for the same arguments, less
+ * `threads'.
+ *
+ * watchpaths_dispatch() handles the events which are ready, invoking
+ * the callback as watchpaths() would, along with the callbacks for any
+ * debounced events which are due, and returns without blocking. At
+ * most `max_events' events are handled, or every ready event if
+ * `max_events' is zero or less. If the callback sets *cont to zero,
+ * no further events are read until the next call. Returns the number
+ * of events handled, which may be zero, or -1 if watching can not
+ * continue, in which case the watch set should be destroyed. When the
+ * return value is `max_events', more events may be ready even though
+ * the descriptor does not report them, so call again before waiting.
+ *
+ * watchpaths_debounce() makes the watch set coalesce bursts of events,
+ * such as those of a writer appending in small chunks. The fflags of
+ * the events for a path are held back and ORed together until no event
+ * has been seen for the path for `quiet_ms' milliseconds, or until
+ * `max_ms' milliseconds have passed since the first of them, whichever
+ * comes first, and are then passed to a single callback. A `max_ms' of
+ * zero sets no limit, and a `quiet_ms' of zero reports every event at
+ * once, which is the default. Returns 0, or -1 with errno set to EINVAL
+ * if either value is negative.
+ *
+ * watchpaths_batch() makes the watch set pass the events of each
+ * watchpaths_dispatch() to `batch' in a single call rather than invoke
+ * the callback once per event, so that the receiver can amortize its
+ * own work, such as a queue push or a database transaction, over all of
+ * them. `events' holds `count' records, in the order the callback would
+ * have seen them, and is only valid until the batch callback returns.
+ * The storage is kept by the watch set and reused, so delivery does not
+ * allocate once it has grown to fit the busiest dispatch. `data' and
+ * `cont' are as for the callback; setting *cont to zero stops
+ * watchpaths_run(). Passing NULL restores per-event callbacks, and the
+ * callback given to watchpaths_create() may be NULL if a batch callback
+ * is installed before the first dispatch.
+ *
+ * watchpaths_open() makes the watch set invoke `opened' for each event
+ * rather than the callback, passing the file now at the path already
+ * open, so that a callback which reads the changed file at once does
+ * not look it up and open it again. The file is opened with `flags',
+ * as for open(2), along with O_CLOEXEC, and if `map' is nonzero a
+ * regular file is mapped read-only and whole as well. The descriptor
+ * and the mapping are kept and handed over again for the next event
+ * while the path names the same file, the mapping while its size is
+ * the same too, and are replaced once it does not. With kqueue, when
+ * `flags' is the mode its watches are opened with, O_EVTONLY where the
+ * system has it and O_RDONLY elsewhere, the descriptor of the watch is
+ * handed over and no other is opened. Both belong to the watch set:
+ * they must not be closed or unmapped, and are only valid until the
+ * callback returns or the path is removed. The file offset is kept
+ * from one event to the next, so read with pread(2). A file truncated
+ * while its mapping is read raises SIGBUS, as for any mapping. One
+ * descriptor is held for each path with an event, so a large watch
+ * set may need a higher RLIMIT_NOFILE. The descriptor is -1 for the
+ * tick, for the entries and roots of trees, and for a path which is
+ * missing or could not be opened; `view' is NULL unless the file was
+ * mapped. `data' and `cont' are as for the callback, and a batch
+ * callback still takes precedence. Passing NULL restores the callback
+ * and closes the files held. Returns 0, or -1 with errno set, to
+ * EINVAL if `flags' would create or truncate the file, or ask for a
+ * mapping of one open for writing only, or to EBUSY if called from a
+ * callback or while there are workers.
+ *
+ * watchpaths_tail() puts the open callback into tail mode, for
+ * following files which are appended to, such as logs: the watch set
+ * keeps how far into each file it has passed, and gives the callback
+ * only the bytes appended since, as `offset' and `length', to be read
+ * from `fd' with pread(2), or sent on with sendfile(2) or splice(2),
+ * or read from `view' at `offset'. An event which appends nothing
+ * invokes no callback. Each file is followed from its end as it is when
+ * tailing starts, or from its beginning if it is created later. A file
+ * which shrinks is passed again from its beginning, with WP_TRUNCATED
+ * added to the fflags, and a file found in place of the one followed,
+ * as when a log is rotated, from its beginning with WP_ROTATED; the
+ * bytes appended to the old file before it was renamed away are passed
+ * first, through the descriptor still open on it. With a state file,
+ * see watchpaths_state(), how far each file has been passed is stored
+ * in its record once each callback returns, so that a restart carries
+ * on where the last callback left off, passing at once whatever was
+ * appended while nothing watched, and the range of a callback the
+ * process died during again. One descriptor is held for each file
+ * followed. Passing zero leaves tail mode and forgets the offsets, as
+ * does removing the open callback. Returns 0, or -1 with errno set, to
+ * EINVAL if there is no open callback, to ENOMEM if memory could not be
+ * allocated, or to EBUSY if called from a callback.
+ *
+ * watchpaths_workers() makes the watch set run its callbacks on
+ * `threads' worker threads rather than on the thread dispatching it, so
+ * that a slow callback, such as one waiting for a child process, does
+ * not hold back the reading of events for the other paths. The
+ * callbacks for one index are always run by the same worker, in order
+ * and never two at once, while those for different indexes run side by
+ * side. The dispatching thread hands the callbacks over without taking
+ * a lock, and only waits if a worker has fallen 1024 callbacks
+ * behind. A callback run by a worker may call watchpaths_entry() but
+ * none of the other functions here. Once such a callback sets *cont to
+ * zero, the callbacks not yet started are dropped, and so are later
+ * ones, until watchpaths_run() or watchpaths_workers() is called again;
+ * watchpaths_run() returns once the callbacks under way are done. A
+ * batch callback is still invoked by the dispatching thread. Passing
+ * zero stops the workers once they have run the callbacks handed to
+ * them, as does watchpaths_destroy(). Returns 0, or -1 with errno set,
+ * to EINVAL if `threads' is negative or to EBUSY if called from a
+ * callback or, unless `threads' is zero, while there is an open
+ * callback.
+ *
+ * watchpaths_queued() fills in `queue' with the number of callbacks
+ * waiting for the workers and how far they have fallen behind.
+ *
+ * watchpaths_stats() fills in `stats' with the counters of the watch
+ * set, which tell how busy it is and what it holds. They are kept by
+ * the dispatching thread at the cost of a store each, without locks or
+ * atomic instructions, and may be read from any thread, including a
+ * callback; each is up to date, though they are not taken at one
+ * instant.
+ *
+ * watchpaths_fingerprint() makes the watch set skip the callback for
+ * an event which leaves the content of a path as it was, such as a
+ * configuration tool rewriting a file with the same bytes, or a change
+ * of permissions alone. A fingerprint of each path is taken at once,
+ * and of each path added later, and is compared with a new one before
+ * each callback: the same file with the same size and modification time
+ * is not read again, and any other is hashed in full. With debouncing,
+ * the comparison is made once the held back events fall due. Events
+ * for paths which are missing or are not regular files are always
+ * reported, and the entries of trees are not fingerprinted. Passing
+ * zero turns fingerprinting off and frees the fingerprints. Returns 0,
+ * or -1 with errno set if memory could not be allocated.
+ *
+ * watchpaths_poll() makes the watch set poll the paths which lie on
+ * file systems whose changes the kernel does not report, such as NFS,
+ * SMB and FUSE mounts, or every path if `force' is nonzero. Each such
+ * path is looked up once every `interval_ms' milliseconds, and a change
+ * of its inode, size or modification time is reported as NOTE_WRITE.
+ * A change of its change time alone is reported as NOTE_ATTRIB to a
+ * path whose mask names it, see struct watchpaths_opts. The lookups
+ * are spread evenly over the interval, so that polling many paths costs
+ * a steady trickle of work rather than a burst. The file system of a
+ * path is judged when polling is turned on and when the path is added.
+ * The kernel watches are kept, so changes it does report still arrive
+ * at once. The roots of trees are not polled. An interval of zero stops
+ * polling, which is the default. Returns 0, or -1 with errno set, to
+ * EINVAL if `interval_ms' is negative.
+ *
+ * watchpaths_state() keeps a record of each watched path in the state
+ * file `file', so that changes made while nothing watched are not lost.
+ * Each path is compared with its record at once, and each path which
+ * now names a file where it named none, another file, or one whose size
+ * or modification time differs, is reported with NOTE_WRITE on the
+ * next dispatch. A file whose modification time alone differs counts as
+ * changed only if its content differs too, when the record holds a
+ * content hash, which it does for paths fingerprinted while it was made,
+ * see watchpaths_fingerprint(). Paths with no record, as on the first
+ * use of the file, are recorded without a callback, and paths which no
+ * longer name a file are not reported. The records are brought up to
+ * date as each callback is invoked, by storing into a mapping of the
+ * file, and so survive the process dying at any point; a change whose
+ * callback is under way at that moment is not reported again. The file
+ * holds fixed size records in a hash table and is locked while in use,
+ * and one written by an earlier version is brought up to date as it is
+ * opened. In tail mode the records keep how far each file has been
+ * passed as well, see watchpaths_tail(). Trees are not recorded.
+ * Passing NULL stops keeping records. Returns 0, or -1 with errno set,
+ * to EBUSY if another process uses the file or to EINVAL if it holds
+ * anything but a state file, which is left untouched.
+ *
+ * watchpaths_trace() records what the watch set does in the trace file
+ * `file', which holds the last `records' of them, rounded up to a power
+ * of two, in a ring. Each record holds a time on the monotonic clock, in
+ * ns, and the time the event behind it was read from the kernel, so
+ * that the time from a write to a callback, or to whatever the callback
+ * does, can be read off. The file is mapped, and records are added
+ * without locks by any thread, so another process may read them at any
+ * moment without stopping this one; a record being overwritten as it is
+ * read is told apart by its sequence number, see struct
+ * watchpaths_trace. The file is created, or truncated, and is left in
+ * place when tracing stops. Passing NULL stops tracing. Returns 0, or
+ * -1 with errno set, to EINVAL if `records' is zero or too large, or to
+ * EBUSY if called from a callback or while there are workers.
+ *
+ * watchpaths_trace_note() adds a record of kind `kind', such as
+ * WP_TRACE_EXEC, for the path at `index' with `value' to the trace, if
+ * any. Called from a callback, or from a process forked by one, the
+ * record carries the time the event behind the callback was read. It
+ * may be called from any thread, and between fork(2) and exec(2).
+ *
+ * watchpaths_latency() fills in `lat' with the distribution of the
+ * latencies of the stage `stage', one of WP_STAGE_DISPATCH,
+ * WP_STAGE_QUEUE and WP_STAGE_CALLBACK. The latencies of every callback
+ * are counted, whether traced or not, in histograms which place each
+ * within 3% of its value, so that a growing tail shows as the watch set
+ * grows without the cost of keeping each one. The debounce window is
+ * part of WP_STAGE_DISPATCH, and WP_STAGE_QUEUE is only counted for
+ * callbacks run by workers. It may be called from any thread. Returns
+ * 0, or -1 with errno set to EINVAL if `stage' is not one of them.
+ *
+ * watchpaths_deadline() gives the path at `index' an inactivity
+ * deadline of `ms' milliseconds. If no event is seen for the path for
+ * that long, the callback is invoked for it with WP_STALE as the
+ * fflags. The deadline restarts with each event, and once it has
+ * expired, waits for the next event to start again. A deadline of zero
+ * removes it. Returns 0, or -1 with errno set to EINVAL if `index' is
+ * not watched or `ms' is negative.
+ *
+ * watchpaths_tick() invokes the callback every `ms' milliseconds with
+ * WP_TICK as the fflags and -1 as the index, or stops doing so if `ms'
+ * is zero. Ticks missed while the watch set was not dispatched are not
+ * made up. Returns 0, or -1 with errno set to EINVAL if `ms' is
+ * negative.
+ *
+ * Deadlines and the tick are kept in a timer wheel, so each costs the
+ * same to arm, restart and expire however many are set.
+ *
+ * watchpaths_timeout() returns the number of milliseconds until held
+ * back events, a deadline, the tick or a poll are due, or -1 if there
+ * are none.
+ * Pass it as the timeout when waiting on the descriptor, and call
+ * watchpaths_dispatch() once it expires, even if no event is ready.
+ *
+ * watchpaths_run() waits for and dispatches events until the callback
+ * sets *cont to zero, as watchpaths() does. Returns 0, or -1 if
+ * watching can not continue.
+ *
+ * watchpaths_add() starts watching `path' in addition to the paths
+ * already watched, which are left untouched. It returns the index which
+ * will be passed to the callback for the path, or -1 with errno set on
+ * failure, such as EEXIST if the path is already watched. Relative paths
+ * are resolved against the current directory, as for watchpaths().
+ *
+ * watchpaths_add_opts() is watchpaths_add() for a path described by
+ * `opts', as for watchpaths_create_opts(). The options of a path are
+ * fixed once it is added; remove it and add it again to change them.
+ *
+ * watchpaths_tree() starts watching the directory tree rooted at
+ * `path', as watchpaths_add() would, and returns its index. The tree
+ * is read once, relative to the descriptor of each directory and in
+ * large blocks where the system allows, and the directories created
+ * within it later are watched as they appear and dropped when they go
+ * away. Besides the events of `path' itself, the callback is invoked
+ * for the index of the tree whenever an entry anywhere within it is
+ * created (NOTE_WRITE), written (NOTE_WRITE), deleted (NOTE_DELETE)
+ * or renamed away (NOTE_RENAME), and watchpaths_entry() names the
+ * entry. The entries of a directory created along with it are reported
+ * as they are found. Those events are not debounced, as each names an
+ * entry of its own, but do restart the deadline of the tree. Symbolic
+ * links are not followed, and a tree does not reach into another file
+ * system mounted within it. With kqueue, which needs a descriptor per
+ * entry, only directories and regular files are watched within a tree,
+ * and only they are reported when created. Returns -1 with errno set
+ * on failure, such as EEXIST if the path is already watched, whether
+ * as a tree or not. The tree is removed with watchpaths_remove().
+ *
+ * watchpaths_entry() returns, while the callback runs, the path of the
+ * entry of a tree it is invoked for, relative to the root of the tree,
+ * or NULL if the event is for the path itself or the index is not a
+ * tree. The string is only valid until the callback returns.
+ *
+ * watchpaths_filter() adds `pattern' to those the entries of trees
+ * must pass to be reported: an entry is reported only if it matches
+ * none of the patterns added with `exclude' nonzero and, if any were
+ * added with `exclude' zero, one of those. Entries which do not pass
+ * are dropped as they are seen, before the deadline or the callback of
+ * their tree is touched. A pattern without a slash, other than a
+ * trailing one, such as "*.lease" or "dhclient.*", matches the name of
+ * an entry in any directory of a tree, while any other, such as
+ * "etc/[a-z]*.conf" or "spool/in?", is matched against the whole path
+ * of the entry relative to the root. "*" matches any run of
+ * characters other than a slash, "?" any one of them, "[...]" one of
+ * the class within, which is negated if it starts with "!" or "^", and
+ * "**" as a whole element any number of elements. A backslash takes
+ * the next character literally. A pattern also matches every entry
+ * beneath a directory it matches, so excluding ".git" drops all of
+ * the entries within it. The patterns are compiled together, so each
+ * entry is classified in one pass over its name however many there
+ * are. Events for the watched paths themselves are never filtered.
+ * Passing NULL as `pattern' removes all of the patterns. Returns 0, or
+ * -1 with errno set to EINVAL if the pattern is empty or has an
+ * unterminated class.
+ *
+ * watchpaths_remove() stops watching `path'. It returns 0, or -1 with
+ * errno set on failure, such as ENOENT if the path is not watched. The
+ * index of a removed path is given to a later watchpaths_add(). Both
+ * functions take time independent of the number of paths watched and
+ * may be called from the callback.
+ *
+ * watchpaths_destroy() stops watching and frees the watch set.
+ */
+struct watchset;
+
+/*
+ * One event passed to a batch callback.
+ *
+ * index:  the index of the path, as passed to the callback, or -1 for
+ *         the tick
+ * fflags: the fflags, as passed to the callback
+ * time:   when the event was read, or for a debounced event or a
+ *         timer, when it fell due, according to CLOCK_REALTIME
+ * entry:  as watchpaths_entry() would return for the event. It is only
+ *         valid until the batch callback returns.
+ * data:   the data of the path, as passed to the callback, see struct
+ *         watchpaths_opts
+ */
+struct watchpaths_event {
+  int index;
+  u_int fflags;
+  struct timespec time;
+  /*@null@*/ /*@dependent@*/ const char *entry;
+  /*@null@*/ /*@dependent@*/ void *data;
+};
+
+/*
+ * A path to watch along with its options, see watchpaths_create_opts().
+ * A path left zeroed but for `path' and `openflags' is watched as
+ * watchpaths_create() would watch it.
+ *
+ * path:      the pathname to watch
+ * mask:      the fflags to report for the path, or 0 for all of them.
+ *            With inotify, NOTE_EXTEND stands for NOTE_WRITE, which is
+ *            how appends are reported. NOTE_ATTRIB is reported only
+ *            by polling, see watchpaths_poll(), and only if named
+ *            here. The timers of watchpaths_deadline() and
+ *            watchpaths_tick() are not masked.
+ * data:      passed to the callbacks for the path in place of `blob', or
+ *            NULL to pass `blob'
+ * openflags: the flags the open callback opens the file with, as for
+ *            watchpaths_open(), or -1 for those given there. A file
+ *            opened for writing only is not mapped.
+ */
+struct watchpaths_opts {
+  /*@observer@*/ const char *path;
+  u_int mask;
+  /*@null@*/ /*@dependent@*/ void *data;
+  int openflags;
+};
+
+/*
+ * The file passed to an open callback, see watchpaths_open().
+ *
+ * fd:     the file at the path, or -1
+ * view:   a read-only mapping of the whole of it, or NULL
+ * size:   its size when the callback was invoked, or 0 if it is not a
+ *         regular file
+ * offset,
+ * length: the range of bytes to read: in tail mode, those appended since
+ *         the last callback, see watchpaths_tail(), and otherwise the
+ *         whole file
+ */
+struct watchpaths_file {
+  int fd;
+  /*@null@*/ /*@dependent@*/ const void *view;
+  size_t size;
+  off_t offset;
+  off_t length;
+};
+
+/*
+ * The callbacks handed to the workers of a watch set, see
+ * watchpaths_workers().
+ *
+ * queued:  the callbacks waiting for their worker now
+ * deepest: the most callbacks ever waiting for one worker at once
+ * handed:  the callbacks handed to the workers so far
+ * stalls:  the times the dispatching thread waited for a worker to make
+ *          room, each of which held back the reading of events
+ */
+struct watchpaths_queue {
+  unsigned long queued;
+  unsigned long deepest;
+  unsigned long handed;
+  unsigned long stalls;
+};
+
+/*
+ * The counters of a watch set, see watchpaths_stats(). All but the last
+ * three count from the creation of the watch set.
+ *
+ * wakeups:     the reads of the queue which found events
+ * events:      the events read from the queue
+ * batchmax:    the most events found by one read
+ * deletes:     the events reporting paths deleted or missing
+ * writes:      the events reporting paths written or extended
+ * attribs:     the events reporting attributes changed
+ * renames:     the events reporting paths renamed
+ * rechecks:    the paths looked up again after their directory changed
+ * rearms:      the kernel watches set on paths, at the outset or again
+ *              once they reappeared
+ * callbacks:   the events passed to callbacks or handed to the workers
+ * suppressed:  the callbacks skipped because content was unchanged
+ * polls:       the lookups of polled paths
+ * paths:       the paths and trees watched now
+ * watches:     the kernel watches held now
+ * descriptors: the file descriptors held now
+ */
+struct watchpaths_stats {
+  unsigned long wakeups;
+  unsigned long events;
+  unsigned long batchmax;
+  unsigned long deletes;
+  unsigned long writes;
+  unsigned long attribs;
+  unsigned long renames;
+  unsigned long rechecks;
+  unsigned long rearms;
+  unsigned long callbacks;
+  unsigned long suppressed;
+  unsigned long polls;
+  unsigned long paths;
+  unsigned long watches;
+  unsigned long descriptors;
+};
+
+/*
+ * The distribution of the latencies of a stage, in ns, see
+ * watchpaths_latency(). Each percentile is the most a latency in its
+ * histogram bucket can be.
+ *
+ * count: the latencies counted
+ * p50, p90, p99, p999: the percentiles
+ * max:   the most any latency counted can be
+ */
+struct watchpaths_latency {
+  unsigned long count;
+  long long p50;
+  long long p90;
+  long long p99;
+  long long p999;
+  long long max;
+};
+
+/*
+ * The header of a trace file, see watchpaths_trace(), which is followed
+ * by `capacity' records. The fields have fixed widths, so that a trace
+ * may be read by a program built apart from the one writing it.
+ *
+ * magic:    WP_TRACE_MAGIC
+ * order:    WP_TRACE_ORDER, as stored by the machine writing the file
+ * version:  WP_TRACE_VERSION
+ * recsize:  the size of a record, sizeof(struct watchpaths_trace)
+ * capacity: the number of records, a power of two
+ * head:     the number of records ever added; the next goes to the
+ *           record at `head' modulo `capacity'
+ */
+struct watchpaths_tracehead {
+  char magic[8];
+  uint64_t order;
+  uint32_t version;
+  uint32_t recsize;
+  uint64_t capacity;
+  uint64_t head;
+  char spare[24];
+};
+
+/*
+ * A record of a trace file. A record is written by setting `seq' to 0,
+ * filling in the rest, and then setting `seq', so a reader copies a
+ * record and takes it only if `seq' was the same, and as expected,
+ * both before and after.
+ *
+ * seq:    one more than the position of the record among all those
+ *         added, or 0 while it is written
+ * time:   when the record was added, in ns on the monotonic clock
+ * origin: when the event behind it was read, in ns on the same clock,
+ *         or 0 if unknown
+ * index:  the index of the path, or -1
+ * fflags: the fflags, as passed to the callback
+ * kind:   one of WP_TRACE_READ and the rest
+ * value:  as described for `kind', or 0
+ */
+struct watchpaths_trace {
+  uint64_t seq;
+  int64_t time;
+  int64_t origin;
+  int32_t index;
+  uint32_t fflags;
+  int32_t kind;
+  int32_t value;
+};
+
+struct watchset *watchpaths_create(char **inpaths, int numpaths,
+                                   void (*callback) (u_int, int, void *,
+                                                     int *),
+                                   void *blob);
+struct watchset *watchpaths_create_threads(char **inpaths, int numpaths,
+                                           void (*callback) (u_int, int,
+                                                             void *, int *),
+                                           void *blob, int threads);
+struct watchset *watchpaths_create_opts(const struct watchpaths_opts *paths,
+                                        int numpaths,
+                                        void (*callback) (u_int, int, void *,
+                                                          int *),
+                                        void *blob, int threads);
+int watchpaths_opts(const struct watchpaths_opts *paths, int numpaths,
+                    void (*callback) (u_int, int, void *, int *), void *blob);
+int watchpaths_fd(struct watchset *ws);
+int watchpaths_dispatch(struct watchset *ws, int max_events);
+int watchpaths_debounce(struct watchset *ws, int quiet_ms, int max_ms);
+void watchpaths_batch(struct watchset *ws,
+                      /*@null@*/ void (*batch) (const struct watchpaths_event *,
+                                                int, void *, int *));
+int watchpaths_open(struct watchset *ws,
+                    /*@null@*/ void (*opened) (u_int, int,
+                                               const struct watchpaths_file *,
+                                               void *, int *),
+                    int flags, int map);
+int watchpaths_tail(struct watchset *ws, int on);
+int watchpaths_workers(struct watchset *ws, int threads);
+void watchpaths_queued(struct watchset *ws, struct watchpaths_queue *queue);
+void watchpaths_stats(struct watchset *ws, struct watchpaths_stats *stats);
+int watchpaths_fingerprint(struct watchset *ws, int on);
+int watchpaths_poll(struct watchset *ws, int interval_ms, int force);
+int watchpaths_state(struct watchset *ws, /*@null@*/ const char *file);
+int watchpaths_trace(struct watchset *ws, /*@null@*/ const char *file,
+                     size_t records);
+void watchpaths_trace_note(struct watchset *ws, int kind, int index,
+                           int value);
+int watchpaths_latency(struct watchset *ws, int stage,
+                       struct watchpaths_latency *lat);
+int watchpaths_deadline(struct watchset *ws, int index, int ms);
+int watchpaths_tick(struct watchset *ws, int ms);
+int watchpaths_timeout(struct watchset *ws);
+int watchpaths_run(struct watchset *ws);
+int watchpaths_add(struct watchset *ws, const char *path);
+int watchpaths_add_opts(struct watchset *ws,
+                        const struct watchpaths_opts *opts);
+int watchpaths_tree(struct watchset *ws, const char *path);
+/*@null@*/ /*@observer@*/
+const char *watchpaths_entry(struct watchset *ws);
+int watchpaths_filter(struct watchset *ws, /*@null@*/ const char *pattern,
+                      int exclude);
+int watchpaths_remove(struct watchset *ws, const char *path);
+void watchpaths_destroy(/*@null@*/ /*@only@*/ struct watchset *ws);
+
 #endif /* __watchpaths_h_ */
 
 